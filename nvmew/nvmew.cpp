@@ -13,7 +13,11 @@
 #include "Handle.h"
 #include "Util.h"
 
+#include <algorithm>
+#include <fstream>
+#include <map>
 #include <sstream>
+#include <vector>
 
 #define DBG(thing) if (debug) {fprintf(stderr, "%-35s = 0x%08x (%-8u) \n", #thing, thing, thing);}
 
@@ -36,6 +40,50 @@ std::string getControlCodeString(DWORD controlCode)
 		return "NVME_IC_MN_OVERRIDE_CONTROL";
 	case NVME_IC_MN_OVERRIDE_RESET:
 		return "NVME_IC_MN_OVERRIDE_RESET";
+	case NVME_HISTORY_SNAPSHOT:
+		return "NVME_HISTORY_SNAPSHOT";
+	case NVME_SLOW_CMD_LOG:
+		return "NVME_SLOW_CMD_LOG";
+	case NVME_SRB_TRACE:
+		return "NVME_SRB_TRACE";
+	case NVME_TUNABLES:
+		return "NVME_TUNABLES";
+	case NVME_FW_DOWNLOAD:
+		return "NVME_FW_DOWNLOAD";
+	case NVME_NAMESPACE_QOS:
+		return "NVME_NAMESPACE_QOS";
+	case NVME_PROTECTION_INFO:
+		return "NVME_PROTECTION_INFO";
+	}
+	return "Unknown";
+}
+
+std::string getHistoryTagString(UCHAR tag)
+{
+	switch (tag)
+	{
+	case GETCMD_RETURN_BUSY:
+		return "GETCMD_RETURN_BUSY";
+	case PRE_ISSUE:
+		return "PRE_ISSUE";
+	case ISSUE_RETURN_BUSY:
+		return "ISSUE_RETURN_BUSY";
+	case ISSUE:
+		return "ISSUE";
+	case COMPPLETE_CMD:
+		return "COMPLETE_CMD";
+	case SRB_RESET_LUN:
+		return "SRB_RESET_LUN";
+	case SRB_RESET_BUS:
+		return "SRB_RESET_BUS";
+	case SRB_RESET_DEVICE:
+		return "SRB_RESET_DEVICE";
+	case DPC_RESET:
+		return "DPC_RESET";
+	case DETECTED_PENDING_CMD:
+		return "DETECTED_PENDING_CMD";
+	case COMPLETE_CMD_RESET:
+		return "COMPLETE_CMD_RESET";
 	}
 	return "Unknown";
 }
@@ -491,173 +539,1535 @@ done:
 	return retVal;
 }
 
-std::string promptForSelection()
+struct HistoryEntry
 {
-	std::vector<std::string> paths;
+	DWORD ring;
+	NVME_HISTORY_RECORD record;
+};
 
-	for (int i = 0; i < 255; i++)
+bool getHistoryRing(HANDLE handle, DWORD ring, DWORD depth, NVME_HISTORY_SNAPSHOT_IOCTL** ppSnap, bool debug)
+{
+	DWORD snapBufferSize = sizeof(NVME_HISTORY_SNAPSHOT_IOCTL) + (depth ? depth - 1 : 0) * sizeof(NVME_HISTORY_RECORD);
+	NVME_HISTORY_SNAPSHOT_IOCTL* snap = (NVME_HISTORY_SNAPSHOT_IOCTL*)calloc(snapBufferSize, 1);
+	DBG(snapBufferSize);
+
+	snap->SrbIoCtrl.HeaderLength = sizeof(SRB_IO_CONTROL);
+	memcpy(snap->SrbIoCtrl.Signature, NVME_SIG_STR, NVME_SIG_STR_LEN);
+	snap->SrbIoCtrl.Timeout = 5;
+	snap->SrbIoCtrl.ControlCode = NVME_HISTORY_SNAPSHOT;
+	snap->SrbIoCtrl.Length = snapBufferSize - sizeof(SRB_IO_CONTROL);
+	snap->Ring = ring;
+
+	DWORD bytesReturned;
+	bool retVal = DeviceIoControl(
+		handle,
+		IOCTL_SCSI_MINIPORT,
+		snap,
+		snapBufferSize,
+		snap,
+		snapBufferSize,
+		&bytesReturned,
+		NULL
+	) != 0;
+	DBG(bytesReturned);
+	DBG(snap->SrbIoCtrl.ReturnCode);
+
+	if (!retVal)
 	{
-		std::string testPath = "\\\\.\\SCSI" + std::to_string(i) + ":";
-		try
-		{
-			Handle handle(testPath);
-		}
-		catch (...)
+		fprintf(stderr, "OS Error: %d\n", GetLastError());
+	}
+	else if (snap->SrbIoCtrl.ReturnCode != NVME_IOCTL_SUCCESS)
+	{
+		fprintf(stderr, "SrbIoCtrl.ReturnCode Error: %d (is the history built in and HistoryDepth non zero?)\n", snap->SrbIoCtrl.ReturnCode);
+		retVal = false;
+	}
+
+	if (!retVal)
+	{
+		free(snap);
+		snap = NULL;
+	}
+
+	*ppSnap = snap;
+	return retVal;
+}
+
+// Reads every core's history ring and prints the records merged by time stamp
+bool getHistory(std::string devicePath, bool debug)
+{
+	Handle handle(devicePath);
+	NVME_HISTORY_SNAPSHOT_IOCTL* snap = NULL;
+	std::vector<HistoryEntry> entries;
+
+	// The first call with no room for records tells us the ring count and depth
+	if (!getHistoryRing(handle.getHandle(), 0, 0, &snap, debug))
+	{
+		return false;
+	}
+
+	DWORD numRings = snap->NumRings;
+	DWORD depth = snap->Depth;
+	free(snap);
+	DBG(numRings);
+	DBG(depth);
+
+	for (DWORD ring = 0; ring < numRings; ring++)
+	{
+		if (!getHistoryRing(handle.getHandle(), ring, depth, &snap, debug))
 		{
-			continue;
+			return false;
 		}
 
-		bool ofa = false;
-		bool csm = false;
-
-		csm = nvmePassthru(6, 0, 1, 0, 0, 0, 0, 0, false, 5, 2, 4096, "ic.bin", testPath, false, true, true);
-		
-		if (!csm)
+		if (snap->Written > snap->NumRecords)
 		{
-			ofa = nvmePassthru(6, 0, 1, 0, 0, 0, 0, 0, false, 5, 2, 4096, "ic.bin", testPath, false, false, true);
+			fprintf(stderr, "Ring %u wrapped, %u older records were overwritten\n", ring, snap->Written - snap->NumRecords);
 		}
 
-		if (csm || ofa)
+		for (DWORD i = 0; i < snap->NumRecords; i++)
 		{
-			std::string model = "?";
-			std::string fw = "?";
-			std::string type = "?";
-			PADMIN_IDENTIFY_CONTROLLER pIc = (PADMIN_IDENTIFY_CONTROLLER)READ_FILE("ic.bin", 4096);
-			model = std::string((char*)pIc->MN, 40);
-			fw = std::string((char*)pIc->FR, 8);
-			CLOSE_FILE(pIc);
-			remove("ic.bin");
-			if (csm)
-			{
-				type = "CSM NVMe Driver";
-			}
-			else if (ofa)
+			// Never written, or caught while being written
+			if (snap->Records[i].TimeStampUs == 0 || snap->Records[i].Tag == NO_ENTRY)
 			{
-				type = "OFA-Compatible Driver";
+				continue;
 			}
-			fprintf(stderr, "%d) %-30s %-8s %-11s %s\n", (int)paths.size(), model.c_str(), fw.c_str(), testPath.c_str(), type.c_str());
-			paths.push_back(testPath);
+			entries.push_back({ ring, snap->Records[i] });
 		}
-
+		free(snap);
 	}
 
-	int sel;
-	std::cerr << "Choose an above index: ";
-	std::cin >> sel;
+	// Each ring is already in order, a stable sort keeps ties in ring order
+	std::stable_sort(entries.begin(), entries.end(), [](const HistoryEntry& a, const HistoryEntry& b)
+	{
+		return a.record.TimeStampUs < b.record.TimeStampUs;
+	});
 
-	return paths[sel];
+	printf("%-16s %-4s %-20s %-5s %-6s %-4s %-10s %-10s %-18s %-18s\n",
+		"TimeUs", "Core", "Tag", "Queue", "CID", "Opc", "Parm0", "Parm1", "Parm2", "Parm3");
+	for (auto& e : entries)
+	{
+		printf("%-16llu %-4u %-20s %-5u 0x%04x 0x%02x 0x%08x 0x%08x 0x%016llx 0x%016llx\n",
+			e.record.TimeStampUs,
+			e.ring,
+			getHistoryTagString(e.record.Tag).c_str(),
+			e.record.QueueId,
+			e.record.CID,
+			e.record.Opcode,
+			e.record.Parm0,
+			e.record.Parm1,
+			e.record.Parm2,
+			e.record.Parm3);
+	}
+
+	return true;
 }
 
-int main(int argc, const char** argv)
+// Reads the driver's slow command log and prints it oldest first
+bool getSlowCommandLog(std::string devicePath, bool debug)
 {
-	try
-	{
-		ArgumentParser parser;
-		parser.add_argument(Argument("DW0", "DWord0", "", "DWord 0 of an NVMe Command", "6", false));
-		parser.add_argument(Argument("DW1", "DWord1", "", "DWord 1 of an NVMe Command", "0", false));
-		parser.add_argument(Argument("DW10", "DWord10", "", "DWord 10 of an NVMe Command", "1", false));
-		parser.add_argument(Argument("DW11", "DWord11", "", "DWord 11 of an NVMe Command", "0", false));
-		parser.add_argument(Argument("DW12", "DWord12", "", "DWord 12 of an NVMe Command", "0", false));
-		parser.add_argument(Argument("DW13", "DWord13", "", "DWord 13 of an NVMe Command", "0", false));
-		parser.add_argument(Argument("DW14", "DWord14", "", "DWord 14 of an NVMe Command", "0", false));
-		parser.add_argument(Argument("DW15", "DWord15", "", "DWord 15 of an NVMe Command", "0", false));
-		parser.add_argument(Argument("nvm", "NVM", "store_true", "If given, send command as NVM instead of Admin", "", false));
-		parser.add_argument(Argument("debug", "debug", "store_true", "If given, Send debug info to stderr", "", false));
-		parser.add_argument(Argument("noLook", "noLook", "store_true", "If given, Use NO_LOOK IOCTL", "", false));
-		parser.add_argument(Argument("timeout", "timeout", "", "Timeout in seconds", "60", false));
-		parser.add_argument(Argument("dataDirection", "dataDirection", "", "0:non data, 1:write, 2:read", "2", false));
-		parser.add_argument(Argument("dataTransferSize", "dataTransferSize", "", "In bytes", "8192", false));
-		parser.add_argument(Argument("dataFile", "dataFile", "", "Location of binary file", "", false));
-		parser.add_argument(Argument("devicePath", "devicePath", "", "Path to device", "", false));
-		parser.add_argument(Argument("model", "modelOverride", "", "Model to override in Identify Controller", "", false));
+	Handle handle(devicePath);
 
-		// Actions
-		parser.add_argument(Argument("passthru", "passthru", "store_true", "If given, Do an NVMe passthru command", "false", false));
-		parser.add_argument(Argument("pciRegisters", "pciRegs", "store_true", "If given, retrieve the pci registers header", "false", false));
-		parser.add_argument(Argument("controllerRegisters", "controllerRegs", "store_true", "If given, target the controller registers", "false", false));
-		parser.add_argument(Argument("reset", "controllerReset", "store_true", "If given, do an NVMe Controller Reset", "false", false));
-		parser.add_argument(Argument("override", "overrideModel", "store_true", "If given, Overwrite the model returned in Identify Controller", "false", false));
-		parser.add_argument(Argument("overrideReset", "overrideModelReset", "store_true", "If given, Reset the override returned in Identify Controller", "false", false));
+	// Room for far more records than the driver keeps
+	DWORD logBufferSize = sizeof(NVME_SLOW_CMD_LOG_IOCTL) + 4095 * sizeof(NVME_SLOW_CMD_RECORD);
+	NVME_SLOW_CMD_LOG_IOCTL* log = (NVME_SLOW_CMD_LOG_IOCTL*)calloc(logBufferSize, 1);
+	DBG(logBufferSize);
 
-		parser.parse_args(argv, argc);
+	log->SrbIoCtrl.HeaderLength = sizeof(SRB_IO_CONTROL);
+	memcpy(log->SrbIoCtrl.Signature, NVME_SIG_STR, NVME_SIG_STR_LEN);
+	log->SrbIoCtrl.Timeout = 5;
+	log->SrbIoCtrl.ControlCode = NVME_SLOW_CMD_LOG;
+	log->SrbIoCtrl.Length = logBufferSize - sizeof(SRB_IO_CONTROL);
 
-		bool passthru = parser.getBooleanValue("passthru");
-		bool pciRegisters = parser.getBooleanValue("pciRegisters");
-		bool controllerRegisters = parser.getBooleanValue("controllerRegisters");
-		bool reset = parser.getBooleanValue("reset");
-		bool overrideModel = parser.getBooleanValue("overrideModel");
-		bool overrideReset = parser.getBooleanValue("overrideReset");
+	DWORD bytesReturned;
+	bool retVal = DeviceIoControl(
+		handle.getHandle(),
+		IOCTL_SCSI_MINIPORT,
+		log,
+		logBufferSize,
+		log,
+		logBufferSize,
+		&bytesReturned,
+		NULL
+	) != 0;
+	DBG(bytesReturned);
+	DBG(log->SrbIoCtrl.ReturnCode);
 
-		// Make sure only one action was given
-		if (!(passthru ^ controllerRegisters ^ reset ^ overrideModel ^ overrideReset ^ pciRegisters))
+	if (!retVal)
+	{
+		fprintf(stderr, "OS Error: %d\n", GetLastError());
+		goto done;
+	}
+
+	if (log->SrbIoCtrl.ReturnCode != NVME_IOCTL_SUCCESS)
+	{
+		fprintf(stderr, "SrbIoCtrl.ReturnCode Error: %d\n", log->SrbIoCtrl.ReturnCode);
+		retVal = false;
+		goto done;
+	}
+
+	if (log->Written > log->NumEntries)
+	{
+		fprintf(stderr, "%u older records were overwritten\n", log->Written - log->NumEntries);
+	}
+	if (log->Truncated != 0)
+	{
+		fprintf(stderr, "%u records didn't fit in the buffer\n", log->Truncated);
+	}
+	if (log->Lost != 0)
+	{
+		fprintf(stderr, "%u records changed while read and were dropped\n", log->Lost);
+	}
+
+	printf("%-16s %-10s %-10s %-3s %-3s %-4s %-4s %-4s %-10s %-18s %-6s %-4s %-4s %-6s\n",
+		"SubmitUs", "LatencyUs", "P999Us", "SQ", "CQ", "SCor", "CCor", "Opc", "NSID", "SLBA", "NLB", "SCT", "SC", "Reason");
+	for (DWORD i = 0; i < log->NumRecords; i++)
+	{
+		NVME_SLOW_CMD_RECORD& r = log->Records[i];
+		NVMe_COMPLETION_QUEUE_ENTRY* cqe = (NVMe_COMPLETION_QUEUE_ENTRY*)r.Cqe;
+		std::string reason;
+		if (r.Reason & NVME_SLOW_CMD_THRESHOLD)
+		{
+			reason += "T";
+		}
+		if (r.Reason & NVME_SLOW_CMD_P999)
 		{
-			throw std::runtime_error("Give one of the following: passthru, controllerRegisters, reset, overrideModel, overrideReset, pciRegisters");
+			reason += "P";
 		}
 
-		bool success = false;
+		// CDW10/11 are the SLBA and CDW12 the 0's based NLB for reads and writes
+		printf("%-16llu %-10llu %-10llu %-3u %-3u %-4u %-4u 0x%02x %-10u 0x%016llx %-6u %-4u 0x%02x %-6s\n",
+			r.SubmitTimeUs,
+			r.CompleteTimeUs - r.SubmitTimeUs,
+			r.P999Us,
+			r.SubQueueId,
+			r.CplQueueId,
+			r.SubmitCore,
+			r.CompleteCore,
+			r.Sqe[0] & 0xFF,
+			r.Sqe[1],
+			((unsigned long long)r.Sqe[11] << 32) | r.Sqe[10],
+			(r.Sqe[12] & 0xFFFF) + 1,
+			cqe->DW3.SF.SCT,
+			cqe->DW3.SF.SC,
+			reason.c_str());
+	}
 
-		std::string devicePath = parser.getStringValue("devicePath");
-		if (devicePath.size() == 0)
+done:
+	free(log);
+
+	DBG(retVal);
+	return retVal;
+}
+
+// Reads the text tracefmt made of a capture with the IoComplete flag enabled and
+// prints latency statistics per submission queue
+bool getTraceStats(std::string dataFile, bool debug)
+{
+	std::ifstream file(dataFile);
+	if (!file)
+	{
+		fprintf(stderr, "Unable to open file: %s\n", dataFile.c_str());
+		return false;
+	}
+
+	std::map<unsigned, std::vector<unsigned long long>> latencies;
+	std::map<unsigned, unsigned long long> errors;
+	std::string line;
+	while (std::getline(file, line))
+	{
+		size_t pos = line.find("NVMeIoComplete ");
+		if (pos == std::string::npos)
 		{
-			devicePath = promptForSelection();
+			continue;
 		}
 
-		if (passthru)
+		unsigned sq, cid, sct, sc;
+		unsigned long long latencyUs;
+		if (sscanf(line.c_str() + pos, "NVMeIoComplete SQ=%u CID=0x%x SCT=%u SC=0x%x LatencyUs=%llu", &sq, &cid, &sct, &sc, &latencyUs) != 5)
 		{
-			success = nvmePassthru(
-				parser.getNumericValue("DW0"),
-				parser.getNumericValue("DW1"),
-				parser.getNumericValue("DW10"),
-				parser.getNumericValue("DW11"),
-				parser.getNumericValue("DW12"),
-				parser.getNumericValue("DW13"),
-				parser.getNumericValue("DW14"),
-				parser.getNumericValue("DW15"),
-				parser.getBooleanValue("NVM"),
-				parser.getNumericValue("timeout"),
-				parser.getNumericValue("dataDirection"),
-				parser.getNumericValue("dataTransferSize"),
-				parser.getStringValue("dataFile"),
-				devicePath,
-				parser.getBooleanValue("debug"),
-				parser.getBooleanValue("noLook"),
-				false
-			);
+			if (debug) fprintf(stderr, "Skipping: %s\n", line.c_str());
+			continue;
 		}
-		else if (reset)
+
+		latencies[sq].push_back(latencyUs);
+		if (sct != 0 || sc != 0)
 		{
-			success = nvmeReset(
-				devicePath,
-				parser.getBooleanValue("debug"),
-				parser.getNumericValue("timeout")
-			);
+			errors[sq]++;
 		}
-		else if (controllerRegisters)
+	}
+
+	if (latencies.empty())
+	{
+		fprintf(stderr, "No NVMeIoComplete events found in: %s\n", dataFile.c_str());
+		return false;
+	}
+
+	printf("%-5s %-10s %-8s %-10s %-10s %-10s %-10s %-10s %-10s\n",
+		"SQ", "Count", "Errors", "MinUs", "AvgUs", "P50Us", "P99Us", "P999Us", "MaxUs");
+	for (auto& q : latencies)
+	{
+		std::vector<unsigned long long>& l = q.second;
+		std::sort(l.begin(), l.end());
+
+		unsigned long long total = 0;
+		for (auto v : l)
 		{
-			success = nvmeControllerRegisters(
-				parser.getNumericValue("timeout"),
-				parser.getNumericValue("dataTransferSize"),
-				parser.getStringValue("dataFile"),
-				devicePath,
-				parser.getNumericValue("dataDirection"),
-				parser.getBooleanValue("debug")
-			);
+			total += v;
 		}
-		else if (pciRegisters)
+
+		auto pct = [&l](double p) { return l[(size_t)(p * (l.size() - 1) + 0.5)]; };
+		printf("%-5u %-10zu %-8llu %-10llu %-10llu %-10llu %-10llu %-10llu %-10llu\n",
+			q.first,
+			l.size(),
+			errors[q.first],
+			l.front(),
+			total / l.size(),
+			pct(0.5),
+			pct(0.99),
+			pct(0.999),
+			l.back());
+	}
+
+	return true;
+}
+
+// Drains as many SRB trace records as traceBufferSize holds, along with the
+// driver's per stage time counters
+bool drainSrbTrace(Handle& handle, NVME_SRB_TRACE_IOCTL* trace, DWORD traceBufferSize, bool debug)
+{
+	memset(trace, 0, traceBufferSize);
+	trace->SrbIoCtrl.HeaderLength = sizeof(SRB_IO_CONTROL);
+	memcpy(trace->SrbIoCtrl.Signature, NVME_SIG_STR, NVME_SIG_STR_LEN);
+	trace->SrbIoCtrl.Timeout = 5;
+	trace->SrbIoCtrl.ControlCode = NVME_SRB_TRACE;
+	trace->SrbIoCtrl.Length = traceBufferSize - sizeof(SRB_IO_CONTROL);
+
+	DWORD bytesReturned;
+	bool retVal = DeviceIoControl(
+		handle.getHandle(),
+		IOCTL_SCSI_MINIPORT,
+		trace,
+		traceBufferSize,
+		trace,
+		traceBufferSize,
+		&bytesReturned,
+		NULL
+	) != 0;
+
+	if (!retVal)
+	{
+		fprintf(stderr, "OS Error: %d\n", GetLastError());
+		return false;
+	}
+
+	if (trace->SrbIoCtrl.ReturnCode != NVME_IOCTL_SUCCESS)
+	{
+		fprintf(stderr, "SrbIoCtrl.ReturnCode Error: %d\n", trace->SrbIoCtrl.ReturnCode);
+		return false;
+	}
+
+	DBG(trace->NumRecords);
+	return true;
+}
+
+// Drains the driver's SRB trace into dataFile for timeout seconds. The file is a
+// NVME_SRB_TRACE_FILE_HEADER followed by the records in the order they arrived.
+bool captureSrbTrace(std::string devicePath, std::string dataFile, DWORD timeout, bool debug)
+{
+	Handle handle(devicePath);
+
+	FILE* file = fopen(dataFile.c_str(), "wb");
+	if (!file)
+	{
+		fprintf(stderr, "Unable to open file: %s\n", dataFile.c_str());
+		return false;
+	}
+
+	NVME_SRB_TRACE_FILE_HEADER header = { 0 };
+	memcpy(header.Magic, NVME_SRB_TRACE_FILE_MAGIC, sizeof(header.Magic));
+	header.Version = NVME_SRB_TRACE_FILE_VERSION;
+	header.RecordSize = sizeof(NVME_SRB_TRACE_RECORD);
+	fwrite(&header, sizeof(header), 1, file);
+
+	DWORD traceBufferSize = sizeof(NVME_SRB_TRACE_IOCTL) + 16383 * sizeof(NVME_SRB_TRACE_RECORD);
+	NVME_SRB_TRACE_IOCTL* trace = (NVME_SRB_TRACE_IOCTL*)calloc(traceBufferSize, 1);
+	DBG(traceBufferSize);
+
+	bool retVal = true;
+	ULONGLONG end = GetTickCount64() + (ULONGLONG)timeout * 1000;
+	while (GetTickCount64() < end)
+	{
+		retVal = drainSrbTrace(handle, trace, traceBufferSize, debug);
+		if (!retVal)
 		{
-			success = getPciRegisters(
-				parser.getNumericValue("dataTransferSize"),
-				parser.getStringValue("dataFile"),
-				devicePath,
-				parser.getBooleanValue("debug")
-			);
+			break;
 		}
-		else if (overrideModel)
+
+		if (trace->Lost)
 		{
-			success = overwriteModel(
-				devicePath,
-				parser.getStringValue("modelOverride"),
-				parser.getBooleanValue("debug")
+			fprintf(stderr, "%u records were overwritten before they were read\n", trace->Lost);
+		}
+
+		fwrite(trace->Records, sizeof(NVME_SRB_TRACE_RECORD), trace->NumRecords, file);
+		header.NumRecords += trace->NumRecords;
+		header.Lost += trace->Lost;
+
+		// Go again right away while the buffer keeps filling up
+		if (trace->NumRecords < 16384)
+		{
+			Sleep(10);
+		}
+	}
+
+	fseek(file, 0, SEEK_SET);
+	fwrite(&header, sizeof(header), 1, file);
+	fclose(file);
+	free(trace);
+
+	fprintf(stderr, "Captured %llu records, %llu lost\n", header.NumRecords, header.Lost);
+
+	DBG(retVal);
+	return retVal;
+}
+
+// Reads a capture made by captureSrbTrace, records in arrival order. Version 1
+// records are the same size and layout, only QueueDepth wasn't filled in.
+bool readSrbTraceFile(std::string dataFile, NVME_SRB_TRACE_FILE_HEADER& header, std::vector<NVME_SRB_TRACE_RECORD>& records, bool debug)
+{
+	FILE* file = fopen(dataFile.c_str(), "rb");
+	if (!file)
+	{
+		fprintf(stderr, "Unable to open file: %s\n", dataFile.c_str());
+		return false;
+	}
+
+	if (fread(&header, sizeof(header), 1, file) != 1 ||
+		memcmp(header.Magic, NVME_SRB_TRACE_FILE_MAGIC, sizeof(header.Magic)) != 0 ||
+		header.Version == 0 ||
+		header.Version > NVME_SRB_TRACE_FILE_VERSION ||
+		header.RecordSize != sizeof(NVME_SRB_TRACE_RECORD))
+	{
+		fprintf(stderr, "Not an SRB trace file: %s\n", dataFile.c_str());
+		fclose(file);
+		return false;
+	}
+
+	records.resize((size_t)header.NumRecords);
+	size_t read = records.size() ? fread(&records[0], sizeof(NVME_SRB_TRACE_RECORD), records.size(), file) : 0;
+	fclose(file);
+	records.resize(read);
+	DBG(header.Version);
+	DBG(header.NumRecords);
+
+	if (records.empty())
+	{
+		fprintf(stderr, "No records found in: %s\n", dataFile.c_str());
+		return false;
+	}
+
+	if (header.Version < 2)
+	{
+		for (auto& r : records)
+		{
+			r.QueueDepth = 0;
+		}
+	}
+
+	// Cores stamp their own time, put them back in arrival order
+	std::stable_sort(records.begin(), records.end(),
+		[](const NVME_SRB_TRACE_RECORD& a, const NVME_SRB_TRACE_RECORD& b) { return a.TimeStampUs < b.TimeStampUs; });
+
+	return true;
+}
+
+// Reads a capture made by captureSrbTrace and prints the workload it describes:
+// arrival rate and spacing, how it spreads over cores, read/write mix, sizes and
+// how full the submission queues were
+bool getSrbTraceStats(std::string dataFile, bool debug)
+{
+	NVME_SRB_TRACE_FILE_HEADER header;
+	std::vector<NVME_SRB_TRACE_RECORD> records;
+	if (!readSrbTraceFile(dataFile, header, records, debug))
+	{
+		return false;
+	}
+
+	std::map<unsigned, unsigned long long> cores;
+	std::map<unsigned long, unsigned long long> sizes;
+	std::vector<unsigned long long> gaps;
+	unsigned long long reads = 0, writes = 0, other = 0, prpAligned = 0, readBytes = 0, writeBytes = 0;
+	unsigned long long depthTotal = 0, depthMax = 0;
+	for (size_t i = 0; i < records.size(); i++)
+	{
+		NVME_SRB_TRACE_RECORD& r = records[i];
+		cores[r.Core]++;
+		depthTotal += r.QueueDepth;
+		depthMax = std::max(depthMax, (unsigned long long)r.QueueDepth);
+		if (i)
+		{
+			gaps.push_back(r.TimeStampUs - records[i - 1].TimeStampUs);
+		}
+
+		switch (r.CdbLength ? r.Cdb[0] : 0)
+		{
+		case 0x08: case 0x28: case 0xA8: case 0x88:
+			reads++;
+			readBytes += r.DataLength;
+			sizes[r.DataLength]++;
+			break;
+		case 0x0A: case 0x2A: case 0xAA: case 0x8A:
+			writes++;
+			writeBytes += r.DataLength;
+			sizes[r.DataLength]++;
+			break;
+		default:
+			other++;
+			break;
+		}
+
+		if (r.SgFlags & NVME_SRB_TRACE_SG_PRP_ALIGNED)
+		{
+			prpAligned++;
+		}
+	}
+
+	unsigned long long durationUs = records.back().TimeStampUs - records.front().TimeStampUs;
+	printf("Records: %zu (%llu lost)\n", records.size(), header.Lost);
+	printf("Duration: %llu us\n", durationUs);
+	if (durationUs)
+	{
+		printf("IOPS: %llu\n", records.size() * 1000000ULL / durationUs);
+	}
+	printf("Reads: %llu (%llu bytes)  Writes: %llu (%llu bytes)  Other: %llu\n", reads, readBytes, writes, writeBytes, other);
+	printf("PRP aligned SG lists: %llu\n", prpAligned);
+	if (header.Version >= 2)
+	{
+		printf("SQ occupancy at arrival: avg %llu max %llu\n", depthTotal / records.size(), depthMax);
+	}
+
+	if (!gaps.empty())
+	{
+		std::sort(gaps.begin(), gaps.end());
+		unsigned long long total = 0;
+		for (auto v : gaps)
+		{
+			total += v;
+		}
+		auto pct = [&gaps](double p) { return gaps[(size_t)(p * (gaps.size() - 1) + 0.5)]; };
+		printf("Inter-arrival us: avg %llu p50 %llu p99 %llu max %llu\n",
+			total / gaps.size(), pct(0.5), pct(0.99), gaps.back());
+	}
+
+	printf("\n%-6s %-10s\n", "Core", "Count");
+	for (auto& c : cores)
+	{
+		printf("%-6u %-10llu\n", c.first, c.second);
+	}
+
+	printf("\n%-10s %-10s\n", "Bytes", "Count");
+	for (auto& s : sizes)
+	{
+		printf("%-10lu %-10llu\n", s.first, s.second);
+	}
+
+	return true;
+}
+
+// One in flight IO of replaySrbTrace, OVERLAPPED first so a completion maps back
+struct ReplayIo
+{
+	OVERLAPPED overlapped;
+	PVOID buffer;
+	LARGE_INTEGER submitted;
+};
+
+// Replays a capture made by captureSrbTrace against diskPath, the disk behind
+// devicePath, issuing each READ/WRITE at its recorded LBA and size, at the
+// recorded pace divided by speed, 0 for as fast as possible. Writes go out as
+// reads of the same range unless replayWrites is given, which overwrites data.
+// Prints what the host saw and, from the driver, the time per request spent in
+// each NVME_SRB_STAGE_XXX and the SQ occupancy it recorded during the run.
+bool replaySrbTrace(std::string devicePath, std::string diskPath, std::string dataFile, DWORD speed, bool replayWrites, bool debug)
+{
+	NVME_SRB_TRACE_FILE_HEADER header;
+	std::vector<NVME_SRB_TRACE_RECORD> records;
+	if (!readSrbTraceFile(dataFile, header, records, debug))
+	{
+		return false;
+	}
+
+	Handle handle(devicePath);
+
+	HANDLE disk = CreateFile(diskPath.c_str(),
+		GENERIC_READ | (replayWrites ? GENERIC_WRITE : 0),
+		FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL,
+		OPEN_EXISTING,
+		FILE_FLAG_OVERLAPPED | FILE_FLAG_NO_BUFFERING,
+		NULL
+	);
+	if (disk == INVALID_HANDLE_VALUE)
+	{
+		fprintf(stderr, "Unable to open disk: %s (%d)\n", diskPath.c_str(), GetLastError());
+		return false;
+	}
+
+	DISK_GEOMETRY_EX geometry = { 0 };
+	DWORD bytesReturned;
+	if (!DeviceIoControl(disk, IOCTL_DISK_GET_DRIVE_GEOMETRY_EX, NULL, 0, &geometry, sizeof(geometry), &bytesReturned, NULL))
+	{
+		fprintf(stderr, "OS Error: %d\n", GetLastError());
+		CloseHandle(disk);
+		return false;
+	}
+	ULONGLONG sectorSize = geometry.Geometry.BytesPerSector;
+	ULONGLONG diskSize = (ULONGLONG)geometry.DiskSize.QuadPart;
+	DBG(sectorSize);
+
+	HANDLE port = CreateIoCompletionPort(disk, NULL, 0, 0);
+	if (!port)
+	{
+		fprintf(stderr, "OS Error: %d\n", GetLastError());
+		CloseHandle(disk);
+		return false;
+	}
+
+	// Keep what the trace did and size every buffer for the largest of it
+	std::vector<NVME_SRB_TRACE_RECORD> ios;
+	DWORD maxLength = 0;
+	for (auto& r : records)
+	{
+		UCHAR opCode = r.CdbLength ? r.Cdb[0] : 0;
+		if ((opCode == 0x08 || opCode == 0x28 || opCode == 0xA8 || opCode == 0x88 ||
+			opCode == 0x0A || opCode == 0x2A || opCode == 0xAA || opCode == 0x8A) &&
+			r.DataLength != 0)
+		{
+			ios.push_back(r);
+			maxLength = std::max(maxLength, (DWORD)r.DataLength);
+		}
+	}
+	maxLength = (DWORD)((maxLength + sectorSize - 1) / sectorSize * sectorSize);
+	if (ios.empty() || (ULONGLONG)maxLength > diskSize)
+	{
+		fprintf(stderr, "No reads or writes to replay in: %s\n", dataFile.c_str());
+		CloseHandle(port);
+		CloseHandle(disk);
+		return false;
+	}
+
+	const size_t slots = 256;
+	std::vector<ReplayIo> inFlight(slots);
+	std::vector<ReplayIo*> freeSlots;
+	for (auto& io : inFlight)
+	{
+		io.buffer = VirtualAlloc(NULL, maxLength, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		if (!io.buffer)
+		{
+			fprintf(stderr, "Unable to allocate %u bytes\n", maxLength);
+			break;
+		}
+		freeSlots.push_back(&io);
+	}
+
+	// Throw away what the driver recorded so far, keep its stage counters
+	DWORD traceBufferSize = sizeof(NVME_SRB_TRACE_IOCTL) + 16383 * sizeof(NVME_SRB_TRACE_RECORD);
+	NVME_SRB_TRACE_IOCTL* trace = (NVME_SRB_TRACE_IOCTL*)calloc(traceBufferSize, 1);
+	ULONGLONG stageTimeNs[NVME_SRB_STAGES] = { 0 };
+	ULONGLONG stageCalls[NVME_SRB_STAGES] = { 0 };
+	bool retVal = freeSlots.size() == slots;
+	while (retVal)
+	{
+		retVal = drainSrbTrace(handle, trace, traceBufferSize, debug);
+		if (retVal && trace->NumRecords == 0)
+		{
+			break;
+		}
+	}
+	if (retVal)
+	{
+		memcpy(stageTimeNs, trace->StageTimeNs, sizeof(stageTimeNs));
+		memcpy(stageCalls, trace->StageCalls, sizeof(stageCalls));
+	}
+
+	LARGE_INTEGER frequency, start, now;
+	QueryPerformanceFrequency(&frequency);
+	auto elapsedUs = [&frequency](LARGE_INTEGER from, LARGE_INTEGER to) {
+		return (ULONGLONG)((to.QuadPart - from.QuadPart) * 1000000 / frequency.QuadPart);
+	};
+
+	unsigned long long issued = 0, completed = 0, errors = 0, bytes = 0, deferred = 0;
+	unsigned long long latencyTotal = 0, latencyMax = 0, outstandingTotal = 0, outstandingMax = 0;
+	size_t next = 0;
+	QueryPerformanceCounter(&start);
+	while (retVal && (next < ios.size() || freeSlots.size() != slots))
+	{
+		QueryPerformanceCounter(&now);
+
+		// Issue everything that's due and has a slot
+		while (next < ios.size() && !freeSlots.empty())
+		{
+			NVME_SRB_TRACE_RECORD& r = ios[next];
+			ULONGLONG dueUs = speed ? (r.TimeStampUs - ios[0].TimeStampUs) / speed : 0;
+			if (dueUs > elapsedUs(start, now))
+			{
+				break;
+			}
+
+			ULONGLONG lba;
+			switch (r.CdbLength)
+			{
+			case 6:
+				lba = ((ULONGLONG)(r.Cdb[1] & 0x1F) << 16) | ((ULONGLONG)r.Cdb[2] << 8) | r.Cdb[3];
+				break;
+			case 16:
+				lba = 0;
+				for (int i = 2; i < 10; i++)
+				{
+					lba = (lba << 8) | r.Cdb[i];
+				}
+				break;
+			default:
+				lba = ((ULONGLONG)r.Cdb[2] << 24) | ((ULONGLONG)r.Cdb[3] << 16) | ((ULONGLONG)r.Cdb[4] << 8) | r.Cdb[5];
+				break;
+			}
+
+			// Same sector size as the captured disk expected, wrap onto a smaller one
+			DWORD length = (DWORD)((r.DataLength + sectorSize - 1) / sectorSize * sectorSize);
+			ULONGLONG offset = lba * sectorSize;
+			if (offset + length > diskSize)
+			{
+				offset %= ((diskSize - length) / sectorSize + 1) * sectorSize;
+			}
+
+			ReplayIo* io = freeSlots.back();
+			freeSlots.pop_back();
+			memset(&io->overlapped, 0, sizeof(io->overlapped));
+			io->overlapped.Offset = (DWORD)offset;
+			io->overlapped.OffsetHigh = (DWORD)(offset >> 32);
+			QueryPerformanceCounter(&io->submitted);
+
+			bool write = replayWrites && (r.Cdb[0] == 0x0A || r.Cdb[0] == 0x2A || r.Cdb[0] == 0xAA || r.Cdb[0] == 0x8A);
+			BOOL ok = write ?
+				WriteFile(disk, io->buffer, length, NULL, &io->overlapped) :
+				ReadFile(disk, io->buffer, length, NULL, &io->overlapped);
+			if (!ok && GetLastError() != ERROR_IO_PENDING)
+			{
+				errors++;
+				freeSlots.push_back(io);
+			}
+			else
+			{
+				issued++;
+				outstandingTotal += slots - freeSlots.size();
+				outstandingMax = std::max(outstandingMax, (unsigned long long)(slots - freeSlots.size()));
+			}
+			next++;
+		}
+
+		// The trace had more in flight than there are slots, it falls behind
+		if (next < ios.size() && freeSlots.empty())
+		{
+			deferred++;
+		}
+
+		// Wait for a completion, or until the next IO is due
+		DWORD waitMs = INFINITE;
+		if (next < ios.size() && !freeSlots.empty())
+		{
+			ULONGLONG dueUs = speed ? (ios[next].TimeStampUs - ios[0].TimeStampUs) / speed : 0;
+			QueryPerformanceCounter(&now);
+			ULONGLONG nowUs = elapsedUs(start, now);
+			waitMs = dueUs > nowUs ? (DWORD)((dueUs - nowUs) / 1000) : 0;
+		}
+		if (freeSlots.size() == slots && waitMs != INFINITE)
+		{
+			// Nothing in flight, just wait for the next one to be due
+			if (waitMs)
+			{
+				Sleep(waitMs);
+			}
+			continue;
+		}
+
+		DWORD length;
+		ULONG_PTR key;
+		LPOVERLAPPED overlapped;
+		BOOL ok = GetQueuedCompletionStatus(port, &length, &key, &overlapped, waitMs);
+		while (overlapped)
+		{
+			ReplayIo* io = CONTAINING_RECORD(overlapped, ReplayIo, overlapped);
+			QueryPerformanceCounter(&now);
+			ULONGLONG latencyUs = elapsedUs(io->submitted, now);
+			latencyTotal += latencyUs;
+			latencyMax = std::max(latencyMax, latencyUs);
+			if (ok)
+			{
+				completed++;
+				bytes += length;
+			}
+			else
+			{
+				errors++;
+			}
+			freeSlots.push_back(io);
+
+			// Reap whatever else is already done without waiting
+			ok = GetQueuedCompletionStatus(port, &length, &key, &overlapped, 0);
+		}
+	}
+	QueryPerformanceCounter(&now);
+	ULONGLONG durationUs = elapsedUs(start, now);
+
+	// What the driver saw of the run, records of other IO to the adapter included
+	unsigned long long depthRecords = 0, depthTotal = 0, depthMax = 0, lost = 0;
+	while (retVal)
+	{
+		retVal = drainSrbTrace(handle, trace, traceBufferSize, debug);
+		if (!retVal)
+		{
+			break;
+		}
+
+		lost += trace->Lost;
+		for (ULONG i = 0; i < trace->NumRecords; i++)
+		{
+			depthRecords++;
+			depthTotal += trace->Records[i].QueueDepth;
+			depthMax = std::max(depthMax, (unsigned long long)trace->Records[i].QueueDepth);
+		}
+		if (trace->NumRecords == 0)
+		{
+			break;
+		}
+	}
+
+	if (retVal)
+	{
+		printf("Replayed: %llu of %zu IOs (%llu errors) in %llu us, %s\n",
+			issued, ios.size(), errors, durationUs, replayWrites ? "writes as writes" : "writes as reads");
+		if (durationUs)
+		{
+			printf("IOPS: %llu  MB/s: %llu\n", completed * 1000000ULL / durationUs, bytes / durationUs);
+		}
+		if (completed + errors)
+		{
+			printf("Latency us: avg %llu max %llu\n", latencyTotal / (completed + errors), latencyMax);
+		}
+		if (issued)
+		{
+			printf("Host outstanding: avg %llu max %llu (%zu slots, %llu waits for one)\n",
+				outstandingTotal / issued, outstandingMax, slots, deferred);
+		}
+		if (depthRecords)
+		{
+			printf("SQ occupancy at arrival: avg %llu max %llu (%llu records, %llu lost)\n",
+				depthTotal / depthRecords, depthMax, depthRecords, lost);
+		}
+
+		const char* stageNames[NVME_SRB_STAGES] = { "translate", "submit", "complete" };
+		printf("\n%-10s %-10s %-10s\n", "Stage", "Calls", "ns/call");
+		for (int s = 0; s < NVME_SRB_STAGES; s++)
+		{
+			ULONGLONG calls = trace->StageCalls[s] - stageCalls[s];
+			ULONGLONG timeNs = trace->StageTimeNs[s] - stageTimeNs[s];
+			printf("%-10s %-10llu %-10llu\n", stageNames[s], calls, calls ? timeNs / calls : 0);
+		}
+	}
+
+	// Nothing may still be in flight before the buffers go
+	while (freeSlots.size() != slots)
+	{
+		DWORD length;
+		ULONG_PTR key;
+		LPOVERLAPPED overlapped;
+		GetQueuedCompletionStatus(port, &length, &key, &overlapped, INFINITE);
+		if (overlapped)
+		{
+			freeSlots.push_back(CONTAINING_RECORD(overlapped, ReplayIo, overlapped));
+		}
+	}
+	for (auto& io : inFlight)
+	{
+		if (io.buffer)
+		{
+			VirtualFree(io.buffer, 0, MEM_RELEASE);
+		}
+	}
+	free(trace);
+	CloseHandle(port);
+	CloseHandle(disk);
+
+	DBG(retVal);
+	return retVal;
+}
+
+std::string promptForSelection()
+{
+	std::vector<std::string> paths;
+
+	for (int i = 0; i < 255; i++)
+	{
+		std::string testPath = "\\\\.\\SCSI" + std::to_string(i) + ":";
+		try
+		{
+			Handle handle(testPath);
+		}
+		catch (...)
+		{
+			continue;
+		}
+
+		bool ofa = false;
+		bool csm = false;
+
+		csm = nvmePassthru(6, 0, 1, 0, 0, 0, 0, 0, false, 5, 2, 4096, "ic.bin", testPath, false, true, true);
+		
+		if (!csm)
+		{
+			ofa = nvmePassthru(6, 0, 1, 0, 0, 0, 0, 0, false, 5, 2, 4096, "ic.bin", testPath, false, false, true);
+		}
+
+		if (csm || ofa)
+		{
+			std::string model = "?";
+			std::string fw = "?";
+			std::string type = "?";
+			PADMIN_IDENTIFY_CONTROLLER pIc = (PADMIN_IDENTIFY_CONTROLLER)READ_FILE("ic.bin", 4096);
+			model = std::string((char*)pIc->MN, 40);
+			fw = std::string((char*)pIc->FR, 8);
+			CLOSE_FILE(pIc);
+			remove("ic.bin");
+			if (csm)
+			{
+				type = "CSM NVMe Driver";
+			}
+			else if (ofa)
+			{
+				type = "OFA-Compatible Driver";
+			}
+			fprintf(stderr, "%d) %-30s %-8s %-11s %s\n", (int)paths.size(), model.c_str(), fw.c_str(), testPath.c_str(), type.c_str());
+			paths.push_back(testPath);
+		}
+
+	}
+
+	int sel;
+	std::cerr << "Choose an above index: ";
+	std::cin >> sel;
+
+	return paths[sel];
+}
+
+// Downloads the firmware image in dataFile with a single NVME_FW_DOWNLOAD, the
+// driver pipelines the chunks and commits it to slot with action.
+bool firmwareDownload(std::string devicePath, std::string dataFile, DWORD slot, DWORD action, DWORD chunkSize, DWORD depth, DWORD timeout, bool debug)
+{
+	Handle handle(devicePath);
+	std::vector<BYTE> image;
+
+	FILE* file = fopen(dataFile.c_str(), "rb");
+	if (!file)
+	{
+		fprintf(stderr, "Unable to open file: %s\n", dataFile.c_str());
+		return false;
+	}
+	BYTE chunk[64 * 1024];
+	size_t read;
+	while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0)
+	{
+		image.insert(image.end(), chunk, chunk + read);
+	}
+	fclose(file);
+
+	// Firmware Image Download works in dwords, pad the image out to one
+	image.resize((image.size() + 3) & ~(size_t)3, 0);
+	if (image.size() == 0)
+	{
+		fprintf(stderr, "Empty firmware image: %s\n", dataFile.c_str());
+		return false;
+	}
+
+	DWORD bufferSize = (DWORD)(FIELD_OFFSET(NVME_FW_DOWNLOAD_IOCTL, Image) + image.size());
+	NVME_FW_DOWNLOAD_IOCTL* fw = (NVME_FW_DOWNLOAD_IOCTL*)calloc(bufferSize, 1);
+	DBG(bufferSize);
+
+	fw->SrbIoCtrl.HeaderLength = sizeof(SRB_IO_CONTROL);
+	memcpy(fw->SrbIoCtrl.Signature, NVME_SIG_STR, NVME_SIG_STR_LEN);
+	fw->SrbIoCtrl.Timeout = timeout;
+	fw->SrbIoCtrl.ControlCode = NVME_FW_DOWNLOAD;
+	fw->SrbIoCtrl.Length = bufferSize - sizeof(SRB_IO_CONTROL);
+	fw->Slot = slot;
+	fw->CommitAction = action;
+	fw->ChunkSize = chunkSize;
+	fw->Depth = depth;
+	fw->ImageLength = (ULONG)image.size();
+	memcpy(fw->Image, &image[0], image.size());
+
+	ULONGLONG start = GetTickCount64();
+	DWORD bytesReturned;
+	bool retVal = DeviceIoControl(
+		handle.getHandle(),
+		IOCTL_SCSI_MINIPORT,
+		fw,
+		bufferSize,
+		fw,
+		bufferSize,
+		&bytesReturned,
+		NULL
+	) != 0;
+	ULONGLONG elapsedMs = GetTickCount64() - start;
+	DBG(bytesReturned);
+	DBG(fw->SrbIoCtrl.ReturnCode);
+
+	NVMe_COMPLETION_QUEUE_ENTRY_DWORD_3* status = (NVMe_COMPLETION_QUEUE_ENTRY_DWORD_3*)&fw->CplStatus;
+
+	if (!retVal)
+	{
+		fprintf(stderr, "OS Error: %d\n", GetLastError());
+		goto done;
+	}
+
+	switch (fw->SrbIoCtrl.ReturnCode)
+	{
+	case NVME_IOCTL_SUCCESS:
+		break;
+	case NVME_IOCTL_FW_DOWNLOAD_FAILED:
+		fprintf(stderr, "Firmware Image Download failed at offset 0x%x: SCT %u SC 0x%02x\n",
+			fw->FailedOffset, status->SF.SCT, status->SF.SC);
+		retVal = false;
+		goto done;
+	case NVME_IOCTL_FW_COMMIT_FAILED:
+		fprintf(stderr, "Firmware Commit failed: SCT %u SC 0x%02x\n", status->SF.SCT, status->SF.SC);
+		retVal = false;
+		goto done;
+	case NVME_IOCTL_INVALID_FW_PARAMETER:
+		fprintf(stderr, "Invalid slot, commit action or chunk size for this controller\n");
+		retVal = false;
+		goto done;
+	default:
+		fprintf(stderr, "SrbIoCtrl.ReturnCode Error: %d\n", fw->SrbIoCtrl.ReturnCode);
+		retVal = false;
+		goto done;
+	}
+
+	printf("%-14s %u bytes in %u chunks of %u, up to %u in flight\n",
+		"Downloaded", fw->ImageLength, fw->Chunks, fw->ChunkSize, fw->MaxInFlight);
+	printf("%-14s %u us, %.1f MB/s\n", "Download", fw->DownloadUs,
+		fw->DownloadUs ? (double)fw->ImageLength / fw->DownloadUs : 0.0);
+	printf("%-14s %u us\n", "Commit", fw->CommitUs);
+	printf("%-14s %llu ms\n", "Round trip", elapsedMs);
+	if (status->SF.SCT == COMMAND_SPECIFIC_ERRORS)
+	{
+		printf("The new firmware activates at the next %s\n",
+			status->SF.SC == FIRMWARE_ACTIVATION_REQUIRES_NVM_SUBSYSTEM_RESET ? "NVM subsystem reset" :
+			status->SF.SC == FIRMWARE_ACTIVATION_REQUIRES_RESET ? "controller reset" : "conventional reset");
+	}
+
+done:
+	free(fw);
+	return retVal;
+}
+
+// Reads the counters of one namespace, false once lun is past the last one
+static bool getNamespaceQos(Handle& handle, DWORD lun, NVME_NAMESPACE_QOS_IOCTL* qos, bool debug)
+{
+	memset(qos, 0, sizeof(NVME_NAMESPACE_QOS_IOCTL));
+	qos->SrbIoCtrl.HeaderLength = sizeof(SRB_IO_CONTROL);
+	memcpy(qos->SrbIoCtrl.Signature, NVME_SIG_STR, NVME_SIG_STR_LEN);
+	qos->SrbIoCtrl.Timeout = 5;
+	qos->SrbIoCtrl.ControlCode = NVME_NAMESPACE_QOS;
+	qos->SrbIoCtrl.Length = sizeof(NVME_NAMESPACE_QOS_IOCTL) - sizeof(SRB_IO_CONTROL);
+	qos->Lun = lun;
+
+	DWORD bytesReturned;
+	bool retVal = DeviceIoControl(
+		handle.getHandle(),
+		IOCTL_SCSI_MINIPORT,
+		qos,
+		sizeof(NVME_NAMESPACE_QOS_IOCTL),
+		qos,
+		sizeof(NVME_NAMESPACE_QOS_IOCTL),
+		&bytesReturned,
+		NULL
+	) != 0;
+	DBG(bytesReturned);
+	DBG(qos->SrbIoCtrl.ReturnCode);
+
+	if (!retVal)
+	{
+		fprintf(stderr, "OS Error: %d\n", GetLastError());
+		return false;
+	}
+
+	if (qos->SrbIoCtrl.ReturnCode != NVME_IOCTL_SUCCESS && qos->SrbIoCtrl.ReturnCode != NVME_IOCTL_INVALID_NAMESPACE_ID)
+	{
+		fprintf(stderr, "SrbIoCtrl.ReturnCode Error: %d\n", qos->SrbIoCtrl.ReturnCode);
+		return false;
+	}
+
+	return qos->SrbIoCtrl.ReturnCode == NVME_IOCTL_SUCCESS;
+}
+
+// Prints the read and write throughput of every namespace that had any, once a
+// second for timeout seconds, along with the requests held for a format. Run
+// it next to a Format NVM of one namespace to see the others keep going.
+bool namespaceStats(std::string devicePath, DWORD timeout, bool debug)
+{
+	Handle handle(devicePath);
+	std::vector<NVME_NAMESPACE_QOS_IOCTL> last;
+	NVME_NAMESPACE_QOS_IOCTL qos;
+
+	for (DWORD lun = 0; getNamespaceQos(handle, lun, &qos, debug); lun++)
+	{
+		last.push_back(qos);
+	}
+	if (last.size() == 0)
+	{
+		return false;
+	}
+
+	printf("%-8s %-4s %-10s %-10s %-6s\n", "Second", "LUN", "IOPS", "MB/s", "Held");
+	ULONGLONG lastMs = GetTickCount64();
+	for (DWORD second = 1; second <= timeout; second++)
+	{
+		Sleep(1000);
+		ULONGLONG nowMs = GetTickCount64();
+		double elapsed = (nowMs - lastMs) / 1000.0;
+		lastMs = nowMs;
+
+		for (DWORD lun = 0; lun < last.size(); lun++)
+		{
+			if (!getNamespaceQos(handle, lun, &qos, debug))
+			{
+				return false;
+			}
+
+			ULONGLONG ios = qos.CompletedRequests - last[lun].CompletedRequests;
+			ULONGLONG bytes = qos.CompletedBytes - last[lun].CompletedBytes;
+			if (ios != 0 || qos.HeldRequests != 0)
+			{
+				printf("%-8u %-4u %-10.0f %-10.1f %-6u\n",
+					second, lun, ios / elapsed, bytes / elapsed / (1024 * 1024), qos.HeldRequests);
+			}
+			last[lun] = qos;
+		}
+	}
+
+	return true;
+}
+
+// Reads the PI format of one namespace, false once lun is past the last one
+static bool getProtectionInfo(Handle& handle, DWORD lun, NVME_PROTECTION_INFO_IOCTL* pi, bool debug)
+{
+	memset(pi, 0, sizeof(NVME_PROTECTION_INFO_IOCTL));
+	pi->SrbIoCtrl.HeaderLength = sizeof(SRB_IO_CONTROL);
+	memcpy(pi->SrbIoCtrl.Signature, NVME_SIG_STR, NVME_SIG_STR_LEN);
+	pi->SrbIoCtrl.Timeout = 5;
+	pi->SrbIoCtrl.ControlCode = NVME_PROTECTION_INFO;
+	pi->SrbIoCtrl.Length = sizeof(NVME_PROTECTION_INFO_IOCTL) - sizeof(SRB_IO_CONTROL);
+	pi->Lun = lun;
+
+	DWORD bytesReturned;
+	bool retVal = DeviceIoControl(
+		handle.getHandle(),
+		IOCTL_SCSI_MINIPORT,
+		pi,
+		sizeof(NVME_PROTECTION_INFO_IOCTL),
+		pi,
+		sizeof(NVME_PROTECTION_INFO_IOCTL),
+		&bytesReturned,
+		NULL
+	) != 0;
+	DBG(bytesReturned);
+	DBG(pi->SrbIoCtrl.ReturnCode);
+
+	if (!retVal)
+	{
+		fprintf(stderr, "OS Error: %d\n", GetLastError());
+		return false;
+	}
+
+	if (pi->SrbIoCtrl.ReturnCode != NVME_IOCTL_SUCCESS && pi->SrbIoCtrl.ReturnCode != NVME_IOCTL_INVALID_NAMESPACE_ID)
+	{
+		fprintf(stderr, "SrbIoCtrl.ReturnCode Error: %d\n", pi->SrbIoCtrl.ReturnCode);
+		return false;
+	}
+
+	return pi->SrbIoCtrl.ReturnCode == NVME_IOCTL_SUCCESS;
+}
+
+// Prints the metadata and PI format of each namespace, then once a second for
+// timeout seconds the blocks the driver's host PI check went through, the
+// throughput of its guard CRC and mismatches. Run it next to a read/write
+// load on a namespace keeping its PI separately with PiHostCheck set.
+bool protectionStats(std::string devicePath, DWORD timeout, bool debug)
+{
+	Handle handle(devicePath);
+	NVME_PROTECTION_INFO_IOCTL pi;
+	NVME_PROTECTION_INFO_IOCTL last;
+	DWORD luns = 0;
+
+	printf("%-4s %-8s %-8s %-6s %-10s %-10s %-10s\n", "LUN", "LBA", "Metadata", "Type", "Location", "Supported", "HostCheck");
+	for (; getProtectionInfo(handle, luns, &pi, debug); luns++)
+	{
+		printf("%-4u %-8u %-8u %-6u %-10s %-10s %-10s\n",
+			luns, pi.LbaSize, pi.MetadataSize, pi.PiType,
+			pi.MetadataSize == 0 ? "-" : (pi.ExtendedLba ? "Extended" : "Separate"),
+			pi.Supported ? "Yes" : "No", pi.HostCheck ? "Yes" : "No");
+		last = pi;
+	}
+	if (luns == 0)
+	{
+		return false;
+	}
+
+	printf("\n%-8s %-12s %-12s %-10s\n", "Second", "Blocks/s", "CRC MB/s", "Errors");
+	for (DWORD second = 1; second <= timeout; second++)
+	{
+		Sleep(1000);
+		if (!getProtectionInfo(handle, 0, &pi, debug))
+		{
+			return false;
+		}
+
+		ULONGLONG blocks = pi.HostBlocks - last.HostBlocks;
+		ULONGLONG bytes = pi.HostBytes - last.HostBytes;
+		ULONGLONG us = pi.HostTimeUs - last.HostTimeUs;
+		printf("%-8u %-12llu %-12.1f %-10llu\n",
+			second, blocks, us == 0 ? 0.0 : (double)bytes / us * 1000000 / (1024 * 1024),
+			pi.HostErrors - last.HostErrors);
+		last = pi;
+	}
+
+	return true;
+}
+
+// Prints the latency of each opcode class summed over all completion queues,
+// and the admin commands on their own, clearing the counters if reset is given
+bool latencyStats(std::string devicePath, bool reset, bool debug)
+{
+	static const char* classNames[NVME_LAT_CLASSES] = { "Read", "Write", "Flush", "DSM", "Admin", "Other" };
+	Handle handle(devicePath);
+	NVME_LATENCY_HISTOGRAM_IOCTL hist;
+
+	printf("%-8s %-12s %-10s %-10s\n", "Class", "Count", "AvgUs", "MaxUs");
+	for (DWORD opClass = 0; opClass < NVME_LAT_CLASSES; opClass++)
+	{
+		memset(&hist, 0, sizeof(hist));
+		hist.SrbIoCtrl.HeaderLength = sizeof(SRB_IO_CONTROL);
+		memcpy(hist.SrbIoCtrl.Signature, NVME_SIG_STR, NVME_SIG_STR_LEN);
+		hist.SrbIoCtrl.Timeout = 5;
+		hist.SrbIoCtrl.ControlCode = NVME_LATENCY_HISTOGRAM;
+		hist.SrbIoCtrl.Length = sizeof(NVME_LATENCY_HISTOGRAM_IOCTL) - sizeof(SRB_IO_CONTROL);
+		hist.QueueId = NVME_LAT_ALL_QUEUES;
+		hist.OpClass = opClass;
+		hist.Reset = (reset && opClass == NVME_LAT_CLASSES - 1) ? 1 : 0;
+
+		DWORD bytesReturned;
+		bool retVal = DeviceIoControl(
+			handle.getHandle(),
+			IOCTL_SCSI_MINIPORT,
+			&hist,
+			sizeof(NVME_LATENCY_HISTOGRAM_IOCTL),
+			&hist,
+			sizeof(NVME_LATENCY_HISTOGRAM_IOCTL),
+			&bytesReturned,
+			NULL
+		) != 0;
+		DBG(bytesReturned);
+		DBG(hist.SrbIoCtrl.ReturnCode);
+
+		if (!retVal)
+		{
+			fprintf(stderr, "OS Error: %d\n", GetLastError());
+			return false;
+		}
+
+		if (hist.SrbIoCtrl.ReturnCode != NVME_IOCTL_SUCCESS)
+		{
+			fprintf(stderr, "SrbIoCtrl.ReturnCode Error: %d\n", hist.SrbIoCtrl.ReturnCode);
+			return false;
+		}
+
+		printf("%-8s %-12llu %-10llu %-10llu\n", classNames[opClass], hist.Count,
+			hist.Count == 0 ? 0 : hist.TotalUs / hist.Count, hist.MaxUs);
+	}
+
+	// The admin totals come with every class, the last reply has them all
+	printf("\nAdmin commands (AER excluded): %llu, avg %llu us, max %llu us\n",
+		hist.AdminCount, hist.AdminCount == 0 ? 0 : hist.AdminTotalUs / hist.AdminCount, hist.AdminMaxUs);
+
+	return true;
+}
+
+static bool sendTunables(Handle& handle, NVME_TUNABLES_IOCTL* tunables, bool debug)
+{
+	tunables->SrbIoCtrl.HeaderLength = sizeof(SRB_IO_CONTROL);
+	memcpy(tunables->SrbIoCtrl.Signature, NVME_SIG_STR, NVME_SIG_STR_LEN);
+	// Queue changes wait for the IO in flight to drain first
+	tunables->SrbIoCtrl.Timeout = 30;
+	tunables->SrbIoCtrl.ControlCode = NVME_TUNABLES;
+	tunables->SrbIoCtrl.Length = sizeof(NVME_TUNABLES_IOCTL) - sizeof(SRB_IO_CONTROL);
+
+	DWORD bytesReturned;
+	bool retVal = DeviceIoControl(
+		handle.getHandle(),
+		IOCTL_SCSI_MINIPORT,
+		tunables,
+		sizeof(NVME_TUNABLES_IOCTL),
+		tunables,
+		sizeof(NVME_TUNABLES_IOCTL),
+		&bytesReturned,
+		NULL
+	) != 0;
+	DBG(bytesReturned);
+	DBG(tunables->SrbIoCtrl.ReturnCode);
+
+	if (!retVal)
+	{
+		fprintf(stderr, "OS Error: %d\n", GetLastError());
+		return false;
+	}
+
+	switch (tunables->SrbIoCtrl.ReturnCode)
+	{
+	case NVME_IOCTL_SUCCESS:
+		return true;
+	case NVME_IOCTL_INVALID_TUNABLE:
+		fprintf(stderr, "A value is out of range, queue entries and queues can't go above the Max shown\n");
+		break;
+	case NVME_IOCTL_UNSUPPORTED_OPERATION:
+		fprintf(stderr, "The queues can't be changed now, try again once the controller is ready\n");
+		break;
+	case NVME_IOCTL_QUIESCE_TIMEOUT:
+		fprintf(stderr, "IO didn't drain in %u us, nothing was changed\n", tunables->QuiesceUs);
+		break;
+	default:
+		fprintf(stderr, "SrbIoCtrl.ReturnCode Error: %d\n", tunables->SrbIoCtrl.ReturnCode);
+		break;
+	}
+
+	return false;
+}
+
+// Reads the driver's tunables, changes the ones given and prints the result.
+// Values that come in pairs default to what the driver has for the other one.
+bool nvmeTunables(std::string devicePath, ArgumentParser& parser, bool debug)
+{
+	Handle handle(devicePath);
+	NVME_TUNABLES_IOCTL tunables = { 0 };
+
+	if (!sendTunables(handle, &tunables, debug))
+	{
+		return false;
+	}
+
+	struct { const char* name; ULONG flag; ULONG* value; } knobs[] = {
+		{ "intCoalescingTime", NVME_TUNE_INT_COALESCING, &tunables.IntCoalescingTime },
+		{ "intCoalescingEntry", NVME_TUNE_INT_COALESCING, &tunables.IntCoalescingEntry },
+		{ "cplBudget", NVME_TUNE_CPL_BUDGET, &tunables.CplBudget },
+		{ "cplDoorbellBatch", NVME_TUNE_CPL_DOORBELL, &tunables.CplDoorbellBatch },
+		{ "traceSampleRate", NVME_TUNE_TRACE_SAMPLE, &tunables.TraceSampleRate },
+		{ "slowCmdThresholdUs", NVME_TUNE_SLOW_CMD, &tunables.SlowCmdThresholdUs },
+		{ "qosIopsLimit", NVME_TUNE_QOS, &tunables.QosIopsLimit },
+		{ "qosBandwidthLimit", NVME_TUNE_QOS, &tunables.QosBandwidthLimit },
+		{ "ioQueueEntries", NVME_TUNE_IO_QUEUE_ENTRIES, &tunables.IoQEntries },
+		{ "ioQueues", NVME_TUNE_IO_QUEUES, &tunables.IoQueues },
+	};
+
+	tunables.Set = 0;
+	for (auto& knob : knobs)
+	{
+		if (parser.getStringValue(knob.name).size() > 0)
+		{
+			*knob.value = parser.getNumericValue(knob.name);
+			tunables.Set |= knob.flag;
+		}
+	}
+
+	if (tunables.Set != 0 && !sendTunables(handle, &tunables, debug))
+	{
+		return false;
+	}
+
+	for (auto& knob : knobs)
+	{
+		printf("%-20s %u\n", knob.name, *knob.value);
+	}
+	printf("%-20s %u\n", "maxIoQueueEntries", tunables.MaxIoQEntries);
+	printf("%-20s %u\n", "maxIoQueues", tunables.MaxIoQueues);
+	if (tunables.Set & NVME_TUNE_RECREATE)
+	{
+		printf("%-20s %u\n", "quiesceUs", tunables.QuiesceUs);
+	}
+
+	return true;
+}
+
+int main(int argc, const char** argv)
+{
+	try
+	{
+		ArgumentParser parser;
+		parser.add_argument(Argument("DW0", "DWord0", "", "DWord 0 of an NVMe Command", "6", false));
+		parser.add_argument(Argument("DW1", "DWord1", "", "DWord 1 of an NVMe Command", "0", false));
+		parser.add_argument(Argument("DW10", "DWord10", "", "DWord 10 of an NVMe Command", "1", false));
+		parser.add_argument(Argument("DW11", "DWord11", "", "DWord 11 of an NVMe Command", "0", false));
+		parser.add_argument(Argument("DW12", "DWord12", "", "DWord 12 of an NVMe Command", "0", false));
+		parser.add_argument(Argument("DW13", "DWord13", "", "DWord 13 of an NVMe Command", "0", false));
+		parser.add_argument(Argument("DW14", "DWord14", "", "DWord 14 of an NVMe Command", "0", false));
+		parser.add_argument(Argument("DW15", "DWord15", "", "DWord 15 of an NVMe Command", "0", false));
+		parser.add_argument(Argument("nvm", "NVM", "store_true", "If given, send command as NVM instead of Admin", "", false));
+		parser.add_argument(Argument("debug", "debug", "store_true", "If given, Send debug info to stderr", "", false));
+		parser.add_argument(Argument("noLook", "noLook", "store_true", "If given, Use NO_LOOK IOCTL", "", false));
+		parser.add_argument(Argument("timeout", "timeout", "", "Timeout in seconds", "60", false));
+		parser.add_argument(Argument("dataDirection", "dataDirection", "", "0:non data, 1:write, 2:read", "2", false));
+		parser.add_argument(Argument("dataTransferSize", "dataTransferSize", "", "In bytes", "8192", false));
+		parser.add_argument(Argument("dataFile", "dataFile", "", "Location of binary file", "", false));
+		parser.add_argument(Argument("devicePath", "devicePath", "", "Path to device", "", false));
+		parser.add_argument(Argument("model", "modelOverride", "", "Model to override in Identify Controller", "", false));
+		parser.add_argument(Argument("fwSlot", "firmwareSlot", "", "For firmware, the slot to commit to, 0 lets the controller pick", "0", false));
+		parser.add_argument(Argument("fwAction", "firmwareCommitAction", "", "For firmware, 0:replace, 1:replace and activate at reset, 2:activate at reset, 3:activate now", "1", false));
+		parser.add_argument(Argument("fwChunkSize", "firmwareChunkSize", "", "For firmware, bytes per download command, 0 for the largest", "0", false));
+		parser.add_argument(Argument("fwDepth", "firmwareDepth", "", "For firmware, download commands kept in flight, 0 for the driver default", "0", false));
+		parser.add_argument(Argument("intCoalescingTime", "intCoalescingTime", "", "For tune, aggregation time in 100us units", "", false));
+		parser.add_argument(Argument("intCoalescingEntry", "intCoalescingEntry", "", "For tune, aggregation threshold in entries", "", false));
+		parser.add_argument(Argument("cplBudget", "cplBudget", "", "For tune, completions a DPC handles per queue before yielding, 0 for no limit", "", false));
+		parser.add_argument(Argument("cplDoorbellBatch", "cplDoorbellBatch", "", "For tune, completions per CQ head doorbell write, 0 for once per queue sweep", "", false));
+		parser.add_argument(Argument("traceSampleRate", "traceSampleRate", "", "For tune, trace 1 in this many commands", "", false));
+		parser.add_argument(Argument("slowCmdThresholdUs", "slowCmdThresholdUs", "", "For tune, slow command log threshold in us, 0 for off", "", false));
+		parser.add_argument(Argument("qosIopsLimit", "qosIopsLimit", "", "For tune, default per namespace IOPS limit, 0 for none", "", false));
+		parser.add_argument(Argument("qosBandwidthLimit", "qosBandwidthLimit", "", "For tune, default per namespace KB/s limit, 0 for none", "", false));
+		parser.add_argument(Argument("ioQueueEntries", "ioQueueEntries", "", "For tune, IO queue depth, recreates the queues", "", false));
+		parser.add_argument(Argument("ioQueues", "ioQueues", "", "For tune, IO queues to spread the cores over, recreates the queues", "", false));
+		parser.add_argument(Argument("latencyReset", "latencyReset", "store_true", "For latency, clear the counters once read", "", false));
+		parser.add_argument(Argument("diskPath", "diskPath", "", "For srbReplay, the disk to replay to, e.g. \\\\.\\PhysicalDrive1", "", false));
+		parser.add_argument(Argument("replaySpeed", "replaySpeed", "", "For srbReplay, 1 replays at the recorded pace, N N times faster, 0 as fast as possible", "1", false));
+		parser.add_argument(Argument("replayWrites", "replayWrites", "store_true", "For srbReplay, replay writes as writes, overwriting data on diskPath", "", false));
+
+		// Actions
+		parser.add_argument(Argument("passthru", "passthru", "store_true", "If given, Do an NVMe passthru command", "false", false));
+		parser.add_argument(Argument("pciRegisters", "pciRegs", "store_true", "If given, retrieve the pci registers header", "false", false));
+		parser.add_argument(Argument("controllerRegisters", "controllerRegs", "store_true", "If given, target the controller registers", "false", false));
+		parser.add_argument(Argument("reset", "controllerReset", "store_true", "If given, do an NVMe Controller Reset", "false", false));
+		parser.add_argument(Argument("override", "overrideModel", "store_true", "If given, Overwrite the model returned in Identify Controller", "false", false));
+		parser.add_argument(Argument("overrideReset", "overrideModelReset", "store_true", "If given, Reset the override returned in Identify Controller", "false", false));
+		parser.add_argument(Argument("history", "history", "store_true", "If given, Dump the driver's per core command history merged by time", "false", false));
+		parser.add_argument(Argument("slowLog", "slowCommandLog", "store_true", "If given, Dump the driver's slow command log", "false", false));
+		parser.add_argument(Argument("traceStats", "traceStats", "store_true", "If given, Print per queue latency statistics from a tracefmt text file given as dataFile", "false", false));
+		parser.add_argument(Argument("srbTrace", "srbTrace", "store_true", "If given, Capture the driver's SRB trace to dataFile for timeout seconds", "false", false));
+		parser.add_argument(Argument("srbTraceStats", "srbTraceStats", "store_true", "If given, Print workload statistics from an SRB trace capture given as dataFile", "false", false));
+		parser.add_argument(Argument("srbReplay", "srbReplay", "store_true", "If given, Replay an SRB trace capture given as dataFile to diskPath and print the driver's time per stage", "false", false));
+		parser.add_argument(Argument("tune", "tune", "store_true", "If given, Change the driver tunables given and print them all", "false", false));
+		parser.add_argument(Argument("firmware", "firmwareDownload", "store_true", "If given, Download the firmware image in dataFile and commit it", "false", false));
+		parser.add_argument(Argument("nsStats", "namespaceStats", "store_true", "If given, Print the throughput of each namespace every second for timeout seconds", "false", false));
+		parser.add_argument(Argument("piStats", "protectionStats", "store_true", "If given, Print each namespace's PI format, then the driver's host PI check rate every second for timeout seconds", "false", false));
+		parser.add_argument(Argument("latency", "latency", "store_true", "If given, Print the driver's completion latency per opcode class and of admin commands", "false", false));
+
+		parser.parse_args(argv, argc);
+
+		bool passthru = parser.getBooleanValue("passthru");
+		bool pciRegisters = parser.getBooleanValue("pciRegisters");
+		bool controllerRegisters = parser.getBooleanValue("controllerRegisters");
+		bool reset = parser.getBooleanValue("reset");
+		bool overrideModel = parser.getBooleanValue("overrideModel");
+		bool overrideReset = parser.getBooleanValue("overrideReset");
+		bool history = parser.getBooleanValue("history");
+		bool traceStats = parser.getBooleanValue("traceStats");
+		bool slowLog = parser.getBooleanValue("slowCommandLog");
+		bool srbTrace = parser.getBooleanValue("srbTrace");
+		bool srbTraceStats = parser.getBooleanValue("srbTraceStats");
+		bool srbReplay = parser.getBooleanValue("srbReplay");
+		bool tune = parser.getBooleanValue("tune");
+		bool firmware = parser.getBooleanValue("firmware");
+		bool nsStats = parser.getBooleanValue("nsStats");
+		bool piStats = parser.getBooleanValue("piStats");
+		bool latency = parser.getBooleanValue("latency");
+
+		// Make sure only one action was given
+		if (!(passthru ^ controllerRegisters ^ reset ^ overrideModel ^ overrideReset ^ pciRegisters ^ history ^ traceStats ^ slowLog ^ srbTrace ^ srbTraceStats ^ srbReplay ^ tune ^ firmware ^ nsStats ^ piStats ^ latency))
+		{
+			throw std::runtime_error("Give one of the following: passthru, controllerRegisters, reset, overrideModel, overrideReset, pciRegisters, history, traceStats, slowLog, srbTrace, srbTraceStats, srbReplay, tune, firmware, nsStats, piStats, latency");
+		}
+
+		bool success = false;
+
+		// Trace statistics work off a file, no device needed
+		std::string devicePath = parser.getStringValue("devicePath");
+		if (devicePath.size() == 0 && !traceStats && !srbTraceStats)
+		{
+			devicePath = promptForSelection();
+		}
+
+		if (traceStats)
+		{
+			success = getTraceStats(
+				parser.getStringValue("dataFile"),
+				parser.getBooleanValue("debug")
+			);
+		}
+		else if (srbTraceStats)
+		{
+			success = getSrbTraceStats(
+				parser.getStringValue("dataFile"),
+				parser.getBooleanValue("debug")
+			);
+		}
+		else if (passthru)
+		{
+			success = nvmePassthru(
+				parser.getNumericValue("DW0"),
+				parser.getNumericValue("DW1"),
+				parser.getNumericValue("DW10"),
+				parser.getNumericValue("DW11"),
+				parser.getNumericValue("DW12"),
+				parser.getNumericValue("DW13"),
+				parser.getNumericValue("DW14"),
+				parser.getNumericValue("DW15"),
+				parser.getBooleanValue("NVM"),
+				parser.getNumericValue("timeout"),
+				parser.getNumericValue("dataDirection"),
+				parser.getNumericValue("dataTransferSize"),
+				parser.getStringValue("dataFile"),
+				devicePath,
+				parser.getBooleanValue("debug"),
+				parser.getBooleanValue("noLook"),
+				false
+			);
+		}
+		else if (reset)
+		{
+			success = nvmeReset(
+				devicePath,
+				parser.getBooleanValue("debug"),
+				parser.getNumericValue("timeout")
+			);
+		}
+		else if (controllerRegisters)
+		{
+			success = nvmeControllerRegisters(
+				parser.getNumericValue("timeout"),
+				parser.getNumericValue("dataTransferSize"),
+				parser.getStringValue("dataFile"),
+				devicePath,
+				parser.getNumericValue("dataDirection"),
+				parser.getBooleanValue("debug")
+			);
+		}
+		else if (pciRegisters)
+		{
+			success = getPciRegisters(
+				parser.getNumericValue("dataTransferSize"),
+				parser.getStringValue("dataFile"),
+				devicePath,
+				parser.getBooleanValue("debug")
+			);
+		}
+		else if (overrideModel)
+		{
+			success = overwriteModel(
+				devicePath,
+				parser.getStringValue("modelOverride"),
+				parser.getBooleanValue("debug")
 			);
 		}
 		else if (overrideReset)
@@ -667,6 +2077,85 @@ int main(int argc, const char** argv)
 				parser.getBooleanValue("debug")
 			);
 		}
+		else if (srbTrace)
+		{
+			success = captureSrbTrace(
+				devicePath,
+				parser.getStringValue("dataFile"),
+				parser.getNumericValue("timeout"),
+				parser.getBooleanValue("debug")
+			);
+		}
+		else if (srbReplay)
+		{
+			success = replaySrbTrace(
+				devicePath,
+				parser.getStringValue("diskPath"),
+				parser.getStringValue("dataFile"),
+				parser.getNumericValue("replaySpeed"),
+				parser.getBooleanValue("replayWrites"),
+				parser.getBooleanValue("debug")
+			);
+		}
+		else if (firmware)
+		{
+			success = firmwareDownload(
+				devicePath,
+				parser.getStringValue("dataFile"),
+				parser.getNumericValue("firmwareSlot"),
+				parser.getNumericValue("firmwareCommitAction"),
+				parser.getNumericValue("firmwareChunkSize"),
+				parser.getNumericValue("firmwareDepth"),
+				parser.getNumericValue("timeout"),
+				parser.getBooleanValue("debug")
+			);
+		}
+		else if (nsStats)
+		{
+			success = namespaceStats(
+				devicePath,
+				parser.getNumericValue("timeout"),
+				parser.getBooleanValue("debug")
+			);
+		}
+		else if (piStats)
+		{
+			success = protectionStats(
+				devicePath,
+				parser.getNumericValue("timeout"),
+				parser.getBooleanValue("debug")
+			);
+		}
+		else if (latency)
+		{
+			success = latencyStats(
+				devicePath,
+				parser.getBooleanValue("latencyReset"),
+				parser.getBooleanValue("debug")
+			);
+		}
+		else if (tune)
+		{
+			success = nvmeTunables(
+				devicePath,
+				parser,
+				parser.getBooleanValue("debug")
+			);
+		}
+		else if (slowLog)
+		{
+			success = getSlowCommandLog(
+				devicePath,
+				parser.getBooleanValue("debug")
+			);
+		}
+		else if (history)
+		{
+			success = getHistory(
+				devicePath,
+				parser.getBooleanValue("debug")
+			);
+		}
 
 		if (success)
 		{
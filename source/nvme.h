@@ -395,6 +395,10 @@ typedef struct _NVMe_COMPLETION_QUEUE_ENTRY
 /* Delete I/O Completion Queue */
 #define INVALID_QUEUE_DELETION                          0xC // NVMe1.0E
 
+/* Firmware Commit */
+#define FIRMWARE_ACTIVATION_REQUIRES_NVM_SUBSYSTEM_RESET 0x10 // NVMe1.2
+#define FIRMWARE_ACTIVATION_REQUIRES_RESET              0x11 // NVMe1.2
+
 
 /*
  * Status Code - Command Specific Error Values, NVM Command Set
@@ -465,6 +469,7 @@ typedef struct _NVM_OPCODE
 #define ADMIN_FIRMWARE_ACTIVATE                         0x10
 #define ADMIN_FIRMWARE_IMAGE_DOWNLOAD                   0x11
 #define ADMIN_NAMESPACE_ATTACHMENT                      0x15
+#define ADMIN_DOORBELL_BUFFER_CONFIG                    0x7C
 
 /*Opcodes for Admin Commands, NVM Command Set Specific, Section 5, Figure 25 */
 #define ADMIN_FORMAT_NVM                                0x80
@@ -539,6 +544,12 @@ typedef struct _ADMIN_CREATE_IO_SUBMISSION_QUEUE_DW11
 } ADMIN_CREATE_IO_SUBMISSION_QUEUE_DW11,
   *PADMIN_CREATE_IO_SUBMISSION_QUEUE_DW11;
 
+/* Queue Priority values of the QPRIO field */
+#define QPRIO_URGENT                        0
+#define QPRIO_HIGH                          1
+#define QPRIO_MEDIUM                        2
+#define QPRIO_LOW                           3
+
 /* Get Log Page Command, Section 5.10.1, Figure 56, Opcode 0x02 */
 typedef struct _ADMIN_GET_LOG_PAGE_COMMAND_DW10
 {
@@ -999,7 +1010,19 @@ typedef struct _ADMIN_IDENTIFY_POWER_STATE_DESCRIPTOR
      * value in this field multiplied by 0.01.
      */
     USHORT  MP;
-    USHORT  Reserved1;
+    UCHAR   Reserved1;
+
+    /*
+     * [Max Power Scale] When set, MP is in units of 0.0001 W instead of 0.01 W.
+     */
+    UCHAR   MXPS       :1;
+
+    /*
+     * [Non-Operational State] When set, the controller processes no I/O
+     * commands in this power state and only leaves it on its own.
+     */
+    UCHAR   NOPS       :1;
+    UCHAR   Reserved1a :6;
 
     /*
      * [Entry Latency] This field indicates the maximum entry latency in
@@ -1175,7 +1198,14 @@ typedef struct _ADMIN_IDENTIFY_CONTROLLER
          * Namespace Attachment commands.
          */
         USHORT  SupportsNamespaceMgmtAndAttachment      :1;
-        USHORT  Reserved                                :12;
+        USHORT  Reserved                                :4;
+        /*
+         * Bit 8 if set to '1' then the controller supports the Doorbell
+         * Buffer Config command. If cleared to '0' then the controller does
+         * not support the Doorbell Buffer Config command.
+         */
+        USHORT  SupportsDoorbellBufferConfig            :1;
+        USHORT  Reserved2                               :7;
     } OACS;
 
     /*
@@ -1260,7 +1290,36 @@ typedef struct _ADMIN_IDENTIFY_CONTROLLER
      */
     UCHAR   AVSCC          :1;
     UCHAR   Reserved_AVSCC :7;
-    UCHAR   Reserved2[247];
+
+    /*
+     * [Autonomous Power State Transition Attributes] Bit 0 set indicates the
+     * controller supports autonomous power state transitions.
+     */
+    UCHAR   APSTA          :1;
+    UCHAR   Reserved_APSTA :7;
+    UCHAR   Reserved2[6];
+
+    /*
+     * [Host Memory Buffer Preferred Size] The preferred size the host should
+     * allocate for the Host Memory Buffer, in 4 KiB units. 0 means the
+     * controller doesn't use one.
+     */
+    ULONG   HMPRE;
+
+    /*
+     * [Host Memory Buffer Minimum Size] The minimum size the host should
+     * allocate for the Host Memory Buffer, in 4 KiB units.
+     */
+    ULONG   HMMIN;
+    UCHAR   Reserved2a[39];
+
+    /*
+     * [Firmware Update Granularity] The granularity and alignment of Firmware
+     * Image Download commands in 4 KiB units, NVMe 1.3. 0 means no information
+     * is given and FFh that there is no restriction.
+     */
+    UCHAR   FWUG;
+    UCHAR   Reserved2b[192];
     /* NVM Command Set Attributes */
 
     /*
@@ -1891,6 +1950,8 @@ typedef struct _ADMIN_GET_FEATURES_COMMAND_DW10
 #define INTERRUPT_VECTOR_CONFIGURATION      0x09
 #define WRITE_ATOMICITY                     0x0A
 #define ASYNCHRONOUS_EVENT_CONFIGURATION    0x0B
+#define AUTONOMOUS_POWER_STATE_TRANSITION   0x0C
+#define HOST_MEMORY_BUFFER                  0x0D
 #define SOFTWARE_PROGRESS_MARKER            0x80
 #define RESERVATION_PERSISTANCE             0x83
 
@@ -1959,6 +2020,72 @@ typedef struct _ADMIN_SET_FEATURES_COMMAND_POWER_MANAGEMENT_DW11
 } ADMIN_SET_FEATURES_COMMAND_POWER_MANAGEMENT_DW11,
   *PADMIN_SET_FEATURES_COMMAND_POWER_MANAGEMENT_DW11;
 
+/* Autonomous Power State Transition, Feature Identifier 0Ch */
+typedef struct _ADMIN_SET_FEATURES_COMMAND_APST_DW11
+{
+    /*
+     * [Autonomous Power State Transition Enable] When set, the controller
+     * moves between power states on its own using the table passed via PRP1.
+     */
+    ULONG   APSTE   :1;
+    ULONG   Reserved:31;
+} ADMIN_SET_FEATURES_COMMAND_APST_DW11,
+  *PADMIN_SET_FEATURES_COMMAND_APST_DW11;
+
+/*
+ * Autonomous Power State Transition - Entry
+ *
+ * The table holds one entry per power state, 32 entries in all.
+ */
+typedef struct _ADMIN_SET_FEATURES_APST_ENTRY
+{
+    ULONGLONG   Reserved1:3;
+
+    /*
+     * [Idle Transition Power State] The non-operational power state the
+     * controller moves to after ITPT of idle in this power state.
+     */
+    ULONGLONG   ITPS     :5;
+
+    /*
+     * [Idle Time Prior to Transition] Idle time in milliseconds before moving
+     * to ITPS. 0 disables the transition out of this power state.
+     */
+    ULONGLONG   ITPT     :24;
+    ULONGLONG   Reserved2:32;
+} ADMIN_SET_FEATURES_APST_ENTRY, *PADMIN_SET_FEATURES_APST_ENTRY;
+
+/* Host Memory Buffer, Feature Identifier 0Dh */
+typedef struct _ADMIN_SET_FEATURES_COMMAND_HMB_DW11
+{
+    /* [Enable Host Memory] When set, the controller may use the buffer */
+    ULONG   EHM     :1;
+
+    /*
+     * [Memory Return] When set, the host is handing back the same buffer the
+     * controller used last time, with its contents unchanged.
+     */
+    ULONG   MR      :1;
+    ULONG   Reserved:30;
+} ADMIN_SET_FEATURES_COMMAND_HMB_DW11,
+  *PADMIN_SET_FEATURES_COMMAND_HMB_DW11;
+
+/*
+ * Host Memory Buffer - Descriptor Entry
+ *
+ * CDW12 carries the total size in memory pages, CDW13/CDW14 the address of
+ * the descriptor list and CDW15 the number of entries in it.
+ */
+typedef struct _ADMIN_SET_FEATURES_HMB_DESCRIPTOR
+{
+    /* [Buffer Address] Memory page aligned start of this chunk */
+    ULONGLONG   BADD;
+
+    /* [Buffer Size] Size of this chunk in memory pages */
+    ULONG       BSIZE;
+    ULONG       Reserved;
+} ADMIN_SET_FEATURES_HMB_DESCRIPTOR, *PADMIN_SET_FEATURES_HMB_DESCRIPTOR;
+
 /* LBA Range Type, Section 5.12.1.3, Figure 76, Feature Identifier 02h */
 typedef struct _ADMIN_SET_FEATURES_COMMAND_LBA_RANGE_TYPE_DW11
 {
@@ -317,7 +317,7 @@ BOOLEAN NVMeEnumNumaCores(
 {
     GROUP_AFFINITY GroupAffinity;
     USHORT Bit = 0, Grp;
-    ULONG Core = 0, CoreCounter = 0;
+    ULONG Core = 0;
     ULONG BaseCoreNum = 0;
     ULONG Node = 0;
     ULONG Status = 0;
@@ -425,6 +425,9 @@ BOOLEAN NVMeEnumNumaCores(
     if (pRMT->pCoreTbl == NULL)
         return (FALSE);
 
+    for (Core = 0; Core < pRMT->NumActiveCores; Core++)
+        (pRMT->pCoreTbl + Core)->ApicId = CORE_APIC_ID_UNKNOWN;
+
     /* Based on NUMA node number, populate the NUMA/Core tables */
     for (Node = 0; Node < pRMT->NumNumaNodes; Node++) {
         pNNT = pRMT->pNumaNodeTbl + Node;
@@ -444,23 +447,32 @@ BOOLEAN NVMeEnumNumaCores(
         pNNT->LastCoreNum = BaseCoreNum;
         FirstCoreFound = FALSE;
 
-        /* For each core, populate CORE_TBL structure */
+        /*
+         * For each core, populate CORE_TBL structure. The system-wise number
+         * is the group's base plus the bit position, the same way
+         * NVMeMapCore2Queue looks it up, so that several nodes sharing one
+         * group don't land on the same entries.
+         */
         for (Bit = 0; Bit < MaxNumCoresInGroup; Bit++) {
-            /* Save previsou bit check result first */
             if (((pNNT->GroupAffinity.Mask >> Bit) & 1) == 1) {
-                /* Mark the first core if haven't found yet, reset the counter */
+                Core = BaseCoreNum + Bit;
+                if (Core >= pRMT->NumActiveCores)
+                    continue;
+
+                /* Mark the first core if haven't found yet */
                 if (FirstCoreFound == FALSE) {
-                    CoreCounter = 0;
+                    pNNT->FirstCoreNum = Core;
                     FirstCoreFound = TRUE;
                 }
-                Core = BaseCoreNum + CoreCounter;
                 pCoreTblTemp = pRMT->pCoreTbl + Core;
                 pCoreTblTemp->NumaNode = (USHORT) Node;
                 pCoreTblTemp->Group = pNNT->GroupAffinity.Group;
+                pCoreTblTemp->ApicId = (pAE->ntldrDump == FALSE) ?
+                    NVMeGetCoreApicId(pNNT->GroupAffinity.Group, Bit) :
+                    CORE_APIC_ID_UNKNOWN;
                 
                 /* Always mark the last core */
                 pNNT->LastCoreNum = Core;
-                CoreCounter++;
                 TotalCores++;
             }
         }
@@ -486,6 +498,56 @@ BOOLEAN NVMeEnumNumaCores(
     return(TRUE);
 } /* NVMeEnumNumaCores */
 
+/*******************************************************************************
+ * NVMeGetCoreApicId
+ *
+ * @brief NVMeGetCoreApicId runs on the given processor for a moment and reads
+ *        its APIC ID with CPUID: the x2APIC ID from leaf 0xB where there is
+ *        one, the initial APIC ID from leaf 1 otherwise. Processor numbers
+ *        say nothing about APIC IDs, those can be sparse or in another order.
+ *
+ * @param Group - Processor group of the core
+ * @param Number - Number of the core within its group
+ *
+ * @return ULONG
+ *     APIC ID of the core, CORE_APIC_ID_UNKNOWN if not at PASSIVE_LEVEL
+ ******************************************************************************/
+ULONG NVMeGetCoreApicId(
+    USHORT Group,
+    USHORT Number
+)
+{
+    GROUP_AFFINITY Affinity;
+    GROUP_AFFINITY PrevAffinity;
+    int CpuInfo[4];
+    ULONG ApicId;
+
+    if (KeGetCurrentIrql() != PASSIVE_LEVEL)
+        return (CORE_APIC_ID_UNKNOWN);
+
+    memset(&Affinity, 0, sizeof(GROUP_AFFINITY));
+    Affinity.Group = Group;
+    Affinity.Mask = (KAFFINITY)1 << Number;
+    KeSetSystemGroupAffinityThread(&Affinity, &PrevAffinity);
+
+    __cpuid(CpuInfo, 0);
+    if (CpuInfo[0] >= 0xB) {
+        __cpuidex(CpuInfo, 0xB, 0);
+        /* EBX of 0 means leaf 0xB isn't really implemented */
+        if (CpuInfo[1] != 0) {
+            ApicId = (ULONG)CpuInfo[3];
+            KeRevertToUserGroupAffinityThread(&PrevAffinity);
+            return (ApicId);
+        }
+    }
+
+    __cpuid(CpuInfo, 1);
+    ApicId = ((ULONG)CpuInfo[1] >> 24) & 0xFF;
+
+    KeRevertToUserGroupAffinityThread(&PrevAffinity);
+    return (ApicId);
+} /* NVMeGetCoreApicId */
+
 /*******************************************************************************
  * NVMeStrCompare
  *
@@ -622,12 +684,236 @@ BOOLEAN NVMeEnumMsiMessages (
     return (TRUE);
 } /* NVMeEnumMsiMessages */
 
+/*******************************************************************************
+ * NVMeDeriveMsiMapping
+ *
+ * @brief NVMeDeriveMsiMapping tries to build the core/vector table straight
+ *        from the granted MSI-X messages instead of learning it with reads.
+ *        In the compatibility format, physical destination mode without
+ *        redirection, the Destination Field of each message address (as
+ *        returned by StorPortGetMSIInfo) is the APIC ID of its target core,
+ *        which is matched against the APIC ID each core reported for itself.
+ *        Only used when every core has its own vector and queue pair; any
+ *        other layout, remappable messages or a core whose APIC ID is unknown
+ *        or doesn't fit the field are left to learning mode.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ *
+ * @return BOOLEAN
+ *     TRUE - Core table, message table and CQ vectors are all populated
+ *     FALSE - Mapping can't be derived, caller falls back to learning
+ ******************************************************************************/
+BOOLEAN NVMeDeriveMsiMapping(
+    PNVME_DEVICE_EXTENSION pAE
+)
+{
+    PRES_MAPPING_TBL pRMT = &pAE->ResMapTbl;
+    PQUEUE_INFO pQI = &pAE->QueueInfo;
+    PMSI_MESSAGE_TBL pMMT = NULL;
+    PCORE_TBL pCT = NULL;
+    PCPL_QUEUE_INFO pCQI = NULL;
+    ULONG MsgID, Core;
+    ULONG Matches;
+
+    if ((pRMT->InterruptType != INT_TYPE_MSIX) ||
+        (pRMT->pMsiMsgTbl->Shared == TRUE) ||
+        (pRMT->NumMsiMsgGranted < pRMT->NumActiveCores) ||
+        (pQI->NumCplIoQAllocated < pRMT->NumActiveCores) ||
+        (pAE->MultipleCoresToSingleQueueFlag == TRUE)) {
+        return (FALSE);
+    }
+
+    /*
+     * Redirection hint or logical mode means the destination isn't a core.
+     * With interrupt remapping the address holds a remapping table index.
+     */
+    for (MsgID = 0; MsgID < pRMT->NumActiveCores; MsgID++) {
+        pMMT = pRMT->pMsiMsgTbl + MsgID;
+        if ((pMMT->Addr.LowPart &
+             (MSI_ADDR_RH_DM_MASK | MSI_ADDR_REMAPPABLE_MASK)) != 0)
+            return (FALSE);
+    }
+
+    /*
+     * Find the one message aimed at each core's APIC ID. None or several
+     * can't be told apart so give up on those. Partial results left in the
+     * core table get overwritten by the learning mode setup.
+     */
+    for (Core = 0; Core < pRMT->NumActiveCores; Core++) {
+        pCT = pRMT->pCoreTbl + Core;
+        if (pCT->ApicId > MSI_ADDR_MAX_DESTINATION)
+            return (FALSE);
+
+        Matches = 0;
+        for (MsgID = 0; MsgID < pRMT->NumActiveCores; MsgID++) {
+            pMMT = pRMT->pMsiMsgTbl + MsgID;
+            if (GET_DESTINATION_FIELD(pMMT->Addr.LowPart) == pCT->ApicId) {
+                pCT->MsiMsgID = (USHORT)MsgID;
+                Matches++;
+            }
+        }
+
+        if (Matches != 1)
+            return (FALSE);
+    }
+
+    /* Now tie each core's queue pair to the vector routed to that core */
+    for (Core = 0; Core < pRMT->NumActiveCores; Core++) {
+        pCT = pRMT->pCoreTbl + Core;
+        pMMT = pRMT->pMsiMsgTbl + pCT->MsiMsgID;
+        pMMT->CplQueueNum = pCT->CplQueue;
+        pCQI = pQI->pCplQueueInfo + pCT->CplQueue;
+        pCQI->MsiMsgID = pCT->MsiMsgID;
+
+        StorPortDebugPrint(INFO,
+            "NVMeDeriveMsiMapping: Core(0x%x) APIC(0x%x) Msg#(0x%x) QueuePair(0x%x)\n",
+            Core, pCT->ApicId,
+            pCT->MsiMsgID, pCT->CplQueue);
+    }
+
+    return (TRUE);
+} /* NVMeDeriveMsiMapping */
+
+/*******************************************************************************
+ * NVMeBindMsiToQueues
+ *
+ * @brief NVMeBindMsiToQueues gets called when cores share IO queues, once the
+ *        core each message is delivered to (TargetCore) is known, either from
+ *        Storport's message affinities or from learning mode. Every message
+ *        is bound to one not-yet-bound completion queue, preferring in order:
+ *        the queue its target core already uses, a queue homed on the same
+ *        NUMA node, one in the same processor group, then any. The target
+ *        core is then moved onto the queue its vector completes on, and each
+ *        core's MsiMsgID follows its queue.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ *
+ * @return VOID
+ ******************************************************************************/
+VOID NVMeBindMsiToQueues(
+    PNVME_DEVICE_EXTENSION pAE
+)
+{
+    PRES_MAPPING_TBL pRMT = &pAE->ResMapTbl;
+    PQUEUE_INFO pQI = &pAE->QueueInfo;
+    PMSI_MESSAGE_TBL pMMT = NULL;
+    PCORE_TBL pCT = NULL;
+    PCORE_TBL pTarget = NULL;
+    PCPL_QUEUE_INFO pCQI = NULL;
+    PNUMA_NODE_TBL pNNT = NULL;
+    PNUMA_NODE_TBL pHome = NULL;
+    ULONG NumQueues = pQI->NumCplIoQAllocated;
+    ULONG MsgID, Queue, Node, Core;
+    ULONG Best, Level, BestLevel;
+    ULONG Bound = 0, CrossNode = 0;
+    USHORT Unbound = (USHORT)pRMT->NumMsiMsgGranted;
+
+    for (Queue = 1; Queue <= NumQueues; Queue++)
+        (pQI->pCplQueueInfo + Queue)->MsiMsgID = Unbound;
+
+    for (MsgID = 0;
+         (MsgID < pRMT->NumMsiMsgGranted) && (Bound < NumQueues);
+         MsgID++) {
+        pMMT = pRMT->pMsiMsgTbl + MsgID;
+        pTarget = NULL;
+        if ((pMMT->Learned == TRUE) &&
+            (pMMT->TargetCore < pRMT->NumActiveCores))
+            pTarget = pRMT->pCoreTbl + pMMT->TargetCore;
+
+        Best = 0;
+        BestLevel = MAXULONG;
+        for (Queue = 1; Queue <= NumQueues; Queue++) {
+            pCQI = pQI->pCplQueueInfo + Queue;
+            if (pCQI->MsiMsgID != Unbound)
+                continue;
+
+            Level = 3;
+            if (pTarget == NULL) {
+                Level = 0;
+            } else if (pTarget->CplQueue == Queue) {
+                Level = 0;
+            } else {
+                /* The queue's home is the first node planned onto it */
+                pHome = NULL;
+                for (Node = 0; Node < pRMT->NumNumaNodes; Node++) {
+                    pNNT = pRMT->pNumaNodeTbl + Node;
+                    if ((pNNT->NumQueues != 0) &&
+                        (Queue >= pNNT->FirstQueue) &&
+                        (Queue < pNNT->FirstQueue + pNNT->NumQueues)) {
+                        pHome = pNNT;
+                        break;
+                    }
+                }
+
+                if ((pHome != NULL) && (pHome->NodeNum == pTarget->NumaNode))
+                    Level = 1;
+                else if ((pHome != NULL) &&
+                         (pHome->GroupAffinity.Group == pTarget->Group))
+                    Level = 2;
+            }
+
+            if (Level < BestLevel) {
+                Best = Queue;
+                BestLevel = Level;
+                if (Level == 0)
+                    break;
+            }
+        }
+
+        if (Best == 0)
+            break;
+
+        pCQI = pQI->pCplQueueInfo + Best;
+        pCQI->MsiMsgID = (USHORT)MsgID;
+        pMMT->CplQueueNum = (USHORT)Best;
+        Bound++;
+
+        /* Let the core taking this vector's interrupts submit on its queue */
+        if (pTarget != NULL)
+            pTarget->SubQueue = pTarget->CplQueue = (USHORT)Best;
+
+        StorPortDebugPrint(INFO,
+            "NVMeBindMsiToQueues: Msg#(0x%x) Core(0x%x) ---> QueuePair(0x%x) level %d\n",
+            MsgID, pMMT->TargetCore, Best, BestLevel);
+    }
+
+    /* Queues left without a vector (not expected) fall back to message 0 */
+    for (Queue = 1; Queue <= NumQueues; Queue++) {
+        pCQI = pQI->pCplQueueInfo + Queue;
+        if (pCQI->MsiMsgID == Unbound)
+            pCQI->MsiMsgID = 0;
+    }
+
+    /*
+     * Every core follows the vector of its queue. Note how many cores get
+     * their completions on a core of another node.
+     */
+    for (Core = 0; Core < pRMT->NumActiveCores; Core++) {
+        pCT = pRMT->pCoreTbl + Core;
+        pCQI = pQI->pCplQueueInfo + pCT->CplQueue;
+        pCT->MsiMsgID = pCQI->MsiMsgID;
+
+        pMMT = pRMT->pMsiMsgTbl + pCT->MsiMsgID;
+        if ((pMMT->Learned == TRUE) &&
+            (pMMT->TargetCore < pRMT->NumActiveCores) &&
+            ((pRMT->pCoreTbl + pMMT->TargetCore)->NumaNode != pCT->NumaNode))
+            CrossNode++;
+    }
+
+    StorPortDebugPrint(INFO,
+        "NVMeBindMsiToQueues: %d of %d cores complete on another node (%d%%)\n",
+        CrossNode, pRMT->NumActiveCores,
+        (CrossNode * 100) / pRMT->NumActiveCores);
+} /* NVMeBindMsiToQueues */
+
 /*******************************************************************************
  * NVMeMsiMapCores
  *
  * @brief NVMeMsiMapCores is called to setup the initial mapping for MSI or MSIX
- *        modes.  Initial mapping is just 1:1, learning will happen as each core
- *        processes an IO and new mappings will be created for optimal use.
+ *        modes.  If Storport gave us the message affinities, or the mapping
+ *        can be derived from the message addresses, that is used directly.
+ *        Otherwise initial mapping is just 1:1, learning will happen as each
+ *        core processes an IO and new mappings will be created for optimal use.
  *
  * @param pAE - Pointer to hardware device extension.
  *
@@ -637,8 +923,8 @@ VOID NVMeMsiMapCores(
 	PNVME_DEVICE_EXTENSION pAE
 	)
 {
-	UCHAR Core;
-	UCHAR MaxCore;
+	ULONG Core;
+	ULONG MaxCore;
 	PRES_MAPPING_TBL pRMT = &pAE->ResMapTbl;
 	PMSI_MESSAGE_TBL pMMT = NULL;
 	PCORE_TBL pCT = NULL;
@@ -652,8 +938,11 @@ VOID NVMeMsiMapCores(
 	ULONG CoreNo;
 #endif
 
-	MaxCore = (UCHAR)min(pAE->QueueInfo.NumSubIoQAllocFromAdapter,
+	MaxCore = min(pAE->QueueInfo.NumSubIoQAllocFromAdapter,
 		pAE->QueueInfo.NumCplIoQAllocFromAdapter);
+
+	pAE->MsiMappingDerived = FALSE;
+	pAE->MsiMappingMismatches = 0;
 	
 
 	/* if API is executed succesfully use the data obtained from API else fallback to learning cores */
@@ -677,9 +966,13 @@ VOID NVMeMsiMapCores(
 			pProcGrpTbl = pRMT->pProcGroupTbl + TempGrpAff.Group;
 			pCT = pRMT->pCoreTbl + Core + pProcGrpTbl->BaseProcessor;
 			pCT->Group = TempGrpAff.Group;
-			/* assign new queue pair only if MsgGranted is less than Cores*/
-			if (pAE->ResMapTbl.NumMsiMsgGranted < pAE->ResMapTbl.NumActiveCores) {
-				pCT->CplQueue = pCT->SubQueue = (USHORT)pQI->NumIoQMapped;
+			/* When cores share queues, just note the target, bound below */
+			if (pAE->MultipleCoresToSingleQueueFlag == TRUE) {
+				pMMT = pRMT->pMsiMsgTbl + MsgID;
+				pMMT->TargetCore = Core + pProcGrpTbl->BaseProcessor;
+				pMMT->Learned = TRUE;
+				pQI->NumIoQMapped++;
+				continue;
 			}
 			pCT->MsiMsgID = MsgID;
 			pMMT = pRMT->pMsiMsgTbl + pCT->MsiMsgID;
@@ -690,6 +983,9 @@ VOID NVMeMsiMapCores(
 
 		}
 
+		if (pAE->MultipleCoresToSingleQueueFlag == TRUE)
+			NVMeBindMsiToQueues(pAE);
+
 #if DBG
 		StorPortDebugPrint(INFO, "NVMeMsimapcores: <Info> Learning Complete.  Core Table:\n");
 		for (CoreNo = 0; CoreNo < pRMT->NumActiveCores; CoreNo++) {
@@ -704,34 +1000,50 @@ VOID NVMeMsiMapCores(
 		pAE->LearningCores = pRMT->NumActiveCores;
 
 	}
+	else if (NVMeDeriveMsiMapping(pAE) == TRUE)
+	{
+		/*
+		 * Queues get created on the right vectors from the start. Learning
+		 * mode still runs, but only to verify the table, so there is no need
+		 * to delete and recreate every queue afterwards.
+		 */
+		pAE->MsiMappingDerived = TRUE;
+	}
 	else
 	{
-
-
 		/*
-		 * Loop thru the cores and assign granted messages in sequential manner.
-		 * When requests completed, based on the messagID and look up the
+		 * Assign granted messages to the queues in sequential manner, queue
+		 * #(n) on message #(n-1), and let each core follow its queue. When
+		 * requests completed, based on the messagID and look up the
 		 * associated completion queue for just-completed entries
 		 */
+		for (Core = 1; Core <= MaxCore; Core++) {
+			if ((Core > pQI->NumCplIoQAllocated) ||
+				(Core > pRMT->NumMsiMsgGranted))
+				break;
+
+			pCQI = pQI->pCplQueueInfo + Core;
+			pCQI->MsiMsgID = (USHORT)(Core - 1);
+
+			/*
+			 * On the other side, mark down the associated queue number
+			 * for the message as well
+			 */
+			pMMT = pRMT->pMsiMsgTbl + pCQI->MsiMsgID;
+			pMMT->CplQueueNum = (USHORT)Core;
+		}
+
 		for (Core = 0; Core < pRMT->NumActiveCores; Core++) {
-			if (Core < MaxCore) {
-				/* Handle one Core Table at a time */
-				pCT = pRMT->pCoreTbl + Core;
-
-				/* Mark down the initial associated message + SQ/CQ for this core */
-				pCT->MsiMsgID = pCT->CplQueue - 1;
-
-				/*
-				 * On the other side, mark down the associated core number
-				 * for the message as well
-				 */
-				pMMT = pRMT->pMsiMsgTbl + pCT->MsiMsgID;
-				pMMT->CplQueueNum = pCT->CplQueue;
-
-				StorPortDebugPrint(INFO,
-					"NVMeMsiMapCores: Core(0x%x)Msg#(0x%x)\n",
-					Core, pCT->MsiMsgID);
-			}
+			/* Handle one Core Table at a time */
+			pCT = pRMT->pCoreTbl + Core;
+			pCQI = pQI->pCplQueueInfo + pCT->CplQueue;
+
+			/* Mark down the initial associated message + SQ/CQ for this core */
+			pCT->MsiMsgID = pCQI->MsiMsgID;
+
+			StorPortDebugPrint(INFO,
+				"NVMeMsiMapCores: Core(0x%x)Msg#(0x%x)\n",
+				Core, pCT->MsiMsgID);
 		}
 	}
 } /* NVMeMsiMapCores */
@@ -812,6 +1124,14 @@ ULONG NVMeMapCore2Queue(
         /* Return the queue IDs */
         *pSubQueue = pCT->SubQueue;
         *pCplQueue = pCT->CplQueue;
+
+        /* Fold onto the queues left in use by NVME_TUNABLES */
+        if ((pAE->IoQueueLimit != 0) && (*pCplQueue > pAE->IoQueueLimit)) {
+            if ((pCT->FoldFrom != pCT->CplQueue) ||
+                (pCT->FoldLimit != pAE->IoQueueLimit))
+                NVMeFoldCoreQueue(pAE, pCT);
+            *pSubQueue = *pCplQueue = pCT->FoldQueue;
+        }
     } else {
         *pSubQueue = (USHORT)pAE->LearningCores + 1;
         *pCplQueue = (USHORT)pAE->LearningCores + 1;
@@ -820,6 +1140,63 @@ ULONG NVMeMapCore2Queue(
     return (STOR_STATUS_SUCCESS);
 } /* NVMeMapCore2Queue */
 
+/*******************************************************************************
+ * NVMeFoldCoreQueue
+ *
+ * @brief NVMeFoldCoreQueue picks the queue a core whose own queue is beyond
+ *        IoQueueLimit submits to instead. It's one of the kept queues owned
+ *        by a core on the same NUMA node, so the completions still interrupt
+ *        a core near the submitter and the queue memory stays local, spread
+ *        by the core's own queue ID. Only without such a queue does it fold
+ *        by queue ID alone. The choice is kept in the core's CORE_TBL entry
+ *        until its queue or the limit changes.
+ *
+ * @param pAE - Pointer to hardware device extension
+ * @param pCT - Pointer to the CORE_TBL entry of the core to fold
+ *
+ * @return VOID
+ ******************************************************************************/
+VOID NVMeFoldCoreQueue(
+    PNVME_DEVICE_EXTENSION pAE,
+    PCORE_TBL pCT
+)
+{
+    PRES_MAPPING_TBL pRMT = &pAE->ResMapTbl;
+    PCORE_TBL pOwner = NULL;
+    ULONG Limit = pAE->IoQueueLimit;
+    ULONG Local = 0;
+    ULONG Pick;
+    ULONG Core;
+    USHORT FoldQueue;
+
+    /* Kept queues owned by cores on this core's node */
+    for (Core = 0; Core < pRMT->NumActiveCores; Core++) {
+        pOwner = pRMT->pCoreTbl + Core;
+        if ((pOwner->CplQueue != 0) && (pOwner->CplQueue <= Limit) &&
+            (pOwner->NumaNode == pCT->NumaNode))
+            Local++;
+    }
+
+    FoldQueue = (USHORT)(((pCT->CplQueue - 1) % Limit) + 1);
+    if (Local != 0) {
+        Pick = (pCT->CplQueue - 1) % Local;
+        for (Core = 0; Core < pRMT->NumActiveCores; Core++) {
+            pOwner = pRMT->pCoreTbl + Core;
+            if ((pOwner->CplQueue != 0) && (pOwner->CplQueue <= Limit) &&
+                (pOwner->NumaNode == pCT->NumaNode) && (Pick-- == 0)) {
+                FoldQueue = pOwner->CplQueue;
+                break;
+            }
+        }
+    }
+
+    /* The queue first, a racing lookup on this core sees old keys */
+    pCT->FoldQueue = FoldQueue;
+    MemoryBarrier();
+    pCT->FoldLimit = Limit;
+    pCT->FoldFrom = pCT->CplQueue;
+} /* NVMeFoldCoreQueue */
+
 /*******************************************************************************
  * NVMeInitFreeQ
  *
@@ -836,22 +1213,19 @@ VOID NVMeInitFreeQ(
     PNVME_DEVICE_EXTENSION pAE
 )
 {
-    USHORT Entry;
+    ULONG Entry;
+    ULONG Slot;
+    ULONG Page = 0;
     PCMD_ENTRY pCmdEntry = NULL;
     PCMD_INFO pCmdInfo = NULL;
-    ULONG_PTR CurPRPList = 0;
-    ULONG prpListSz = 0;
+    PPRP_LIST_CHUNK pChunk = pSQI->pPRPListChunk;
 #ifdef DUMB_DRIVER
     ULONG_PTR PtrTemp;
     ULONG dblBuffSz = 0;
 #endif
 
-    /* For each entry, initialize the CmdID and PRPList flields */
-    CurPRPList = (ULONG_PTR)((PUCHAR)pSQI->pPRPListStart);
-
     for (Entry = 0; Entry < pSQI->SubQEntries; Entry++) {
-        pCmdEntry = (PCMD_ENTRY)pSQI->pCmdEntry;
-        pCmdEntry += Entry;
+        pCmdEntry = GET_CMD_ENTRY(pSQI, Entry);
         pCmdInfo = &pCmdEntry->CmdInfo;
 
         /*
@@ -859,18 +1233,23 @@ VOID NVMeInitFreeQ(
          * Use Entry to locate the starting point.
          */
         pCmdInfo->CmdID = Entry;
-        pCmdInfo->pPRPList = (PVOID)(CurPRPList + pAE->PRPListSize);
 
         /*
-         * Because PRP List can't cross page boundary, if not enough room left
-         * for one list, need to move on to next page boundary.
-         * NumPRPListOnepage is calculated for this purpose.
+         * Because PRP List can't cross page boundary, each page holds
+         * NumPRPListOnePage lists. Move on to the next page when one is full
+         * and to the next chunk when its pages are used up.
          */
-        if (Entry != 0 && ((Entry % pSQI->NumPRPListOnePage) == 0))
-            pCmdInfo->pPRPList = PAGE_ALIGN_BUF_PTR(pCmdInfo->pPRPList);
+        Slot = Entry % pSQI->NumPRPListOnePage;
+        if (Entry != 0 && Slot == 0) {
+            if (++Page == pChunk->NumPages) {
+                pChunk++;
+                Page = 0;
+            }
+        }
 
-        /* Save the address of current list for calculating next list */
-        CurPRPList = (ULONG_PTR)pCmdInfo->pPRPList;
+        pCmdInfo->pPRPList = (PVOID)((PUCHAR)pChunk->pStart +
+                                     (Page * PAGE_SIZE) +
+                                     (Slot * pAE->PRPListSize));
         pCmdInfo->prpListPhyAddr = NVMeGetPhysAddr(pAE, pCmdInfo->pPRPList);
 
 #ifdef DUMB_DRIVER
@@ -893,11 +1272,83 @@ VOID NVMeInitFreeQ(
     }
 } /* NVMeInitFreeQ */
 
+/*******************************************************************************
+ * NVMeAllocPRPLists
+ *
+ * @brief NVMeAllocPRPLists gets called to allocate the PRP List pages of a
+ *        submission queue. PRP Lists only need to be contiguous within a page,
+ *        so the pool is first tried in one piece and, if contiguous memory is
+ *        scarce, in chunks of half the size each time, down to
+ *        PRP_LIST_MIN_CHUNK_PAGES pages.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ * @param pSQI - The submission queue to allocate the PRP Lists for
+ * @param NumPages - Number of pages of PRP Lists needed
+ * @param NumaNode - Which NUMA node associated memory to allocate from
+ *
+ * @return ULONG
+ *     STOR_STATUS_SUCCESS - If all resources are allocated properly
+ *     Otherwise - If anything goes wrong, the caller frees what was allocated
+ ******************************************************************************/
+ULONG NVMeAllocPRPLists(
+    PNVME_DEVICE_EXTENSION pAE,
+    PSUB_QUEUE_INFO pSQI,
+    ULONG NumPages,
+    USHORT NumaNode
+)
+{
+    PPRP_LIST_CHUNK pChunk = NULL;
+    ULONG MaxChunks;
+    ULONG ChunkPages = NumPages;
+    ULONG Pages;
+    ULONG Done = 0;
+
+    /* Every chunk but the last has at least PRP_LIST_MIN_CHUNK_PAGES pages */
+    MaxChunks = (NumPages / PRP_LIST_MIN_CHUNK_PAGES) + 1;
+    pSQI->pPRPListChunk = (PPRP_LIST_CHUNK)
+        NVMeAllocatePool(pAE, MaxChunks * sizeof(PRP_LIST_CHUNK));
+    if (pSQI->pPRPListChunk == NULL)
+        return ( STOR_STATUS_INSUFFICIENT_RESOURCES );
+
+    pSQI->NumPRPListChunks = 0;
+
+    while (Done < NumPages) {
+        Pages = min(ChunkPages, NumPages - Done);
+        pChunk = pSQI->pPRPListChunk + pSQI->NumPRPListChunks;
+
+        /* One extra page to make the lists start system page aligned */
+        pChunk->pAlloc = NVMeAllocateMem(pAE, (Pages + 1) * PAGE_SIZE, NumaNode);
+        if (pChunk->pAlloc == NULL) {
+            if ((ChunkPages <= PRP_LIST_MIN_CHUNK_PAGES) ||
+                (pSQI->NumPRPListChunks + 1 >= MaxChunks))
+                return ( STOR_STATUS_INSUFFICIENT_RESOURCES );
+
+            ChunkPages = max(ChunkPages / 2, PRP_LIST_MIN_CHUNK_PAGES);
+            StorPortDebugPrint(INFO,
+                "NVMeAllocPRPLists: retrying with %d page chunks\n",
+                ChunkPages);
+            continue;
+        }
+
+        pChunk->AllocSize = (Pages + 1) * PAGE_SIZE;
+        pChunk->pStart = PAGE_ALIGN_BUF_PTR(pChunk->pAlloc);
+        pChunk->NumPages = Pages;
+        pSQI->NumPRPListChunks++;
+        Done += Pages;
+    }
+
+    return (STOR_STATUS_SUCCESS);
+} /* NVMeAllocPRPLists */
+
 /*******************************************************************************
  * NVMeAllocQueues
  *
  * @brief NVMeAllocQueues gets called to allocate buffers in
- *        non-paged, contiguous memory space for Submission/Completion queues.
+ *        non-paged, contiguous memory space for Submission/Completion queues,
+ *        non-paged pool for the command entries and chunks of contiguous
+ *        memory for the PRP Lists. When the contiguous queue memory can't be
+ *        had at full size, IO queues settle for fewer entries, halving down
+ *        to DFT_IO_QUEUE_ENTRIES.
  *
  * @param pAE - Pointer to hardware device extension.
  * @param QueueID - Which queue to allocate memory for
@@ -920,14 +1371,22 @@ ULONG NVMeAllocQueues (
     ULONG SysPageSizeInSubEntries;
     PQUEUE_INFO pQI = &pAE->QueueInfo;
     PSUB_QUEUE_INFO pSQI = NULL;
-    PRES_MAPPING_TBL pRMT = &pAE->ResMapTbl;
     ULONG SizeQueueEntry = 0;
+    ULONG AllocEntries = 0;
+    ULONG CplEntries = 0;
     ULONG NumPageToAlloc = 0;
+    ULONG Chunk;
+    ULONG Status = STOR_STATUS_SUCCESS;
+    BOOLEAN SubQOnly;
 
     /* Ensure the QueueID is valid via the number of active cores in system */
-    if (QueueID > pRMT->NumActiveCores)
+    if (QueueID > NVME_MAX_SUB_IO_QUEUES(pAE))
         return (STOR_STATUS_INVALID_PARAMETER);
 
+    /* Priority class SQs post to the CQ allocated with their base SQ */
+    SubQOnly = ((pQI->NumSubQClasses > 1) &&
+                (QueueID > pQI->NumCplIoQAllocated)) ? TRUE : FALSE;
+
     /* Locate the target SUB_QUEUE_STRUCTURE via QueueID */
     pSQI = pQI->pSubQueueInfo + QueueID;
 
@@ -940,25 +1399,43 @@ ULONG NVMeAllocQueues (
      *        1. Round up the allocated size of all Submission entries to be
      *           multiple(s) of system page size.
      *        2. Add one extra system page to allocation size
+     *
+     * Only the allocation is rounded up, the queue is created with QEntries
+     * so that it never exceeds CAP.MQES + 1. With WRR the CQ takes the
+     * completions of all class SQs, FindAdapter keeps their sum in CAP too.
      */
     SysPageSizeInSubEntries = PAGE_SIZE / sizeof (NVMe_COMMAND);
-    if ((QEntries % SysPageSizeInSubEntries) != 0)
-        QEntries = (QEntries + SysPageSizeInSubEntries) &
-                  ~(SysPageSizeInSubEntries - 1);
-
-    /*
-     * Determine the allocation size in bytes
-     *   1. For Sub/Cpl/Cmd entries
-     *   2. For PRP Lists
-     */
-    SizeQueueEntry = QEntries * (sizeof(NVMe_COMMAND) +
-                                 sizeof(NVMe_COMPLETION_QUEUE_ENTRY) +
-                                 sizeof(CMD_ENTRY));
+    do {
+        AllocEntries = QEntries;
+        if ((AllocEntries % SysPageSizeInSubEntries) != 0)
+            AllocEntries = (AllocEntries + SysPageSizeInSubEntries) &
+                           ~(SysPageSizeInSubEntries - 1);
+
+        CplEntries = 0;
+        if (SubQOnly == FALSE)
+            CplEntries = ((pAE->WrrEnabled == TRUE) && (QueueID != 0)) ?
+                         (QEntries * NVME_SQ_CLASSES) : QEntries;
+
+        /* Sub/Cpl entries have to be physically contiguous */
+        SizeQueueEntry = AllocEntries * sizeof(NVMe_COMMAND);
+        SizeQueueEntry += ((CplEntries * sizeof(NVMe_COMPLETION_QUEUE_ENTRY)) +
+                           PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+        pSQI->pQueueAlloc = NVMeAllocateMem(pAE,
+                                            SizeQueueEntry + PAGE_SIZE,
+                                            NumaNode);
+
+        if ((pSQI->pQueueAlloc != NULL) ||
+            (QueueID == 0) ||
+            (SubQOnly == TRUE) ||
+            (QEntries <= DFT_IO_QUEUE_ENTRIES))
+            break;
 
-    /* Allcate memory for Sub/Cpl/Cmd entries first */
-    pSQI->pQueueAlloc = NVMeAllocateMem(pAE,
-                                        SizeQueueEntry + PAGE_SIZE,
-                                        NumaNode);
+        QEntries = max(QEntries / 2, DFT_IO_QUEUE_ENTRIES);
+        StorPortDebugPrint(INFO,
+            "NVMeAllocQueues: QueueID %d retrying with %d entries\n",
+            QueueID, QEntries);
+    } while (TRUE);
 
     if (pSQI->pQueueAlloc == NULL)
         return ( STOR_STATUS_INSUFFICIENT_RESOURCES );
@@ -966,6 +1443,20 @@ ULONG NVMeAllocQueues (
     /* Save the size if needed to free the unused buffers */
     pSQI->QueueAllocSize = SizeQueueEntry + PAGE_SIZE;
 
+    /*
+     * Command entries are only touched by the driver, no need to be
+     * contiguous. Over-allocate by a cache line to align the table.
+     */
+    pSQI->pCmdEntryAlloc = NVMeAllocatePool(pAE,
+                               (QEntries * CMD_ENTRY_STRIDE) + CMD_ENTRY_ALIGN);
+    if (pSQI->pCmdEntryAlloc == NULL) {
+        NVMeFreeQueueMem(pAE, pSQI);
+        return ( STOR_STATUS_INSUFFICIENT_RESOURCES );
+    }
+    pSQI->pCmdEntry = (PVOID)(((ULONG_PTR)pSQI->pCmdEntryAlloc +
+                               CMD_ENTRY_ALIGN - 1) &
+                              ~((ULONG_PTR)CMD_ENTRY_ALIGN - 1));
+
 #ifdef DUMB_DRIVER
     pSQI->pDblBuffAlloc = NVMeAllocateMem(pAE,
                                           (QEntries * DUMB_DRIVER_SZ) + PAGE_SIZE,
@@ -998,33 +1489,160 @@ ULONG NVMeAllocQueues (
         (QEntries / pSQI->NumPRPListOnePage) + 1 :
         (QEntries / pSQI->NumPRPListOnePage);
 
-    pSQI->pPRPListAlloc = NVMeAllocateMem(pAE,
-                                          (NumPageToAlloc + 1) * PAGE_SIZE,
-                                          NumaNode);
-
-    if (pSQI->pPRPListAlloc == NULL) {
+    Status = NVMeAllocPRPLists(pAE, pSQI, NumPageToAlloc, NumaNode);
+    if (Status != STOR_STATUS_SUCCESS) {
         /* Free the allcated memory for Sub/Cpl/Cmd entries before returning */
-        StorPortFreeContiguousMemorySpecifyCache((PVOID)pAE,
-                                                 pSQI->pQueueAlloc,
-                                                 pSQI->QueueAllocSize,
-                                                 MmCached);
-        pSQI->pQueueAlloc = NULL;
-        return ( STOR_STATUS_INSUFFICIENT_RESOURCES );
+        NVMeFreeQueueMem(pAE, pSQI);
+        return (Status);
     }
 
-    /* Save the size if needed to free the unused buffers */
-    pSQI->PRPListAllocSize = (NumPageToAlloc + 1) * PAGE_SIZE;
+    /*
+     * Report the contiguous memory this queue takes, against what it took
+     * with the command entries carved out of the queue block.
+     */
+    SizeQueueEntry = pSQI->QueueAllocSize;
+    for (Chunk = 0; Chunk < pSQI->NumPRPListChunks; Chunk++)
+        SizeQueueEntry += (pSQI->pPRPListChunk + Chunk)->AllocSize;
+
+    StorPortDebugPrint(INFO,
+        "NVMeAllocQueues: QueueID %d, %d entries, %d contiguous bytes (%d with CMD_ENTRY inline), %d pool bytes\n",
+        QueueID, QEntries, SizeQueueEntry,
+        SizeQueueEntry + (AllocEntries * sizeof(CMD_ENTRY)),
+        (QEntries * CMD_ENTRY_STRIDE) + CMD_ENTRY_ALIGN);
+
+    /* IO submission queues go to the CMB while there's room left */
+    if ((QueueID != 0) && (pAE->ntldrDump == FALSE))
+        NVMeAllocCmbSubQueue(pAE, pSQI, QEntries);
 
     /* Mark down the number of entries allocated successfully */
+    pSQI->SubQEntries = QEntries;
+    pSQI->CplQEntries = CplEntries;
+    pSQI->NumaNode = NumaNode;
     if (QueueID != 0) {
-        pQI->NumIoQEntriesAllocated = (USHORT)QEntries;
+        pQI->NumIoQEntriesAllocated = QEntries;
     } else {
-        pQI->NumAdQEntriesAllocated = (USHORT)QEntries;
+        pQI->NumAdQEntriesAllocated = QEntries;
     }
 
     return (STOR_STATUS_SUCCESS);
 } /* NVMeAllocQueues */
 
+/*******************************************************************************
+ * NVMeAllocCmbSubQueue
+ *
+ * @brief NVMeAllocCmbSubQueue gets called to carve the submission queue of one
+ *        IO queue pair out of the Controller Memory Buffer, saving the device
+ *        a host memory read for every command it fetches. The CMB is handed
+ *        out front to back in whole pages and the queue keeps its host
+ *        memory copy when the CMB is absent, disabled or full.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ * @param pSQI - The submission queue to place
+ * @param QEntries - Number of submission entries of the queue
+ *
+ * @return BOOLEAN
+ *     TRUE - The submission queue lives in the CMB
+ *     FALSE - The submission queue stays in host memory
+ ******************************************************************************/
+BOOLEAN NVMeAllocCmbSubQueue(
+    PNVME_DEVICE_EXTENSION pAE,
+    PSUB_QUEUE_INFO pSQI,
+    ULONG QEntries
+)
+{
+    PCMB_INFO pCmb = &pAE->CmbInfo;
+    ULONG64 Size = ((ULONG64)QEntries * sizeof(NVMe_COMMAND) + PAGE_SIZE - 1) &
+                   ~((ULONG64)PAGE_SIZE - 1);
+
+    pSQI->pCmbSubQ = NULL;
+    pSQI->CmbSubQStart.QuadPart = 0;
+
+    if ((pAE->InitInfo.CmbSubQueues == 0) ||
+        (pCmb->SubQSupported == FALSE) ||
+        ((pCmb->Used + Size) > pCmb->Size))
+        return (FALSE);
+
+    pSQI->pCmbSubQ = (PVOID)(pCmb->pCmbStart + pCmb->Used);
+    pSQI->CmbSubQStart.QuadPart = pCmb->CmbStart.QuadPart + pCmb->Used;
+    pCmb->Used += Size;
+
+    StorPortDebugPrint(INFO,
+        "NVMeAllocCmbSubQueue: SQ at CMB offset 0x%x, %d bytes\n",
+        (ULONG)(pSQI->CmbSubQStart.QuadPart - pCmb->CmbStart.QuadPart),
+        (ULONG)Size);
+
+    return (TRUE);
+} /* NVMeAllocCmbSubQueue */
+
+/*******************************************************************************
+ * NVMeFreeQueueMem
+ *
+ * @brief NVMeFreeQueueMem gets called to free the queue entry, command entry
+ *        and PRP list buffers of one submission/completion queue pair.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ * @param pSQI - The submission queue whose buffers to free
+ *
+ * @return VOID
+ ******************************************************************************/
+VOID NVMeFreeQueueMem(
+    PNVME_DEVICE_EXTENSION pAE,
+    PSUB_QUEUE_INFO pSQI
+)
+{
+    PPRP_LIST_CHUNK pChunk = NULL;
+    ULONG Chunk;
+
+    if (pSQI->pQueueAlloc != NULL) {
+        StorPortFreeContiguousMemorySpecifyCache((PVOID)pAE,
+                                                 pSQI->pQueueAlloc,
+                                                 pSQI->QueueAllocSize,
+                                                 MmCached);
+        pSQI->pQueueAlloc = NULL;
+    }
+
+    /* CMB space isn't handed back per queue, only all at once */
+    pSQI->pCmbSubQ = NULL;
+    pSQI->CmbSubQStart.QuadPart = 0;
+
+    if (pSQI->pCmdEntryAlloc != NULL) {
+        StorPortFreePool((PVOID)pAE, pSQI->pCmdEntryAlloc);
+        pSQI->pCmdEntryAlloc = NULL;
+        pSQI->pCmdEntry = NULL;
+    }
+
+    if (pSQI->pPRPListChunk != NULL) {
+        for (Chunk = 0; Chunk < pSQI->NumPRPListChunks; Chunk++) {
+            pChunk = pSQI->pPRPListChunk + Chunk;
+            StorPortFreeContiguousMemorySpecifyCache((PVOID)pAE,
+                                                     pChunk->pAlloc,
+                                                     pChunk->AllocSize,
+                                                     MmCached);
+        }
+        StorPortFreePool((PVOID)pAE, pSQI->pPRPListChunk);
+        pSQI->pPRPListChunk = NULL;
+        pSQI->NumPRPListChunks = 0;
+    }
+
+#ifdef DUMB_DRIVER
+    if (pSQI->pDblBuffAlloc != NULL) {
+        StorPortFreeContiguousMemorySpecifyCache((PVOID)pAE,
+                                                 pSQI->pDblBuffAlloc,
+                                                 pSQI->dblBuffSz,
+                                                 MmCached);
+        pSQI->pDblBuffAlloc = NULL;
+    }
+
+    if (pSQI->pDblBuffListAlloc != NULL) {
+        StorPortFreeContiguousMemorySpecifyCache((PVOID)pAE,
+                                                 pSQI->pDblBuffListAlloc,
+                                                 pSQI->dblBuffListSz,
+                                                 MmCached);
+        pSQI->pDblBuffListAlloc = NULL;
+    }
+#endif /* DUMB_DRIVER */
+} /* NVMeFreeQueueMem */
+
 /*******************************************************************************
  * NVMeInitSubQueue
  *
@@ -1046,18 +1664,18 @@ ULONG NVMeInitSubQueue(
     PQUEUE_INFO pQI = &pAE->QueueInfo;
     PSUB_QUEUE_INFO pSQI = pQI->pSubQueueInfo + QueueID;
     PRES_MAPPING_TBL pRMT = &pAE->ResMapTbl;
-    ULONG_PTR PtrTemp = 0;
-    USHORT Entries;
+    PPRP_LIST_CHUNK pChunk = NULL;
+    ULONG Chunk;
     ULONG dbIndex = 0;
-    UCHAR maxCore;
+    ULONG maxCore;
 
     NVMe_CONTROLLER_CAPABILITIES CAP = {0};
 
-    maxCore = (UCHAR)min(pAE->QueueInfo.NumCplIoQAllocFromAdapter,
+    maxCore = min(pAE->QueueInfo.NumCplIoQAllocFromAdapter,
                         pAE->QueueInfo.NumSubIoQAllocFromAdapter);
 
     /* Ensure the QueueID is valid via the number of active cores in system */
-    if (QueueID > maxCore)
+    if (QueueID > (maxCore * pQI->NumSubQClasses))
         return ( STOR_STATUS_INVALID_PARAMETER );
 		
 /* Code Analysis fails on StoPortReadRegisterUlong64 */
@@ -1071,9 +1689,10 @@ ULONG NVMeInitSubQueue(
         (PULONG)(&pAE->pCtrlRegister->CAP.LowPart));
 #endif
 
-    /* Initialize static fields of SUB_QUEUE_INFO structure */
-    pSQI->SubQEntries = (QueueID != 0) ? pQI->NumIoQEntriesAllocated :
-                                         pQI->NumAdQEntriesAllocated;
+    /*
+     * Initialize static fields of SUB_QUEUE_INFO structure. SubQEntries was
+     * set when the queue got allocated, IO queues may differ in size.
+     */
     pSQI->SubQueueID = QueueID;
     pSQI->FreeSubQEntries = pSQI->SubQEntries;
 
@@ -1087,7 +1706,23 @@ ULONG NVMeInitSubQueue(
     StorPortDebugPrint(INFO,
                        "NVMeInitSubQueue : SQ 0x%x pSubTDBL 0x%p at index  0x%x\n",
                        QueueID, pSQI->pSubTDBL, dbIndex);
-    pSQI->Requests = 0;
+
+    /*
+     * Shadow doorbells mirror the register layout within one page, IO queues
+     * beyond it and the admin queue keep using the doorbell registers.
+     */
+    pSQI->pSubTShadow = NULL;
+    pSQI->pSubTEventIdx = NULL;
+    if ((QueueID != 0) &&
+        (pAE->DbbufInfo.Enabled == TRUE) &&
+        (dbIndex < (PAGE_SIZE / sizeof(ULONG)))) {
+        pSQI->pSubTShadow = pAE->DbbufInfo.pShadowDbl + dbIndex;
+        pSQI->pSubTEventIdx = pAE->DbbufInfo.pEventIdx + dbIndex;
+        *pSQI->pSubTShadow = 0;
+        *pSQI->pSubTEventIdx = 0;
+    }
+    pSQI->DoorbellWrites = 0;
+    pSQI->Requests = 0;
     pSQI->SubQTailPtr = 0;
     pSQI->SubQHeadPtr = 0;
 
@@ -1098,12 +1733,23 @@ ULONG NVMeInitSubQueue(
      *   we are in crashdump.
      */
     if ((QueueID == 0)                                   ||
-        (pQI->NumSubIoQAllocated < maxCore) ||
+        (pQI->NumCplIoQAllocated < maxCore) ||
         (pAE->ntldrDump == TRUE)) {
         pSQI->Shared = TRUE;
     }
 
-    pSQI->CplQueueID = QueueID;
+    /*
+     * Priority class SQs are numbered a class at a time after the base
+     * (medium) SQs and post to the same CQ as the base SQ they shadow.
+     */
+    if ((QueueID != 0) && (QueueID > pQI->NumCplIoQAllocated)) {
+        pSQI->PriorityClass = (UCHAR)((QueueID - 1) / pQI->NumCplIoQAllocated);
+        pSQI->CplQueueID = (USHORT)(((QueueID - 1) % pQI->NumCplIoQAllocated) + 1);
+        pSQI->Shared = (pQI->pSubQueueInfo + pSQI->CplQueueID)->Shared;
+    } else {
+        pSQI->PriorityClass = NVME_SQ_CLASS_MEDIUM;
+        pSQI->CplQueueID = QueueID;
+    }
 
     /*
      * Initialize submission queue starting point. Per NVMe specification, need
@@ -1113,7 +1759,18 @@ ULONG NVMeInitSubQueue(
 
     memset(pSQI->pQueueAlloc, 0, pSQI->QueueAllocSize);
 
-    pSQI->SubQStart = NVMeGetPhysAddr(pAE, pSQI->pSubQStart);
+    /*
+     * A queue carved out of the CMB is used in place of the host copy, which
+     * is still allocated and stays the completion queue's home. The device
+     * never reads entries past the tail so the CMB copy isn't cleared.
+     */
+    if (pSQI->pCmbSubQ != NULL) {
+        pSQI->pSubQStart = pSQI->pCmbSubQ;
+        pSQI->SubQStart = pSQI->CmbSubQStart;
+    } else {
+        pSQI->SubQStart = NVMeGetPhysAddr(pAE, pSQI->pSubQStart);
+    }
+
     /* If fails on converting to physical address, return here */
     if (pSQI->SubQStart.QuadPart == 0)
         return ( STOR_STATUS_INSUFFICIENT_RESOURCES );
@@ -1127,16 +1784,14 @@ ULONG NVMeInitSubQueue(
 #endif
 
     /*
-     * Initialize PRP list starting point. Per NVMe specification, need to make
-     * it system page aligned if it's not.
+     * Clear the PRP list chunks, their starting points were made system page
+     * aligned when allocated. Per list physical addresses are looked up when
+     * the command entries get initialized.
      */
-    pSQI->pPRPListStart = PAGE_ALIGN_BUF_PTR(pSQI->pPRPListAlloc);
-    memset(pSQI->pPRPListAlloc, 0, pSQI->PRPListAllocSize);
-
-    pSQI->PRPListStart = NVMeGetPhysAddr( pAE, pSQI->pPRPListStart );
-    /* If fails on converting to physical address, return here */
-    if (pSQI->PRPListStart.QuadPart == 0)
-        return ( STOR_STATUS_INSUFFICIENT_RESOURCES );
+    for (Chunk = 0; Chunk < pSQI->NumPRPListChunks; Chunk++) {
+        pChunk = pSQI->pPRPListChunk + Chunk;
+        memset(pChunk->pAlloc, 0, pChunk->AllocSize);
+    }
 
     /* Initialize list head of the free queue list */
     InitializeListHead(&pSQI->FreeQList);
@@ -1166,16 +1821,15 @@ ULONG NVMeInitCplQueue(
     PSUB_QUEUE_INFO pSQI = NULL;
     PCPL_QUEUE_INFO pCQI = NULL;
     PRES_MAPPING_TBL pRMT = &pAE->ResMapTbl;
-    PCORE_TBL pCT = NULL;
     ULONG_PTR PtrTemp;
     USHORT Entries;
     ULONG queueSize = 0;
     ULONG dbIndex = 0;
-    UCHAR maxCore;
+    ULONG maxCore;
 
     NVMe_CONTROLLER_CAPABILITIES CAP = {0};
 
-    maxCore = (UCHAR)min(pAE->QueueInfo.NumCplIoQAllocFromAdapter,
+    maxCore = min(pAE->QueueInfo.NumCplIoQAllocFromAdapter,
                         pAE->QueueInfo.NumSubIoQAllocFromAdapter);
 
     /* Ensure the QueueID is valid via the number of active cores in system */
@@ -1198,7 +1852,7 @@ ULONG NVMeInitCplQueue(
 
     /* Initialize static fields of CPL_QUEUE_INFO structure */
     pCQI->CplQueueID = QueueID;
-    pCQI->CplQEntries = pSQI->SubQEntries;
+    pCQI->CplQEntries = pSQI->CplQEntries;
 
     /* calculate byte offset per 10.c spec formula  */
     dbIndex = (2 * QueueID + 1) * (4 << CAP.DSTRD);
@@ -1210,6 +1864,18 @@ ULONG NVMeInitCplQueue(
     StorPortDebugPrint(INFO,
                        "NVMeInitCplQueue : CQ 0x%x pCplHDBL 0x%p at index  0x%x\n",
                        QueueID, pCQI->pCplHDBL, dbIndex);
+
+    pCQI->pCplHShadow = NULL;
+    pCQI->pCplHEventIdx = NULL;
+    if ((QueueID != 0) &&
+        (pAE->DbbufInfo.Enabled == TRUE) &&
+        (dbIndex < (PAGE_SIZE / sizeof(ULONG)))) {
+        pCQI->pCplHShadow = pAE->DbbufInfo.pShadowDbl + dbIndex;
+        pCQI->pCplHEventIdx = pAE->DbbufInfo.pEventIdx + dbIndex;
+        *pCQI->pCplHShadow = 0;
+        *pCQI->pCplHEventIdx = 0;
+    }
+    pCQI->DoorbellWrites = 0;
     pCQI->Completions = 0;
     pCQI->CurPhaseTag = 0;
     pCQI->CplQHeadPtr = 0;
@@ -1231,22 +1897,13 @@ ULONG NVMeInitCplQueue(
         if (pRMT->NumMsiMsgGranted < maxCore) {
             /* All completion queueus share the single message */
             pCQI->MsiMsgID = 0;
-        } else {
-            /*
-             * When enough queues allocated, the mappings between cores and
-             * queues are set up as core#(n) <=> queue#(n+1)
-             * Only need to deal with IO queues since Admin queue uses message#0
-             *
-             * When we come through here the first time during boot/init, the msg
-             * ID needs to be initialized.  After learning is complete, the msg ID
-             * will point to the proper MSI vector.  Learning is complete when
-             * LearningCores == NumActiveCores.
-             */
-            if ((QueueID != 0) && (pAE->LearningCores < pRMT->NumActiveCores)) {
-                pCT = pRMT->pCoreTbl + QueueID - 1;
-                pCQI->MsiMsgID = pCT->MsiMsgID;
-            }
         }
+        /*
+         * Otherwise the IO queue's message was already set up by
+         * NVMeMsiMapCores (and updated by learning), cores no longer map
+         * 1:1 onto queues so there is nothing to derive from the core table.
+         * Admin queue uses message#0.
+         */
     }
 
     /*
@@ -1254,10 +1911,10 @@ ULONG NVMeInitCplQueue(
      * entry system page aligned.
      */
     queueSize = pSQI->SubQEntries * sizeof(NVMe_COMMAND);
-    PtrTemp = (ULONG_PTR)((PUCHAR)pSQI->pSubQStart);
+    PtrTemp = (ULONG_PTR)PAGE_ALIGN_BUF_PTR(pSQI->pQueueAlloc);
     pCQI->pCplQStart = (PVOID)(PtrTemp + queueSize);
 
-    queueSize = pSQI->SubQEntries * sizeof(NVMe_COMPLETION_QUEUE_ENTRY);
+    queueSize = pCQI->CplQEntries * sizeof(NVMe_COMPLETION_QUEUE_ENTRY);
     pCQI->pCplQStart = PAGE_ALIGN_BUF_PTR(pCQI->pCplQStart);
     memset(pCQI->pCplQStart, 0, queueSize);
 
@@ -1289,20 +1946,13 @@ ULONG NVMeInitCmdEntries(
 {
     PQUEUE_INFO pQI = &pAE->QueueInfo;
     PSUB_QUEUE_INFO pSQI = pQI->pSubQueueInfo + QueueID;
-    PCPL_QUEUE_INFO pCQI = pQI->pCplQueueInfo + QueueID;
-    PRES_MAPPING_TBL pRMT = &pAE->ResMapTbl;
-    ULONG_PTR PtrTemp = 0;
 
     /* Ensure the QueueID is valid via the number of active cores in system */
-    if (QueueID > pRMT->NumActiveCores)
+    if (QueueID > NVME_MAX_SUB_IO_QUEUES(pAE))
         return (STOR_STATUS_INVALID_PARAMETER);
 
-    /* Initialize command entries and Free list */
-    PtrTemp = (ULONG_PTR)((PUCHAR)pCQI->pCplQStart);
-    pSQI->pCmdEntry = (PVOID) (PtrTemp + (pSQI->SubQEntries *
-                                          sizeof(NVMe_COMPLETION_QUEUE_ENTRY)));
-
-    memset(pSQI->pCmdEntry, 0, sizeof(CMD_ENTRY) * pSQI->SubQEntries);
+    /* Initialize command entries, allocated with the queue, and Free list */
+    memset(pSQI->pCmdEntry, 0, CMD_ENTRY_STRIDE * pSQI->SubQEntries);
     NVMeInitFreeQ(pSQI, pAE);
 
     return (STOR_STATUS_SUCCESS);
@@ -1361,11 +2011,81 @@ BOOLEAN NVMeResetAdapter(
 		}
 	}
 
+	/*
+	 * A disabled controller has let go of the Host Memory Buffer and forgot
+	 * the shadow doorbells, both are handed over again during init.
+	 */
+	pAE->HmbInfo.Enabled = FALSE;
+	pAE->DbbufInfo.Enabled = FALSE;
+
  	pAE->DriverState.NextDriverState = NVMeWaitOnRDY;
 
     return (TRUE);
 } /* NVMeResetAdapter */
 
+/*******************************************************************************
+ * NVMeQuiesceController
+ *
+ * @brief NVMeQuiesceController gets called before host memory the controller
+ *        may still access is released. Unlike NVMeResetAdapter it doesn't
+ *        wait for RDY to be set first, a controller that failed init may
+ *        never get there, and it leaves the state machine alone. A controller
+ *        that's gone from the bus can't access memory anymore either.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ *
+ * @return BOOLEAN
+ *     TRUE - The controller is disabled or gone
+ *     FALSE - RDY didn't clear, host memory must not be released
+ ******************************************************************************/
+BOOLEAN NVMeQuiesceController(
+    PNVME_DEVICE_EXTENSION pAE
+)
+{
+    NVMe_CONTROLLER_CONFIGURATION CC;
+    NVMe_CONTROLLER_STATUS CSTS;
+    ULONG PollMax = pAE->uSecCrtlTimeout / MAX_STATE_STALL_us;
+    ULONG PollCount;
+
+    /* Nothing was ever enabled without the registers mapped */
+    if (pAE->pCtrlRegister == NULL)
+        return (TRUE);
+
+    CC.AsUlong = StorPortReadRegisterUlong(pAE,
+                                           (PULONG)(&pAE->pCtrlRegister->CC));
+    CSTS.AsUlong = StorPortReadRegisterUlong(pAE,
+                       (PULONG)(&pAE->pCtrlRegister->CSTS.AsUlong));
+    if ((CC.AsUlong == INVALID_DEVICE_REGISTER_VALUE) ||
+        (CSTS.AsUlong == INVALID_DEVICE_REGISTER_VALUE))
+        return (TRUE);
+
+    if (CC.EN == 1) {
+        CC.EN = 0;
+        StorPortWriteRegisterUlong(pAE,
+                                   (PULONG)(&pAE->pCtrlRegister->CC),
+                                   CC.AsUlong);
+    }
+
+    for (PollCount = 0; (CSTS.RDY == 1) && (PollCount < PollMax); PollCount++) {
+        NVMeStallExecution(pAE, MAX_STATE_STALL_us);
+        CSTS.AsUlong = StorPortReadRegisterUlong(pAE,
+                           (PULONG)(&pAE->pCtrlRegister->CSTS.AsUlong));
+        if (CSTS.AsUlong == INVALID_DEVICE_REGISTER_VALUE)
+            return (TRUE);
+    }
+
+    if (CSTS.RDY == 1) {
+        StorPortDebugPrint(ERROR,
+            "NVMeQuiesceController: <Error> RDY still set\n");
+        return (FALSE);
+    }
+
+    pAE->HmbInfo.Enabled = FALSE;
+    pAE->DbbufInfo.Enabled = FALSE;
+
+    return (TRUE);
+} /* NVMeQuiesceController */
+
 
 /*******************************************************************************
  * NVMeEnableAdapter
@@ -1430,7 +2150,8 @@ BOOLEAN NVMeEnableAdapter(
     CC.EN = 1;
     CC.CSS = NVME_CC_NVM_CMD;
     CC.MPS = (PAGE_SIZE >> NVME_MEM_PAGE_SIZE_SHIFT);
-    CC.AMS = NVME_CC_ROUND_ROBIN;
+    CC.AMS = (pAE->WrrEnabled == TRUE) ? NVME_CC_WRR_URGENT :
+                                         NVME_CC_ROUND_ROBIN;
     CC.SHN = NVME_CC_SHUTDOWN_NONE;
     CC.IOSQES = NVME_CC_IOSQES;
     CC.IOCQES = NVME_CC_IOCQES;
@@ -1495,8 +2216,6 @@ VOID NVMeSetFeaturesCompletion(
     PADMIN_SET_FEATURES_COMMAND_LBA_RANGE_TYPE_DW11 pSetFeaturesCDW11 = NULL;
     NS_VISBILITY visibility = IGNORED;
     ULONG lunId;
-    UINT8 flbas;
-    UINT16 metadataSize;
 
     /*
      * Mark down the resulted information if succeeded. Otherwise, log the error
@@ -1525,6 +2244,74 @@ VOID NVMeSetFeaturesCompletion(
             pAE->DriverState.StateChkCount = 0;
             pAE->DriverState.NextDriverState = NVMeWaitOnSetFeatures;
         }
+    } else if (pNVMeCmd->CDW0.OPC == ADMIN_SET_FEATURES &&
+               pSetFeaturesCDW10->FID == AUTONOMOUS_POWER_STATE_TRANSITION) {
+        PADMIN_SET_FEATURES_COMMAND_APST_DW11 pApstCDW11 =
+            (PADMIN_SET_FEATURES_COMMAND_APST_DW11) &pNVMeCmd->CDW11;
+
+        /* APST only saves power, carry on without it if it's refused */
+        if (pCplEntry->DW3.SF.SC != 0) {
+            StorPortDebugPrint(INFO,
+                "NVMeSetFeaturesCompletion: APST not accepted, SCT 0x%x SC 0x%x\n",
+                pCplEntry->DW3.SF.SCT,
+                pCplEntry->DW3.SF.SC);
+        } else if (pApstCDW11->APSTE == 1) {
+            pAE->ApstInfo.Enabled = TRUE;
+            pAE->ApstInfo.CurrentState = 0;
+            pAE->ApstInfo.StateIdleMs = 0;
+        }
+        pAE->DriverState.ApstSet = TRUE;
+
+        /* Reset the counter and keep tihs state to set more features */
+        pAE->DriverState.StateChkCount = 0;
+        pAE->DriverState.NextDriverState = NVMeWaitOnSetFeatures;
+    } else if (pNVMeCmd->CDW0.OPC == ADMIN_SET_FEATURES &&
+               pSetFeaturesCDW10->FID == ARBITRATION) {
+        /* The controller keeps its default weights if these are refused */
+        if (pCplEntry->DW3.SF.SC != 0) {
+            StorPortDebugPrint(INFO,
+                "NVMeSetFeaturesCompletion: Arbitration not accepted, SCT 0x%x SC 0x%x\n",
+                pCplEntry->DW3.SF.SCT,
+                pCplEntry->DW3.SF.SC);
+        }
+        pAE->DriverState.ArbitrationSet = TRUE;
+
+        /* Reset the counter and keep tihs state to set more features */
+        pAE->DriverState.StateChkCount = 0;
+        pAE->DriverState.NextDriverState = NVMeWaitOnSetFeatures;
+    } else if (pNVMeCmd->CDW0.OPC == ADMIN_DOORBELL_BUFFER_CONFIG) {
+        /* Doorbell registers still work if the buffers are refused */
+        if (pCplEntry->DW3.SF.SC != 0) {
+            StorPortDebugPrint(INFO,
+                "NVMeSetFeaturesCompletion: DBBUF not accepted, SCT 0x%x SC 0x%x\n",
+                pCplEntry->DW3.SF.SCT,
+                pCplEntry->DW3.SF.SC);
+        } else {
+            pAE->DbbufInfo.Enabled = TRUE;
+        }
+        pAE->DriverState.DbbufSet = TRUE;
+
+        /* Reset the counter and keep tihs state to set more features */
+        pAE->DriverState.StateChkCount = 0;
+        pAE->DriverState.NextDriverState = NVMeWaitOnSetFeatures;
+    } else if (pNVMeCmd->CDW0.OPC == ADMIN_SET_FEATURES &&
+               pSetFeaturesCDW10->FID == HOST_MEMORY_BUFFER) {
+        /* HMB is a performance aid only, run without it if it's refused */
+        if (pCplEntry->DW3.SF.SC != 0) {
+            StorPortDebugPrint(INFO,
+                "NVMeSetFeaturesCompletion: HMB not accepted, SCT 0x%x SC 0x%x\n",
+                pCplEntry->DW3.SF.SCT,
+                pCplEntry->DW3.SF.SC);
+            NVMeFreeHostMemBuffer(pAE);
+        } else {
+            pAE->HmbInfo.Enabled = TRUE;
+            pAE->HmbInfo.Returnable = TRUE;
+        }
+        pAE->DriverState.HmbSet = TRUE;
+
+        /* Reset the counter and keep tihs state to set more features */
+        pAE->DriverState.StateChkCount = 0;
+        pAE->DriverState.NextDriverState = NVMeWaitOnSetFeatures;
     } else if (pNVMeCmd->CDW0.OPC == ADMIN_SET_FEATURES &&
                pSetFeaturesCDW10->FID == NUMBER_OF_QUEUES) {
         if (pCplEntry->DW3.SF.SC != 0) {
@@ -1538,6 +2325,9 @@ VOID NVMeSetFeaturesCompletion(
             pQI->NumSubIoQAllocFromAdapter = GET_WORD_0(pCplEntry->DW0) + 1;
             pQI->NumCplIoQAllocFromAdapter = GET_WORD_1(pCplEntry->DW0) + 1;
 
+            /* The priority class SQs come out of the unclamped grant */
+            pQI->NumSubIoQGranted = pQI->NumSubIoQAllocFromAdapter;
+
             /*
              * Ensure there is the minimum number of queues between the MSI
              * granted, number of cores, and number allocated from the adapter.
@@ -1559,9 +2349,31 @@ VOID NVMeSetFeaturesCompletion(
                 }
             } 
 
-            /* Reset the counter and keep tihs state to set more features */
             pAE->DriverState.StateChkCount = 0;
-            pAE->DriverState.NextDriverState = NVMeWaitOnSetFeatures;
+            if (pAE->DriverState.FastResume == TRUE) {
+                /*
+                 * The kept queues are only usable if the controller still
+                 * grants as many as were created before the power down,
+                 * otherwise the resume falls back to a full init.
+                 */
+                if ((pQI->NumSubIoQAllocFromAdapter < pQI->NumCplIoQAllocated) ||
+                    (pQI->NumSubIoQGranted < pQI->NumSubIoQAllocated) ||
+                    (pQI->NumCplIoQAllocFromAdapter < pQI->NumCplIoQAllocated)) {
+                    StorPortDebugPrint(INFO,
+                        "NVMeSetFeaturesCompletion: %d/%d queues granted on resume, need %d/%d\n",
+                        pQI->NumSubIoQGranted,
+                        pQI->NumCplIoQAllocFromAdapter,
+                        pQI->NumSubIoQAllocated,
+                        pQI->NumCplIoQAllocated);
+                    pAE->DriverState.NextDriverState = NVMeStateFailed;
+                } else {
+                    /* LBA ranges were examined at the full init */
+                    pAE->DriverState.NextDriverState = NVMeWaitOnSetupQueues;
+                }
+            } else {
+                /* Reset the counter and keep tihs state to set more features */
+                pAE->DriverState.NextDriverState = NVMeWaitOnSetFeatures;
+            }
         }
     } else if ((pAE->DriverState.TtlLbaRangeExamined <
                 pAE->DriverState.IdentifyNamespaceFetched) &&
@@ -1583,8 +2395,10 @@ VOID NVMeSetFeaturesCompletion(
                 else
                     lunId = pAE->DriverState.VisibleNamespacesExamined;
 
+                /* Past the LUN range a namespace is tracked, not exposed */
                 pLunExt = pAE->pLunExtensionTable[lunId];
-                if (pLunExt->identifyData.NCAP != 0) {
+                if ((pLunExt->identifyData.NCAP != 0) &&
+                    (lunId < MAX_NAMESPACES)) {
 					if (!pAE->controllerIdentifyData.OACS.SupportsNamespaceMgmtAndAttachment) {
 						pLunExt->nsStatus = ATTACHED;
 					}
@@ -1593,7 +2407,9 @@ VOID NVMeSetFeaturesCompletion(
                     pAE->DriverState.VisibleNamespacesExamined++;
                     pAE->DriverState.ConfigLbaRangeNeeded = FALSE;
                     pAE->DriverState.TtlLbaRangeExamined++;
-                } else if ((INACTIVE == pLunExt->nsStatus) || (INVALID == pLunExt->nsStatus)) {
+                } else if ((INACTIVE == pLunExt->nsStatus) ||
+                           (INVALID == pLunExt->nsStatus) ||
+                           (lunId >= MAX_NAMESPACES)) {
                     pAE->DriverState.ConfigLbaRangeNeeded = FALSE;
                     pAE->DriverState.TtlLbaRangeExamined++;
                 }
@@ -1663,12 +2479,10 @@ VOID NVMeSetFeaturesCompletion(
                             pLbaRangeTypeEntry->Attributes.Overwriteable ?
                                 FALSE:TRUE;
                     /*
-                     *  When the namespace is formatted using metadata, 
-                     *  don't advertise it for now 
+                     *  Don't advertise a namespace whose metadata the
+                     *  driver can't place
                      */
-                    flbas = pLunExt->identifyData.FLBAS.SupportedCombination;
-                    metadataSize = pLunExt->identifyData.LBAFx[flbas].MS;
-                    if (metadataSize != 0)
+                    if (SntiIsFormatSupported(pLunExt) == FALSE)
                        visibility = HIDDEN;
 
                 } else {
@@ -1680,12 +2494,13 @@ VOID NVMeSetFeaturesCompletion(
 
                 pAE->DriverState.ConfigLbaRangeNeeded = FALSE;
                 pAE->DriverState.TtlLbaRangeExamined++;
-                if (visibility == VISIBLE) {
+                if ((visibility == VISIBLE) && (lunId < MAX_NAMESPACES)) {
                     pLunExt->slotStatus = ONLINE;
                     pAE->DriverState.VisibleNamespacesExamined++;
                 } else {
                     StorPortDebugPrint(INFO,"NVMeSetFeaturesCompletion: FYI LnuExt at %d has been cleared (NSID not visible)\n",
                         lunId);
+                    NVMeSetNamespaceId(pAE, lunId, 0);
                     RtlZeroMemory(pLunExt, sizeof(NVME_LUN_EXTENSION));
                 }
 
@@ -1781,9 +2596,10 @@ BOOLEAN NVMeDeleteQueueCallback(
             pSQI->SubQTailPtr = 0;
             pSQI->SubQHeadPtr = 0;
             /* we don't recycle SQs w/learning mode but for consistency... */
-            memset(pSQI->pSubQStart,
-                0,
-                (pSQI->SubQEntries * sizeof(NVMe_COMMAND)));
+            if (pSQI->pCmbSubQ == NULL)
+                memset(pSQI->pSubQStart,
+                    0,
+                    (pSQI->SubQEntries * sizeof(NVMe_COMMAND)));
             pQI->NumSubIoQCreated--;
         } else {
             NVMeDriverFatalError(pAE,
@@ -1830,6 +2646,15 @@ BOOLEAN NVMeInitCallback(
 
     NVMe_CONTROLLER_CAPABILITIES CAP = {0};
     StorPortDebugPrint(INFO,"NVMeInitCallback: Driver state: %d\n", pAE->DriverState.NextDriverState);
+
+    /* A create of a fast resume burst is done with its SRB extension */
+    if ((pAE->DriverState.pBurstSrbExt != NULL) &&
+        (pSrbExt >= (PNVME_SRB_EXTENSION)pAE->DriverState.pBurstSrbExt) &&
+        (pSrbExt < (PNVME_SRB_EXTENSION)pAE->DriverState.pBurstSrbExt +
+                   CREATE_QUEUE_BURST))
+        pAE->DriverState.BurstSlotsBusy &= ~(1 << (pSrbExt -
+            (PNVME_SRB_EXTENSION)pAE->DriverState.pBurstSrbExt));
+
     switch (pAE->DriverState.NextDriverState) {
         case NVMeWaitOnIdentifyCtrl:
             /*
@@ -1855,7 +2680,8 @@ BOOLEAN NVMeInitCallback(
 				}
 				else {
 					pAE->DriverState.NextDriverState = NVMeWaitOnIdentifyNS;
-					pAE->DriverState.NumKnownNamespaces = pAE->controllerIdentifyData.NN;
+					pAE->DriverState.NumKnownNamespaces =
+						min(pAE->controllerIdentifyData.NN, pAE->NumLunExtensions);
 				}
 
 /* Code Analysis fails on StoPortReadRegisterUlong64 */
@@ -1911,23 +2737,38 @@ BOOLEAN NVMeInitCallback(
                 (pCplEntry->DW3.SF.SCT == GENERIC_COMMAND_STATUS)) {
 
                 pNamespaceId = (PULONG) pAE->DriverState.pDataBuffer;
-                for (i = 0; i < MAX_NAMESPACES; i++) {
+                for (i = 0; i < MAX_NUMBER_OF_NAMESPACES; i++) {
                     currentNSID = (ULONG)*pNamespaceId;
 
                     /* A value of 0 NSID indicates end of list of namespaces */ 
-                    if (currentNSID == 0) {
+                    if ((currentNSID == 0) ||
+                        (pAE->DriverState.NumKnownNamespaces >=
+                         pAE->NumLunExtensions)) {
                         break;
                     }
 
                     /* found a new NSID */
                     lunId = pAE->DriverState.NumKnownNamespaces;
-                    pAE->pLunExtensionTable[lunId]->namespaceId = currentNSID;
+                    NVMeSetNamespaceId(pAE, lunId, currentNSID);
                     pAE->pLunExtensionTable[lunId]->nsStatus = ATTACHED;
                     pAE->DriverState.NumKnownNamespaces++;
                     pNamespaceId++;
                 }
-                /* Move to the next state: list all existing namespace(s) */
-                pAE->DriverState.NextDriverState = NVMeWaitOnListExistingNs;
+
+                /*
+                 * A full page may not be the end of the list, ask for the
+                 * next one after its last NSID while the table has room.
+                 * Otherwise move to the next state: list all existing
+                 * namespace(s)
+                 */
+                if ((i == MAX_NUMBER_OF_NAMESPACES) &&
+                    (pAE->DriverState.NumKnownNamespaces <
+                     pAE->NumLunExtensions)) {
+                    pAE->DriverState.ListNsStart = currentNSID;
+                } else {
+                    pAE->DriverState.ListNsStart = 0;
+                    pAE->DriverState.NextDriverState = NVMeWaitOnListExistingNs;
+                }
             } else {
                 NVMeDriverFatalError(pAE,
                                     (1 << START_STATE_LIST_ATTACHED_NS_FAILURE));
@@ -1943,25 +2784,38 @@ BOOLEAN NVMeInitCallback(
                 (pCplEntry->DW3.SF.SCT == GENERIC_COMMAND_STATUS)) {
 
                 pNamespaceId = (PULONG) pAE->DriverState.pDataBuffer;
-                for (i = 0; i < MAX_NAMESPACES; i++) {
+                for (i = 0; i < MAX_NUMBER_OF_NAMESPACES; i++) {
                     currentNSID = (ULONG)*pNamespaceId;
 
                     /* A value of 0 NSID indicates end of list of namespaces */ 
-                    if (currentNSID == 0) {
+                    if ((currentNSID == 0) ||
+                        (pAE->DriverState.NumKnownNamespaces >=
+                         pAE->NumLunExtensions)) {
                         break;
                     }
 
                     if (INVALID == NVMeGetNamespaceStatusAndSlot(pAE, currentNSID, &lunId)) {
                         /* found a new NSID */
                         lunId = pAE->DriverState.NumKnownNamespaces;
-                        pAE->pLunExtensionTable[lunId]->namespaceId = currentNSID;
+                        NVMeSetNamespaceId(pAE, lunId, currentNSID);
                         pAE->pLunExtensionTable[lunId]->nsStatus = INACTIVE;
                         pAE->DriverState.NumKnownNamespaces++;
                     }
                     pNamespaceId++;
                 }
-                /* Move to the next state: identify namespace(s) */
-                pAE->DriverState.NextDriverState = NVMeWaitOnIdentifyNS;
+
+                /*
+                 * Same as above, page through the list while the table has
+                 * room, then move to the next state: identify namespace(s)
+                 */
+                if ((i == MAX_NUMBER_OF_NAMESPACES) &&
+                    (pAE->DriverState.NumKnownNamespaces <
+                     pAE->NumLunExtensions)) {
+                    pAE->DriverState.ListNsStart = currentNSID;
+                } else {
+                    pAE->DriverState.ListNsStart = 0;
+                    pAE->DriverState.NextDriverState = NVMeWaitOnIdentifyNS;
+                }
             } else {
                 NVMeDriverFatalError(pAE,
                                     (1 << START_STATE_LIST_EXISTING_NS_FAILURE));
@@ -1999,8 +2853,9 @@ BOOLEAN NVMeInitCallback(
                  * Otherwise, mark down the Namespace ID here 
                  */
                 if (!pAE->controllerIdentifyData.OACS.SupportsNamespaceMgmtAndAttachment)
-                    pLunExt->namespaceId =
-                        pAE->DriverState.IdentifyNamespaceFetched;
+                    NVMeSetNamespaceId(pAE,
+                                       pAE->DriverState.VisibleNamespacesExamined,
+                                       pAE->DriverState.IdentifyNamespaceFetched);
 
                 /* Note next Namespace ID to fetch Namespace structure */
                 /* for use in the LBA range type commands we need this info */
@@ -2045,6 +2900,7 @@ BOOLEAN NVMeInitCallback(
                 /* Reset the counter and set next state */
                 pAE->DriverState.StateChkCount = 0;
                 if (pQI->NumCplIoQAllocated == pQI->NumCplIoQCreated) {
+                    pAE->DriverState.FastResumeIssued = 0;
                     pAE->DriverState.NextDriverState = NVMeWaitOnIoSQ;
                 } else {
                     pAE->DriverState.NextDriverState = NVMeWaitOnIoCQ;
@@ -2125,7 +2981,27 @@ BOOLEAN NVMeInitCallback(
                             pRMT->pMsiMsgTbl->Shared = TRUE;
                             pAE->DriverState.NextDriverState = NVMeStartComplete;
 
+                    } else if ((pAE->MsiMappingDerived == TRUE) &&
+                               (pAE->MsiMappingMismatches == 0)) {
+                        /*
+                         * Learning just confirmed the derived table and the
+                         * queues were created on those vectors already, so
+                         * skip tearing them down and recreating them.
+                         */
+                        StorPortDebugPrint(INFO,
+                            "Derived core/vector mapping verified\n");
+#if DBG
+                        pAE->LearningComplete = TRUE;
+#endif
+                        if (pAE->DriverState.AllNamespacesAreReady) {
+                            pAE->DriverState.NextDriverState = NVMeStartComplete;
+                        } else {
+                            pAE->DriverState.NextDriverState = NVMeWaitOnNamespaceReady;
+                        }
                     } else {
+                        /* Shared queues only learned targets, pair them up */
+                        if (pAE->MultipleCoresToSingleQueueFlag == TRUE)
+                            NVMeBindMsiToQueues(pAE);
 
 #if DBG
                         /* print out the learned table */
@@ -2145,8 +3021,10 @@ BOOLEAN NVMeInitCallback(
                         /*
                          * Learning is done. Any additional cores not assigned to
                          * queues will be assigned in the start complete state.
+                         * A derived table that didn't verify is dropped here in
+                         * favor of what was learned.
                          */
-
+                        pAE->MsiMappingDerived = FALSE;
                         pAE->DriverState.NextDriverState = NVMeWaitOnReSetupQueues;
                     }
                 }
@@ -2337,13 +3215,13 @@ BOOLEAN NVMeSetIntCoalescing(
 } /* NVMeSetIntCoalescing */
 
 /*******************************************************************************
- * NVMeAllocQueueFromAdapter
+ * NVMeSetArbitration
  *
- * @brief NVMeAllocQueueFromAdapter gets called to allocate
- *        submission/completion queues from the adapter via Set Feature command
- *        with Feature ID#7. This routine requests the same number of
- *        submission/completion queues as the number of current active cores in
- *        the system.
+ * @brief NVMeSetArbitration gets called to program the Weighted Round Robin
+ *        weights and arbitration burst via Set Features command with Feature
+ *        ID#01h. Urgent SQs are always served first, the high, medium and low
+ *        classes then share each round by their weights. Without WRR the
+ *        command is skipped and the state machine is simply called again.
  *
  * @param pAE - Pointer to hardware device extension.
  *
@@ -2351,15 +3229,22 @@ BOOLEAN NVMeSetIntCoalescing(
  *     TRUE - If the issued command completed without any errors
  *     FALSE - If anything goes wrong
  ******************************************************************************/
-BOOLEAN NVMeAllocQueueFromAdapter(
+BOOLEAN NVMeSetArbitration(
     PNVME_DEVICE_EXTENSION pAE
 )
 {
     PNVME_SRB_EXTENSION pNVMeSrbExt =
         (PNVME_SRB_EXTENSION)pAE->DriverState.pSrbExt;
     PNVMe_COMMAND pSetFeatures = (PNVMe_COMMAND)(&pNVMeSrbExt->nvmeSqeUnit);
+
     PADMIN_SET_FEATURES_COMMAND_DW10 pSetFeaturesCDW10 = NULL;
-    PADMIN_SET_FEATURES_COMMAND_NUMBER_OF_QUEUES_DW11 pSetFeaturesCDW11 = NULL;
+    PADMIN_SET_FEATURES_COMMAND_ARBITRATION_DW11 pSetFeaturesCDW11 = NULL;
+
+    if ((pAE->ntldrDump == TRUE) || (pAE->WrrEnabled == FALSE)) {
+        pAE->DriverState.ArbitrationSet = TRUE;
+        NVMeCallArbiter(pAE);
+        return (TRUE);
+    }
 
     /* Zero out the extension first */
     memset((PVOID)pNVMeSrbExt, 0, sizeof(NVME_SRB_EXTENSION));
@@ -2371,46 +3256,30 @@ BOOLEAN NVMeAllocQueueFromAdapter(
     /* Populate submission entry fields */
     pSetFeatures->CDW0.OPC = ADMIN_SET_FEATURES;
     pSetFeaturesCDW10 = (PADMIN_SET_FEATURES_COMMAND_DW10) &pSetFeatures->CDW10;
-    pSetFeaturesCDW11 = (PADMIN_SET_FEATURES_COMMAND_NUMBER_OF_QUEUES_DW11)
+    pSetFeaturesCDW11 = (PADMIN_SET_FEATURES_COMMAND_ARBITRATION_DW11)
         &pSetFeatures->CDW11;
-    pSetFeaturesCDW10->FID = NUMBER_OF_QUEUES;
 
-    /* Set up NCSQR and NSQR, which are 0-based. */
-    if (pAE->ntldrDump == TRUE) {
-        /* In crashdump/hibernation case, only 1 pair of IO queue needed */
-        pSetFeaturesCDW11->NCQR = 0;
-        pSetFeaturesCDW11->NSQR = 0;
-    } else {
-        /*
-         * Number of cores, number of MSI granted, and number of queues
-         * supported by the controller are the variables to determine how
-         * many queues to create.
-         */
-        pSetFeaturesCDW11->NCQR = min(pAE->ResMapTbl.NumActiveCores,
-                                      pAE->ResMapTbl.NumMsiMsgGranted) - 1;
-        pSetFeaturesCDW11->NSQR = min(pAE->ResMapTbl.NumActiveCores,
-                                      pAE->ResMapTbl.NumMsiMsgGranted) - 1;    }
+    pSetFeaturesCDW10->FID = ARBITRATION;
+
+    /* The weights are 0 based, the burst is a power of 2 */
+    pSetFeaturesCDW11->AB = WRR_ARBITRATION_BURST;
+    pSetFeaturesCDW11->HPW = WRR_HIGH_WEIGHT - 1;
+    pSetFeaturesCDW11->MPW = WRR_MEDIUM_WEIGHT - 1;
+    pSetFeaturesCDW11->LPW = WRR_LOW_WEIGHT - 1;
 
     /* Now issue the command via Admin Doorbell register */
     return ProcessIo(pAE, pNVMeSrbExt, NVME_QUEUE_TYPE_ADMIN, FALSE);
-} /* NVMeAllocQueueFromAdapter */
+} /* NVMeSetArbitration */
 
 /*******************************************************************************
- * NVMeAccessLbaRangeEntry
- *
- * @brief NVMeAccessLbaRangeEntry gets called to query/update the first LBA
- *        Range entry of a given namespace. The procedure is described below:
+ * NVMeSetApst
  *
- *        Depending on the value of ConfigLbaRangeNeeded, if TRUE, it issues
- *        Set Features command. Otherwise, it issues Get Features commands.
- *
- *        When issuing Set Features, the namespace has:
- *          Type = Filesystem,
- *          ReadOnly = FALSE,
- *          Visible = TRUE.
- *
- *        When command completes, NVMeSetFeaturesCompletion is called to exam
- *        the LBA Range Type entries and wrap up the access.
+ * @brief NVMeSetApst gets called to program autonomous power state
+ *        transitions via Set Features command with Feature ID#0Ch. The table
+ *        is built from the power state descriptors and the ApstMaxLatency
+ *        registry value; APST is explicitly disabled when no state qualifies.
+ *        Controllers without APST, and dump mode, skip the command and the
+ *        state machine is simply called again.
  *
  * @param pAE - Pointer to hardware device extension.
  *
@@ -2418,7 +3287,7 @@ BOOLEAN NVMeAllocQueueFromAdapter(
  *     TRUE - If the issued command completed without any errors
  *     FALSE - If anything goes wrong
  ******************************************************************************/
-BOOLEAN NVMeAccessLbaRangeEntry(
+BOOLEAN NVMeSetApst(
     PNVME_DEVICE_EXTENSION pAE
 )
 {
@@ -2426,17 +3295,21 @@ BOOLEAN NVMeAccessLbaRangeEntry(
         (PNVME_SRB_EXTENSION)pAE->DriverState.pSrbExt;
     PNVMe_COMMAND pSetFeatures = (PNVMe_COMMAND)(&pNVMeSrbExt->nvmeSqeUnit);
     PADMIN_SET_FEATURES_COMMAND_DW10 pSetFeaturesCDW10 = NULL;
-    PADMIN_SET_FEATURES_COMMAND_LBA_RANGE_TYPE_ENTRY pLbaRangeEntry = NULL;
-    ULONG NSID = pAE->DriverState.CurrentNsid;
-    BOOLEAN Query = pAE->DriverState.ConfigLbaRangeNeeded;
+    PADMIN_SET_FEATURES_COMMAND_APST_DW11 pSetFeaturesCDW11 = NULL;
+    PADMIN_SET_FEATURES_APST_ENTRY pApstTable =
+        (PADMIN_SET_FEATURES_APST_ENTRY)pAE->DriverState.pDataBuffer;
+    ULONG NumTransitions;
 
-    /* 
-     * if not capable of namespace mgmt...
-     * Fail here if Namespace ID is 0 or out of range 
-     */
-    if ((!pAE->controllerIdentifyData.OACS.SupportsNamespaceMgmtAndAttachment) &&
-		(NSID == 0 || NSID > pAE->DriverState.NumKnownNamespaces))
-        return FALSE;
+    pAE->ApstInfo.Enabled = FALSE;
+
+    if ((pAE->ntldrDump == TRUE) ||
+        (pAE->controllerIdentifyData.APSTA == 0)) {
+        pAE->DriverState.ApstSet = TRUE;
+        NVMeCallArbiter(pAE);
+        return (TRUE);
+    }
+
+    NumTransitions = NVMeBuildApstTable(pAE, pApstTable);
 
     /* Zero out the extension first */
     memset((PVOID)pNVMeSrbExt, 0, sizeof(NVME_SRB_EXTENSION));
@@ -2446,90 +3319,632 @@ BOOLEAN NVMeAccessLbaRangeEntry(
     pNVMeSrbExt->pNvmeCompletionRoutine = NVMeInitCallback;
 
     /* Populate submission entry fields */
-    pSetFeatures->NSID = NSID;
-
-    /*
-     * Prepare the buffer for transferring LBA Range entries
-     * Need to zero the buffer out first when retrieving the entries
-     */
-    if (pAE->DriverState.ConfigLbaRangeNeeded == TRUE) {
-        pSetFeatures->CDW0.OPC = ADMIN_SET_FEATURES;
+    pSetFeatures->CDW0.OPC = ADMIN_SET_FEATURES;
+    pSetFeaturesCDW10 = (PADMIN_SET_FEATURES_COMMAND_DW10) &pSetFeatures->CDW10;
+    pSetFeaturesCDW11 = (PADMIN_SET_FEATURES_COMMAND_APST_DW11)
+        &pSetFeatures->CDW11;
 
-        /* Prepare new first LBA Range entry */
-        pLbaRangeEntry = (PADMIN_SET_FEATURES_COMMAND_LBA_RANGE_TYPE_ENTRY)
-            pAE->DriverState.pDataBuffer;
-        pLbaRangeEntry->Type = LBA_TYPE_FILESYSTEM;
-        pLbaRangeEntry->Attributes.Overwriteable = 1;
-        pLbaRangeEntry->Attributes.Hidden = 0;
-        pLbaRangeEntry->NLB = pAE->pLunExtensionTable[NSID-1]->identifyData.NSZE;
-    } else {
-        pSetFeatures->CDW0.OPC = ADMIN_GET_FEATURES;
-        memset(pAE->DriverState.pDataBuffer, 0, PAGE_SIZE);
-    }
+    pSetFeaturesCDW10->FID = AUTONOMOUS_POWER_STATE_TRANSITION;
+    pSetFeaturesCDW11->APSTE = (NumTransitions != 0) ? 1 : 0;
 
-    /* Prepare PRP entries, need at least one PRP entry */
+    /* The table is always transferred, it's all zero when disabling */
     if (NVMePreparePRPs(pAE,
                         pNVMeSrbExt,
-                        pAE->DriverState.pDataBuffer,
-                        sizeof(ADMIN_SET_FEATURES_LBA_COMMAND_RANGE_TYPE_ENTRY))
-                        == FALSE) {
+                        (PVOID)pApstTable,
+                        sizeof(ADMIN_SET_FEATURES_APST_ENTRY) *
+                        MAX_POWER_STATES) == FALSE) {
         return (FALSE);
     }
 
-    pSetFeaturesCDW10 = (PADMIN_SET_FEATURES_COMMAND_DW10) &pSetFeatures->CDW10;
-    pSetFeaturesCDW10->FID = LBA_RANGE_TYPE;
-
     /* Now issue the command via Admin Doorbell register */
     return ProcessIo(pAE, pNVMeSrbExt, NVME_QUEUE_TYPE_ADMIN, FALSE);
-} /* NVMeAccessLbaRangeEntry */
+} /* NVMeSetApst */
 
 /*******************************************************************************
- * NVMeGetIdentifyStructures
+ * NVMeAllocHostMemBuffer
  *
- * @brief NVMeGetIdentifyStructures gets called to retrieve Identify structures,
- *        including the Controller and Namespace information depending on
- *        NamespaceID.
+ * @brief NVMeAllocHostMemBuffer gets called to allocate the Host Memory
+ *        Buffer the controller asked for in HMPRE, capped by the HmbMaxSize
+ *        registry value. The buffer is built from physically contiguous
+ *        chunks, starting at HMB_MAX_CHUNK_SIZE and halving the chunk size
+ *        whenever an allocation fails. Anything short of HMMIN is released.
  *
  * @param pAE - Pointer to hardware device extension.
- * @param NamespaceID - Specify either Controller or Namespace structure to
- *                      retrieve
  *
  * @return BOOLEAN
- *     TRUE - If the issued command completed without any errors
+ *     TRUE - At least HMMIN was allocated and described
  *     FALSE - If anything goes wrong
  ******************************************************************************/
-BOOLEAN NVMeGetIdentifyStructures(
-    PNVME_DEVICE_EXTENSION pAE,
-    ULONG NamespaceID,
-    USHORT CNS
+BOOLEAN NVMeAllocHostMemBuffer(
+    PNVME_DEVICE_EXTENSION pAE
 )
 {
-    PNVME_SRB_EXTENSION pNVMeSrbExt =
-        (PNVME_SRB_EXTENSION)pAE->DriverState.pSrbExt;
-    PNVMe_COMMAND pIdentify = NULL;
-    PADMIN_IDENTIFY_CONTROLLER pIdenCtrl = &pAE->controllerIdentifyData;
-    PADMIN_IDENTIFY_COMMAND_DW10 pIdentifyCDW10 = NULL;
-    ULONG lunId;
+    PHMB_INFO pHmb = &pAE->HmbInfo;
+    PADMIN_IDENTIFY_CONTROLLER pIdCtrl = &pAE->controllerIdentifyData;
+    ULONG64 Preferred = (ULONG64)pIdCtrl->HMPRE * HMB_UNIT_SIZE;
+    ULONG64 Minimum = (ULONG64)pIdCtrl->HMMIN * HMB_UNIT_SIZE;
+    ULONG64 MaxSize = (ULONG64)pAE->InitInfo.HmbMaxSize * 1024 * 1024;
+    ULONG64 Target;
+    ULONG ChunkSize = HMB_MAX_CHUNK_SIZE;
+    ULONG AllocSize;
+    PVOID pChunk = NULL;
+    STOR_PHYSICAL_ADDRESS PhysAddr;
 
-    /* Zero-out the entire SRB_EXTENSION */
-    memset((PVOID)pNVMeSrbExt, 0, sizeof(NVME_SRB_EXTENSION));
+    if (Minimum > MaxSize) {
+        StorPortDebugPrint(INFO,
+            "NVMeAllocHostMemBuffer: HMMIN of %d KB is over the %d MB limit\n",
+            (ULONG)(Minimum / 1024),
+            pAE->InitInfo.HmbMaxSize);
+        return (FALSE);
+    }
 
-    /* Populate SRB_EXTENSION fields */
-    pNVMeSrbExt->pNvmeDevExt = pAE;
-    pNVMeSrbExt->pNvmeCompletionRoutine = NVMeInitCallback;
+    Target = max(min(Preferred, MaxSize), Minimum);
 
-    /* Populate submission entry fields */
-    pIdentify = &pNVMeSrbExt->nvmeSqeUnit;
-    pIdentify->CDW0.OPC = ADMIN_IDENTIFY;
+    pHmb->pDescList = NVMeAllocateMem(pAE, PAGE_SIZE, 0);
+    pHmb->ppChunk = NVMeAllocatePool(pAE, sizeof(PVOID) * HMB_MAX_DESCRIPTORS);
+    if ((pHmb->pDescList == NULL) || (pHmb->ppChunk == NULL)) {
+        NVMeFreeHostMemBuffer(pAE);
+        return (FALSE);
+    }
 
-    pIdentifyCDW10 = (PADMIN_IDENTIFY_COMMAND_DW10) &pIdentify->CDW10;
-    /* Set the type of identify command */
-    pIdentifyCDW10->CNS = CNS;
+    while ((pHmb->TotalSize < Target) &&
+           (pHmb->NumChunks < HMB_MAX_DESCRIPTORS)) {
+        AllocSize = (ULONG)min(ChunkSize, Target - pHmb->TotalSize);
+        AllocSize = (AllocSize + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+        pChunk = NVMeAllocateMem(pAE, AllocSize, 0);
+        if (pChunk == NULL) {
+            /* Try smaller pieces until there's no point going smaller */
+            if (ChunkSize <= HMB_MIN_CHUNK_SIZE)
+                break;
+            ChunkSize /= 2;
+            continue;
+        }
 
-    switch (CNS) {
-    case IDENTIFY_CNTLR:
-        /* Prepare PRP entries, need at least one PRP entry */
-        if (NVMePreparePRPs(pAE,
+        PhysAddr = NVMeGetPhysAddr(pAE, pChunk);
+        pHmb->ppChunk[pHmb->NumChunks] = pChunk;
+        pHmb->pDescList[pHmb->NumChunks].BADD = PhysAddr.QuadPart;
+        pHmb->pDescList[pHmb->NumChunks].BSIZE = AllocSize / PAGE_SIZE;
+        pHmb->NumChunks++;
+        pHmb->TotalSize += AllocSize;
+    }
+
+    if (pHmb->TotalSize < Minimum) {
+        StorPortDebugPrint(INFO,
+            "NVMeAllocHostMemBuffer: only got %d of %d KB\n",
+            (ULONG)(pHmb->TotalSize / 1024),
+            (ULONG)(Minimum / 1024));
+        NVMeFreeHostMemBuffer(pAE);
+        return (FALSE);
+    }
+
+    StorPortDebugPrint(INFO,
+        "NVMeAllocHostMemBuffer: %d KB in %d chunks (preferred %d KB)\n",
+        (ULONG)(pHmb->TotalSize / 1024),
+        pHmb->NumChunks,
+        (ULONG)(Preferred / 1024));
+
+    return (TRUE);
+} /* NVMeAllocHostMemBuffer */
+
+/*******************************************************************************
+ * NVMeFreeHostMemBuffer
+ *
+ * @brief NVMeFreeHostMemBuffer gets called to release the Host Memory Buffer
+ *        chunks and descriptor list. The controller must not be using them,
+ *        either because HMB was disabled or the controller has been reset.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ *
+ * @return VOID
+ ******************************************************************************/
+VOID NVMeFreeHostMemBuffer(
+    PNVME_DEVICE_EXTENSION pAE
+)
+{
+    PHMB_INFO pHmb = &pAE->HmbInfo;
+    ULONG Chunk;
+
+    if ((pHmb->ppChunk != NULL) && (pHmb->pDescList != NULL)) {
+        for (Chunk = 0; Chunk < pHmb->NumChunks; Chunk++) {
+            StorPortFreeContiguousMemorySpecifyCache((PVOID)pAE,
+                pHmb->ppChunk[Chunk],
+                pHmb->pDescList[Chunk].BSIZE * PAGE_SIZE,
+                MmCached);
+        }
+    }
+
+    if (pHmb->ppChunk != NULL)
+        StorPortFreePool((PVOID)pAE, pHmb->ppChunk);
+
+    if (pHmb->pDescList != NULL)
+        StorPortFreeContiguousMemorySpecifyCache((PVOID)pAE,
+                                                 pHmb->pDescList,
+                                                 PAGE_SIZE,
+                                                 MmCached);
+
+    memset(pHmb, 0, sizeof(HMB_INFO));
+} /* NVMeFreeHostMemBuffer */
+
+/*******************************************************************************
+ * NVMeSetHostMemBuffer
+ *
+ * @brief NVMeSetHostMemBuffer gets called to hand the Host Memory Buffer to
+ *        the controller via Set Features command with Feature ID#0Dh. The
+ *        buffer is allocated the first time and kept across resets and power
+ *        transitions, after which it's returned with MR set. Controllers
+ *        that don't want one, dump mode and failed allocations skip the
+ *        command and the state machine is simply called again.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ *
+ * @return BOOLEAN
+ *     TRUE - If the issued command completed without any errors
+ *     FALSE - If anything goes wrong
+ ******************************************************************************/
+BOOLEAN NVMeSetHostMemBuffer(
+    PNVME_DEVICE_EXTENSION pAE
+)
+{
+    PNVME_SRB_EXTENSION pNVMeSrbExt =
+        (PNVME_SRB_EXTENSION)pAE->DriverState.pSrbExt;
+    PNVMe_COMMAND pSetFeatures = (PNVMe_COMMAND)(&pNVMeSrbExt->nvmeSqeUnit);
+    PADMIN_SET_FEATURES_COMMAND_DW10 pSetFeaturesCDW10 = NULL;
+    PADMIN_SET_FEATURES_COMMAND_HMB_DW11 pSetFeaturesCDW11 = NULL;
+    PHMB_INFO pHmb = &pAE->HmbInfo;
+    STOR_PHYSICAL_ADDRESS PhysAddr;
+
+    if ((pAE->ntldrDump == TRUE) ||
+        (pAE->controllerIdentifyData.HMPRE == 0) ||
+        (pAE->InitInfo.HmbMaxSize == 0) ||
+        ((pHmb->NumChunks == 0) && (NVMeAllocHostMemBuffer(pAE) == FALSE))) {
+        pAE->DriverState.HmbSet = TRUE;
+        NVMeCallArbiter(pAE);
+        return (TRUE);
+    }
+
+    PhysAddr = NVMeGetPhysAddr(pAE, pHmb->pDescList);
+    if (PhysAddr.QuadPart == 0)
+        return (FALSE);
+
+    /* Zero out the extension first */
+    memset((PVOID)pNVMeSrbExt, 0, sizeof(NVME_SRB_EXTENSION));
+
+    /* Populate SRB_EXTENSION fields */
+    pNVMeSrbExt->pNvmeDevExt = pAE;
+    pNVMeSrbExt->pNvmeCompletionRoutine = NVMeInitCallback;
+
+    /* Populate submission entry fields */
+    pSetFeatures->CDW0.OPC = ADMIN_SET_FEATURES;
+    pSetFeaturesCDW10 = (PADMIN_SET_FEATURES_COMMAND_DW10) &pSetFeatures->CDW10;
+    pSetFeaturesCDW11 = (PADMIN_SET_FEATURES_COMMAND_HMB_DW11)
+        &pSetFeatures->CDW11;
+
+    pSetFeaturesCDW10->FID = HOST_MEMORY_BUFFER;
+    pSetFeaturesCDW11->EHM = 1;
+    pSetFeaturesCDW11->MR = (pHmb->Returnable == TRUE) ? 1 : 0;
+
+    /* Size in memory pages, descriptor list address and entry count */
+    pSetFeatures->CDW12 = (ULONG)(pHmb->TotalSize / PAGE_SIZE);
+    pSetFeatures->CDW13 = PhysAddr.LowPart;
+    pSetFeatures->CDW14 = PhysAddr.HighPart;
+    pSetFeatures->CDW15 = pHmb->NumChunks;
+
+    /* Now issue the command via Admin Doorbell register */
+    return ProcessIo(pAE, pNVMeSrbExt, NVME_QUEUE_TYPE_ADMIN, FALSE);
+} /* NVMeSetHostMemBuffer */
+
+/*******************************************************************************
+ * NVMeDisableHostMemBuffer
+ *
+ * @brief NVMeDisableHostMemBuffer gets called before the controller is
+ *        powered down or shut down so it stops using host memory and can
+ *        flush what it needs to its own media first. The Set Features
+ *        command is polled for since interrupts can't be relied on here,
+ *        under the lock the MSIX0 DPC takes for the admin queue, and for at
+ *        most HMB_DISABLE_TIMEOUT_us since the reset that follows disables
+ *        the buffer anyway.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ *
+ * @return BOOLEAN
+ *     TRUE - HMB is not in use by the controller anymore
+ *     FALSE - If anything goes wrong, a controller reset still disables it
+ ******************************************************************************/
+BOOLEAN NVMeDisableHostMemBuffer(
+    PNVME_DEVICE_EXTENSION pAE
+)
+{
+    PNVME_SRB_EXTENSION pNVMeSrbExt =
+        (PNVME_SRB_EXTENSION)pAE->DriverState.pSrbExt;
+    PNVMe_COMMAND pSetFeatures = (PNVMe_COMMAND)(&pNVMeSrbExt->nvmeSqeUnit);
+    PADMIN_SET_FEATURES_COMMAND_DW10 pSetFeaturesCDW10 = NULL;
+    PMSI_MESSAGE_TBL pMMT = pAE->ResMapTbl.pMsiMsgTbl;
+    STOR_LOCK_HANDLE DpcLockhandle = { 0 };
+    PSTOR_DPC pDpc = NULL;
+    ULONG PollMax = HMB_DISABLE_TIMEOUT_us / STATE_POLL_us;
+    ULONG PollCount;
+
+    if (pAE->HmbInfo.Enabled == FALSE)
+        return (TRUE);
+
+    /*
+     * The admin queue is drained by the DPC NVMeIsrMsix queues for MSIX0,
+     * under its DPC lock. With MultipleCoresToSingleQueueFlag set it takes
+     * the StartIo lock instead, which the power and shutdown SRBs already
+     * hold in StartIo.
+     */
+    if ((pAE->MultipleCoresToSingleQueueFlag == FALSE) &&
+        (pAE->pDpcArray != NULL) && (pMMT != NULL))
+        pDpc = (PSTOR_DPC)pAE->pDpcArray +
+               ((pMMT->Shared == TRUE) ? 0 : pMMT->CplQueueNum);
+
+    /* Zero out the extension first */
+    memset((PVOID)pNVMeSrbExt, 0, sizeof(NVME_SRB_EXTENSION));
+
+    /* Populate SRB_EXTENSION fields */
+    pNVMeSrbExt->pNvmeDevExt = pAE;
+    pNVMeSrbExt->pNvmeCompletionRoutine = NVMeHmbDisableCallback;
+
+    /* Populate submission entry fields, EHM left clear */
+    pSetFeatures->CDW0.OPC = ADMIN_SET_FEATURES;
+    pSetFeaturesCDW10 = (PADMIN_SET_FEATURES_COMMAND_DW10) &pSetFeatures->CDW10;
+    pSetFeaturesCDW10->FID = HOST_MEMORY_BUFFER;
+
+    pAE->HmbInfo.DisablePending = TRUE;
+    if (ProcessIo(pAE, pNVMeSrbExt, NVME_QUEUE_TYPE_ADMIN, FALSE) == FALSE) {
+        pAE->HmbInfo.DisablePending = FALSE;
+        return (FALSE);
+    }
+
+    for (PollCount = 0;
+         (PollCount < PollMax) && (pAE->HmbInfo.DisablePending == TRUE);
+         PollCount++) {
+        NVMeStallExecution(pAE, STATE_POLL_us);
+
+        if (pDpc != NULL)
+            StorPortAcquireSpinLock(pAE, DpcLock, pDpc, &DpcLockhandle);
+
+        IoCompletionRoutine(NULL, pAE, (PVOID)0, 0);
+
+        if (pDpc != NULL)
+            StorPortReleaseSpinLock(pAE, &DpcLockhandle);
+    }
+
+    if (pAE->HmbInfo.Enabled == TRUE) {
+        StorPortDebugPrint(ERROR,
+            "NVMeDisableHostMemBuffer: <Error> HMB still enabled\n");
+        return (FALSE);
+    }
+
+    return (TRUE);
+} /* NVMeDisableHostMemBuffer */
+
+/*******************************************************************************
+ * NVMeHmbDisableCallback
+ *
+ * @brief NVMeHmbDisableCallback is the completion routine of the Set Features
+ *        command issued by NVMeDisableHostMemBuffer.
+ *
+ * @param pNVMeDevExt - Pointer to hardware device extension.
+ * @param pSrbExtension - Pointer to the completion entry
+ *
+ * @return BOOLEAN
+ *     TRUE - Always, there is no host request to complete
+ ******************************************************************************/
+BOOLEAN NVMeHmbDisableCallback(
+    PVOID pNVMeDevExt,
+    PVOID pSrbExtension
+)
+{
+    PNVME_DEVICE_EXTENSION pAE = (PNVME_DEVICE_EXTENSION)pNVMeDevExt;
+    PNVME_SRB_EXTENSION pSrbExt = (PNVME_SRB_EXTENSION)pSrbExtension;
+    PNVMe_COMPLETION_QUEUE_ENTRY pCplEntry = pSrbExt->pCplEntry;
+
+    if (pCplEntry->DW3.SF.SC == 0)
+        pAE->HmbInfo.Enabled = FALSE;
+
+    pAE->HmbInfo.DisablePending = FALSE;
+
+    return (TRUE);
+} /* NVMeHmbDisableCallback */
+
+/*******************************************************************************
+ * NVMeSetDoorbellBuffer
+ *
+ * @brief NVMeSetDoorbellBuffer gets called to issue the Doorbell Buffer Config
+ *        command on controllers that support it, typically emulated ones
+ *        where every doorbell register write traps to the hypervisor. The
+ *        shadow doorbell and EventIdx pages are allocated the first time and
+ *        cleared before every hand over, they must be given to the controller
+ *        before the IO queues get created.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ *
+ * @return BOOLEAN
+ *     TRUE - If the issued command completed without any errors
+ *     FALSE - If anything goes wrong
+ ******************************************************************************/
+BOOLEAN NVMeSetDoorbellBuffer(
+    PNVME_DEVICE_EXTENSION pAE
+)
+{
+    PNVME_SRB_EXTENSION pNVMeSrbExt =
+        (PNVME_SRB_EXTENSION)pAE->DriverState.pSrbExt;
+    PNVMe_COMMAND pDbbufConfig = (PNVMe_COMMAND)(&pNVMeSrbExt->nvmeSqeUnit);
+    PDBBUF_INFO pDbbuf = &pAE->DbbufInfo;
+
+    if ((pAE->ntldrDump == TRUE) ||
+        (pAE->controllerIdentifyData.OACS.SupportsDoorbellBufferConfig == 0)) {
+        pAE->DriverState.DbbufSet = TRUE;
+        NVMeCallArbiter(pAE);
+        return (TRUE);
+    }
+
+    if (pDbbuf->pShadowDbl == NULL)
+        pDbbuf->pShadowDbl = NVMeAllocateMem(pAE, PAGE_SIZE, 0);
+
+    if (pDbbuf->pEventIdx == NULL)
+        pDbbuf->pEventIdx = NVMeAllocateMem(pAE, PAGE_SIZE, 0);
+
+    /* Shadow doorbells are an optimization, go on without them */
+    if ((pDbbuf->pShadowDbl == NULL) || (pDbbuf->pEventIdx == NULL)) {
+        NVMeFreeDoorbellBuffer(pAE);
+        pAE->DriverState.DbbufSet = TRUE;
+        NVMeCallArbiter(pAE);
+        return (TRUE);
+    }
+
+    memset((PVOID)pDbbuf->pShadowDbl, 0, PAGE_SIZE);
+    memset((PVOID)pDbbuf->pEventIdx, 0, PAGE_SIZE);
+
+    /* Zero out the extension first */
+    memset((PVOID)pNVMeSrbExt, 0, sizeof(NVME_SRB_EXTENSION));
+
+    /* Populate SRB_EXTENSION fields */
+    pNVMeSrbExt->pNvmeDevExt = pAE;
+    pNVMeSrbExt->pNvmeCompletionRoutine = NVMeInitCallback;
+
+    /* Populate submission entry fields */
+    pDbbufConfig->CDW0.OPC = ADMIN_DOORBELL_BUFFER_CONFIG;
+    pDbbufConfig->PRP1 = NVMeGetPhysAddr(pAE, pDbbuf->pShadowDbl).QuadPart;
+    pDbbufConfig->PRP2 = NVMeGetPhysAddr(pAE, pDbbuf->pEventIdx).QuadPart;
+
+    /* Now issue the command via Admin Doorbell register */
+    return ProcessIo(pAE, pNVMeSrbExt, NVME_QUEUE_TYPE_ADMIN, FALSE);
+} /* NVMeSetDoorbellBuffer */
+
+/*******************************************************************************
+ * NVMeFreeDoorbellBuffer
+ *
+ * @brief NVMeFreeDoorbellBuffer gets called to release the shadow doorbell and
+ *        EventIdx pages once no queue refers to them anymore.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ *
+ * @return VOID
+ ******************************************************************************/
+VOID NVMeFreeDoorbellBuffer(
+    PNVME_DEVICE_EXTENSION pAE
+)
+{
+    PDBBUF_INFO pDbbuf = &pAE->DbbufInfo;
+
+    if (pDbbuf->pShadowDbl != NULL)
+        StorPortFreeContiguousMemorySpecifyCache((PVOID)pAE,
+                                                 pDbbuf->pShadowDbl,
+                                                 PAGE_SIZE,
+                                                 MmCached);
+
+    if (pDbbuf->pEventIdx != NULL)
+        StorPortFreeContiguousMemorySpecifyCache((PVOID)pAE,
+                                                 pDbbuf->pEventIdx,
+                                                 PAGE_SIZE,
+                                                 MmCached);
+
+    memset(pDbbuf, 0, sizeof(DBBUF_INFO));
+} /* NVMeFreeDoorbellBuffer */
+
+/*******************************************************************************
+ * NVMeAllocQueueFromAdapter
+ *
+ * @brief NVMeAllocQueueFromAdapter gets called to allocate
+ *        submission/completion queues from the adapter via Set Feature command
+ *        with Feature ID#7. This routine requests the same number of
+ *        submission/completion queues as the number of current active cores in
+ *        the system.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ *
+ * @return BOOLEAN
+ *     TRUE - If the issued command completed without any errors
+ *     FALSE - If anything goes wrong
+ ******************************************************************************/
+BOOLEAN NVMeAllocQueueFromAdapter(
+    PNVME_DEVICE_EXTENSION pAE
+)
+{
+    PNVME_SRB_EXTENSION pNVMeSrbExt =
+        (PNVME_SRB_EXTENSION)pAE->DriverState.pSrbExt;
+    PNVMe_COMMAND pSetFeatures = (PNVMe_COMMAND)(&pNVMeSrbExt->nvmeSqeUnit);
+    PADMIN_SET_FEATURES_COMMAND_DW10 pSetFeaturesCDW10 = NULL;
+    PADMIN_SET_FEATURES_COMMAND_NUMBER_OF_QUEUES_DW11 pSetFeaturesCDW11 = NULL;
+
+    /* Zero out the extension first */
+    memset((PVOID)pNVMeSrbExt, 0, sizeof(NVME_SRB_EXTENSION));
+
+    /* Populate SRB_EXTENSION fields */
+    pNVMeSrbExt->pNvmeDevExt = pAE;
+    pNVMeSrbExt->pNvmeCompletionRoutine = NVMeInitCallback;
+
+    /* Populate submission entry fields */
+    pSetFeatures->CDW0.OPC = ADMIN_SET_FEATURES;
+    pSetFeaturesCDW10 = (PADMIN_SET_FEATURES_COMMAND_DW10) &pSetFeatures->CDW10;
+    pSetFeaturesCDW11 = (PADMIN_SET_FEATURES_COMMAND_NUMBER_OF_QUEUES_DW11)
+        &pSetFeatures->CDW11;
+    pSetFeaturesCDW10->FID = NUMBER_OF_QUEUES;
+
+    /* Set up NCSQR and NSQR, which are 0-based. */
+    if (pAE->ntldrDump == TRUE) {
+        /* In crashdump/hibernation case, only 1 pair of IO queue needed */
+        pSetFeaturesCDW11->NCQR = 0;
+        pSetFeaturesCDW11->NSQR = 0;
+    } else {
+        /*
+         * Number of cores, number of MSI granted, and number of queues
+         * supported by the controller are the variables to determine how
+         * many queues to create.
+         */
+        pSetFeaturesCDW11->NCQR = min(pAE->ResMapTbl.NumActiveCores,
+                                      pAE->ResMapTbl.NumMsiMsgGranted) - 1;
+        pSetFeaturesCDW11->NSQR = min(pAE->ResMapTbl.NumActiveCores,
+                                      pAE->ResMapTbl.NumMsiMsgGranted) - 1;
+
+        /* With WRR every CQ takes one SQ per priority class */
+        if (pAE->WrrEnabled == TRUE)
+            pSetFeaturesCDW11->NSQR = ((pSetFeaturesCDW11->NSQR + 1) *
+                                       NVME_SQ_CLASSES) - 1;
+    }
+
+    /* Now issue the command via Admin Doorbell register */
+    return ProcessIo(pAE, pNVMeSrbExt, NVME_QUEUE_TYPE_ADMIN, FALSE);
+} /* NVMeAllocQueueFromAdapter */
+
+/*******************************************************************************
+ * NVMeAccessLbaRangeEntry
+ *
+ * @brief NVMeAccessLbaRangeEntry gets called to query/update the first LBA
+ *        Range entry of a given namespace. The procedure is described below:
+ *
+ *        Depending on the value of ConfigLbaRangeNeeded, if TRUE, it issues
+ *        Set Features command. Otherwise, it issues Get Features commands.
+ *
+ *        When issuing Set Features, the namespace has:
+ *          Type = Filesystem,
+ *          ReadOnly = FALSE,
+ *          Visible = TRUE.
+ *
+ *        When command completes, NVMeSetFeaturesCompletion is called to exam
+ *        the LBA Range Type entries and wrap up the access.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ *
+ * @return BOOLEAN
+ *     TRUE - If the issued command completed without any errors
+ *     FALSE - If anything goes wrong
+ ******************************************************************************/
+BOOLEAN NVMeAccessLbaRangeEntry(
+    PNVME_DEVICE_EXTENSION pAE
+)
+{
+    PNVME_SRB_EXTENSION pNVMeSrbExt =
+        (PNVME_SRB_EXTENSION)pAE->DriverState.pSrbExt;
+    PNVMe_COMMAND pSetFeatures = (PNVMe_COMMAND)(&pNVMeSrbExt->nvmeSqeUnit);
+    PADMIN_SET_FEATURES_COMMAND_DW10 pSetFeaturesCDW10 = NULL;
+    PADMIN_SET_FEATURES_COMMAND_LBA_RANGE_TYPE_ENTRY pLbaRangeEntry = NULL;
+    ULONG NSID = pAE->DriverState.CurrentNsid;
+    BOOLEAN Query = pAE->DriverState.ConfigLbaRangeNeeded;
+
+    /* 
+     * if not capable of namespace mgmt...
+     * Fail here if Namespace ID is 0 or out of range 
+     */
+    if ((!pAE->controllerIdentifyData.OACS.SupportsNamespaceMgmtAndAttachment) &&
+		(NSID == 0 || NSID > pAE->DriverState.NumKnownNamespaces))
+        return FALSE;
+
+    /* Zero out the extension first */
+    memset((PVOID)pNVMeSrbExt, 0, sizeof(NVME_SRB_EXTENSION));
+
+    /* Populate SRB_EXTENSION fields */
+    pNVMeSrbExt->pNvmeDevExt = pAE;
+    pNVMeSrbExt->pNvmeCompletionRoutine = NVMeInitCallback;
+
+    /* Populate submission entry fields */
+    pSetFeatures->NSID = NSID;
+
+    /*
+     * Prepare the buffer for transferring LBA Range entries
+     * Need to zero the buffer out first when retrieving the entries
+     */
+    if (pAE->DriverState.ConfigLbaRangeNeeded == TRUE) {
+        pSetFeatures->CDW0.OPC = ADMIN_SET_FEATURES;
+
+        /* Prepare new first LBA Range entry */
+        pLbaRangeEntry = (PADMIN_SET_FEATURES_COMMAND_LBA_RANGE_TYPE_ENTRY)
+            pAE->DriverState.pDataBuffer;
+        pLbaRangeEntry->Type = LBA_TYPE_FILESYSTEM;
+        pLbaRangeEntry->Attributes.Overwriteable = 1;
+        pLbaRangeEntry->Attributes.Hidden = 0;
+        pLbaRangeEntry->NLB = pAE->pLunExtensionTable[NSID-1]->identifyData.NSZE;
+    } else {
+        pSetFeatures->CDW0.OPC = ADMIN_GET_FEATURES;
+        memset(pAE->DriverState.pDataBuffer, 0, PAGE_SIZE);
+    }
+
+    /* Prepare PRP entries, need at least one PRP entry */
+    if (NVMePreparePRPs(pAE,
+                        pNVMeSrbExt,
+                        pAE->DriverState.pDataBuffer,
+                        sizeof(ADMIN_SET_FEATURES_LBA_COMMAND_RANGE_TYPE_ENTRY))
+                        == FALSE) {
+        return (FALSE);
+    }
+
+    pSetFeaturesCDW10 = (PADMIN_SET_FEATURES_COMMAND_DW10) &pSetFeatures->CDW10;
+    pSetFeaturesCDW10->FID = LBA_RANGE_TYPE;
+
+    /* Now issue the command via Admin Doorbell register */
+    return ProcessIo(pAE, pNVMeSrbExt, NVME_QUEUE_TYPE_ADMIN, FALSE);
+} /* NVMeAccessLbaRangeEntry */
+
+/*******************************************************************************
+ * NVMeGetIdentifyStructures
+ *
+ * @brief NVMeGetIdentifyStructures gets called to retrieve Identify structures,
+ *        including the Controller and Namespace information depending on
+ *        NamespaceID.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ * @param NamespaceID - Specify either Controller or Namespace structure to
+ *                      retrieve
+ *
+ * @return BOOLEAN
+ *     TRUE - If the issued command completed without any errors
+ *     FALSE - If anything goes wrong
+ ******************************************************************************/
+BOOLEAN NVMeGetIdentifyStructures(
+    PNVME_DEVICE_EXTENSION pAE,
+    ULONG NamespaceID,
+    USHORT CNS
+)
+{
+    PNVME_SRB_EXTENSION pNVMeSrbExt =
+        (PNVME_SRB_EXTENSION)pAE->DriverState.pSrbExt;
+    PNVMe_COMMAND pIdentify = NULL;
+    PADMIN_IDENTIFY_CONTROLLER pIdenCtrl = &pAE->controllerIdentifyData;
+    PADMIN_IDENTIFY_COMMAND_DW10 pIdentifyCDW10 = NULL;
+    ULONG lunId;
+
+    /* Zero-out the entire SRB_EXTENSION */
+    memset((PVOID)pNVMeSrbExt, 0, sizeof(NVME_SRB_EXTENSION));
+
+    /* Populate SRB_EXTENSION fields */
+    pNVMeSrbExt->pNvmeDevExt = pAE;
+    pNVMeSrbExt->pNvmeCompletionRoutine = NVMeInitCallback;
+
+    /* Populate submission entry fields */
+    pIdentify = &pNVMeSrbExt->nvmeSqeUnit;
+    pIdentify->CDW0.OPC = ADMIN_IDENTIFY;
+
+    pIdentifyCDW10 = (PADMIN_IDENTIFY_COMMAND_DW10) &pIdentify->CDW10;
+    /* Set the type of identify command */
+    pIdentifyCDW10->CNS = CNS;
+
+    switch (CNS) {
+    case IDENTIFY_CNTLR:
+        /* Prepare PRP entries, need at least one PRP entry */
+        if (NVMePreparePRPs(pAE,
                             pNVMeSrbExt,
                             (PVOID)pAE->DriverState.pDataBuffer,
                             sizeof(ADMIN_IDENTIFY_CONTROLLER)) == FALSE) {
@@ -2583,6 +3998,9 @@ BOOLEAN NVMeGetIdentifyStructures(
         break;
     case LIST_ATTACHED_NAMESPACES:
     case LIST_EXISTING_NAMESPACES:
+        /* The list starts after NamespaceID, 0 for the first page */
+        pIdentify->NSID = NamespaceID;
+
         /* Prepare PRP entries, need at least one PRP entry */
         if (NVMePreparePRPs(pAE,
                             pNVMeSrbExt,
@@ -2610,6 +4028,8 @@ BOOLEAN NVMeGetIdentifyStructures(
  *
  * @param pAE - Pointer to hardware device extension.
  * @param QueueID - Which completion queue to create.
+ * @param pSrbExt - SRB extension to issue it with, NULL for the state
+ *                  machine's own
  *
  * @return BOOLEAN
  *     TRUE - If the issued commands completed without any errors
@@ -2617,10 +4037,11 @@ BOOLEAN NVMeGetIdentifyStructures(
  ******************************************************************************/
 BOOLEAN NVMeCreateCplQueue(
     PNVME_DEVICE_EXTENSION pAE,
-    USHORT QueueID
+    USHORT QueueID,
+    PNVME_SRB_EXTENSION pSrbExt
 )
 {
-    PNVME_SRB_EXTENSION pNVMeSrbExt =
+    PNVME_SRB_EXTENSION pNVMeSrbExt = (pSrbExt != NULL) ? pSrbExt :
         (PNVME_SRB_EXTENSION)pAE->DriverState.pSrbExt;
     PQUEUE_INFO pQI = &pAE->QueueInfo;
     PNVMe_COMMAND pCreateCpl = NULL;
@@ -2648,7 +4069,7 @@ BOOLEAN NVMeCreateCplQueue(
         pCQI = pQI->pCplQueueInfo + QueueID;
         pCreateCpl->PRP1 = pCQI->CplQStart.QuadPart;
         pCreateCplCDW10->QID = QueueID;
-        pCreateCplCDW10->QSIZE = pQI->NumIoQEntriesAllocated - 1;
+        pCreateCplCDW10->QSIZE = (USHORT)(pCQI->CplQEntries - 1);
         pCreateCplCDW11->PC = 1;
         pCreateCplCDW11->IEN = 1;
         pCreateCplCDW11->IV = pCQI->MsiMsgID;
@@ -2671,6 +4092,8 @@ BOOLEAN NVMeCreateCplQueue(
  *
  * @param pAE - Pointer to hardware device extension.
  * @param QueueID - Which submission queue to create.
+ * @param pSrbExt - SRB extension to issue it with, NULL for the state
+ *                  machine's own
  *
  * @return BOOLEAN
  *     TRUE - If the issued commands completed without any errors
@@ -2678,10 +4101,11 @@ BOOLEAN NVMeCreateCplQueue(
  ******************************************************************************/
 BOOLEAN NVMeCreateSubQueue(
     PNVME_DEVICE_EXTENSION pAE,
-    USHORT QueueID
+    USHORT QueueID,
+    PNVME_SRB_EXTENSION pSrbExt
 )
 {
-    PNVME_SRB_EXTENSION pNVMeSrbExt =
+    PNVME_SRB_EXTENSION pNVMeSrbExt = (pSrbExt != NULL) ? pSrbExt :
         (PNVME_SRB_EXTENSION)pAE->DriverState.pSrbExt;
     PQUEUE_INFO pQI = &pAE->QueueInfo;
     PNVMe_COMMAND pCreateSub = NULL;
@@ -2689,7 +4113,7 @@ BOOLEAN NVMeCreateSubQueue(
     PADMIN_CREATE_IO_SUBMISSION_QUEUE_DW11 pCreateSubCDW11 = NULL;
     PSUB_QUEUE_INFO pSQI = NULL;
 
-    if (QueueID != 0 && QueueID <= pQI->NumCplIoQAllocated) {
+    if (QueueID != 0 && QueueID <= pQI->NumSubIoQAllocated) {
         /* Zero-out the entire SRB_EXTENSION */
         memset((PVOID)pNVMeSrbExt, 0, sizeof(NVME_SRB_EXTENSION));
 
@@ -2709,10 +4133,26 @@ BOOLEAN NVMeCreateSubQueue(
         pSQI = pQI->pSubQueueInfo + QueueID;
         pCreateSub->PRP1 = pSQI->SubQStart.QuadPart;
         pCreateSubCDW10->QID = QueueID;
-        pCreateSubCDW10->QSIZE = pQI->NumIoQEntriesAllocated - 1;
+        pCreateSubCDW10->QSIZE = (USHORT)(pSQI->SubQEntries - 1);
         pCreateSubCDW11->CQID = pSQI->CplQueueID;
         pCreateSubCDW11->PC = 1;
 
+        /* QPRIO is ignored by the controller unless WRR is selected */
+        switch (pSQI->PriorityClass) {
+            case NVME_SQ_CLASS_URGENT:
+                pCreateSubCDW11->QPRIO = QPRIO_URGENT;
+            break;
+            case NVME_SQ_CLASS_HIGH:
+                pCreateSubCDW11->QPRIO = QPRIO_HIGH;
+            break;
+            case NVME_SQ_CLASS_LOW:
+                pCreateSubCDW11->QPRIO = QPRIO_LOW;
+            break;
+            default:
+                pCreateSubCDW11->QPRIO = QPRIO_MEDIUM;
+            break;
+        }
+
         /* Now issue the command via Admin Doorbell register */
         return ProcessIo(pAE, pNVMeSrbExt, NVME_QUEUE_TYPE_ADMIN, FALSE);
     }
@@ -2845,6 +4285,9 @@ BOOLEAN NVMeNormalShutdown(
         return FALSE;
     }
 
+    /* Let the controller flush what it keeps in host memory, reset covers failure */
+    NVMeDisableHostMemBuffer(pAE);
+
     /* Delete all queues */
     if (NVMeResetAdapter(pAE) != TRUE) {
         return (FALSE);
@@ -2897,6 +4340,97 @@ BOOLEAN NVMeNormalShutdown(
 #endif /* DBG */
 } /* NVMeNormalShutdown */
 
+/*******************************************************************************
+ * NVMeAllocLunTable
+ *
+ * @brief NVMeAllocLunTable gets called to allocate the LUN extension table
+ *        for NumEntries namespaces and the NSID hash that indexes it. The
+ *        extensions come LUN_EXT_CHUNK at a time so a large table doesn't need
+ *        one large physically contiguous run; NumLunExtensions only counts
+ *        chunks that made it, which is what NVMeFreeBuffers goes by.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ * @param NumEntries - Namespaces to track, rounded up to whole chunks
+ *
+ * @return BOOLEAN
+ *     TRUE - If the whole table is allocated
+ *     FALSE - If anything goes wrong
+ ******************************************************************************/
+BOOLEAN NVMeAllocLunTable(
+    PNVME_DEVICE_EXTENSION pAE,
+    ULONG NumEntries
+)
+{
+    PNVME_LUN_EXTENSION pChunk = NULL;
+    ULONG NumHeads = 1;
+    ULONG Lun;
+    ULONG i;
+
+    NumEntries = ((NumEntries + LUN_EXT_CHUNK - 1) / LUN_EXT_CHUNK) *
+                 LUN_EXT_CHUNK;
+
+    pAE->NumLunExtensions = 0;
+    pAE->pLunExtensionTable = (PNVME_LUN_EXTENSION *)
+        NVMeAllocatePool(pAE, sizeof(PNVME_LUN_EXTENSION) * NumEntries);
+    if (pAE->pLunExtensionTable == NULL)
+        return (FALSE);
+
+    for (Lun = 0; Lun < NumEntries; Lun += LUN_EXT_CHUNK) {
+        pChunk = (PNVME_LUN_EXTENSION)NVMeAllocateMem(pAE,
+                     sizeof(NVME_LUN_EXTENSION) * LUN_EXT_CHUNK, 0);
+        if (pChunk == NULL)
+            return (FALSE);
+
+        for (i = 0; i < LUN_EXT_CHUNK; i++)
+            pAE->pLunExtensionTable[Lun + i] = pChunk + i;
+
+        pAE->NumLunExtensions += LUN_EXT_CHUNK;
+    }
+
+    /* One chain per namespace on average, rounded up to a power of 2 */
+    pAE->NsHashShift = 32;
+    while (NumHeads < NumEntries) {
+        NumHeads <<= 1;
+        pAE->NsHashShift--;
+    }
+
+    pAE->pNsHashHeads = (PULONG)NVMeAllocatePool(pAE, sizeof(ULONG) * NumHeads);
+    if (pAE->pNsHashHeads == NULL)
+        return (FALSE);
+
+    NVMeResetLunTable(pAE);
+
+    return (TRUE);
+} /* NVMeAllocLunTable */
+
+/*******************************************************************************
+ * NVMeResetLunTable
+ *
+ * @brief NVMeResetLunTable gets called to forget every namespace, zeroing the
+ *        LUN extensions and emptying the NSID hash.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ *
+ * @return VOID
+ ******************************************************************************/
+VOID NVMeResetLunTable(
+    PNVME_DEVICE_EXTENSION pAE
+)
+{
+    PNVME_LUN_EXTENSION pLunExt = NULL;
+    ULONG NumHeads = (ULONG)1 << (32 - pAE->NsHashShift);
+    ULONG Lun;
+
+    for (Lun = 0; Lun < pAE->NumLunExtensions; Lun++) {
+        pLunExt = pAE->pLunExtensionTable[Lun];
+        memset((PVOID)pLunExt, 0, sizeof(NVME_LUN_EXTENSION));
+        pLunExt->NsHashNext = INVALID_LUN_EXTN;
+    }
+
+    for (Lun = 0; Lun < NumHeads; Lun++)
+        pAE->pNsHashHeads[Lun] = INVALID_LUN_EXTN;
+} /* NVMeResetLunTable */
+
 /*******************************************************************************
  * NVMeFreeBuffers
  *
@@ -2912,6 +4446,7 @@ VOID NVMeFreeBuffers (
 )
 {
     USHORT QueueID;
+    ULONG Lun;
     PQUEUE_INFO pQI = &pAE->QueueInfo;
     PRES_MAPPING_TBL pRMT = &pAE->ResMapTbl;
     PSUB_QUEUE_INFO pSQI = NULL;
@@ -2923,51 +4458,46 @@ VOID NVMeFreeBuffers (
                                                  PAGE_SIZE, MmCached);
         pAE->DriverState.pDataBuffer = NULL;
     }
-    /* Free the NVME_LUN_EXTENSION memory allocated by driver */
-    if (pAE->pLunExtensionTable[0] != NULL) {
-        StorPortFreeContiguousMemorySpecifyCache((PVOID)pAE,
-                                                 pAE->pLunExtensionTable[0],
-                                                 pAE->LunExtSize,
-                                                 MmCached);
-        pAE->pLunExtensionTable[0] = NULL;
+    /* Free the NVME_LUN_EXTENSION chunks allocated by driver */
+    if (pAE->pLunExtensionTable != NULL) {
+        for (Lun = 0; Lun < pAE->NumLunExtensions; Lun += LUN_EXT_CHUNK) {
+            StorPortFreeContiguousMemorySpecifyCache((PVOID)pAE,
+                                   pAE->pLunExtensionTable[Lun],
+                                   sizeof(NVME_LUN_EXTENSION) * LUN_EXT_CHUNK,
+                                   MmCached);
+        }
+        pAE->NumLunExtensions = 0;
     }
 
     /* Free the allocated queue entry and PRP list buffers */
     if (pQI->pSubQueueInfo != NULL) {
-        for (QueueID = 0; QueueID <= pRMT->NumActiveCores; QueueID++) {
+        for (QueueID = 0; QueueID <= NVME_MAX_SUB_IO_QUEUES(pAE); QueueID++) {
             pSQI = pQI->pSubQueueInfo + QueueID;
-            if (pSQI->pQueueAlloc != NULL) {
-                StorPortFreeContiguousMemorySpecifyCache((PVOID)pAE,
-                                                         pSQI->pQueueAlloc,
-                                                         pSQI->QueueAllocSize,
-                                                         MmCached);
-                pSQI->pQueueAlloc = NULL;
-            }
-
-            if (pSQI->pPRPListAlloc != NULL) {
-                StorPortFreeContiguousMemorySpecifyCache((PVOID)pAE,
-                                                         pSQI->pPRPListAlloc,
-                                                         pSQI->PRPListAllocSize,
-                                                         MmCached);
-                pSQI->pPRPListAlloc = NULL;
-            }
-
-
-#ifdef DUMB_DRIVER
-            if (pSQI->pDblBuffAlloc != NULL)
-                StorPortFreeContiguousMemorySpecifyCache((PVOID)pAE,
-                                                         pSQI->pDblBuffAlloc,
-                                                         pSQI->dblBuffSz,
-                                                         MmCached);
-            if (pSQI->pDblBuffListAlloc != NULL)
-                StorPortFreeContiguousMemorySpecifyCache((PVOID)pAE,
-                                                         pSQI->pDblBuffListAlloc,
-                                                         pSQI->dblBuffListSz,
-                                                         MmCached);
-#endif /* DUMB_DRIVER */
+            NVMeFreeQueueMem(pAE, pSQI);
         }
     }
 
+    /*
+     * Init may have failed with the Host Memory Buffer or shadow doorbells
+     * handed over, the controller is stopped first. If it won't stop they're
+     * leaked, they're never given back to the OS while it may still use them.
+     */
+    if ((pAE->HmbInfo.NumChunks == 0) &&
+        (pAE->DbbufInfo.pShadowDbl == NULL) &&
+        (pAE->DbbufInfo.pEventIdx == NULL)) {
+        NVMeFreeHostMemBuffer(pAE);
+    } else if (NVMeQuiesceController(pAE) == TRUE) {
+        NVMeFreeHostMemBuffer(pAE);
+        NVMeFreeDoorbellBuffer(pAE);
+    } else {
+        StorPortDebugPrint(ERROR,
+            "NVMeFreeBuffers: <Error> leaking %d KB of HMB and shadow doorbells\n",
+            (ULONG)(pAE->HmbInfo.TotalSize / 1024));
+    }
+
+    /* No queue lives in the Controller Memory Buffer anymore */
+    pAE->CmbInfo.Used = 0;
+
     /* Lastly, free the allocated non-contiguous buffers */
     NVMeFreeNonContiguousBuffers(pAE);
 } /* NVMeFreeBuffers */
@@ -2996,6 +4526,12 @@ VOID NVMeFreeNonContiguousBuffers (
         pAE->DriverState.pSrbExt = NULL;
     }
 
+    /* Free the fast resume burst's SRB extensions */
+    if (pAE->DriverState.pBurstSrbExt != NULL) {
+        StorPortFreePool((PVOID)pAE, pAE->DriverState.pBurstSrbExt);
+        pAE->DriverState.pBurstSrbExt = NULL;
+    }
+
     /* Free the resource mapping tables if allocated */
     if (pRMT->pMsiMsgTbl != NULL) {
         StorPortFreePool((PVOID)pAE, pRMT->pMsiMsgTbl);
@@ -3040,27 +4576,220 @@ VOID NVMeFreeNonContiguousBuffers (
 		pAE->pArrGrpAff = NULL;
 	}
 
+    /* Free the LUN extension table and its NSID hash */
+    if (pAE->pLunExtensionTable != NULL) {
+        StorPortFreePool((PVOID)pAE, pAE->pLunExtensionTable);
+        pAE->pLunExtensionTable = NULL;
+    }
+
+    if (pAE->pNsHashHeads != NULL) {
+        StorPortFreePool((PVOID)pAE, pAE->pNsHashHeads);
+        pAE->pNsHashHeads = NULL;
+    }
+
+    /*
+     * Free the namespace QoS table. Requests still deferred on it are owed a
+     * completion and the timer must not fire on a freed table.
+     */
+    if (pAE->pQosInfo != NULL) {
+#if (NTDDI_VERSION > NTDDI_WIN7)
+        if ((pAE->QosTimerArmed == TRUE) && (pAE->QosTimerhandle != NULL))
+            StorPortRequestTimer(pAE, pAE->QosTimerhandle, NVMeQosTimer,
+                                 NULL, 0, 0);
+#endif
+        pAE->QosTimerArmed = FALSE;
+        NVMeQosFlush(pAE, TRUE, SRB_STATUS_BUS_RESET);
+
+        StorPortFreePool((PVOID)pAE, pAE->pQosInfo);
+        pAE->pQosInfo = NULL;
+    }
+
+    /* Free the per queue completion counters */
+    if (pAE->pQosCompleted != NULL) {
+        StorPortFreePool((PVOID)pAE, pAE->pQosCompleted);
+        pAE->pQosCompleted = NULL;
+        pAE->NumQosQueues = 0;
+    }
+
+    /* Free the latency histograms */
+    if (pAE->pLatencyHist != NULL) {
+        StorPortFreePool((PVOID)pAE, pAE->pLatencyHist);
+        pAE->pLatencyHist = NULL;
+        pAE->NumLatencyHist = 0;
+    }
+
+    /* Free the SRB trace */
+    if (pAE->pSrbTrace != NULL) {
+        StorPortFreePool((PVOID)pAE, pAE->pSrbTrace);
+        pAE->pSrbTrace = NULL;
+        pAE->SrbTraceEntries = 0;
+    }
+
+    /* Free the firmware download commands */
+    if (pAE->FwDownloadInfo.pSrbExt != NULL) {
+        StorPortFreePool((PVOID)pAE, pAE->FwDownloadInfo.pSrbExt);
+        pAE->FwDownloadInfo.pSrbExt = NULL;
+    }
+
+    /* Free the slow command log */
+    if (pAE->pSlowCmdLog != NULL) {
+        StorPortFreePool((PVOID)pAE, pAE->pSlowCmdLog);
+        pAE->pSlowCmdLog = NULL;
+    }
+
+#ifdef HISTORY
+    /* Free the command history rings */
+    if (pAE->pHistoryRings != NULL) {
+        StorPortFreePool((PVOID)pAE, pAE->pHistoryRings);
+        pAE->pHistoryRings = NULL;
+        pAE->NumHistoryRings = 0;
+    }
+
+    if (pAE->pHistoryRecords != NULL) {
+        StorPortFreePool((PVOID)pAE, pAE->pHistoryRecords);
+        pAE->pHistoryRecords = NULL;
+    }
+#endif
+
 } /* NVMeFreeNonContiguousBuffer */
 
+/*******************************************************************************
+ * NVMePlanSharedQueues
+ *
+ * @brief NVMePlanSharedQueues gets called when there are fewer IO queues than
+ *        active cores and splits the queues among the populated NUMA nodes so
+ *        that every queue is shared by cores that are as close to each other
+ *        as possible. Each node gets a contiguous range of queues sized in
+ *        proportion to its core count (at least one); within the node, each
+ *        queue takes a contiguous run of logical processors, which keeps SMT
+ *        siblings (numbered next to each other) on the same queue. When there
+ *        are fewer queues than nodes, neighbouring nodes of the same group
+ *        share whole queues instead. Nodes are visited in group order.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ * @param NumQueues - Number of IO queue pairs to hand out
+ *
+ * @return VOID
+ ******************************************************************************/
+VOID NVMePlanSharedQueues(
+    PNVME_DEVICE_EXTENSION pAE,
+    ULONG NumQueues
+)
+{
+    PRES_MAPPING_TBL pRMT = &pAE->ResMapTbl;
+    PNUMA_NODE_TBL pNNT = NULL;
+    PNUMA_NODE_TBL pBest = NULL;
+    ULONG Node, Grp;
+    ULONG NumNodes = 0, NodeIndex = 0, Assigned = 0;
+    ULONG NextQueue = 1;
+
+    for (Node = 0; Node < pRMT->NumNumaNodes; Node++) {
+        pNNT = pRMT->pNumaNodeTbl + Node;
+        pNNT->FirstQueue = pNNT->NumQueues = 0;
+        if (pNNT->NumCores != 0)
+            NumNodes++;
+    }
+
+    if (NumNodes == 0 || NumQueues == 0)
+        return;
+
+    if (NumQueues < NumNodes) {
+        /* Neighbouring nodes, in group order, share whole queues */
+        for (Grp = 0; Grp < pRMT->NumGroup; Grp++) {
+            for (Node = 0; Node < pRMT->NumNumaNodes; Node++) {
+                pNNT = pRMT->pNumaNodeTbl + Node;
+                if (pNNT->NumCores == 0 || pNNT->GroupAffinity.Group != Grp)
+                    continue;
+
+                pNNT->FirstQueue = 1 + (NodeIndex * NumQueues) / NumNodes;
+                pNNT->NumQueues = 1;
+                NodeIndex++;
+            }
+        }
+        return;
+    }
+
+    /* Proportional share, at least one queue and no more than its cores */
+    for (Node = 0; Node < pRMT->NumNumaNodes; Node++) {
+        pNNT = pRMT->pNumaNodeTbl + Node;
+        if (pNNT->NumCores == 0)
+            continue;
+
+        pNNT->NumQueues = (NumQueues * pNNT->NumCores) / pRMT->NumActiveCores;
+        pNNT->NumQueues = max(pNNT->NumQueues, 1);
+        pNNT->NumQueues = min(pNNT->NumQueues, pNNT->NumCores);
+        Assigned += pNNT->NumQueues;
+    }
+
+    /* Rounding leftovers: take from the least loaded, give to the busiest */
+    while (Assigned != NumQueues) {
+        pBest = NULL;
+        for (Node = 0; Node < pRMT->NumNumaNodes; Node++) {
+            pNNT = pRMT->pNumaNodeTbl + Node;
+            if (pNNT->NumCores == 0)
+                continue;
+
+            if (Assigned > NumQueues) {
+                if (pNNT->NumQueues > 1 &&
+                    (pBest == NULL ||
+                     pNNT->NumCores * pBest->NumQueues <
+                     pBest->NumCores * pNNT->NumQueues))
+                    pBest = pNNT;
+            } else {
+                if (pNNT->NumQueues < pNNT->NumCores &&
+                    (pBest == NULL ||
+                     pNNT->NumCores * pBest->NumQueues >
+                     pBest->NumCores * pNNT->NumQueues))
+                    pBest = pNNT;
+            }
+        }
+
+        if (pBest == NULL)
+            break;
+
+        if (Assigned > NumQueues) {
+            pBest->NumQueues--;
+            Assigned--;
+        } else {
+            pBest->NumQueues++;
+            Assigned++;
+        }
+    }
+
+    for (Grp = 0; Grp < pRMT->NumGroup; Grp++) {
+        for (Node = 0; Node < pRMT->NumNumaNodes; Node++) {
+            pNNT = pRMT->pNumaNodeTbl + Node;
+            if (pNNT->NumCores == 0 || pNNT->GroupAffinity.Group != Grp)
+                continue;
+
+            pNNT->FirstQueue = NextQueue;
+            NextQueue += pNNT->NumQueues;
+        }
+    }
+} /* NVMePlanSharedQueues */
+
 /*******************************************************************************
  * NVMeAllocIoQueues
  *
  * @brief NVMeAllocIoQueues gets called to allocate IO queue(s) from system
- *        memory after determining the number of queues to allocate. In the case
- *        of failing to allocate memory, it needs to fall back to use one queue
- *        per adapter and free up the allocated buffers that is not used. The
- *        scenarios can be described in the follow pseudo codes:
- *
- *        if (Queue Number granted from adapter >= core number) {
- *            for (NUMA = 0; NUMA < NUMA node number; NUMA++) {
- *                for (Core = FirstCore; Core <= LastCore; Core++) {
- *                    Allocate queue pair for each core;
- *                    if (Succeeded) {
- *                        Note down which queue to use for each core;
- *                    } else {
- *                        if (failed on first queue allocation and NUMA == 0) {
+ *        memory after determining the number of queues to allocate. Each
+ *        queue is allocated on the NUMA node of the cores that use it. In the
+ *        case of failing to allocate memory, it needs to fall back to use one
+ *        queue per adapter and free up the allocated buffers that is not used.
+ *        The scenarios can be described in the follow pseudo codes:
+ *
+ *        if (Queue Number granted from adapter < core number)
+ *            Plan which cores share which queue (NVMePlanSharedQueues);
+ *
+ *        for (Group = 0; Group < group number; Group++) {
+ *            for (each NUMA node in Group) {
+ *                for (each Core of the node) {
+ *                    Pick the queue: one per core, or the planned shared one;
+ *                    if (queue not allocated yet) {
+ *                        Allocate queue pair on the node;
+ *                        if (failed on first queue allocation) {
  *                            return FALSE;
- *                        } else { //at least one queue allocated
+ *                        } else if (failed) {
  *                            // Fall back to one queue per adapter
  *                            Free up the allocated, not used queues;
  *                            Mark down number of queues allocated;
@@ -3068,21 +4797,12 @@ VOID NVMeFreeNonContiguousBuffers (
  *                            return TRUE;
  *                        }
  *                    }
+ *                    Note down which queue to use for the core;
  *                }
  *            }
- *            Mark down number of queue pairs allocated;
- *            return TRUE;
- *        } else {
- *            // Allocate one queue pair only
- *            Allocate one queue pair;
- *            if (Succeeded) {
- *                Mark down one pair of queues allocated;
- *                Note down which queue to use for each core;
- *                return TRUE;
- *            } else {
- *                return FALSE;
- *            }
  *        }
+ *        Mark down number of queue pairs allocated;
+ *        return TRUE;
  *
  * @param pAE - Pointer to hardware device extension.
  *
@@ -3100,12 +4820,15 @@ BOOLEAN NVMeAllocIoQueues(
     PNUMA_NODE_TBL pNNT = NULL;
     PSUB_QUEUE_INFO pSQI = NULL;
     PCORE_TBL pCT = NULL;
-    ULONG Core, Node, QEntries;
-    ULONG CoreTableIndex = 0;
+    ULONG Core, Node, Grp, QEntries;
+    ULONG CoreInNode = 0;
+    BOOLEAN SharedQueues = FALSE;
     USHORT QueueID = 0;
     ULONG Queue = 0;
 
     pQI->NumSubIoQAllocated = pQI->NumCplIoQAllocated = 0;
+    pQI->NumIoQEntriesAllocated = 0;
+    pQI->NumSubQClasses = 1;
 
     if (pAE->ntldrDump == TRUE) {
         QEntries = MIN_IO_QUEUE_ENTRIES; 
@@ -3121,117 +4844,167 @@ BOOLEAN NVMeAllocIoQueues(
             return (FALSE);
         }
     } else {
-        for (Node = 0; Node < pRMT->NumNumaNodes; Node++) {
-            pNNT = pRMT->pNumaNodeTbl + Node;
-            /* When no logical processors assigned to the node, just move on */
-            if (pNNT->NumCores == 0)
-                continue;
-
-            for (Core = pNNT->FirstCoreNum; Core <= pNNT->LastCoreNum; Core++) {
+        if (pQI->NumSubIoQAllocFromAdapter < pRMT->NumActiveCores) {
+            NVMePlanSharedQueues(pAE, pQI->NumSubIoQAllocFromAdapter);
+            SharedQueues = TRUE;
+            pAE->MultipleCoresToSingleQueueFlag = TRUE;
+        }
 
+        for (Grp = 0; Grp < pRMT->NumGroup; Grp++) {
+            for (Node = 0; Node < pRMT->NumNumaNodes; Node++) {
+                pNNT = pRMT->pNumaNodeTbl + Node;
+                /* When no logical processors assigned to the node, just move on */
+                if (pNNT->NumCores == 0 || pNNT->GroupAffinity.Group != Grp)
+                    continue;
 
-                pCT = pRMT->pCoreTbl + CoreTableIndex;
+                CoreInNode = 0;
+                for (Core = pNNT->FirstCoreNum; Core <= pNNT->LastCoreNum; Core++) {
+                    pCT = pRMT->pCoreTbl + Core;
+                    if (pCT->NumaNode != Node)
+                        continue;
 
-                /*
-                 * If there are more cores than Qs alloc'd from the adapter, just
-                 * cycle through the available Qs in the core table.  Ex, if there
-                 * are 2 Q's and 4 cores, the table will look like:
-                 * Core  QID
-                 *  0     1
-                 *  1     2
-                 *  3     1
-                 *  4     2
-                 */
-                 QueueID = (QueueID + 1 > (USHORT)pQI->NumSubIoQAllocFromAdapter) ?
-                            1 : QueueID + 1;
+                    /*
+                     * With a queue per core, hand them out in order. Otherwise,
+                     * each core takes its slot in the node's planned range, so
+                     * a queue serves a contiguous run of the node's cores.
+                     */
+                    if (SharedQueues == FALSE) {
+                        QueueID++;
+                    } else {
+                        QueueID = (USHORT)(pNNT->FirstQueue +
+                            (CoreInNode * pNNT->NumQueues) / pNNT->NumCores);
+                    }
+                    CoreInNode++;
 
-                if (pQI->NumSubIoQAllocated < QueueID)  {
+                    if (pQI->NumSubIoQAllocated < QueueID)  {
  
-                    QEntries = pAE->InitInfo.IoQEntries;
-                    Status = NVMeAllocQueues(pAE,
-                                             QueueID,
-                                             QEntries,
-                                             (USHORT)Node);
-
-                    if (Status == STOR_STATUS_SUCCESS) {
+                        /* Once a queue had to settle for less, so do the rest */
+                        QEntries = (pQI->NumIoQEntriesAllocated != 0) ?
+                                   pQI->NumIoQEntriesAllocated :
+                                   pAE->InitInfo.IoQEntries;
+                        Status = NVMeAllocQueues(pAE,
+                                                 QueueID,
+                                                 QEntries,
+                                                 (USHORT)Node);
+
+                        if (Status == STOR_STATUS_SUCCESS) {
    
-                        pQI->NumSubIoQAllocated = ++pQI->NumCplIoQAllocated;
-                    } else {
-                        /*
-                         * If faling on the very first queue allocation, failure
-                         * case.
-                         */
-                        if (CoreTableIndex == pNNT->FirstCoreNum && Node == 0) {
-                            return (FALSE);
+                            pQI->NumSubIoQAllocated = ++pQI->NumCplIoQAllocated;
                         } else {
                             /*
-                             * Fall back to share the very first queue allocated.
-                             * Free the other allocated queues before returning
-                             * and return TRUE.
+                             * If faling on the very first queue allocation, failure
+                             * case.
                              */
-                            Queue = 0;
-                            for (Core = 1; Core < pRMT->NumActiveCores; Core++) {
-                                /* Need to keep first allocated IO queue for sharing */
-                                Queue = Core + 1; 
-                                pSQI = pQI->pSubQueueInfo + Queue;
-
-                                if (pSQI->pQueueAlloc != NULL)
-                                    StorPortFreeContiguousMemorySpecifyCache(
-                                        (PVOID)pAE,
-                                        pSQI->pQueueAlloc,
-                                        pSQI->QueueAllocSize,
-                                        MmCached);
-                                pSQI->pQueueAlloc = NULL;
-
-                                if (pSQI->pPRPListAlloc != NULL)
-                                    StorPortFreeContiguousMemorySpecifyCache(
-                                        (PVOID)pAE,
-                                        pSQI->pPRPListAlloc,
-                                        pSQI->PRPListAllocSize,
-                                        MmCached);
-                                pSQI->pPRPListAlloc = NULL;
-#ifdef DUMB_DRIVER
-                                if (pSQI->pDblBuffAlloc != NULL)
-                                    StorPortFreeContiguousMemorySpecifyCache(
-                                                            (PVOID)pAE,
-                                                            pSQI->pDblBuffAlloc,
-                                                            pSQI->dblBuffSz,
-                                                            MmCached);
-
-                                if (pSQI->pDblBuffListAlloc != NULL)
-                                    StorPortFreeContiguousMemorySpecifyCache(
-                                                            (PVOID)pAE,
-                                                            pSQI->pDblBuffListAlloc,
-                                                            pSQI->dblBuffListSz,
-                                                            MmCached);
-
-#endif
-                                pCT = pRMT->pCoreTbl + Core;
-                                pCT->SubQueue = pCT->CplQueue = 1;
-                            }
-
-                            pQI->NumSubIoQAllocated = pQI->NumCplIoQAllocated = 1;
+                            if (QueueID == 1) {
+                                return (FALSE);
+                            } else {
+                                /*
+                                 * Fall back to share the very first queue allocated.
+                                 * Free the other allocated queues before returning
+                                 * and return TRUE.
+                                 */
+                                for (Queue = 2;
+                                     Queue <= pQI->NumSubIoQAllocated;
+                                     Queue++) {
+                                    /* Need to keep first allocated IO queue for sharing */
+                                    pSQI = pQI->pSubQueueInfo + Queue;
+                                    NVMeFreeQueueMem(pAE, pSQI);
+                                }
+
+                                for (Core = 0; Core < pRMT->NumActiveCores; Core++) {
+                                    pCT = pRMT->pCoreTbl + Core;
+                                    pCT->SubQueue = pCT->CplQueue = 1;
+                                }
+
+                                pQI->NumSubIoQAllocated = pQI->NumCplIoQAllocated = 1;
         
-                            pAE->MultipleCoresToSingleQueueFlag = TRUE;
-                            return (TRUE);
-                        } /* fall back to use only one queue */
-                    } /* failure case */
-                } else {
-                    pAE->MultipleCoresToSingleQueueFlag = TRUE;
-                }
+                                pAE->MultipleCoresToSingleQueueFlag = TRUE;
+                                return (TRUE);
+                            } /* fall back to use only one queue */
+                        } /* failure case */
+                    }
+
+                    /* Succeeded! Mark down the number of queues allocated */
+                    pCT->SubQueue = pCT->CplQueue = QueueID;
+                    StorPortDebugPrint(INFO,
+                        "NVMeAllocIoQueues: Core 0x%x (node %d) ---> QueueID 0x%x\n",
+                        Core, Node, QueueID);
+                } /* current core */
+            } /* current NUMA node */
+        } /* current group */
 
-                /* Succeeded! Mark down the number of queues allocated */
-                pCT->SubQueue = pCT->CplQueue = QueueID;
-                StorPortDebugPrint(INFO,
-                    "NVMeAllocIoQueues: Core 0x%x ---> QueueID 0x%x\n",
-                    CoreTableIndex, QueueID);
-                CoreTableIndex++;
-            } /* current core */
-        } /* current NUMA node */
+        /* The base SQs are in place, add the priority classes on top */
+        if (pAE->WrrEnabled == TRUE)
+            NVMeAllocPriorityQueues(pAE);
 
         return (TRUE);
     }
 } /* NVMeAllocIoQueues */
+
+/*******************************************************************************
+ * NVMeAllocPriorityQueues
+ *
+ * @brief NVMeAllocPriorityQueues gets called once the per core queue pairs
+ *        are allocated to add an urgent, high and low priority SQ next to
+ *        each base SQ, which becomes the medium class. The class SQs are
+ *        numbered a class at a time after the base SQs, use the base SQ's
+ *        size and NUMA node and post to its CQ, which was allocated large
+ *        enough for all of them. It's all classes or none: if
+ *        the controller didn't grant enough SQs or memory runs out, the
+ *        driver carries on with the base SQs only.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ *
+ * @return BOOLEAN
+ *     TRUE - If the priority class SQs are allocated
+ *     FALSE - If the driver is left with the base SQs only
+ ******************************************************************************/
+BOOLEAN NVMeAllocPriorityQueues(
+    PNVME_DEVICE_EXTENSION pAE
+)
+{
+    PQUEUE_INFO pQI = &pAE->QueueInfo;
+    PSUB_QUEUE_INFO pBaseSQI = NULL;
+    ULONG NumBase = pQI->NumCplIoQAllocated;
+    ULONG QueueID;
+    ULONG Status;
+
+    if (pQI->NumSubIoQGranted < (NumBase * NVME_SQ_CLASSES)) {
+        StorPortDebugPrint(INFO,
+            "NVMeAllocPriorityQueues: %d SQs granted, %d needed, no priority classes\n",
+            pQI->NumSubIoQGranted, NumBase * NVME_SQ_CLASSES);
+        return (FALSE);
+    }
+
+    pQI->NumSubQClasses = NVME_SQ_CLASSES;
+
+    for (QueueID = NumBase + 1;
+         QueueID <= (NumBase * NVME_SQ_CLASSES);
+         QueueID++) {
+        pBaseSQI = pQI->pSubQueueInfo + (((QueueID - 1) % NumBase) + 1);
+        Status = NVMeAllocQueues(pAE,
+                                 (USHORT)QueueID,
+                                 pBaseSQI->SubQEntries,
+                                 pBaseSQI->NumaNode);
+
+        if (Status != STOR_STATUS_SUCCESS) {
+            StorPortDebugPrint(INFO,
+                "NVMeAllocPriorityQueues: SQ %d failed, no priority classes\n",
+                QueueID);
+
+            while (--QueueID > NumBase)
+                NVMeFreeQueueMem(pAE, pQI->pSubQueueInfo + QueueID);
+
+            pQI->NumSubQClasses = 1;
+            pQI->NumSubIoQAllocated = NumBase;
+            return (FALSE);
+        }
+
+        pQI->NumSubIoQAllocated = QueueID;
+    }
+
+    return (TRUE);
+} /* NVMeAllocPriorityQueues */
 /*******************************************************************************
  * NVMeAcqQueueEntry
  *
@@ -3386,6 +5159,84 @@ ULONG NVMeGetCplEntry(
     return STOR_STATUS_UNSUCCESSFUL;
 } /* NVMeGetCplEntry */
 
+/*******************************************************************************
+ * NVMeHarvestCplEntries
+ *
+ * @brief NVMeHarvestCplEntries collects up to MaxEntries newly completed
+ *        entries from a completion queue through NVMeGetCplEntry and starts
+ *        prefetching the CMD_ENTRY each of them resolves to, so those are in
+ *        the cache by the time the entries are completed. The entries stay in
+ *        the queue, the caller must complete all of them before ringing the
+ *        head doorbell.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ * @param pCQI - Completion queue to harvest from
+ * @param ppCplBatch - Caller prepared array receiving the entry pointers
+ * @param MaxEntries - Size of the array
+ *
+ * @return ULONG
+ *     Number of entries harvested, 0 when there are no new ones
+ ******************************************************************************/
+ULONG NVMeHarvestCplEntries(
+    PNVME_DEVICE_EXTENSION pAE,
+    PCPL_QUEUE_INFO pCQI,
+    PNVMe_COMPLETION_QUEUE_ENTRY *ppCplBatch,
+    ULONG MaxEntries
+)
+{
+    PQUEUE_INFO pQI = &pAE->QueueInfo;
+    PNVMe_COMPLETION_QUEUE_ENTRY pCQE = NULL;
+    ULONG Harvested = 0;
+
+    while (Harvested < MaxEntries) {
+        if (NVMeGetCplEntry(pAE, pCQI, &pCQE) != STOR_STATUS_SUCCESS)
+            break;
+
+        if (pCQE->DW2.SQID <= pQI->NumSubIoQCreated)
+            PreFetchCacheLine(PF_TEMPORAL_LEVEL_1,
+                              GET_CMD_ENTRY(pQI->pSubQueueInfo + pCQE->DW2.SQID,
+                                            pCQE->DW3.CID));
+
+        ppCplBatch[Harvested++] = pCQE;
+    }
+
+    return Harvested;
+} /* NVMeHarvestCplEntries */
+
+/*******************************************************************************
+ * NVMePrefetchCplContext
+ *
+ * @brief NVMePrefetchCplContext starts prefetching the SRB extension of a
+ *        harvested entry. It's called one entry ahead of the completion, by
+ *        then the CMD_ENTRY holding the pointer should be in the cache.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ * @param pCplEntry - Harvested completion queue entry
+ *
+ * @return VOID
+ ******************************************************************************/
+VOID NVMePrefetchCplContext(
+    PNVME_DEVICE_EXTENSION pAE,
+    PNVMe_COMPLETION_QUEUE_ENTRY pCplEntry
+)
+{
+    PQUEUE_INFO pQI = &pAE->QueueInfo;
+    PSUB_QUEUE_INFO pSQI = NULL;
+    PCMD_ENTRY pCmdEntry = NULL;
+
+    /* Entries are checked again when completed, just don't read past arrays */
+    if (pCplEntry->DW2.SQID > pQI->NumSubIoQCreated)
+        return;
+
+    pSQI = pQI->pSubQueueInfo + pCplEntry->DW2.SQID;
+    if (pCplEntry->DW3.CID >= pSQI->SubQEntries)
+        return;
+
+    pCmdEntry = GET_CMD_ENTRY(pSQI, pCplEntry->DW3.CID);
+    if (pCmdEntry->Context != NULL)
+        PreFetchCacheLine(PF_TEMPORAL_LEVEL_1, pCmdEntry->Context);
+} /* NVMePrefetchCplContext */
+
 /*******************************************************************************
  * NVMeReadRegistry
  *
@@ -3483,12 +5334,41 @@ BOOLEAN NVMeWriteRegistry(
  *        Registry when the driver first loaded. The sub-keys are:
  *
  *        Namespace: The supported number of Namespace
+ *        NamespaceTable: Namespaces tracked, attached or not, for Namespace
+ *                        Management, MAX_NAMESPACES up to 4096
  *        TranSize: Max transfer size in bytes with one request
  *        AdQueueEntries: The number of Admin queue entries, 128 by default
  *        IoQueueEntries: The number of IO queue entries, 1024 by default
  *        IntCoalescingTime: The frequency of interrupt coalescing time in 100
  *                           ms increments
  *        IntCoalescingEntry: The frequency of interrupt coalescing entries
+ *        ApstMaxLatency: The largest exit latency in us APST may add, 0 turns
+ *                        APST off
+ *        HmbMaxSize: The largest Host Memory Buffer in MB, 0 turns HMB off
+ *        CmbSubQueues: 1 places IO submission queues in the Controller Memory
+ *                      Buffer when the controller supports it, 0 doesn't
+ *        WrrArbitration: 1 uses Weighted Round Robin with Urgent and priority
+ *                        class SQs when the controller supports it, 0 doesn't
+ *        QosIopsLimit: Default per namespace limit in commands per second, 0
+ *                      for no limit
+ *        QosBandwidthLimit: Default per namespace limit in KB per second, 0
+ *                           for no limit
+ *        CplBudget: Completions handled per queue by one DPC run before the
+ *                   DPC is re-queued, 0 for no limit
+ *        CplDoorbellBatch: Completions between head doorbell writes within a
+ *                          queue sweep, 0 rings it once per sweep
+ *        HistoryDepth: Command history records kept per core, 0 (default)
+ *                      leaves the history off
+ *        TraceSampleRate: 1 in this many commands gets the IoSubmit and
+ *                         IoComplete WPP tracepoints
+ *        SlowCmdThresholdUs: Commands slower than this in us are logged as
+ *                            well as those past their p99.9, 0 for no
+ *                            fixed threshold
+ *        SrbTraceEntries: Size of the SRB trace recorded in BuildIo, 0 turns
+ *                         the recorder off
+ *        PiHostCheck: 1 has the driver generate and verify the PI of
+ *                     namespaces keeping it in a separate buffer, 0 leaves
+ *                     that to PRACT
  *
  * @param pAE - Device Extension
  *
@@ -3500,11 +5380,25 @@ BOOLEAN NVMeFetchRegistry(
 )
 {
     UCHAR NAMESPACES[] = "Namespaces";
+    UCHAR NAMESPACETABLE[] = "NamespaceTable";
     UCHAR MAXTXSIZE[] = "MaxTXSize";
     UCHAR ADQUEUEENTRY[] = "AdQEntries";
     UCHAR IOQUEUEENTRY[] = "IoQEntries";
     UCHAR INTCOALESCINGTIME[] = "IntCoalescingTime";
     UCHAR INTCOALESCINGENTRY[] = "IntCoalescingEntries";
+    UCHAR APSTMAXLATENCY[] = "ApstMaxLatency";
+    UCHAR HMBMAXSIZE[] = "HmbMaxSize";
+    UCHAR CMBSUBQUEUES[] = "CmbSubQueues";
+    UCHAR WRRARBITRATION[] = "WrrArbitration";
+    UCHAR QOSIOPSLIMIT[] = "QosIopsLimit";
+    UCHAR QOSBANDWIDTHLIMIT[] = "QosBandwidthLimit";
+    UCHAR CPLBUDGET[] = "CplBudget";
+    UCHAR CPLDOORBELLBATCH[] = "CplDoorbellBatch";
+    UCHAR HISTORYDEPTH[] = "HistoryDepth";
+    UCHAR TRACESAMPLERATE[] = "TraceSampleRate";
+    UCHAR SLOWCMDTHRESHOLD[] = "SlowCmdThresholdUs";
+    UCHAR SRBTRACEENTRIES[] = "SrbTraceEntries";
+    UCHAR PIHOSTCHECK[] = "PiHostCheck";
 
     ULONG Type = MINIPORT_REG_DWORD;
     UCHAR* pBuf = NULL;
@@ -3538,6 +5432,22 @@ BOOLEAN NVMeFetchRegistry(
 
     memset(pBuf, 0, sizeof(ULONG));
 
+    if (NVMeReadRegistry(pAE,
+                         NAMESPACETABLE,
+                         Type,
+                         pBuf,
+                         (ULONG*)&Len ) == TRUE ) {
+        if (RANGE_CHK(*(PULONG)pBuf,
+                      MIN_NAMESPACE_TABLE,
+                      MAX_NAMESPACE_TABLE) == TRUE) {
+            StorPortCopyMemory((PVOID)(&pAE->InitInfo.NamespaceTable),
+                   (PVOID)pBuf,
+                   sizeof(ULONG));
+        }
+    }
+
+    memset(pBuf, 0, sizeof(ULONG));
+
     if (NVMeReadRegistry(pAE,
                          MAXTXSIZE,
                          Type,
@@ -3614,6 +5524,214 @@ BOOLEAN NVMeFetchRegistry(
         }
     }
 
+    memset(pBuf, 0, sizeof(ULONG));
+
+    if (NVMeReadRegistry(pAE,
+                         APSTMAXLATENCY,
+                         Type,
+                         pBuf,
+                         (ULONG*)&Len ) == TRUE ) {
+        if (RANGE_CHK(*(PULONG)pBuf,
+                      MIN_APST_MAX_LATENCY,
+                      MAX_APST_MAX_LATENCY) == TRUE) {
+            StorPortCopyMemory((PVOID)(&pAE->InitInfo.ApstMaxLatency),
+                   (PVOID)pBuf,
+                   sizeof(ULONG));
+        }
+    }
+
+    memset(pBuf, 0, sizeof(ULONG));
+
+    if (NVMeReadRegistry(pAE,
+                         HMBMAXSIZE,
+                         Type,
+                         pBuf,
+                         (ULONG*)&Len ) == TRUE ) {
+        if (RANGE_CHK(*(PULONG)pBuf,
+                      MIN_HMB_MAX_SIZE,
+                      MAX_HMB_MAX_SIZE) == TRUE) {
+            StorPortCopyMemory((PVOID)(&pAE->InitInfo.HmbMaxSize),
+                   (PVOID)pBuf,
+                   sizeof(ULONG));
+        }
+    }
+
+    memset(pBuf, 0, sizeof(ULONG));
+
+    if (NVMeReadRegistry(pAE,
+                         CMBSUBQUEUES,
+                         Type,
+                         pBuf,
+                         (ULONG*)&Len ) == TRUE ) {
+        if (RANGE_CHK(*(PULONG)pBuf,
+                      MIN_CMB_SUB_QUEUES,
+                      MAX_CMB_SUB_QUEUES) == TRUE) {
+            StorPortCopyMemory((PVOID)(&pAE->InitInfo.CmbSubQueues),
+                   (PVOID)pBuf,
+                   sizeof(ULONG));
+        }
+    }
+
+    memset(pBuf, 0, sizeof(ULONG));
+
+    if (NVMeReadRegistry(pAE,
+                         WRRARBITRATION,
+                         Type,
+                         pBuf,
+                         (ULONG*)&Len ) == TRUE ) {
+        if (RANGE_CHK(*(PULONG)pBuf,
+                      MIN_WRR_ARBITRATION,
+                      MAX_WRR_ARBITRATION) == TRUE) {
+            StorPortCopyMemory((PVOID)(&pAE->InitInfo.WrrArbitration),
+                   (PVOID)pBuf,
+                   sizeof(ULONG));
+        }
+    }
+
+    memset(pBuf, 0, sizeof(ULONG));
+
+    if (NVMeReadRegistry(pAE,
+                         QOSIOPSLIMIT,
+                         Type,
+                         pBuf,
+                         (ULONG*)&Len ) == TRUE ) {
+        if (RANGE_CHK(*(PULONG)pBuf,
+                      MIN_QOS_IOPS_LIMIT,
+                      MAX_QOS_IOPS_LIMIT) == TRUE) {
+            StorPortCopyMemory((PVOID)(&pAE->InitInfo.QosIopsLimit),
+                   (PVOID)pBuf,
+                   sizeof(ULONG));
+        }
+    }
+
+    memset(pBuf, 0, sizeof(ULONG));
+
+    if (NVMeReadRegistry(pAE,
+                         QOSBANDWIDTHLIMIT,
+                         Type,
+                         pBuf,
+                         (ULONG*)&Len ) == TRUE ) {
+        if (RANGE_CHK(*(PULONG)pBuf,
+                      MIN_QOS_BANDWIDTH_LIMIT,
+                      MAX_QOS_BANDWIDTH_LIMIT) == TRUE) {
+            StorPortCopyMemory((PVOID)(&pAE->InitInfo.QosBandwidthLimit),
+                   (PVOID)pBuf,
+                   sizeof(ULONG));
+        }
+    }
+
+    memset(pBuf, 0, sizeof(ULONG));
+
+    if (NVMeReadRegistry(pAE,
+                         CPLBUDGET,
+                         Type,
+                         pBuf,
+                         (ULONG*)&Len ) == TRUE ) {
+        if (RANGE_CHK(*(PULONG)pBuf,
+                      MIN_CPL_BUDGET,
+                      MAX_CPL_BUDGET) == TRUE) {
+            StorPortCopyMemory((PVOID)(&pAE->InitInfo.CplBudget),
+                   (PVOID)pBuf,
+                   sizeof(ULONG));
+        }
+    }
+
+    memset(pBuf, 0, sizeof(ULONG));
+
+    if (NVMeReadRegistry(pAE,
+                         CPLDOORBELLBATCH,
+                         Type,
+                         pBuf,
+                         (ULONG*)&Len ) == TRUE ) {
+        if (RANGE_CHK(*(PULONG)pBuf,
+                      MIN_CPL_DOORBELL_BATCH,
+                      MAX_CPL_DOORBELL_BATCH) == TRUE) {
+            StorPortCopyMemory((PVOID)(&pAE->InitInfo.CplDoorbellBatch),
+                   (PVOID)pBuf,
+                   sizeof(ULONG));
+        }
+    }
+
+    memset(pBuf, 0, sizeof(ULONG));
+
+    if (NVMeReadRegistry(pAE,
+                         HISTORYDEPTH,
+                         Type,
+                         pBuf,
+                         (ULONG*)&Len ) == TRUE ) {
+        if (RANGE_CHK(*(PULONG)pBuf,
+                      MIN_HISTORY_DEPTH,
+                      MAX_HISTORY_DEPTH) == TRUE) {
+            StorPortCopyMemory((PVOID)(&pAE->InitInfo.HistoryDepth),
+                   (PVOID)pBuf,
+                   sizeof(ULONG));
+        }
+    }
+
+    memset(pBuf, 0, sizeof(ULONG));
+
+    if (NVMeReadRegistry(pAE,
+                         TRACESAMPLERATE,
+                         Type,
+                         pBuf,
+                         (ULONG*)&Len ) == TRUE ) {
+        if (RANGE_CHK(*(PULONG)pBuf,
+                      MIN_TRACE_SAMPLE_RATE,
+                      MAX_TRACE_SAMPLE_RATE) == TRUE) {
+            StorPortCopyMemory((PVOID)(&pAE->InitInfo.TraceSampleRate),
+                   (PVOID)pBuf,
+                   sizeof(ULONG));
+        }
+    }
+
+    memset(pBuf, 0, sizeof(ULONG));
+
+    if (NVMeReadRegistry(pAE,
+                         SLOWCMDTHRESHOLD,
+                         Type,
+                         pBuf,
+                         (ULONG*)&Len ) == TRUE ) {
+        if (RANGE_CHK(*(PULONG)pBuf,
+                      MIN_SLOW_CMD_THRESHOLD,
+                      MAX_SLOW_CMD_THRESHOLD) == TRUE) {
+            StorPortCopyMemory((PVOID)(&pAE->InitInfo.SlowCmdThresholdUs),
+                   (PVOID)pBuf,
+                   sizeof(ULONG));
+        }
+    }
+
+    memset(pBuf, 0, sizeof(ULONG));
+
+    if (NVMeReadRegistry(pAE,
+                         SRBTRACEENTRIES,
+                         Type,
+                         pBuf,
+                         (ULONG*)&Len ) == TRUE ) {
+        if (RANGE_CHK(*(PULONG)pBuf,
+                      MIN_SRB_TRACE_ENTRIES,
+                      MAX_SRB_TRACE_ENTRIES) == TRUE) {
+            StorPortCopyMemory((PVOID)(&pAE->InitInfo.SrbTraceEntries),
+                   (PVOID)pBuf,
+                   sizeof(ULONG));
+        }
+    }
+
+    memset(pBuf, 0, sizeof(ULONG));
+
+    if (NVMeReadRegistry(pAE,
+                         PIHOSTCHECK,
+                         Type,
+                         pBuf,
+                         (ULONG*)&Len ) == TRUE ) {
+        if (RANGE_CHK(*(PULONG)pBuf,
+                      MIN_PI_HOST_CHECK,
+                      MAX_PI_HOST_CHECK) == TRUE) {
+            StorPortCopyMemory((PVOID)(&pAE->InitInfo.PiHostCheck),
+                   (PVOID)pBuf,
+                   sizeof(ULONG));
+        }
+    }
+
     /* Release the buffer before returning */
     StorPortFreeRegistryBuffer( pAE, pBuf );
 
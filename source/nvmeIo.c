@@ -81,7 +81,7 @@ ULONG NVMeIssueCmd(
     PQUEUE_INFO pQI = &pAE->QueueInfo;
     PSUB_QUEUE_INFO pSQI = NULL;
     PNVMe_COMMAND pNVMeCmd = NULL;
-    USHORT tempSqTail = 0;
+    ULONG tempSqTail = 0;
 
     /* Make sure the parameters are valid */
     if (QueueID > pQI->NumSubIoQCreated || pTempSubEntry == NULL)
@@ -99,7 +99,7 @@ ULONG NVMeIssueCmd(
 
     if (tempSqTail == pSQI->SubQHeadPtr) {
 #ifdef HISTORY
-        TracePathSubmit(ISSUE_RETURN_BUSY, QueueID, ((PNVMe_COMMAND)pTempSubEntry)->NSID,
+        TracePathSubmit(pAE, ISSUE_RETURN_BUSY, QueueID, ((PNVMe_COMMAND)pTempSubEntry)->NSID,
             ((PNVMe_COMMAND)pTempSubEntry)->CDW0, 0, 0, 0);
 #endif
         return (STOR_STATUS_INSUFFICIENT_RESOURCES);
@@ -108,7 +108,14 @@ ULONG NVMeIssueCmd(
     pNVMeCmd = (PNVMe_COMMAND)pSQI->pSubQStart;
     pNVMeCmd += pSQI->SubQTailPtr;
 
-    StorPortCopyMemory((PVOID)pNVMeCmd, pTempSubEntry, sizeof(NVMe_COMMAND));
+    /* Entries in the Controller Memory Buffer are written as MMIO */
+    if (pSQI->pCmbSubQ != NULL)
+        StorPortWriteRegisterBufferUlong(pAE,
+                                         (PULONG)pNVMeCmd,
+                                         (PULONG)pTempSubEntry,
+                                         sizeof(NVMe_COMMAND) / sizeof(ULONG));
+    else
+        StorPortCopyMemory((PVOID)pNVMeCmd, pTempSubEntry, sizeof(NVMe_COMMAND));
 
     /* Increase the tail pointer by 1 and reset it if needed */
     pSQI->SubQTailPtr = tempSqTail;
@@ -119,11 +126,11 @@ ULONG NVMeIssueCmd(
     pSQI->Requests++;
 
 #ifdef HISTORY
-        TracePathSubmit(ISSUE, QueueID, ((PNVMe_COMMAND)pTempSubEntry)->NSID,
+        TracePathSubmit(pAE, ISSUE, QueueID, ((PNVMe_COMMAND)pTempSubEntry)->NSID,
             ((PNVMe_COMMAND)pTempSubEntry)->CDW0, pSQI->SubQTailPtr, 0, 0);
 #endif
     /* Now issue the command via Doorbell register */
-    StorPortWriteRegisterUlong(pAE, pSQI->pSubTDBL, (ULONG)pSQI->SubQTailPtr);
+    NVMeRingSubDoorbell(pAE, pSQI);
 
 #if DBG
     if (gResetTest && (gResetCounter++ > gResetCount)) {
@@ -146,7 +153,7 @@ ULONG NVMeIssueCmd(
         ULONG entryStatus = STOR_STATUS_UNSUCCESSFUL;
         PNVMe_COMPLETION_QUEUE_ENTRY pCplEntry = NULL;
         PNVME_SRB_EXTENSION pSrbExtension = NULL;
-        PCPL_QUEUE_INFO pCQI = pQI->pCplQueueInfo + QueueID;
+        PCPL_QUEUE_INFO pCQI = pQI->pCplQueueInfo + pSQI->CplQueueID;
         PRES_MAPPING_TBL pRMT = &pAE->ResMapTbl;
         BOOLEAN learning;
 
@@ -183,9 +190,7 @@ ULONG NVMeIssueCmd(
                                             pAE,
                                             pSrbExtension->pSrb);
                 }
-                StorPortWriteRegisterUlong(pAE,
-                                           pCQI->pCplHDBL,
-                                           (ULONG)pCQI->CplQHeadPtr);
+                NVMeRingCplDoorbell(pAE, pCQI);
              }
         }
     }
@@ -194,6 +199,156 @@ ULONG NVMeIssueCmd(
     return STOR_STATUS_SUCCESS;
 } /* NVMeIssueCmd */
 
+/*******************************************************************************
+ * NVMeShadowDoorbellNeedsMmio
+ *
+ * @brief NVMeShadowDoorbellNeedsMmio stores a new tail/head value in the shadow
+ *        doorbell and checks it against the EventIdx the controller published.
+ *        The MMIO doorbell only has to be written when the update moved the
+ *        value past EventIdx, in 16 bit modulo arithmetic as queue sizes
+ *        never exceed 64K entries.
+ *
+ * @param pShadow - Shadow doorbell entry of the queue
+ * @param pEventIdx - EventIdx entry of the queue
+ * @param NewValue - New tail or head value
+ *
+ * @return BOOLEAN
+ *     TRUE - The controller needs the MMIO doorbell write
+ *     FALSE - The shadow doorbell update is enough
+ ******************************************************************************/
+BOOLEAN NVMeShadowDoorbellNeedsMmio(
+    volatile ULONG *pShadow,
+    volatile ULONG *pEventIdx,
+    ULONG NewValue
+)
+{
+    ULONG OldValue = *pShadow;
+    ULONG EventIdx;
+
+    *pShadow = NewValue;
+
+    /*
+     * The shadow update has to be visible before EventIdx is sampled, or
+     * the controller could go idle between the two without seeing it.
+     */
+    MemoryBarrier();
+
+    EventIdx = *pEventIdx;
+
+    return ((USHORT)(NewValue - EventIdx - 1) < (USHORT)(NewValue - OldValue));
+} /* NVMeShadowDoorbellNeedsMmio */
+
+/*******************************************************************************
+ * NVMeRingSubDoorbell
+ *
+ * @brief NVMeRingSubDoorbell tells the controller about the current submission
+ *        queue tail, through the shadow doorbell when Doorbell Buffer Config
+ *        is in use and through the tail doorbell register otherwise.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ * @param pSQI - Submission queue whose tail moved
+ *
+ * @return VOID
+ ******************************************************************************/
+VOID NVMeRingSubDoorbell(
+    PNVME_DEVICE_EXTENSION pAE,
+    PSUB_QUEUE_INFO pSQI
+)
+{
+    if ((pSQI->pSubTShadow != NULL) &&
+        (NVMeShadowDoorbellNeedsMmio(pSQI->pSubTShadow,
+                                     pSQI->pSubTEventIdx,
+                                     pSQI->SubQTailPtr) == FALSE)) {
+        return;
+    }
+
+    StorPortWriteRegisterUlong(pAE, pSQI->pSubTDBL, (ULONG)pSQI->SubQTailPtr);
+    pSQI->DoorbellWrites++;
+} /* NVMeRingSubDoorbell */
+
+/*******************************************************************************
+ * NVMeRingCplDoorbell
+ *
+ * @brief NVMeRingCplDoorbell tells the controller about the current completion
+ *        queue head, through the shadow doorbell when Doorbell Buffer Config
+ *        is in use and through the head doorbell register otherwise.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ * @param pCQI - Completion queue whose head moved
+ *
+ * @return VOID
+ ******************************************************************************/
+VOID NVMeRingCplDoorbell(
+    PNVME_DEVICE_EXTENSION pAE,
+    PCPL_QUEUE_INFO pCQI
+)
+{
+    if ((pCQI->pCplHShadow != NULL) &&
+        (NVMeShadowDoorbellNeedsMmio(pCQI->pCplHShadow,
+                                     pCQI->pCplHEventIdx,
+                                     pCQI->CplQHeadPtr) == FALSE)) {
+        return;
+    }
+
+    StorPortWriteRegisterUlong(pAE, pCQI->pCplHDBL, (ULONG)pCQI->CplQHeadPtr);
+    pCQI->DoorbellWrites++;
+} /* NVMeRingCplDoorbell */
+
+/*******************************************************************************
+ * NVMeMapSrbPriority
+ *
+ * @brief NVMeMapSrbPriority picks the priority class SQ an IO request goes to
+ *        when Weighted Round Robin is in use. A namespace set to urgent sends
+ *        everything to the urgent SQs. Otherwise low priority requests from
+ *        the class driver go to the low class and head of queue tagged ones
+ *        to the high class, the rest stay on the namespace's class, medium
+ *        unless changed through WMI. Internal requests use the medium class.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ * @param pSrbExt - SRB extension of the request
+ *
+ * @return ULONG
+ *     The NVME_SQ_CLASS_XXX of the request
+ ******************************************************************************/
+ULONG NVMeMapSrbPriority(
+    PNVME_DEVICE_EXTENSION pAE,
+    PNVME_SRB_EXTENSION pSrbExt
+)
+{
+#if (NTDDI_VERSION > NTDDI_WIN7)
+    PSTORAGE_REQUEST_BLOCK pSrb = pSrbExt->pSrb;
+#else
+    PSCSI_REQUEST_BLOCK pSrb = pSrbExt->pSrb;
+#endif
+    PNVME_LUN_EXTENSION pLunExt = NULL;
+    ULONG Class = NVME_SQ_CLASS_MEDIUM;
+    ULONG SrbFlags;
+
+    UNREFERENCED_PARAMETER(pAE);
+
+    if (pSrb == NULL)
+        return (NVME_SQ_CLASS_MEDIUM);
+
+    if ((GetLunExtension(pSrbExt, &pLunExt) == SNTI_SUCCESS) &&
+        (pLunExt != NULL))
+        Class = pLunExt->PriorityClass;
+
+    if (Class == NVME_SQ_CLASS_URGENT)
+        return (Class);
+
+    SrbFlags = GET_SRB_FLAGS(pSrb);
+#if defined(SRB_CLASS_FLAGS_LOW_PRIORITY)
+    if ((SrbFlags & SRB_CLASS_FLAGS_LOW_PRIORITY) != 0)
+        return (NVME_SQ_CLASS_LOW);
+#endif
+
+    if (((SrbFlags & SRB_FLAGS_QUEUE_ACTION_ENABLE) != 0) &&
+        (GET_QUEUE_ACTION(pSrb) == SRB_HEAD_OF_QUEUE_TAG_REQUEST))
+        return (NVME_SQ_CLASS_HIGH);
+
+    return (Class);
+} /* NVMeMapSrbPriority */
+
 /*******************************************************************************
  * ProcessIo
  *
@@ -227,6 +382,7 @@ ProcessIo(
     USHORT CplQueue = 0;
     STOR_LOCK_HANDLE hStartIoLock = {0};
     BOOLEAN completeStatus = FALSE;
+    PSUB_QUEUE_INFO pSQI = NULL;
 #ifdef PRP_DBG
     PVOID pVa = NULL;
 #endif
@@ -268,6 +424,13 @@ ProcessIo(
                 IoStatus = NOT_SUBMITTED;
                 __leave;
             }
+
+            /* Move to the SQ of the request's class, the CQ stays the same */
+            if (pAdapterExtension->QueueInfo.NumSubQClasses > 1) {
+                SubQueue += (USHORT)(NVMeMapSrbPriority(pAdapterExtension,
+                                                        pSrbExtension) *
+                    pAdapterExtension->QueueInfo.NumCplIoQAllocated);
+            }
     } else {
         /* It's an admin queue */
         SubQueue = CplQueue = 0;
@@ -418,10 +581,42 @@ ProcessIo(
 #endif /* PRP_DBG */
 #endif /* DBL_BUFF */
 #ifdef HISTORY
-            TracePathSubmit(PRE_ISSUE, SubQueue, pNvmeCmd->NSID, pNvmeCmd->CDW0,
-                pNvmeCmd->PRP1, pNvmeCmd->PRP2, pSrbExtension->numberOfPrpEntries);
+            TracePathSubmit(pAdapterExtension, PRE_ISSUE, SubQueue,
+                pNvmeCmd->NSID, pNvmeCmd->CDW0,
+                pSrbExtension->numberOfPrpEntries,
+                pNvmeCmd->PRP1, pNvmeCmd->PRP2);
 #endif
 
+    /* Stamp the CMD_ENTRY for the latency histograms */
+    if (pAdapterExtension->pLatencyHist != NULL)
+        CONTAINING_RECORD(pCmdInfo, CMD_ENTRY, CmdInfo)->SubmitTimeUs =
+            NVMeGetTimeStampUs(pAdapterExtension);
+
+    pSrbExtension->SubmitCore =
+        (USHORT)KeGetProcessorIndexFromNumber(&ProcNumber);
+
+    /* Sample 1 in TraceSampleRate commands for the IO path tracepoints */
+    pSrbExtension->TraceSampled = FALSE;
+    if (NVME_TRACE_ENABLED(IoSubmit) || NVME_TRACE_ENABLED(IoComplete)) {
+        pSQI = pAdapterExtension->QueueInfo.pSubQueueInfo + SubQueue;
+        if (++pSQI->TraceSampleCount >=
+            pAdapterExtension->InitInfo.TraceSampleRate) {
+            pSQI->TraceSampleCount = 0;
+            pSrbExtension->TraceSampled = TRUE;
+            TraceIoSubmit("NVMeIoSubmit SQ=%u CID=0x%x OPC=0x%x NSID=%u Len=%u LBA=0x%I64x",
+                SubQueue,
+                pNvmeCmd->CDW0.CID,
+                pNvmeCmd->CDW0.OPC,
+                pNvmeCmd->NSID,
+                (pSrbExtension->pSrb != NULL) ?
+                    GET_DATA_LENGTH(pSrbExtension->pSrb) : 0,
+                ((QueueType == NVME_QUEUE_TYPE_IO) &&
+                 ((pNvmeCmd->CDW0.OPC == NVM_READ) ||
+                  (pNvmeCmd->CDW0.OPC == NVM_WRITE))) ?
+                    (((ULONGLONG)pNvmeCmd->CDW11 << 32) | pNvmeCmd->CDW10) : 0);
+        }
+    }
+
     /* 4 - Issue the Command */
     StorStatus = NVMeIssueCmd(pAdapterExtension, SubQueue, pNvmeCmd);
 
@@ -483,7 +678,7 @@ ProcessIo(
 
         if (IoStatus == BUSY) {
 #ifdef HISTORY
-            TracePathSubmit(GETCMD_RETURN_BUSY, SubQueue,
+            TracePathSubmit(pAdapterExtension, GETCMD_RETURN_BUSY, SubQueue,
                 ((PNVMe_COMMAND)(&pSrbExtension->nvmeSqeUnit))->NSID,
                 ((PNVMe_COMMAND)(&pSrbExtension->nvmeSqeUnit))->CDW0,
                 0, 0, 0);
@@ -528,7 +723,7 @@ ProcessIo(
 BOOLEAN NVMeCompleteCmd(
     PNVME_DEVICE_EXTENSION pAE,
     USHORT QueueID,
-    SHORT NewHead,
+    LONG NewHead,
     USHORT CmdID,
     PVOID pContext
 )
@@ -536,6 +731,7 @@ BOOLEAN NVMeCompleteCmd(
     PQUEUE_INFO pQI = &pAE->QueueInfo;
     PSUB_QUEUE_INFO pSQI = NULL;
     PCMD_ENTRY pCmdEntry = NULL;
+    PNVME_SRB_EXTENSION pSrbExtension = NULL;
 
     /* Make sure the parameters are valid */
     ASSERT((QueueID <= pQI->NumSubIoQCreated) && (pContext != NULL));
@@ -546,10 +742,10 @@ BOOLEAN NVMeCompleteCmd(
      */
     pSQI = pQI->pSubQueueInfo + QueueID;
 
-    pCmdEntry = ((PCMD_ENTRY)pSQI->pCmdEntry) + CmdID;
+    pCmdEntry = GET_CMD_ENTRY(pSQI, CmdID);
 
     if (NewHead != NO_SQ_HEAD_CHANGE) {
-        pSQI->SubQHeadPtr = NewHead;
+        pSQI->SubQHeadPtr = (ULONG)NewHead;
     }
 
     /* Ensure the command entry had been acquired */
@@ -571,6 +767,18 @@ BOOLEAN NVMeCompleteCmd(
 
     *((ULONG_PTR *)pContext) = (ULONG_PTR)pCmdEntry->Context;
 
+    /* Only commands completed by the controller count towards latency */
+    if ((NewHead != NO_SQ_HEAD_CHANGE) && (pCmdEntry->SubmitTimeUs != 0)) {
+        pSrbExtension = (PNVME_SRB_EXTENSION)pCmdEntry->Context;
+        pSrbExtension->LatencyUs =
+            NVMeGetTimeStampUs(pAE) - pCmdEntry->SubmitTimeUs;
+        NVMeLatencyRecord(pAE,
+                          pSQI->CplQueueID,
+                          pSrbExtension,
+                          pSrbExtension->LatencyUs);
+    }
+    pCmdEntry->SubmitTimeUs = 0;
+
 #ifdef DUMB_DRIVER
     /*
      * For non admin command read, need to copy from the dbl buff to the
@@ -620,7 +828,7 @@ BOOLEAN NVMeDetectPendingCmds(
     PQUEUE_INFO pQI = &pAE->QueueInfo;
     PSUB_QUEUE_INFO pSQI = NULL;
     PCMD_ENTRY pCmdEntry = NULL;
-    USHORT CmdID;
+    ULONG CmdID;
     USHORT QueueID = 0;
     PNVME_SRB_EXTENSION pSrbExtension = NULL;
     BOOLEAN retValue = FALSE;
@@ -639,12 +847,23 @@ BOOLEAN NVMeDetectPendingCmds(
     if (pQI->pSubQueueInfo == NULL)
         return retValue;
 
+    /* Requests held back by namespace QoS count as pending too */
+    retValue = NVMeQosFlush(pAE, completeCmd, SrbStatus);
+
+    /* So does a firmware download, its commands are internal ones */
+    if (NVMeFwDownloadFlush(pAE, completeCmd, SrbStatus) == TRUE)
+        retValue = TRUE;
+
+    /* And IO held while a namespace formats */
+    if (NVMeFormatNVMFlush(pAE, completeCmd, SrbStatus) == TRUE)
+        retValue = TRUE;
+
     /* Search all submission queues */
     for (QueueID = 0; QueueID <= pQI->NumSubIoQCreated; QueueID++) {
         pSQI = pQI->pSubQueueInfo + QueueID;
 
         for (CmdID = 0; CmdID < pSQI->SubQEntries; CmdID++) {
-            pCmdEntry = ((PCMD_ENTRY)pSQI->pCmdEntry) + CmdID;
+            pCmdEntry = GET_CMD_ENTRY(pSQI, CmdID);
             if (pCmdEntry->Pending == TRUE) {
                 pSrbExtension = (PNVME_SRB_EXTENSION)pCmdEntry->Context;
 
@@ -668,13 +887,14 @@ BOOLEAN NVMeDetectPendingCmds(
 		        }
 
 #ifdef HISTORY
-                TraceEvent(DETECTED_PENDING_CMD,
+                TraceEvent(pAE,
+                    DETECTED_PENDING_CMD,
                     QueueID,
                     pNVMeCmd->CDW0.CID,
                     pNVMeCmd->CDW0.OPC,
+                    pNVMeCmd->NSID,
                     pNVMeCmd->PRP1,
-                    pNVMeCmd->PRP2,
-                    pNVMeCmd->NSID);
+                    pNVMeCmd->PRP2);
 #endif
 
 #if DBG
@@ -748,7 +968,7 @@ BOOLEAN NVMeDetectPendingCmds(
                     if (pSrbExtension->pSrb != NULL) {
 #ifdef HISTORY
                         NVMe_COMPLETION_QUEUE_ENTRY_DWORD_3 nullEntry = {0};
-                        TracePathComplete(COMPLETE_CMD_RESET,
+                        TracePathComplete(pAE, COMPLETE_CMD_RESET,
                             pSQI->SubQueueID,
                             pNVMeCmd->CDW0.CID, 0, nullEntry,
                             (ULONGLONG)pSrbExtension->pNvmeCompletionRoutine,
@@ -766,3 +986,1140 @@ BOOLEAN NVMeDetectPendingCmds(
 
     return retValue;
 } /* NVMeDetectPendingCmds */
+
+/*******************************************************************************
+ * NVMeIoQuiesced
+ *
+ * @brief NVMeIoQuiesced gets called to check whether every host request has
+ *        left the driver, with none on a queue or held back by namespace QoS.
+ *        Internal commands, e.g. outstanding AERs, don't count, a controller
+ *        reset takes care of them.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ *
+ * @return BOOLEAN
+ *     TRUE - If no host request is left
+ *     FALSE - If some are still in flight
+ ******************************************************************************/
+BOOLEAN NVMeIoQuiesced(
+    PNVME_DEVICE_EXTENSION pAE
+)
+{
+    PQUEUE_INFO pQI = &pAE->QueueInfo;
+    PSUB_QUEUE_INFO pSQI = NULL;
+    PCMD_ENTRY pCmdEntry = NULL;
+    PNVME_SRB_EXTENSION pSrbExtension = NULL;
+    ULONG CmdID;
+    USHORT QueueID;
+
+    if ((pAE->QosDeferred != 0) || (pAE->FwDownloadInfo.pSrb != NULL))
+        return (FALSE);
+
+    if (pQI->pSubQueueInfo == NULL)
+        return (TRUE);
+
+    for (QueueID = 0; QueueID <= pQI->NumSubIoQCreated; QueueID++) {
+        pSQI = pQI->pSubQueueInfo + QueueID;
+
+        for (CmdID = 0; CmdID < pSQI->SubQEntries; CmdID++) {
+            pCmdEntry = GET_CMD_ENTRY(pSQI, CmdID);
+            if (pCmdEntry->Pending == FALSE)
+                continue;
+
+            pSrbExtension = (PNVME_SRB_EXTENSION)pCmdEntry->Context;
+            if ((pSrbExtension != NULL) && (pSrbExtension->pSrb != NULL))
+                return (FALSE);
+        }
+    }
+
+    return (TRUE);
+} /* NVMeIoQuiesced */
+
+/*******************************************************************************
+ * NVMeLunQuiesced
+ *
+ * @brief NVMeLunQuiesced tells whether one namespace has no host request left
+ *        in flight on the IO queues, like NVMeIoQuiesced does for them all.
+ *        Formatting a single namespace waits for it.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ * @param Lun - LUN of the namespace
+ *
+ * @return BOOLEAN
+ *     TRUE - None of its requests are in flight
+ *     FALSE - Some still are
+ ******************************************************************************/
+BOOLEAN NVMeLunQuiesced(
+    PNVME_DEVICE_EXTENSION pAE,
+    ULONG Lun
+)
+{
+    PQUEUE_INFO pQI = &pAE->QueueInfo;
+    PSUB_QUEUE_INFO pSQI = NULL;
+    PCMD_ENTRY pCmdEntry = NULL;
+    PNVME_SRB_EXTENSION pSrbExtension = NULL;
+    ULONG CmdID;
+    USHORT QueueID;
+
+    if (pQI->pSubQueueInfo == NULL)
+        return (TRUE);
+
+    for (QueueID = 1; QueueID <= pQI->NumSubIoQCreated; QueueID++) {
+        pSQI = pQI->pSubQueueInfo + QueueID;
+
+        for (CmdID = 0; CmdID < pSQI->SubQEntries; CmdID++) {
+            pCmdEntry = GET_CMD_ENTRY(pSQI, CmdID);
+            if (pCmdEntry->Pending == FALSE)
+                continue;
+
+            pSrbExtension = (PNVME_SRB_EXTENSION)pCmdEntry->Context;
+            if ((pSrbExtension != NULL) && (pSrbExtension->pSrb != NULL) &&
+                (GET_LUN_ID(pSrbExtension->pSrb) == Lun))
+                return (FALSE);
+        }
+    }
+
+    return (TRUE);
+} /* NVMeLunQuiesced */
+
+/*******************************************************************************
+ * NVMeGetTimeStampUs
+ *
+ * @brief NVMeGetTimeStampUs returns a time stamp in microseconds for measuring
+ *        command latency. The performance counter is used where Storport has
+ *        it, the 10-15 ms granular system time would hide most admin commands.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ *
+ * @return ULONGLONG
+ *     Time stamp in us, only meaningful as a difference to another one
+ ******************************************************************************/
+ULONGLONG NVMeGetTimeStampUs(
+    PNVME_DEVICE_EXTENSION pAE
+)
+{
+    LARGE_INTEGER Count;
+#if (NTDDI_VERSION > NTDDI_WIN7)
+    LARGE_INTEGER Frequency;
+
+    if ((StorPortQueryPerformanceCounter(pAE,
+                                         &Frequency,
+                                         &Count) == STOR_STATUS_SUCCESS) &&
+        (Frequency.QuadPart != 0)) {
+        return (ULONGLONG)((Count.QuadPart / Frequency.QuadPart) * 1000000 +
+                           ((Count.QuadPart % Frequency.QuadPart) * 1000000) /
+                           Frequency.QuadPart);
+    }
+#else
+    UNREFERENCED_PARAMETER(pAE);
+#endif
+
+    /* System time is in 100ns units */
+    StorPortQuerySystemTime(&Count);
+    return (ULONGLONG)(Count.QuadPart / 10);
+} /* NVMeGetTimeStampUs */
+
+/*******************************************************************************
+ * NVMeLatencyInit
+ *
+ * @brief NVMeLatencyInit gets called once at passive init to allocate the
+ *        latency histograms, one per possible completion queue including the
+ *        admin queue. Without them, i.e. in dump mode, commands aren't timed.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ *
+ * @return BOOLEAN
+ *     TRUE - If the histograms are allocated
+ *     FALSE - If anything goes wrong
+ ******************************************************************************/
+BOOLEAN NVMeLatencyInit(
+    PNVME_DEVICE_EXTENSION pAE
+)
+{
+    pAE->NumLatencyHist = pAE->ResMapTbl.NumActiveCores + 1;
+    pAE->pLatencyHist = (PLATENCY_HIST)NVMeAllocatePool(pAE,
+                            sizeof(LATENCY_HIST) * pAE->NumLatencyHist);
+    if (pAE->pLatencyHist == NULL) {
+        pAE->NumLatencyHist = 0;
+        return (FALSE);
+    }
+
+    return (TRUE);
+} /* NVMeLatencyInit */
+
+/*******************************************************************************
+ * NVMeLatencyRecord
+ *
+ * @brief NVMeLatencyRecord adds one completion to the histogram of its queue
+ *        and opcode class. It's called from NVMeCompleteCmd, i.e. the queue's
+ *        completion path. AER is left out, it stays outstanding until there's
+ *        an event. Admin completions also feed the admin latency totals.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ * @param CplQueueID - Completion queue the command completed on
+ * @param pSrbExt - SRB extension of the command
+ * @param LatencyUs - Submit to complete latency
+ *
+ * @return VOID
+ ******************************************************************************/
+VOID NVMeLatencyRecord(
+    PNVME_DEVICE_EXTENSION pAE,
+    USHORT CplQueueID,
+    PNVME_SRB_EXTENSION pSrbExt,
+    ULONGLONG LatencyUs
+)
+{
+    PLATENCY_HIST_CLASS pHist = NULL;
+    ULONGLONG Value = LatencyUs;
+    ULONGLONG Below = 0;
+    ULONG Bucket = 0;
+
+    if ((pAE->pLatencyHist == NULL) || (CplQueueID >= pAE->NumLatencyHist))
+        return;
+
+    if (CplQueueID == 0) {
+        if (pSrbExt->nvmeSqeUnit.CDW0.OPC == ADMIN_ASYNCHRONOUS_EVENT_REQUEST)
+            return;
+
+        pAE->AdminCompletions++;
+        pAE->AdminLatencyTotalUs += LatencyUs;
+        if (LatencyUs > pAE->AdminLatencyMaxUs)
+            pAE->AdminLatencyMaxUs = LatencyUs;
+    }
+
+    /* Bucket N holds 2^N to 2^(N+1) us */
+    while ((Value > 1) && (Bucket < (NVME_LAT_BUCKETS - 1))) {
+        Value >>= 1;
+        Bucket++;
+    }
+
+    pHist = &pAE->pLatencyHist[CplQueueID].Class[NVMeLatencyClass(CplQueueID,
+                                                                  pSrbExt)];
+    pHist->Count++;
+    pHist->TotalUs += LatencyUs;
+    if (LatencyUs > pHist->MaxUs)
+        pHist->MaxUs = LatencyUs;
+    pHist->Buckets[Bucket]++;
+
+    /*
+     * Every SLOW_CMD_P999_INTERVAL completions, find the bucket the p99.9
+     * falls in and keep its top for the slow command log.
+     */
+    if ((pHist->Count % SLOW_CMD_P999_INTERVAL) == 0) {
+        for (Bucket = 0; Bucket < (NVME_LAT_BUCKETS - 1); Bucket++) {
+            Below += pHist->Buckets[Bucket];
+            if (Below >= (pHist->Count - (pHist->Count / 1000)))
+                break;
+        }
+
+        if (Bucket < (NVME_LAT_BUCKETS - 1))
+            pHist->P999Us = (ULONG64)2 << Bucket;
+        else
+            pHist->P999Us = pHist->MaxUs;
+    }
+} /* NVMeLatencyRecord */
+
+/*******************************************************************************
+ * NVMeLatencyClass
+ *
+ * @brief NVMeLatencyClass returns the NVME_LAT_CLASS_XXX a command is
+ *        counted under, everything on the admin queue is NVME_LAT_CLASS_ADMIN.
+ *
+ * @param CplQueueID - Completion queue the command completed on
+ * @param pSrbExt - SRB extension of the command
+ *
+ * @return ULONG
+ *     The opcode class
+ ******************************************************************************/
+ULONG NVMeLatencyClass(
+    USHORT CplQueueID,
+    PNVME_SRB_EXTENSION pSrbExt
+)
+{
+    if (CplQueueID == 0)
+        return (NVME_LAT_CLASS_ADMIN);
+
+    switch (pSrbExt->nvmeSqeUnit.CDW0.OPC) {
+    case NVM_READ:
+        return (NVME_LAT_CLASS_READ);
+    case NVM_WRITE:
+        return (NVME_LAT_CLASS_WRITE);
+    case NVM_FLUSH:
+        return (NVME_LAT_CLASS_FLUSH);
+    case NVM_DATASET_MANAGEMENT:
+        return (NVME_LAT_CLASS_DSM);
+    default:
+    break;
+    }
+
+    return (NVME_LAT_CLASS_OTHER);
+} /* NVMeLatencyClass */
+
+/*******************************************************************************
+ * NVMeLatencyGetHistogram
+ *
+ * @brief NVMeLatencyGetHistogram returns the histogram of one queue, or the
+ *        sum over all queues with NVME_LAT_ALL_QUEUES, for one opcode class.
+ *        The histograms are read without locks, a completion landing at the
+ *        same time may or may not be counted.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ * @param QueueId - Completion queue ID or NVME_LAT_ALL_QUEUES
+ * @param OpClass - NVME_LAT_CLASS_XXX
+ * @param pHistOut - Caller prepared buffer for the histogram
+ *
+ * @return BOOLEAN
+ *     TRUE - If the histogram is returned
+ *     FALSE - If there are no histograms or the parameters are invalid
+ ******************************************************************************/
+BOOLEAN NVMeLatencyGetHistogram(
+    PNVME_DEVICE_EXTENSION pAE,
+    ULONG QueueId,
+    ULONG OpClass,
+    PLATENCY_HIST_CLASS pHistOut
+)
+{
+    PLATENCY_HIST_CLASS pHist = NULL;
+    ULONG First = QueueId;
+    ULONG Last = QueueId;
+    ULONG Queue;
+    ULONG Bucket;
+
+    if ((pAE->pLatencyHist == NULL) || (OpClass >= NVME_LAT_CLASSES))
+        return (FALSE);
+
+    if (QueueId == NVME_LAT_ALL_QUEUES) {
+        First = 0;
+        Last = pAE->NumLatencyHist - 1;
+    } else if (QueueId >= pAE->NumLatencyHist) {
+        return (FALSE);
+    }
+
+    memset(pHistOut, 0, sizeof(LATENCY_HIST_CLASS));
+
+    for (Queue = First; Queue <= Last; Queue++) {
+        pHist = &pAE->pLatencyHist[Queue].Class[OpClass];
+        pHistOut->Count += pHist->Count;
+        pHistOut->TotalUs += pHist->TotalUs;
+        pHistOut->MaxUs = max(pHistOut->MaxUs, pHist->MaxUs);
+        for (Bucket = 0; Bucket < NVME_LAT_BUCKETS; Bucket++)
+            pHistOut->Buckets[Bucket] += pHist->Buckets[Bucket];
+    }
+
+    return (TRUE);
+} /* NVMeLatencyGetHistogram */
+
+/*******************************************************************************
+ * NVMeLatencyReset
+ *
+ * @brief NVMeLatencyReset clears all histograms and the admin latency totals.
+ *        The completion paths keep updating them meanwhile, every counter is
+ *        swapped for 0 on its own so none is ever seen half written.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ *
+ * @return VOID
+ ******************************************************************************/
+VOID NVMeLatencyReset(
+    PNVME_DEVICE_EXTENSION pAE
+)
+{
+    PLATENCY_HIST_CLASS pHist = NULL;
+    ULONG Queue;
+    ULONG OpClass;
+    ULONG Bucket;
+
+    if (pAE->pLatencyHist == NULL)
+        return;
+
+    for (Queue = 0; Queue < pAE->NumLatencyHist; Queue++) {
+        for (OpClass = 0; OpClass < NVME_LAT_CLASSES; OpClass++) {
+            pHist = &pAE->pLatencyHist[Queue].Class[OpClass];
+            InterlockedExchange64((volatile LONG64 *)&pHist->Count, 0);
+            InterlockedExchange64((volatile LONG64 *)&pHist->TotalUs, 0);
+            InterlockedExchange64((volatile LONG64 *)&pHist->MaxUs, 0);
+            InterlockedExchange64((volatile LONG64 *)&pHist->P999Us, 0);
+            for (Bucket = 0; Bucket < NVME_LAT_BUCKETS; Bucket++)
+                InterlockedExchange64(
+                    (volatile LONG64 *)&pHist->Buckets[Bucket], 0);
+        }
+    }
+
+    InterlockedExchange64((volatile LONG64 *)&pAE->AdminCompletions, 0);
+    InterlockedExchange64((volatile LONG64 *)&pAE->AdminLatencyTotalUs, 0);
+    InterlockedExchange64((volatile LONG64 *)&pAE->AdminLatencyMaxUs, 0);
+} /* NVMeLatencyReset */
+
+/*******************************************************************************
+ * NVMeSlowCmdInit
+ *
+ * @brief NVMeSlowCmdInit gets called once at passive init to allocate the
+ *        slow command log. Commands aren't timed in dump mode, so there's no
+ *        log then either.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ *
+ * @return BOOLEAN
+ *     TRUE - If the log is allocated or not needed
+ *     FALSE - If anything goes wrong
+ ******************************************************************************/
+BOOLEAN NVMeSlowCmdInit(
+    PNVME_DEVICE_EXTENSION pAE
+)
+{
+    if (pAE->pLatencyHist == NULL)
+        return (TRUE);
+
+    pAE->SlowCmdNext = 0;
+    pAE->pSlowCmdLog = (PNVME_SLOW_CMD_RECORD)NVMeAllocatePool(pAE,
+                            sizeof(NVME_SLOW_CMD_RECORD) * SLOW_CMD_LOG_ENTRIES);
+    if (pAE->pSlowCmdLog == NULL)
+        return (FALSE);
+
+    return (TRUE);
+} /* NVMeSlowCmdInit */
+
+/*******************************************************************************
+ * NVMeSlowCmdRecord
+ *
+ * @brief NVMeSlowCmdRecord gets called for every command the controller
+ *        completes, once its latency is known, and logs it with its SQE and
+ *        CQE if it took longer than SlowCmdThresholdUs or the p99.9 of its
+ *        queue and opcode class. Completion paths of different queues can
+ *        get here at the same time, each claims its own slot. Seq is cleared
+ *        before the record is filled in and set last, so a reader can tell
+ *        a record that changed under it.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ * @param pSrbExt - SRB extension of the command
+ * @param pCplEntry - The command's completion queue entry
+ *
+ * @return VOID
+ ******************************************************************************/
+VOID NVMeSlowCmdRecord(
+    PNVME_DEVICE_EXTENSION pAE,
+    PNVME_SRB_EXTENSION pSrbExt,
+    PNVMe_COMPLETION_QUEUE_ENTRY pCplEntry
+)
+{
+    PNVME_SLOW_CMD_RECORD pRecord = NULL;
+    PLATENCY_HIST_CLASS pHist = NULL;
+    USHORT CplQueueID;
+    ULONG Reason = 0;
+    ULONG Slot;
+
+    if (pAE->pSlowCmdLog == NULL)
+        return;
+
+    CplQueueID =
+        pAE->QueueInfo.pSubQueueInfo[pCplEntry->DW2.SQID].CplQueueID;
+    if (CplQueueID >= pAE->NumLatencyHist)
+        return;
+
+    /* AER stays outstanding until there's an event, it's never slow */
+    if ((CplQueueID == 0) &&
+        (pSrbExt->nvmeSqeUnit.CDW0.OPC == ADMIN_ASYNCHRONOUS_EVENT_REQUEST))
+        return;
+
+    pHist = &pAE->pLatencyHist[CplQueueID].Class[NVMeLatencyClass(CplQueueID,
+                                                                  pSrbExt)];
+
+    if ((pAE->InitInfo.SlowCmdThresholdUs != 0) &&
+        (pSrbExt->LatencyUs >= pAE->InitInfo.SlowCmdThresholdUs))
+        Reason |= NVME_SLOW_CMD_THRESHOLD;
+
+    if ((pHist->P999Us != 0) && (pSrbExt->LatencyUs > pHist->P999Us))
+        Reason |= NVME_SLOW_CMD_P999;
+
+    if (Reason == 0)
+        return;
+
+    Slot = (ULONG)(InterlockedIncrement(&pAE->SlowCmdNext) - 1);
+    pRecord = &pAE->pSlowCmdLog[Slot % SLOW_CMD_LOG_ENTRIES];
+
+    pRecord->Seq = 0;
+    MemoryBarrier();
+
+    pRecord->CompleteTimeUs = NVMeGetTimeStampUs(pAE);
+    pRecord->SubmitTimeUs = pRecord->CompleteTimeUs - pSrbExt->LatencyUs;
+    pRecord->P999Us = pHist->P999Us;
+    pRecord->SubQueueId = pCplEntry->DW2.SQID;
+    pRecord->CplQueueId = CplQueueID;
+    pRecord->SubmitCore = pSrbExt->SubmitCore;
+    pRecord->CompleteCore = (USHORT)KeGetCurrentProcessorNumberEx(NULL);
+    pRecord->Reason = Reason;
+    StorPortCopyMemory(pRecord->Sqe,
+                       &pSrbExt->nvmeSqeUnit,
+                       sizeof(pRecord->Sqe));
+    StorPortCopyMemory(pRecord->Cqe, pCplEntry, sizeof(pRecord->Cqe));
+
+    MemoryBarrier();
+    pRecord->Seq = Slot + 1;
+} /* NVMeSlowCmdRecord */
+
+/*******************************************************************************
+ * NVMeSrbTraceInit
+ *
+ * @brief NVMeSrbTraceInit gets called once at passive init to allocate the
+ *        SRB trace when SrbTraceEntries asks for one. It's rounded down to a
+ *        power of 2 so positions wrap with a mask. Nothing is recorded in
+ *        dump mode. The stages are timed with the performance counter, where
+ *        Storport has one.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ *
+ * @return BOOLEAN
+ *     TRUE - If the trace is allocated or not wanted
+ *     FALSE - If anything goes wrong
+ ******************************************************************************/
+BOOLEAN NVMeSrbTraceInit(
+    PNVME_DEVICE_EXTENSION pAE
+)
+{
+    ULONG Entries = pAE->InitInfo.SrbTraceEntries;
+#if (NTDDI_VERSION > NTDDI_WIN7)
+    LARGE_INTEGER Frequency;
+    LARGE_INTEGER Count;
+#endif
+
+    if ((pAE->ntldrDump == TRUE) || (Entries == 0))
+        return (TRUE);
+
+    /* Round down to a power of 2 */
+    while ((Entries & (Entries - 1)) != 0)
+        Entries &= (Entries - 1);
+
+    pAE->SrbTraceNext = 0;
+    pAE->SrbTraceRead = 0;
+    memset((PVOID)pAE->SrbStageTicks, 0, sizeof(pAE->SrbStageTicks));
+    memset((PVOID)pAE->SrbStageCalls, 0, sizeof(pAE->SrbStageCalls));
+    pAE->SrbStageFrequency = 0;
+#if (NTDDI_VERSION > NTDDI_WIN7)
+    if (StorPortQueryPerformanceCounter(pAE,
+                                        &Frequency,
+                                        &Count) == STOR_STATUS_SUCCESS)
+        pAE->SrbStageFrequency = (ULONGLONG)Frequency.QuadPart;
+#endif
+
+    pAE->pSrbTrace = (PNVME_SRB_TRACE_RECORD)NVMeAllocatePool(pAE,
+                         sizeof(NVME_SRB_TRACE_RECORD) * Entries);
+    if (pAE->pSrbTrace == NULL)
+        return (FALSE);
+
+    pAE->SrbTraceEntries = Entries;
+
+    return (TRUE);
+} /* NVMeSrbTraceInit */
+
+/*******************************************************************************
+ * NVMeSrbTraceRecord
+ *
+ * @brief NVMeSrbTraceRecord records a SCSI request as it enters BuildIo: its
+ *        CDB, LUN, length, SG list shape, the core and when. BuildIo runs on
+ *        any number of cores at once, each claims its own position, clears
+ *        its Seq before touching the body and publishes the record by
+ *        writing its Seq last, so a reader racing a writer that lapped it
+ *        sees the Seq change across its copy.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ * @param pSrb - This parameter specifies the SCSI I/O request.
+ *
+ * @return VOID
+ ******************************************************************************/
+VOID NVMeSrbTraceRecord(
+    PNVME_DEVICE_EXTENSION pAE,
+#if (NTDDI_VERSION > NTDDI_WIN7)
+    PSTORAGE_REQUEST_BLOCK pSrb
+#else
+    PSCSI_REQUEST_BLOCK pSrb
+#endif
+)
+{
+    PNVME_SRB_TRACE_RECORD pRecord = NULL;
+    PSTOR_SCATTER_GATHER_LIST pSgl = NULL;
+    PSUB_QUEUE_INFO pSQI = NULL;
+    PROCESSOR_NUMBER ProcNumber = {0};
+    USHORT SubQueue = 0;
+    USHORT CplQueue = 0;
+    ULONG Pos;
+    ULONG Elem;
+    ULONG Last;
+
+    if (pAE->pSrbTrace == NULL)
+        return;
+
+    Pos = (ULONG)(InterlockedIncrement(&pAE->SrbTraceNext) - 1);
+    pRecord = &pAE->pSrbTrace[Pos & (pAE->SrbTraceEntries - 1)];
+
+    /* Retire whatever the slot held before rewriting it */
+    pRecord->Seq = 0;
+    MemoryBarrier();
+
+    pRecord->TimeStampUs = NVMeGetTimeStampUs(pAE);
+    pRecord->Core = (USHORT)KeGetCurrentProcessorNumberEx(&ProcNumber);
+
+    /* Occupancy of the SQ this core submits to, a racy sample is enough */
+    pRecord->QueueDepth = 0;
+    if ((pAE->DriverState.NextDriverState == NVMeStartComplete) &&
+        (pAE->QueueInfo.pSubQueueInfo != NULL) &&
+        (NVMeMapCore2Queue(pAE,
+                           &ProcNumber,
+                           &SubQueue,
+                           &CplQueue) == STOR_STATUS_SUCCESS)) {
+        pSQI = pAE->QueueInfo.pSubQueueInfo + SubQueue;
+        if (pSQI->SubQEntries != 0)
+            pRecord->QueueDepth = (USHORT)((pSQI->SubQTailPtr +
+                pSQI->SubQEntries - pSQI->SubQHeadPtr) % pSQI->SubQEntries);
+    }
+    pRecord->Lun = SrbGetLun((PVOID)pSrb);
+    pRecord->CdbLength = (UCHAR)min(GET_CDB_LENGTH(pSrb), sizeof(pRecord->Cdb));
+    StorPortCopyMemory(pRecord->Cdb,
+                       SrbGetCdb((PVOID)pSrb),
+                       pRecord->CdbLength);
+    pRecord->DataLength = GET_DATA_LENGTH(pSrb);
+    pRecord->SrbFlags = GET_SRB_FLAGS(pSrb);
+    pRecord->SgElements = 0;
+    pRecord->SgFirstOffset = 0;
+    pRecord->SgFlags = 0;
+
+    if (pRecord->DataLength != 0)
+        pSgl = StorPortGetScatterGatherList(pAE, (PSCSI_REQUEST_BLOCK)pSrb);
+
+    if ((pSgl != NULL) && (pSgl->NumberOfElements != 0)) {
+        pRecord->SgElements = (USHORT)pSgl->NumberOfElements;
+        pRecord->SgFirstOffset =
+            (USHORT)(pSgl->List[0].PhysicalAddress.LowPart & (PAGE_SIZE - 1));
+
+        /*
+         * PRPs take it as is when everything but the first element starts
+         * on a page and everything but the last ends on one.
+         */
+        pRecord->SgFlags = NVME_SRB_TRACE_SG_PRP_ALIGNED;
+        Last = pSgl->NumberOfElements - 1;
+        for (Elem = 0; Elem <= Last; Elem++) {
+            if (((Elem != 0) &&
+                 ((pSgl->List[Elem].PhysicalAddress.LowPart &
+                   (PAGE_SIZE - 1)) != 0)) ||
+                ((Elem != Last) &&
+                 (((pSgl->List[Elem].PhysicalAddress.LowPart +
+                    pSgl->List[Elem].Length) & (PAGE_SIZE - 1)) != 0))) {
+                pRecord->SgFlags &= ~NVME_SRB_TRACE_SG_PRP_ALIGNED;
+                break;
+            }
+        }
+    }
+
+    /* Publish the record */
+    MemoryBarrier();
+    pRecord->Seq = Pos + 1;
+} /* NVMeSrbTraceRecord */
+
+/*******************************************************************************
+ * NVMeSrbStageStart
+ *
+ * @brief NVMeSrbStageStart starts timing a stage of an IO, see
+ *        NVME_SRB_STAGE_XXX, while the SRB trace is on.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ *
+ * @return ULONGLONG
+ *     Performance counter to hand to NVMeSrbStageEnd, 0 if not timing
+ ******************************************************************************/
+ULONGLONG NVMeSrbStageStart(
+    PNVME_DEVICE_EXTENSION pAE
+)
+{
+#if (NTDDI_VERSION > NTDDI_WIN7)
+    LARGE_INTEGER Count;
+
+    if ((pAE->pSrbTrace == NULL) || (pAE->SrbStageFrequency == 0))
+        return (0);
+
+    if (StorPortQueryPerformanceCounter(pAE, NULL, &Count) !=
+        STOR_STATUS_SUCCESS)
+        return (0);
+
+    return ((ULONGLONG)Count.QuadPart);
+#else
+    UNREFERENCED_PARAMETER(pAE);
+
+    return (0);
+#endif
+} /* NVMeSrbStageStart */
+
+/*******************************************************************************
+ * NVMeSrbStageEnd
+ *
+ * @brief NVMeSrbStageEnd adds the time since NVMeSrbStageStart to the stage
+ *        and counts one call of it. Stages run on any number of cores at
+ *        once, hence the interlocked adds.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ * @param Stage - NVME_SRB_STAGE_XXX timed.
+ * @param StartTicks - What NVMeSrbStageStart returned.
+ *
+ * @return VOID
+ ******************************************************************************/
+VOID NVMeSrbStageEnd(
+    PNVME_DEVICE_EXTENSION pAE,
+    ULONG Stage,
+    ULONGLONG StartTicks
+)
+{
+    ULONGLONG EndTicks;
+
+    if ((StartTicks == 0) || (Stage >= NVME_SRB_STAGES))
+        return;
+
+    EndTicks = NVMeSrbStageStart(pAE);
+    if (EndTicks < StartTicks)
+        return;
+
+    InterlockedExchangeAdd64(&pAE->SrbStageTicks[Stage],
+                             (LONG64)(EndTicks - StartTicks));
+    InterlockedIncrement64(&pAE->SrbStageCalls[Stage]);
+} /* NVMeSrbStageEnd */
+
+/*******************************************************************************
+ * NVMeQosInit
+ *
+ * @brief NVMeQosInit gets called once at passive init to allocate the per
+ *        namespace QoS table, indexed by LUN, and give every namespace the
+ *        default limits from the registry. Without the table, i.e. in dump
+ *        mode, nothing is throttled.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ *
+ * @return BOOLEAN
+ *     TRUE - If the table is allocated
+ *     FALSE - If anything goes wrong
+ ******************************************************************************/
+BOOLEAN NVMeQosInit(
+    PNVME_DEVICE_EXTENSION pAE
+)
+{
+    PQOS_INFO pQos = NULL;
+    ULONG Lun;
+
+    pAE->pQosInfo = (PQOS_INFO)NVMeAllocatePool(pAE,
+                                   sizeof(QOS_INFO) * MAX_NAMESPACES);
+    if (pAE->pQosInfo == NULL)
+        return (FALSE);
+
+    /* One set of completion counters per queue, same as the histograms */
+    pAE->NumQosQueues = pAE->ResMapTbl.NumActiveCores + 1;
+    pAE->pQosCompleted = (PQOS_QUEUE_COUNT)NVMeAllocatePool(pAE,
+        sizeof(QOS_QUEUE_COUNT) * MAX_NAMESPACES * pAE->NumQosQueues);
+    if (pAE->pQosCompleted == NULL)
+        pAE->NumQosQueues = 0;
+
+    for (Lun = 0; Lun < MAX_NAMESPACES; Lun++) {
+        pQos = pAE->pQosInfo + Lun;
+        InitializeListHead(&pQos->DeferredList);
+        NVMeQosSetLimits(pAE,
+                         pQos,
+                         pAE->InitInfo.QosIopsLimit,
+                         pAE->InitInfo.QosBandwidthLimit);
+    }
+
+    return (TRUE);
+} /* NVMeQosInit */
+
+/*******************************************************************************
+ * NVMeQosSetLimits
+ *
+ * @brief NVMeQosSetLimits gets called to change the limits of a namespace.
+ *        The buckets start out full so a new limit doesn't stall the IO that
+ *        is already flowing.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ * @param pQos - QoS info of the namespace
+ * @param IopsLimit - Commands per second, 0 for no limit
+ * @param BandwidthLimit - KB per second, 0 for no limit
+ *
+ * @return VOID
+ ******************************************************************************/
+VOID NVMeQosSetLimits(
+    PNVME_DEVICE_EXTENSION pAE,
+    PQOS_INFO pQos,
+    ULONG IopsLimit,
+    ULONG BandwidthLimit
+)
+{
+    pQos->IopsLimit = IopsLimit;
+    pQos->BandwidthLimit = BandwidthLimit;
+    pQos->IoTokens = max((LONGLONG)IopsLimit * QOS_BURST_US, QOS_TOKEN_SCALE);
+    pQos->ByteTokens = (LONGLONG)BandwidthLimit * 1024 * QOS_BURST_US;
+    pQos->LastRefillUs = NVMeGetTimeStampUs(pAE);
+} /* NVMeQosSetLimits */
+
+/*******************************************************************************
+ * NVMeQosAdmit
+ *
+ * @brief NVMeQosAdmit refills the buckets of a namespace for the time passed
+ *        since the last refill and takes one command and Length bytes out of
+ *        them if there's at least a command's worth and any bytes left. A
+ *        large transfer may take the byte bucket below 0, which then holds
+ *        back the following ones until it's paid off. Times come from
+ *        NVMeGetTimeStampUs, the system time's 10-15 ms ticks would refill
+ *        the buckets in lumps far coarser than the QoS timer.
+ *
+ * @param pQos - QoS info of the namespace
+ * @param NowUs - NVMeGetTimeStampUs of the caller
+ * @param Length - Transfer length of the request
+ *
+ * @return BOOLEAN
+ *     TRUE - The request may be issued
+ *     FALSE - The request has to wait
+ ******************************************************************************/
+BOOLEAN NVMeQosAdmit(
+    PQOS_INFO pQos,
+    ULONGLONG NowUs,
+    ULONG Length
+)
+{
+    LONGLONG ElapsedUs;
+
+    /* Without a performance counter a clock stepping back restarts it */
+    ElapsedUs = (LONGLONG)(NowUs - pQos->LastRefillUs);
+    if (ElapsedUs < 0) {
+        pQos->LastRefillUs = NowUs;
+    } else if (ElapsedUs > 0) {
+        pQos->LastRefillUs = NowUs;
+        ElapsedUs = min(ElapsedUs, QOS_BURST_US);
+        pQos->IoTokens = min(pQos->IoTokens +
+                             ((LONGLONG)pQos->IopsLimit * ElapsedUs),
+                             max((LONGLONG)pQos->IopsLimit * QOS_BURST_US,
+                                 QOS_TOKEN_SCALE));
+        pQos->ByteTokens = min(pQos->ByteTokens +
+                               ((LONGLONG)pQos->BandwidthLimit * 1024 * ElapsedUs),
+                               (LONGLONG)pQos->BandwidthLimit * 1024 * QOS_BURST_US);
+    }
+
+    if (((pQos->IopsLimit != 0) && (pQos->IoTokens < QOS_TOKEN_SCALE)) ||
+        ((pQos->BandwidthLimit != 0) && (pQos->ByteTokens <= 0)))
+        return (FALSE);
+
+    if (pQos->IopsLimit != 0)
+        pQos->IoTokens -= QOS_TOKEN_SCALE;
+
+    if (pQos->BandwidthLimit != 0)
+        pQos->ByteTokens -= (LONGLONG)Length * QOS_TOKEN_SCALE;
+
+    return (TRUE);
+} /* NVMeQosAdmit */
+
+/*******************************************************************************
+ * NVMeQosDefer
+ *
+ * @brief NVMeQosDefer gets called from StartIo, with the StartIo lock held,
+ *        for every host IO. Reads and writes of a namespace with limits are
+ *        put on its deferred list when the buckets are empty, or when others
+ *        are already waiting so they keep their order, instead of being
+ *        busied back. They're released by NVMeQosRelease from completions
+ *        and the QoS timer.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ * @param pSrbExt - SRB extension of the request
+ *
+ * @return BOOLEAN
+ *     TRUE - The request was deferred, the caller must not issue it
+ *     FALSE - The request can be issued now
+ ******************************************************************************/
+BOOLEAN NVMeQosDefer(
+    PNVME_DEVICE_EXTENSION pAE,
+    PNVME_SRB_EXTENSION pSrbExt
+)
+{
+    PQOS_INFO pQos = NULL;
+    ULONGLONG NowUs;
+    ULONG Lun;
+
+    if ((pAE->pQosInfo == NULL) || (pSrbExt->pSrb == NULL))
+        return (FALSE);
+
+    if ((pSrbExt->nvmeSqeUnit.CDW0.OPC != NVM_READ) &&
+        (pSrbExt->nvmeSqeUnit.CDW0.OPC != NVM_WRITE))
+        return (FALSE);
+
+    Lun = GET_LUN_ID(pSrbExt->pSrb);
+    if (Lun >= MAX_NAMESPACES)
+        return (FALSE);
+
+    pQos = pAE->pQosInfo + Lun;
+    if ((pQos->IopsLimit == 0) && (pQos->BandwidthLimit == 0))
+        return (FALSE);
+
+    NowUs = NVMeGetTimeStampUs(pAE);
+    if ((pQos->NumDeferred == 0) &&
+        (NVMeQosAdmit(pQos, NowUs, GET_DATA_LENGTH(pSrbExt->pSrb)) == TRUE))
+        return (FALSE);
+
+    pSrbExt->QosDeferUs = NowUs;
+    InsertTailList(&pQos->DeferredList, &pSrbExt->QosListEntry);
+    pQos->NumDeferred++;
+    pQos->ThrottledRequests++;
+    pAE->QosDeferred++;
+
+    /* Completions may not come, make sure the timer releases them */
+    NVMeQosArmTimer(pAE);
+
+    return (TRUE);
+} /* NVMeQosDefer */
+
+/*******************************************************************************
+ * NVMeQosArmTimer
+ *
+ * @brief NVMeQosArmTimer arms the QoS timer unless it already is, or nothing
+ *        deferred can be released by it. Those of a namespace holding its IO
+ *        for a format wait for NVMeFormatNVMRelease. The caller holds the
+ *        StartIo lock.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ *
+ * @return VOID
+ ******************************************************************************/
+VOID NVMeQosArmTimer(
+    PNVME_DEVICE_EXTENSION pAE
+)
+{
+#if (NTDDI_VERSION > NTDDI_WIN7)
+    ULONG Releasable = pAE->QosDeferred;
+
+    if ((pAE->QosTimerArmed == TRUE) || (pAE->QosTimerhandle == NULL) ||
+        (pAE->pQosInfo == NULL))
+        return;
+
+    if ((pAE->FormatNvmInfo.HoldIo == TRUE) &&
+        (pAE->FormatNvmInfo.TargetLun < MAX_NAMESPACES))
+        Releasable -=
+            pAE->pQosInfo[pAE->FormatNvmInfo.TargetLun].NumDeferred;
+
+    if (Releasable == 0)
+        return;
+
+    if (StorPortRequestTimer(pAE,
+                             pAE->QosTimerhandle,
+                             NVMeQosTimer,
+                             NULL,
+                             QOS_TIMER_INTERVAL_US,
+                             0) == STOR_STATUS_SUCCESS)
+        pAE->QosTimerArmed = TRUE;
+#else
+    UNREFERENCED_PARAMETER(pAE);
+#endif
+} /* NVMeQosArmTimer */
+
+/*******************************************************************************
+ * NVMeQosRelease
+ *
+ * @brief NVMeQosRelease issues deferred requests, oldest first per namespace,
+ *        for as long as the buckets allow. The caller holds the StartIo lock.
+ *        Nothing is released while the controller isn't running, a reset
+ *        completes the deferred requests through NVMeQosFlush instead, nor
+ *        for a namespace holding its IO while it formats.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ *
+ * @return VOID
+ ******************************************************************************/
+VOID NVMeQosRelease(
+    PNVME_DEVICE_EXTENSION pAE
+)
+{
+    PQOS_INFO pQos = NULL;
+    PNVME_SRB_EXTENSION pSrbExt = NULL;
+    ULONGLONG NowUs;
+    ULONG Lun;
+
+    if ((pAE->QosDeferred == 0) ||
+        (pAE->DriverState.NextDriverState != NVMeStartComplete))
+        return;
+
+    NowUs = NVMeGetTimeStampUs(pAE);
+
+    for (Lun = 0; (Lun < MAX_NAMESPACES) && (pAE->QosDeferred != 0); Lun++) {
+        pQos = pAE->pQosInfo + Lun;
+
+        if ((pAE->FormatNvmInfo.HoldIo == TRUE) &&
+            (pAE->FormatNvmInfo.TargetLun == Lun))
+            continue;
+
+        while (pQos->NumDeferred != 0) {
+            pSrbExt = CONTAINING_RECORD(pQos->DeferredList.Flink,
+                                        NVME_SRB_EXTENSION,
+                                        QosListEntry);
+
+            if (NVMeQosAdmit(pQos,
+                             NowUs,
+                             GET_DATA_LENGTH(pSrbExt->pSrb)) == FALSE)
+                break;
+
+            RemoveHeadList(&pQos->DeferredList);
+            pQos->NumDeferred--;
+            pAE->QosDeferred--;
+            pQos->ThrottledTimeUs += NowUs - pSrbExt->QosDeferUs;
+
+            ProcessIo(pAE, pSrbExt, NVME_QUEUE_TYPE_IO, FALSE);
+        }
+    }
+} /* NVMeQosRelease */
+
+/*******************************************************************************
+ * NVMeQosCountCompletion
+ *
+ * @brief NVMeQosCountCompletion counts a completed read or write against its
+ *        namespace, whether or not it has limits, so NVME_NAMESPACE_QOS can
+ *        tell the throughput of each one apart. The counters are the
+ *        completion queue's own, its completion path runs on one core at a
+ *        time, so plain adds do.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ * @param CplQueueID - Completion queue the request completed on
+ * @param pSrbExt - SRB extension of the completed request
+ *
+ * @return VOID
+ ******************************************************************************/
+VOID NVMeQosCountCompletion(
+    PNVME_DEVICE_EXTENSION pAE,
+    USHORT CplQueueID,
+    PNVME_SRB_EXTENSION pSrbExt
+)
+{
+    PQOS_QUEUE_COUNT pCount = NULL;
+    ULONG Lun;
+
+    if ((pAE->pQosCompleted == NULL) || (CplQueueID >= pAE->NumQosQueues) ||
+        (pSrbExt->pSrb == NULL))
+        return;
+
+    if ((pSrbExt->nvmeSqeUnit.CDW0.OPC != NVM_READ) &&
+        (pSrbExt->nvmeSqeUnit.CDW0.OPC != NVM_WRITE))
+        return;
+
+    Lun = GET_LUN_ID(pSrbExt->pSrb);
+    if (Lun >= MAX_NAMESPACES)
+        return;
+
+    pCount = pAE->pQosCompleted + (CplQueueID * MAX_NAMESPACES) + Lun;
+    pCount->Requests++;
+    pCount->Bytes += GET_DATA_LENGTH(pSrbExt->pSrb);
+} /* NVMeQosCountCompletion */
+
+/*******************************************************************************
+ * NVMeQosFlush
+ *
+ * @brief NVMeQosFlush gets called from NVMeDetectPendingCmds, deferred
+ *        requests were never issued but are still owed a completion.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ * @param completeCmd - determines if deferred requests should be completed
+ * @param SrbStatus - Srb Status value for the completing SRBs
+ *
+ * @return BOOLEAN
+ *     TRUE if requests were deferred
+ *     FALSE if none were
+ ******************************************************************************/
+BOOLEAN NVMeQosFlush(
+    PNVME_DEVICE_EXTENSION pAE,
+    BOOLEAN completeCmd,
+    UCHAR SrbStatus
+)
+{
+    PQOS_INFO pQos = NULL;
+    PNVME_SRB_EXTENSION pSrbExt = NULL;
+    ULONG Lun;
+
+    if ((pAE->pQosInfo == NULL) || (pAE->QosDeferred == 0))
+        return (FALSE);
+
+    if (completeCmd == FALSE)
+        return (TRUE);
+
+    for (Lun = 0; Lun < MAX_NAMESPACES; Lun++) {
+        pQos = pAE->pQosInfo + Lun;
+
+        while (IsListEmpty(&pQos->DeferredList) == FALSE) {
+            pSrbExt = CONTAINING_RECORD(RemoveHeadList(&pQos->DeferredList),
+                                        NVME_SRB_EXTENSION,
+                                        QosListEntry);
+            pQos->NumDeferred--;
+            pAE->QosDeferred--;
+
+            pSrbExt->pSrb->SrbStatus = SrbStatus;
+            IO_StorPortNotification(RequestComplete, pAE, pSrbExt->pSrb);
+        }
+    }
+
+    return (TRUE);
+} /* NVMeQosFlush */
+
+/*******************************************************************************
+ * NVMeQosFlushLun
+ *
+ * @brief NVMeQosFlushLun completes the requests deferred for one namespace
+ *        without issuing them, when a format left them built for a block
+ *        format the namespace no longer has. The caller holds the StartIo
+ *        lock.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ * @param Lun - LUN of the namespace
+ * @param SrbStatus - Srb Status value for the completing SRBs
+ *
+ * @return VOID
+ ******************************************************************************/
+VOID NVMeQosFlushLun(
+    PNVME_DEVICE_EXTENSION pAE,
+    ULONG Lun,
+    UCHAR SrbStatus
+)
+{
+    PQOS_INFO pQos = NULL;
+    PNVME_SRB_EXTENSION pSrbExt = NULL;
+
+    if ((pAE->pQosInfo == NULL) || (Lun >= MAX_NAMESPACES))
+        return;
+
+    pQos = pAE->pQosInfo + Lun;
+    while (IsListEmpty(&pQos->DeferredList) == FALSE) {
+        pSrbExt = CONTAINING_RECORD(RemoveHeadList(&pQos->DeferredList),
+                                    NVME_SRB_EXTENSION,
+                                    QosListEntry);
+        pQos->NumDeferred--;
+        pAE->QosDeferred--;
+
+        pSrbExt->pSrb->SrbStatus = SrbStatus;
+        IO_StorPortNotification(RequestComplete, pAE, pSrbExt->pSrb);
+    }
+} /* NVMeQosFlushLun */
+
+#if (NTDDI_VERSION > NTDDI_WIN7)
+/*******************************************************************************
+ * NVMeQosTimer
+ *
+ * @brief NVMeQosTimer releases deferred requests when no completion is coming
+ *        to do it, e.g. a namespace limited to a handful of IOPS. Storport
+ *        calls it with the StartIo lock held. It's re-armed for as long as
+ *        requests it can release are left waiting, not for those of a
+ *        namespace holding its IO while it formats.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ * @param Context - Not used
+ *
+ * @return VOID
+ ******************************************************************************/
+VOID NVMeQosTimer(
+    PNVME_DEVICE_EXTENSION pAE,
+    PVOID Context
+)
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    pAE->QosTimerArmed = FALSE;
+    if (pAE->ShutdownInProgress == TRUE)
+        return;
+
+    NVMeQosRelease(pAE);
+    NVMeQosArmTimer(pAE);
+} /* NVMeQosTimer */
+#endif
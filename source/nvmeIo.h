@@ -67,7 +67,7 @@ BOOLEAN
 NVMeCompleteCmd(
     __in PNVME_DEVICE_EXTENSION pAE,
     __in USHORT QueueID,
-    __in SHORT NewHead,
+    __in LONG NewHead,
     __in USHORT CmdID,
     __in PVOID Context
 );
@@ -78,4 +78,13 @@ BOOLEAN NVMeDetectPendingCmds(
 	UCHAR SrbStatus
 );
 
+BOOLEAN NVMeIoQuiesced(
+    PNVME_DEVICE_EXTENSION pAE
+);
+
+BOOLEAN NVMeLunQuiesced(
+    PNVME_DEVICE_EXTENSION pAE,
+    ULONG Lun
+);
+
 #endif /* __NVME_IO_H__ */
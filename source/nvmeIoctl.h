@@ -66,6 +66,30 @@
 #define NVME_HOT_REMOVE_NAMESPACE \
     CTL_CODE(NVME_STORPORT_DRIVER, 0x803, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
+#define NVME_NAMESPACE_QOS \
+    CTL_CODE(NVME_STORPORT_DRIVER, 0x804, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define NVME_LATENCY_HISTOGRAM \
+    CTL_CODE(NVME_STORPORT_DRIVER, 0x805, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define NVME_HISTORY_SNAPSHOT \
+    CTL_CODE(NVME_STORPORT_DRIVER, 0x806, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define NVME_SLOW_CMD_LOG \
+    CTL_CODE(NVME_STORPORT_DRIVER, 0x807, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define NVME_SRB_TRACE \
+    CTL_CODE(NVME_STORPORT_DRIVER, 0x808, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define NVME_TUNABLES \
+    CTL_CODE(NVME_STORPORT_DRIVER, 0x809, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define NVME_FW_DOWNLOAD \
+    CTL_CODE(NVME_STORPORT_DRIVER, 0x80A, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define NVME_PROTECTION_INFO \
+    CTL_CODE(NVME_STORPORT_DRIVER, 0x80B, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
 #ifdef ENABLE_CSM_IOCTL
 #define NVME_NO_LOOK_PASS_THROUGH \
     CTL_CODE(NVME_STORPORT_DRIVER, 0x810, METHOD_BUFFERED, FILE_ANY_ACCESS)
@@ -132,7 +156,12 @@ enum _IOCTL_STATUS
      NVME_IOCTL_MAX_SSD_NAMESPACES_REACHED,
      NVME_IOCTL_ZERO_DATA_TX_LENGTH_ERROR,
      NVME_IOCTL_MAX_AER_REACHED,
-     NVME_IOCTL_ATTACH_NAMESPACE_FAILED
+     NVME_IOCTL_ATTACH_NAMESPACE_FAILED,
+     NVME_IOCTL_INVALID_TUNABLE,         // NVME_TUNABLES value out of range
+     NVME_IOCTL_QUIESCE_TIMEOUT,         // IO didn't drain to recreate queues
+     NVME_IOCTL_INVALID_FW_PARAMETER,    // NVME_FW_DOWNLOAD image, slot or size
+     NVME_IOCTL_FW_DOWNLOAD_FAILED,
+     NVME_IOCTL_FW_COMMIT_FAILED
 };
 
 #pragma pack(1)
@@ -250,4 +279,438 @@ typedef struct _NVME_SMART_READ_THRESHOLDS_DATA
 } NVME_SMART_READ_THRESHOLDS_DATA, *PNVME_SMART_READ_THRESHOLDS_DATA;
 #pragma pack()
 
+#pragma pack(1)
+/******************************************************************************
+ * NVMe Namespace QoS IOCTL data structure.
+ *
+ * Sent with NVME_NAMESPACE_QOS to read, or with Direction set to
+ * NVME_FROM_HOST_TO_DEV to change, the rate limits of one namespace. Limits
+ * of 0 mean unlimited. The counters are returned either way, sampling the
+ * completed ones gives the throughput of the namespace.
+ ******************************************************************************/
+typedef struct _NVME_NAMESPACE_QOS_IOCTL
+{
+    SRB_IO_CONTROL SrbIoCtrl;
+
+    /* LUN of the namespace */
+    ULONG          Lun;
+
+    /* NVME_FROM_HOST_TO_DEV sets the limits, anything else only reads */
+    ULONG          Direction;
+
+    /* Limits in IOs and KB per second */
+    ULONG          IopsLimit;
+    ULONG          BandwidthLimit;
+
+    /* Requests deferred now, ever deferred and their total wait */
+    ULONG          DeferredRequests;
+    ULONGLONG      ThrottledRequests;
+    ULONGLONG      ThrottledTimeUs;
+
+    /* Reads and writes completed so far */
+    ULONGLONG      CompletedRequests;
+    ULONGLONG      CompletedBytes;
+
+    /* Requests held now while the namespace formats */
+    ULONG          HeldRequests;
+} NVME_NAMESPACE_QOS_IOCTL, *PNVME_NAMESPACE_QOS_IOCTL;
+#pragma pack()
+
+/*
+ * Submit to complete latency histograms are kept per completion queue (0 is
+ * the admin queue) and per opcode class. Bucket 0 counts latencies below
+ * 2 us, bucket N those from 2^N up to 2^(N+1) us, the last one everything
+ * from there on.
+ */
+#define NVME_LAT_BUCKETS            24
+#define NVME_LAT_CLASS_READ         0
+#define NVME_LAT_CLASS_WRITE        1
+#define NVME_LAT_CLASS_FLUSH        2
+#define NVME_LAT_CLASS_DSM          3
+#define NVME_LAT_CLASS_ADMIN        4
+#define NVME_LAT_CLASS_OTHER        5
+#define NVME_LAT_CLASSES            6
+#define NVME_LAT_ALL_QUEUES         0xFFFFFFFF
+
+#pragma pack(1)
+/******************************************************************************
+ * NVMe Latency Histogram IOCTL data structure.
+ *
+ * Sent with NVME_LATENCY_HISTOGRAM to read the histogram of one completion
+ * queue, or of all of them summed up with NVME_LAT_ALL_QUEUES, for one
+ * NVME_LAT_CLASS_XXX. A non zero Reset clears all histograms once read.
+ * The Admin fields always cover every admin command but AER, whichever
+ * queue and class were asked for.
+ ******************************************************************************/
+typedef struct _NVME_LATENCY_HISTOGRAM_IOCTL
+{
+    SRB_IO_CONTROL SrbIoCtrl;
+
+    /* Completion queue ID or NVME_LAT_ALL_QUEUES, and opcode class */
+    ULONG          QueueId;
+    ULONG          OpClass;
+
+    /* Clear all histograms after reading */
+    ULONG          Reset;
+
+    /* Completions, their total and largest latency in us */
+    ULONGLONG      Count;
+    ULONGLONG      TotalUs;
+    ULONGLONG      MaxUs;
+    ULONGLONG      Buckets[NVME_LAT_BUCKETS];
+
+    /* Admin command completions, their total and largest latency in us */
+    ULONGLONG      AdminCount;
+    ULONGLONG      AdminTotalUs;
+    ULONGLONG      AdminMaxUs;
+} NVME_LATENCY_HISTOGRAM_IOCTL, *PNVME_LATENCY_HISTOGRAM_IOCTL;
+#pragma pack()
+
+/* Command history record tags */
+typedef enum _HISTORY_TAG
+{
+    NO_ENTRY = 0, // always first in the enum
+    GETCMD_RETURN_BUSY,
+    PRE_ISSUE,
+    ISSUE_RETURN_BUSY,
+    ISSUE,
+    COMPPLETE_CMD,
+    SRB_RESET_LUN,
+    SRB_RESET_BUS,
+    SRB_RESET_DEVICE,
+    DPC_RESET,
+    DETECTED_PENDING_CMD,
+    COMPLETE_CMD_RESET,
+    HISTORY_MARKER = 255 // always last in the enum
+} HISTORY_TAG;
+
+#pragma pack(1)
+/******************************************************************************
+ * NVMe command history record, 40 bytes.
+ *
+ * Submit records (GETCMD_RETURN_BUSY, PRE_ISSUE, ISSUE_RETURN_BUSY, ISSUE)
+ * carry the NSID in Parm0. PRE_ISSUE has the PRP entry count in Parm1 and
+ * PRP1/PRP2 in Parm2/Parm3, ISSUE the new SQ tail in Parm1.
+ *
+ * Complete records (COMPPLETE_CMD, COMPLETE_CMD_RESET) carry the SQ head in
+ * Parm0, completion DW3 in Parm1 and the completion routine in Parm2.
+ *
+ * DETECTED_PENDING_CMD has the opcode in Parm0, the NSID in Parm1 and PRP1/PRP2 in Parm2/Parm3,
+ * the SRB_RESET_XXX events the LUN in Parm1.
+ ******************************************************************************/
+typedef struct _NVME_HISTORY_RECORD
+{
+    /* NVMeGetTimeStampUs() when the record was written, 0 if never */
+    ULONGLONG      TimeStampUs;
+
+    UCHAR          Tag;
+    UCHAR          Opcode;
+    USHORT         QueueId;
+    USHORT         CID;
+    USHORT         Reserved;
+    ULONG          Parm0;
+    ULONG          Parm1;
+    ULONGLONG      Parm2;
+    ULONGLONG      Parm3;
+} NVME_HISTORY_RECORD, *PNVME_HISTORY_RECORD;
+
+/******************************************************************************
+ * NVMe History Snapshot IOCTL data structure.
+ *
+ * Sent with NVME_HISTORY_SNAPSHOT to read the command history ring of one
+ * core, Ring being its system wide processor index. NumRings and Depth are
+ * always returned so a caller can start with Ring 0 and walk the rest. Records are returned oldest first, as many of
+ * the latest ones as fit behind the structure, and they aren't locked while
+ * copied, a record being written at the time may come back torn.
+ ******************************************************************************/
+typedef struct _NVME_HISTORY_SNAPSHOT_IOCTL
+{
+    SRB_IO_CONTROL      SrbIoCtrl;
+
+    /* Ring to read */
+    ULONG               Ring;
+
+    /* Rings and records per ring the driver keeps */
+    ULONG               NumRings;
+    ULONG               Depth;
+
+    /* Records ever written to this ring and records returned */
+    ULONG               Written;
+    ULONG               NumRecords;
+
+    NVME_HISTORY_RECORD Records[1];
+} NVME_HISTORY_SNAPSHOT_IOCTL, *PNVME_HISTORY_SNAPSHOT_IOCTL;
+#pragma pack()
+
+/* Why a command made it into the slow command log, either or both */
+#define NVME_SLOW_CMD_THRESHOLD     0x1 /* Over SlowCmdThresholdUs */
+#define NVME_SLOW_CMD_P999          0x2 /* Over its queue and class p99.9 */
+
+#pragma pack(1)
+/******************************************************************************
+ * NVMe slow command log record, 120 bytes.
+ *
+ * The SQE is the command as it was issued, the CQE as the controller posted
+ * it. P999Us is the p99.9 bound of the command's queue and opcode class at
+ * the time, 0 while there weren't enough completions to tell. Cores are
+ * system wide processor indexes. Seq is the record's position in the log
+ * plus 1, and 0 while the record is being written.
+ ******************************************************************************/
+typedef struct _NVME_SLOW_CMD_RECORD
+{
+    ULONGLONG      SubmitTimeUs;
+    ULONGLONG      CompleteTimeUs;
+    ULONGLONG      P999Us;
+    USHORT         SubQueueId;
+    USHORT         CplQueueId;
+    USHORT         SubmitCore;
+    USHORT         CompleteCore;
+    ULONG          Reason;
+    ULONG          Seq;
+    ULONG          Sqe[NVME_IOCTL_CMD_DW_SIZE];
+    ULONG          Cqe[NVME_IOCTL_COMPLETE_DW_SIZE];
+} NVME_SLOW_CMD_RECORD, *PNVME_SLOW_CMD_RECORD;
+
+/******************************************************************************
+ * NVMe Slow Command Log IOCTL data structure.
+ *
+ * Sent with NVME_SLOW_CMD_LOG to read the slow command log, oldest record
+ * first, as many of the latest ones as fit behind the structure. Truncated
+ * counts the older ones left out for lack of room, Lost the ones that were
+ * being overwritten while copied. A non zero Reset empties the log once read.
+ ******************************************************************************/
+typedef struct _NVME_SLOW_CMD_LOG_IOCTL
+{
+    SRB_IO_CONTROL       SrbIoCtrl;
+
+    /* Empty the log after reading */
+    ULONG                Reset;
+
+    /* Records the log holds, ever written to it and returned */
+    ULONG                NumEntries;
+    ULONG                Written;
+    ULONG                NumRecords;
+
+    /* Records that didn't fit and that were overwritten while copied */
+    ULONG                Truncated;
+    ULONG                Lost;
+
+    NVME_SLOW_CMD_RECORD Records[1];
+} NVME_SLOW_CMD_LOG_IOCTL, *PNVME_SLOW_CMD_LOG_IOCTL;
+#pragma pack()
+
+/* SG list shape flags of an SRB trace record */
+#define NVME_SRB_TRACE_SG_PRP_ALIGNED   0x1 /* Maps to PRPs as is */
+
+/* Stages of an IO timed while the SRB trace is on */
+#define NVME_SRB_STAGE_TRANSLATE        0 /* SCSI to NVMe, in BuildIo */
+#define NVME_SRB_STAGE_SUBMIT           1 /* ProcessIo, in StartIo */
+#define NVME_SRB_STAGE_COMPLETE         2 /* One IO completion, in the DPC */
+#define NVME_SRB_STAGES                 3
+
+#pragma pack(1)
+/******************************************************************************
+ * NVMe SRB trace record, 48 bytes, one per SCSI request entering BuildIo.
+ *
+ * Seq is the record's position in the trace plus 1 and is written last, a
+ * record whose Seq doesn't match its position isn't complete yet. The
+ * inter-arrival time is the difference of consecutive TimeStampUs. QueueDepth
+ * samples, without the queue lock, the commands outstanding on the SQ of the
+ * recording core, 0 until the driver is started.
+ ******************************************************************************/
+typedef struct _NVME_SRB_TRACE_RECORD
+{
+    ULONG          Seq;
+    USHORT         Core;
+    UCHAR          Lun;
+    UCHAR          CdbLength;
+    ULONGLONG      TimeStampUs;
+    ULONG          DataLength;
+    ULONG          SrbFlags;
+
+    /* SG elements, page offset of the first one and NVME_SRB_TRACE_SG_XXX */
+    USHORT         SgElements;
+    USHORT         SgFirstOffset;
+    USHORT         SgFlags;
+    USHORT         QueueDepth;
+    UCHAR          Cdb[16];
+} NVME_SRB_TRACE_RECORD, *PNVME_SRB_TRACE_RECORD;
+
+/******************************************************************************
+ * NVMe SRB Trace IOCTL data structure.
+ *
+ * Sent with NVME_SRB_TRACE to drain the SRB trace, the records written since
+ * the last call in order, as many as fit behind the structure. Lost counts
+ * those overwritten before they could be drained. StageTimeNs and StageCalls
+ * accumulate, indexed by NVME_SRB_STAGE_XXX, the time spent in each stage and
+ * how often it ran since the trace was allocated, diff two calls for a run.
+ ******************************************************************************/
+typedef struct _NVME_SRB_TRACE_IOCTL
+{
+    SRB_IO_CONTROL        SrbIoCtrl;
+
+    /* Records the trace holds, lost since the last call and returned */
+    ULONG                 Entries;
+    ULONG                 Lost;
+    ULONG                 NumRecords;
+    ULONG                 Reserved;
+
+    /* Per stage time and calls, 0 where no performance counter */
+    ULONGLONG             StageTimeNs[NVME_SRB_STAGES];
+    ULONGLONG             StageCalls[NVME_SRB_STAGES];
+
+    NVME_SRB_TRACE_RECORD Records[1];
+} NVME_SRB_TRACE_IOCTL, *PNVME_SRB_TRACE_IOCTL;
+
+/******************************************************************************
+ * SRB trace file, as saved by nvmew: this header, then the records in order.
+ ******************************************************************************/
+#define NVME_SRB_TRACE_FILE_MAGIC   "NVMESRBT"
+#define NVME_SRB_TRACE_FILE_VERSION 2 /* 1 had no QueueDepth */
+
+typedef struct _NVME_SRB_TRACE_FILE_HEADER
+{
+    UCHAR          Magic[8];
+    ULONG          Version;
+    ULONG          RecordSize;
+
+    /* Records in the file and lost while capturing */
+    ULONGLONG      NumRecords;
+    ULONGLONG      Lost;
+} NVME_SRB_TRACE_FILE_HEADER, *PNVME_SRB_TRACE_FILE_HEADER;
+#pragma pack()
+
+/* NVME_TUNABLES Set flags, which values to change */
+#define NVME_TUNE_INT_COALESCING    0x001 /* IntCoalescingTime and Entry */
+#define NVME_TUNE_CPL_BUDGET        0x002
+#define NVME_TUNE_CPL_DOORBELL      0x004
+#define NVME_TUNE_TRACE_SAMPLE      0x008
+#define NVME_TUNE_SLOW_CMD          0x010
+#define NVME_TUNE_QOS               0x020 /* Default IOPS and bandwidth limits */
+#define NVME_TUNE_IO_QUEUE_ENTRIES  0x040 /* Quiesces and recreates the queues */
+#define NVME_TUNE_IO_QUEUES         0x080 /* Quiesces, then remaps the cores */
+
+#define NVME_TUNE_RECREATE \
+    (NVME_TUNE_IO_QUEUE_ENTRIES | NVME_TUNE_IO_QUEUES)
+
+#pragma pack(1)
+/******************************************************************************
+ * NVMe Tunables IOCTL data structure.
+ *
+ * Sent with NVME_TUNABLES to change the values flagged in Set without a
+ * driver reload, all values are returned as they are afterwards. Set 0 only
+ * reads them. The values have the ranges of their registry counterparts.
+ *
+ * Queue depth and count changes wait for the IO in flight to complete with
+ * new IO held off, QuiesceUs says how long that took. The depth is limited to
+ * what the queues were allocated with at start, MaxIoQEntries, and the count
+ * to the queues created, MaxIoQueues. An IoQueues of 0 uses them all.
+ ******************************************************************************/
+typedef struct _NVME_TUNABLES_IOCTL
+{
+    SRB_IO_CONTROL SrbIoCtrl;
+
+    /* NVME_TUNE_XXX */
+    ULONG          Set;
+
+    ULONG          IntCoalescingTime;
+    ULONG          IntCoalescingEntry;
+    ULONG          CplBudget;
+    ULONG          CplDoorbellBatch;
+    ULONG          TraceSampleRate;
+    ULONG          SlowCmdThresholdUs;
+    ULONG          QosIopsLimit;
+    ULONG          QosBandwidthLimit;
+    ULONG          IoQEntries;
+    ULONG          IoQueues;
+
+    /* Returned */
+    ULONG          MaxIoQEntries;
+    ULONG          MaxIoQueues;
+    ULONG          QuiesceUs;
+} NVME_TUNABLES_IOCTL, *PNVME_TUNABLES_IOCTL;
+#pragma pack()
+
+/* NVME_FW_DOWNLOAD Depth default and limit, downloads kept in flight */
+#define NVME_FW_DOWNLOAD_DFT_DEPTH  4
+#define NVME_FW_DOWNLOAD_MAX_DEPTH  8
+
+#pragma pack(1)
+/******************************************************************************
+ * NVMe Firmware Download IOCTL data structure.
+ *
+ * Sent with NVME_FW_DOWNLOAD with the whole firmware image in Image. The
+ * driver splits it into Firmware Image Download commands of ChunkSize bytes,
+ * keeps Depth of them in flight and, once all completed, sends Firmware Commit
+ * with Slot and CommitAction. ChunkSize is rounded down to the controller's
+ * update granularity and limited by the maximum transfer size, 0 picks the
+ * largest allowed; the values used are returned.
+ *
+ * CplStatus is DW3 of the completion that failed, or of the Firmware Commit.
+ * A commit whose activation waits for a reset returns NVME_IOCTL_SUCCESS with
+ * that status.
+ ******************************************************************************/
+typedef struct _NVME_FW_DOWNLOAD_IOCTL
+{
+    SRB_IO_CONTROL SrbIoCtrl;
+
+    /* Firmware Commit FS and AA */
+    ULONG          Slot;
+    ULONG          CommitAction;
+
+    ULONG          ChunkSize;
+    ULONG          Depth;
+    ULONG          ImageLength;
+
+    /* Returned */
+    ULONG          Chunks;
+    ULONG          MaxInFlight;
+    ULONG          DownloadUs;
+    ULONG          CommitUs;
+    ULONG          FailedOffset;
+    ULONG          CplStatus;
+
+    UCHAR          Image[1];
+} NVME_FW_DOWNLOAD_IOCTL, *PNVME_FW_DOWNLOAD_IOCTL;
+#pragma pack()
+
+#pragma pack(1)
+/******************************************************************************
+ * NVMe Protection Information IOCTL data structure.
+ *
+ * Sent with NVME_PROTECTION_INFO to read how one namespace is formatted for
+ * metadata and protection information, and the adapter's host PI check
+ * counters. Sampling those gives the throughput of the driver's guard CRC.
+ ******************************************************************************/
+typedef struct _NVME_PROTECTION_INFO_IOCTL
+{
+    SRB_IO_CONTROL SrbIoCtrl;
+
+    /* LUN of the namespace */
+    ULONG          Lun;
+
+    /* Data and metadata bytes per LBA */
+    ULONG          LbaSize;
+    ULONG          MetadataSize;
+
+    /* PI Type 1 to 3, 0 when PI is off */
+    UCHAR          PiType;
+
+    /* 1 when metadata is at the end of each LBA, 0 when kept separately */
+    UCHAR          ExtendedLba;
+
+    /* 1 when the driver can read and write the namespace */
+    UCHAR          Supported;
+
+    /* 1 when the driver generates and checks the PI itself */
+    UCHAR          HostCheck;
+
+    /* Host PI check of the adapter: blocks, bytes, time spent, mismatches */
+    ULONGLONG      HostBlocks;
+    ULONGLONG      HostBytes;
+    ULONGLONG      HostTimeUs;
+    ULONGLONG      HostErrors;
+} NVME_PROTECTION_INFO_IOCTL, *PNVME_PROTECTION_INFO_IOCTL;
+#pragma pack()
+
 #endif // __NVME_IOCTL_H__
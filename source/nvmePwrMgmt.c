@@ -66,18 +66,390 @@ BOOLEAN NVMeAdapterControlPowerUp(
 )
 {
     BOOLEAN status = TRUE;
+    BOOLEAN fastResume;
+    ULONGLONG startUs;
+
+    startUs = NVMeGetTimeStampUs(pAE);
+
+    /*
+     * Power down only disabled the controller, so when everything it set up
+     * is still in place just replay what the controller lost.
+     */
+    fastResume = NVMeFastResumePossible(pAE);
+    pAE->DriverState.FastResume = fastResume;
 
     /* Reset the controller */
-    if (NVMeReInitializeController(pAE) == FALSE) {
+    status = NVMeReInitializeController(pAE);
+    if ((status == FALSE) &&
+        (fastResume == TRUE) &&
+        (pAE->DeviceRemovedDuringIO == FALSE)) {
+        StorPortDebugPrint(INFO,
+            "NvmeAdapterControlPowerUp: fast resume failed, doing full init\n");
+        pAE->DriverState.FastResume = FALSE;
+        fastResume = FALSE;
+        status = NVMeReInitializeController(pAE);
+    }
+    pAE->DriverState.FastResume = FALSE;
+
+    /*
+     * A firmware activation or format may have happened while the power was
+     * off, the Identify data is re-fetched once I/O is running again.
+     */
+    if ((status == TRUE) && (fastResume == TRUE)) {
+        pAE->DriverState.ReIdentifyLun = REIDENTIFY_CONTROLLER;
+        pAE->DriverState.ReIdentifyChanged = FALSE;
+        pAE->DriverState.ReIdentifyPending = TRUE;
+    }
+
+    if (status == FALSE) {
         NVMeFreeBuffers(pAE);
         return (FALSE);
     }
 
+    pAE->DriverState.ResumeLatencyUs =
+        (ULONG)(NVMeGetTimeStampUs(pAE) - startUs);
+    StorPortDebugPrint(INFO,
+        "NvmeAdapterControlPowerUp: %s resume to I/O ready in %d us\n",
+        (fastResume == TRUE) ? "fast" : "full",
+        pAE->DriverState.ResumeLatencyUs);
+
     pAE->ShutdownInProgress = FALSE;
     StorPortDebugPrint(INFO, "NvmeAdapterControlPowerUp: returning TRUE\n");
     return status;
 }
 
+/*******************************************************************************
+ * NVMeFastResumePossible
+ *
+ * @brief Checks if the adapter can come back from S3/S4 without a full init.
+ *        That needs the IO queue memory and resource mapping table from the
+ *        last start to still be there and that start to have completed,
+ *        learning included, since the queues are recreated as they were.
+ * 
+ * @param pAE - pointer to device extension
+ * 
+ * @return BOOLEAN
+ *     TRUE - Only Set Features and queue creation need replaying
+ *     FALSE - A full init is needed
+ ******************************************************************************/
+BOOLEAN NVMeFastResumePossible(
+    IN PNVME_DEVICE_EXTENSION pAE
+)
+{
+    if ((pAE->ntldrDump == TRUE) ||
+        (pAE->DeviceRemovedDuringIO == TRUE))
+        return (FALSE);
+
+    if ((pAE->IoQueuesAllocated == FALSE) ||
+        (pAE->ResourceTableMapped == FALSE))
+        return (FALSE);
+
+    if ((pAE->DriverState.NextDriverState != NVMeStartComplete) ||
+        (pAE->LearningCores < pAE->ResMapTbl.NumActiveCores))
+        return (FALSE);
+
+    return (TRUE);
+} /* NVMeFastResumePossible */
+
+/*******************************************************************************
+ * NVMeResumeReIdentify
+ *
+ * @brief Issues the next Identify of the refresh that follows a fast resume:
+ *        Identify Controller first, then Identify Namespace for each online
+ *        namespace. The state machine's SRB extension and data buffer are
+ *        idle once the start has completed, so they carry the commands.
+ *        A namespace is paused from here until its Identify completes, so
+ *        no BuildIo reads its FLBAS/LBAF while the callback replaces them.
+ *
+ * @param pAE - pointer to device extension
+ * @param AcquireLock - TRUE when the caller doesn't hold the StartIo lock
+ *
+ * @return BOOLEAN
+ *     TRUE - Identify issued, or nothing left to refresh
+ *     FALSE - Couldn't issue the command, the refresh is dropped
+ ******************************************************************************/
+BOOLEAN NVMeResumeReIdentify(
+    IN PNVME_DEVICE_EXTENSION pAE,
+    IN BOOLEAN AcquireLock
+)
+{
+    PSTART_STATE pDS = &pAE->DriverState;
+    PNVME_SRB_EXTENSION pSrbExt = (PNVME_SRB_EXTENSION)pDS->pSrbExt;
+    PNVMe_COMMAND pIdentify = NULL;
+    PADMIN_IDENTIFY_COMMAND_DW10 pIdentifyCDW10 = NULL;
+    PNVME_LUN_EXTENSION pLunExt = NULL;
+    ULONG Size;
+
+    pDS->ReIdentifyPending = FALSE;
+
+    memset((PVOID)pSrbExt, 0, sizeof(NVME_SRB_EXTENSION));
+    pSrbExt->pNvmeDevExt = pAE;
+    pSrbExt->pNvmeCompletionRoutine = NVMeResumeReIdentifyCallback;
+
+    pIdentify = &pSrbExt->nvmeSqeUnit;
+    pIdentify->CDW0.OPC = ADMIN_IDENTIFY;
+    pIdentifyCDW10 = (PADMIN_IDENTIFY_COMMAND_DW10)&pIdentify->CDW10;
+
+    if (pDS->ReIdentifyLun == REIDENTIFY_CONTROLLER) {
+        pIdentifyCDW10->CNS = IDENTIFY_CNTLR;
+        Size = sizeof(ADMIN_IDENTIFY_CONTROLLER);
+    } else {
+        /* Skip to the next namespace the OS can see */
+        while (pDS->ReIdentifyLun < pAE->NumLunExtensions) {
+            pLunExt = pAE->pLunExtensionTable[pDS->ReIdentifyLun];
+            if (pLunExt->slotStatus == ONLINE)
+                break;
+            pDS->ReIdentifyLun++;
+        }
+
+        if (pDS->ReIdentifyLun >= pAE->NumLunExtensions) {
+            /* All refreshed, have the OS re-read what changed */
+            StorPortDebugPrint(INFO,
+                "NVMeResumeReIdentify: Identify data refreshed, %s\n",
+                (pDS->ReIdentifyChanged == TRUE) ? "changed" : "unchanged");
+            if (pDS->ReIdentifyChanged == TRUE)
+                StorPortNotification(BusChangeDetected, pAE, 0);
+            return (TRUE);
+        }
+
+        pIdentifyCDW10->CNS = IDENTIFY_NAMESPACE;
+        pIdentify->NSID = pLunExt->namespaceId;
+        Size = sizeof(ADMIN_IDENTIFY_NAMESPACE);
+
+        /*
+         * Hold off new IO to the namespace now rather than in the callback,
+         * so anything already in BuildIo is long done by the time the
+         * completion replaces the data it reads
+         */
+        pLunExt->nsReady = FALSE;
+        StorPortPauseDevice(pAE,
+                            VALID_NVME_PATH_ID,
+                            VALID_NVME_TARGET_ID,
+                            (UCHAR)pDS->ReIdentifyLun,
+                            REIDENTIFY_PAUSE_TIMEOUT);
+    }
+
+    if ((NVMePreparePRPs(pAE,
+                         pSrbExt,
+                         (PVOID)pDS->pDataBuffer,
+                         Size) == TRUE) &&
+        (ProcessIo(pAE, pSrbExt, NVME_QUEUE_TYPE_ADMIN, AcquireLock) == TRUE))
+        return (TRUE);
+
+    if (pLunExt != NULL) {
+        pLunExt->nsReady = TRUE;
+        StorPortResumeDevice(pAE,
+                             VALID_NVME_PATH_ID,
+                             VALID_NVME_TARGET_ID,
+                             (UCHAR)pDS->ReIdentifyLun);
+    }
+
+    return (FALSE);
+} /* NVMeResumeReIdentify */
+
+/*******************************************************************************
+ * NVMeResumeReIdentifyCallback
+ *
+ * @brief Completion of one Identify issued by NVMeResumeReIdentify. Data that
+ *        differs from the cached copy replaces it, then the next Identify is
+ *        issued. A failed Identify ends the refresh, the cached data stays.
+ *        Either way a namespace paused by NVMeResumeReIdentify is resumed.
+ *
+ * @param pNVMeDevExt - pointer to device extension
+ * @param pSrbExtension - the state machine's SRB extension
+ *
+ * @return BOOLEAN
+ *     FALSE - There is no Srb to complete
+ ******************************************************************************/
+BOOLEAN NVMeResumeReIdentifyCallback(
+    IN PVOID pNVMeDevExt,
+    IN PVOID pSrbExtension
+)
+{
+    PNVME_DEVICE_EXTENSION pAE = (PNVME_DEVICE_EXTENSION)pNVMeDevExt;
+    PNVME_SRB_EXTENSION pSrbExt = (PNVME_SRB_EXTENSION)pSrbExtension;
+    PSTART_STATE pDS = &pAE->DriverState;
+    PNVME_LUN_EXTENSION pLunExt = NULL;
+
+    if ((pSrbExt->pCplEntry->DW3.SF.SC != 0) ||
+        (pSrbExt->pCplEntry->DW3.SF.SCT != 0)) {
+        StorPortDebugPrint(ERROR,
+            "NVMeResumeReIdentifyCallback: <Error> Identify failed, lun 0x%x\n",
+            pDS->ReIdentifyLun);
+        if (pDS->ReIdentifyLun != REIDENTIFY_CONTROLLER) {
+            pAE->pLunExtensionTable[pDS->ReIdentifyLun]->nsReady = TRUE;
+            StorPortResumeDevice(pAE,
+                                 VALID_NVME_PATH_ID,
+                                 VALID_NVME_TARGET_ID,
+                                 (UCHAR)pDS->ReIdentifyLun);
+        }
+        return (FALSE);
+    }
+
+    if (pDS->ReIdentifyLun == REIDENTIFY_CONTROLLER) {
+        if (memcmp(&pAE->controllerIdentifyData,
+                   pDS->pDataBuffer,
+                   sizeof(ADMIN_IDENTIFY_CONTROLLER)) != 0) {
+            StorPortCopyMemory(&pAE->controllerIdentifyData,
+                               pDS->pDataBuffer,
+                               sizeof(ADMIN_IDENTIFY_CONTROLLER));
+            pDS->ReIdentifyChanged = TRUE;
+        }
+        pDS->ReIdentifyLun = 0;
+    } else {
+        pLunExt = pAE->pLunExtensionTable[pDS->ReIdentifyLun];
+        if ((pLunExt->slotStatus == ONLINE) &&
+            (memcmp(&pLunExt->identifyData,
+                    pDS->pDataBuffer,
+                    sizeof(ADMIN_IDENTIFY_NAMESPACE)) != 0)) {
+            StorPortCopyMemory(&pLunExt->identifyData,
+                               pDS->pDataBuffer,
+                               sizeof(ADMIN_IDENTIFY_NAMESPACE));
+            pDS->ReIdentifyChanged = TRUE;
+        }
+        pLunExt->nsReady = TRUE;
+        StorPortResumeDevice(pAE,
+                             VALID_NVME_PATH_ID,
+                             VALID_NVME_TARGET_ID,
+                             (UCHAR)pDS->ReIdentifyLun);
+        pDS->ReIdentifyLun++;
+    }
+
+    NVMeResumeReIdentify(pAE, TRUE);
+    return (FALSE);
+} /* NVMeResumeReIdentifyCallback */
+
+/*******************************************************************************
+ * NVMeBuildApstTable
+ *
+ * @brief Builds the Autonomous Power State Transition table from the power
+ *        state descriptors. Only non-operational states whose exit latency
+ *        is within the ApstMaxLatency registry value are used. Each state
+ *        points at the next qualifying state below it, which is entered after
+ *        APST_IDLE_TIME_FACTOR times its entry plus exit latency of idle.
+ *        The table is also kept in the ApstInfo for residency estimates.
+ * 
+ * @param pAE - pointer to device extension
+ * @param pApstTable - receives the MAX_POWER_STATES entry table
+ * 
+ * @return ULONG
+ *     Number of power states given a transition, 0 means APST stays off
+ ******************************************************************************/
+ULONG NVMeBuildApstTable(
+    IN PNVME_DEVICE_EXTENSION pAE,
+    OUT PADMIN_SET_FEATURES_APST_ENTRY pApstTable
+)
+{
+    PADMIN_IDENTIFY_CONTROLLER pIdCtrl = &pAE->controllerIdentifyData;
+    PAPST_INFO pApst = &pAE->ApstInfo;
+    PADMIN_IDENTIFY_POWER_STATE_DESCRIPTOR pPSD = NULL;
+    ULONG64 IdleTimeMs = 0;
+    ULONG NumTransitions = 0;
+    UCHAR Target = 0;
+    LONG State;
+
+    memset(pApstTable,
+           0,
+           sizeof(ADMIN_SET_FEATURES_APST_ENTRY) * MAX_POWER_STATES);
+    memset(pApst->TargetState, 0, sizeof(pApst->TargetState));
+    memset(pApst->IdleTimeMs, 0, sizeof(pApst->IdleTimeMs));
+
+    if (pAE->InitInfo.ApstMaxLatency == 0)
+        return (0);
+
+    /* Walk up from the deepest state so each one knows the next one down */
+    for (State = min(pIdCtrl->NPSS, MAX_POWER_STATES - 1); State >= 0; State--) {
+        if (IdleTimeMs != 0) {
+            pApstTable[State].ITPS = Target;
+            pApstTable[State].ITPT = IdleTimeMs;
+            pApst->TargetState[State] = Target;
+            pApst->IdleTimeMs[State] = (ULONG)IdleTimeMs;
+            NumTransitions++;
+        }
+
+        pPSD = &pIdCtrl->PSDx[State];
+        if ((pPSD->NOPS == 0) ||
+            (pPSD->EXLAT > pAE->InitInfo.ApstMaxLatency))
+            continue;
+
+        IdleTimeMs = ((ULONG64)pPSD->ENLAT + pPSD->EXLAT) *
+                     APST_IDLE_TIME_FACTOR / MILLI_TO_MICRO;
+        IdleTimeMs = max(IdleTimeMs, 1);
+        IdleTimeMs = min(IdleTimeMs, APST_MAX_ITPT_MS);
+        Target = (UCHAR)State;
+
+        StorPortDebugPrint(INFO,
+            "NVMeBuildApstTable: PS%d ENLAT %d EXLAT %d us, entered after %d ms\n",
+            State,
+            pPSD->ENLAT,
+            pPSD->EXLAT,
+            (ULONG)IdleTimeMs);
+    }
+
+    return (NumTransitions);
+} /* NVMeBuildApstTable */
+
+/*******************************************************************************
+ * NVMeApstUpdateResidency
+ *
+ * @brief Called from the surprise removal timer to estimate how long the
+ *        controller spent in each power state. If no command was submitted
+ *        since the last call the elapsed time is played through the APST
+ *        table, otherwise the controller is taken to have been in state 0.
+ * 
+ * @param pAE - pointer to device extension
+ * @param ElapsedMs - time since the last call
+ * 
+ * @return VOID
+ ******************************************************************************/
+VOID NVMeApstUpdateResidency(
+    IN PNVME_DEVICE_EXTENSION pAE,
+    IN ULONG ElapsedMs
+)
+{
+    PAPST_INFO pApst = &pAE->ApstInfo;
+    PQUEUE_INFO pQI = &pAE->QueueInfo;
+    LONG64 Requests = 0;
+    ULONG QueueID;
+    ULONG Step;
+    UCHAR State;
+
+    if ((pApst->Enabled == FALSE) || (pQI->pSubQueueInfo == NULL))
+        return;
+
+    for (QueueID = 0; QueueID <= pQI->NumSubIoQAllocated; QueueID++)
+        Requests += pQI->pSubQueueInfo[QueueID].Requests;
+
+    if (Requests != pApst->LastRequests) {
+        pApst->LastRequests = Requests;
+        if (pApst->CurrentState != 0)
+            pApst->Wakeups++;
+        pApst->CurrentState = 0;
+        pApst->StateIdleMs = 0;
+        pApst->ResidencyMs[0] += ElapsedMs;
+        return;
+    }
+
+    while (ElapsedMs != 0) {
+        State = pApst->CurrentState;
+        if (pApst->IdleTimeMs[State] == 0) {
+            /* Nowhere further to go */
+            pApst->ResidencyMs[State] += ElapsedMs;
+            break;
+        }
+
+        Step = min(ElapsedMs, pApst->IdleTimeMs[State] - pApst->StateIdleMs);
+        pApst->ResidencyMs[State] += Step;
+        pApst->StateIdleMs += Step;
+        ElapsedMs -= Step;
+
+        if (pApst->StateIdleMs >= pApst->IdleTimeMs[State]) {
+            pApst->CurrentState = pApst->TargetState[State];
+            pApst->StateIdleMs = 0;
+        }
+    }
+} /* NVMeApstUpdateResidency */
+
 /*******************************************************************************
  * NVMeAdapterControlPowerDown
  *
@@ -112,6 +484,12 @@ BOOLEAN NVMeAdapterControlPowerDown(
         if (NVMeDetectPendingCmds(pAE, FALSE, SRB_STATUS_BUS_RESET) == TRUE)
             return status;
 
+        /*
+         * Take the Host Memory Buffer back before the controller loses power,
+         * it's kept allocated and returned to the controller on resume.
+         */
+        NVMeDisableHostMemBuffer(pAE);
+
         /* Stop the controller, but do not free the resources */
         if (NVMeResetAdapter(pAE) != TRUE) {
             return (FALSE);
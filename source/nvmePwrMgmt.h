@@ -61,6 +61,30 @@ BOOLEAN NVMeAdapterControlPowerUp(
     IN PNVME_DEVICE_EXTENSION pAdapterExtension
 );
 
+BOOLEAN NVMeFastResumePossible(
+    IN PNVME_DEVICE_EXTENSION pAdapterExtension
+);
+
+BOOLEAN NVMeResumeReIdentify(
+    IN PNVME_DEVICE_EXTENSION pAdapterExtension,
+    IN BOOLEAN AcquireLock
+);
+
+BOOLEAN NVMeResumeReIdentifyCallback(
+    IN PVOID pNVMeDevExt,
+    IN PVOID pSrbExtension
+);
+
+ULONG NVMeBuildApstTable(
+    IN PNVME_DEVICE_EXTENSION pAdapterExtension,
+    OUT PADMIN_SET_FEATURES_APST_ENTRY pApstTable
+);
+
+VOID NVMeApstUpdateResidency(
+    IN PNVME_DEVICE_EXTENSION pAdapterExtension,
+    IN ULONG ElapsedMs
+);
+
 BOOLEAN NVMeAdapterControlPowerDown(
     IN PNVME_DEVICE_EXTENSION pAdapterExtension
 );
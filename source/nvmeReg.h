@@ -58,6 +58,8 @@
 #define NVME_CC_NVM_CMD (0)
 #define NVME_CC_SHUTDOWN_NONE (0)
 #define NVME_CC_ROUND_ROBIN (0)
+#define NVME_CC_WRR_URGENT (1)
+#define NVME_CAP_AMS_WRR_URGENT (1)
 #define NVME_CC_IOSQES (6)
 #define NVME_CC_IOCQES (4)
 
@@ -408,6 +410,59 @@ typedef union _NVMe_COMPLETION_QUEUE_BASE
     };
 } NVMe_COMPLETION_QUEUE_BASE, *PNVMe_COMPLETION_QUEUE_BASE;
 
+/* Controller Memory Buffer Location, NVMe 1.2 Section 3.1.11 */
+typedef union _NVMe_CONTROLLER_MEMORY_BUFFER_LOCATION
+{
+    struct
+    {
+        /* [Base Indicator Register] BAR holding the CMB, 0 is BAR0/1 */
+        ULONG BIR        :3;
+
+        /* Bits 3-11 */
+        ULONG Reserved   :9;
+
+        /* [Offset] From the start of the BAR, in CMBSZ.SZU units */
+        ULONG OFST       :20;
+    };
+
+    ULONG AsUlong;
+} NVMe_CONTROLLER_MEMORY_BUFFER_LOCATION,
+  *PNVMe_CONTROLLER_MEMORY_BUFFER_LOCATION;
+
+/* Controller Memory Buffer Size, NVMe 1.2 Section 3.1.12 */
+typedef union _NVMe_CONTROLLER_MEMORY_BUFFER_SIZE
+{
+    struct
+    {
+        /* [Submission Queue Support] */
+        ULONG SQS        :1;
+
+        /* [Completion Queue Support] */
+        ULONG CQS        :1;
+
+        /* [PRP SGL List Support] */
+        ULONG LISTS      :1;
+
+        /* [Read Data Support] */
+        ULONG RDS        :1;
+
+        /* [Write Data Support] */
+        ULONG WDS        :1;
+
+        /* Bits 5-7 */
+        ULONG Reserved   :3;
+
+        /* [Size Units] 4KB << (4 * SZU) */
+        ULONG SZU        :4;
+
+        /* [Size] In SZU units, 0 means no CMB */
+        ULONG SZ         :20;
+    };
+
+    ULONG AsUlong;
+} NVMe_CONTROLLER_MEMORY_BUFFER_SIZE,
+  *PNVMe_CONTROLLER_MEMORY_BUFFER_SIZE;
+
 /* Table 3.1.11 */
 typedef union _NVMe_QUEUE_Y_DOORBELL
 {
@@ -456,9 +511,11 @@ typedef struct _NVMe_CONTROLLER_REGISTERS
     NVMe_ADMIN_QUEUE_ATTRIBUTES   AQA;
     NVMe_SUBMISSION_QUEUE_BASE    ASQ;
     NVMe_COMPLETION_QUEUE_BASE    ACQ;
+    NVMe_CONTROLLER_MEMORY_BUFFER_LOCATION CMBLOC;
+    NVMe_CONTROLLER_MEMORY_BUFFER_SIZE     CMBSZ;
 
-    /* Bytes 0x38 - 0xEFF */
-    ULONG                         Reserved3[0x3B2];
+    /* Bytes 0x40 - 0xEFF */
+    ULONG                         Reserved3[0x3B0];
 
     /* Bytes 0xF00 - 0xFFF */
     ULONG                         CommandSetSpecific[0x40];
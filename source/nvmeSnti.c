@@ -323,6 +323,9 @@ SNTI_RESPONSE_BLOCK mediaErrorTable[] = {
         SCSI_SENSEQ_NO_ACCESS_RIGHTS}
 };
 
+/* T10 DIF CRC slicing-by-8 tables, built by SntiCrc16Init */
+UINT16 crc16Table[CRC16_TABLES][CRC16_TABLE_ENTRIES];
+
 /******************************************************************************
  * SntiTranslateCommand
  *
@@ -2059,6 +2062,7 @@ SNTI_TRANSLATION_STATUS SntiTranslateExtendedInquiryDataPage(
     UINT16 allocLength;
     UINT8 dataProtectionCapabilities;
     UINT8 dataProtectionSettings;
+    UINT8 referenceTagCheck;
 
     SNTI_STATUS status;
 
@@ -2075,23 +2079,40 @@ SNTI_TRANSLATION_STATUS SntiTranslateExtendedInquiryDataPage(
         SntiMapInternalErrorStatus(pSrb, status);
         returnStatus = SNTI_FAILURE_CHECK_RESPONSE_DATA;
     } else {
-        /* DPC field check from Namepspace Identify struct */
-        if (pLunExt->identifyData.DPC.SupportsProtectionType1 ||
-            pLunExt->identifyData.DPC.SupportsProtectionType2 ||
-            pLunExt->identifyData.DPC.SupportsProtectionType3 ||
-            pLunExt->identifyData.DPC.SupportsProtectionFirst8 ||
-            pLunExt->identifyData.DPC.SupportsProtectionLast8) {
-            dataProtectionCapabilities = PROTECTION_ENABLED;
+        /* SPT from the DPC field of the Namepspace Identify struct */
+        if (pLunExt->identifyData.DPC.SupportsProtectionType1) {
+            if (pLunExt->identifyData.DPC.SupportsProtectionType2)
+                dataProtectionCapabilities =
+                    pLunExt->identifyData.DPC.SupportsProtectionType3 ?
+                        SPT_TYPE_1_2_3 : SPT_TYPE_1_2;
+            else
+                dataProtectionCapabilities =
+                    pLunExt->identifyData.DPC.SupportsProtectionType3 ?
+                        SPT_TYPE_1_3 : SPT_TYPE_1;
+        } else if (pLunExt->identifyData.DPC.SupportsProtectionType2) {
+            dataProtectionCapabilities =
+                pLunExt->identifyData.DPC.SupportsProtectionType3 ?
+                    SPT_TYPE_2_3 : SPT_TYPE_2;
+        } else if (pLunExt->identifyData.DPC.SupportsProtectionType3) {
+            dataProtectionCapabilities = SPT_TYPE_3;
         } else {
-            dataProtectionCapabilities = PROTECTION_DISABLED;
+            dataProtectionCapabilities = SPT_TYPE_1;
         }
 
-        /* DPS field check from Namepspace Identify struct */
+        /*
+         * DPS field check from Namepspace Identify struct, Type 3 has no
+         * reference tag to check
+         */
         if (pLunExt->identifyData.DPS.ProtectionEnabled)
             dataProtectionSettings = PROTECTION_ENABLED;
         else
             dataProtectionSettings = PROTECTION_DISABLED;
 
+        if (pLunExt->identifyData.DPS.ProtectionEnabled == NVME_PI_TYPE_3)
+            referenceTagCheck = PROTECTION_DISABLED;
+        else
+            referenceTagCheck = dataProtectionSettings;
+
         if (allocLength < EXTENDED_INQUIRY_DATA_PAGE_SIZE) {
             pExtInqData = &tmpExtInqData;
         }
@@ -2107,7 +2128,7 @@ SNTI_TRANSLATION_STATUS SntiTranslateExtendedInquiryDataPage(
             pExtInqData->SupportedProtectionType   = dataProtectionCapabilities;
             pExtInqData->GuardCheck                = dataProtectionSettings;
             pExtInqData->ApplicationTagCheck       = dataProtectionSettings;
-            pExtInqData->ReferenceTagCheck         = dataProtectionSettings;
+            pExtInqData->ReferenceTagCheck         = referenceTagCheck;
             pExtInqData->Reserved2                 = RESERVED_FIELDS;
             pExtInqData->UACSKDataSupported        = SENSE_KEY_SPECIFIC_DATA;
             pExtInqData->GroupingFunctionSupported = GROUPING_FUNCTION_UNSUPPORTED;
@@ -2184,6 +2205,8 @@ VOID SntiTranslateStandardInquiryPage(
 )
 {
     PNVME_DEVICE_EXTENSION pDevExt = NULL;
+    PNVME_SRB_EXTENSION pSrbExt = NULL;
+    PNVME_LUN_EXTENSION pLunExt = NULL;
     PINQUIRYDATA pStdInquiry = NULL;
     INQUIRYDATA tmpInquiry;
     UINT16 allocLength;
@@ -2197,7 +2220,8 @@ VOID SntiTranslateStandardInquiryPage(
         pStdInquiry = &tmpInquiry;
     }
 
-    pDevExt = ((PNVME_SRB_EXTENSION)GET_SRB_EXTENSION(pSrb))->pNvmeDevExt;
+    pSrbExt = (PNVME_SRB_EXTENSION)GET_SRB_EXTENSION(pSrb);
+    pDevExt = pSrbExt->pNvmeDevExt;
 
     if (allocLength > 0) {
         memset(pStdInquiry, 0, allocLength);
@@ -2226,7 +2250,14 @@ VOID SntiTranslateStandardInquiryPage(
          *    - 3PC:     3rd Party Copy
          *    - Protect: LUN Protection Information
          *    - SPT:     Type of protection LUN supports
+         *
+         *  Protect is set by hand in byte 5 for namespaces formatted with PI.
          */
+        if ((GetLunExtension(pSrbExt, &pLunExt) == SNTI_SUCCESS) &&
+            (pLunExt->identifyData.DPS.ProtectionEnabled != 0)) {
+            ((PUCHAR)pStdInquiry)[INQ_STD_PROTECT_OFFSET] |=
+                INQ_STD_PROTECT_MASK;
+        }
 
         /* T10 Vendor Id */
         pStdInquiry->VendorId[BYTE_0] = 'N';
@@ -2303,7 +2334,6 @@ SNTI_TRANSLATION_STATUS SntiTranslateReportLuns(
     UINT8 selectReport = 0;
     UCHAR lunExtIdx = 0;
     PNVME_LUN_EXTENSION pLunExt = NULL;
-    UINT8 flbas = 0;
 #if (NTDDI_VERSION > NTDDI_WIN7)
     UINT32 lunValue = SrbGetLun((void*)pSrb);
 #else
@@ -2375,10 +2405,10 @@ SNTI_TRANSLATION_STATUS SntiTranslateReportLuns(
              /*
               * Don't report the LUN when the namespace:
               * (1) with zero size in capacity, or
-              * (2) is formatted using metadata, which is not supported now.
+              * (2) is formatted with metadata the driver can't place.
               */
-             flbas = pLunExt->identifyData.FLBAS.SupportedCombination;
-             if ((pLunExt->identifyData.NSZE == 0) || (pLunExt->identifyData.LBAFx[flbas].MS != 0))
+             if ((pLunExt->identifyData.NSZE == 0) ||
+                 (SntiIsFormatSupported(pLunExt) == FALSE))
                 continue;
              if ((pLunExt->slotStatus == ONLINE) &&
                  (++numberOfLunsFound <= numberOfLuns)) {
@@ -2804,6 +2834,7 @@ SNTI_TRANSLATION_STATUS SntiTranslateWrite(
     PSTOR_SCATTER_GATHER_LIST pSgl = NULL;
     SNTI_STATUS status;
     UINT8 opcode;
+    UINT8 protect = 0;
 
     /* Default to successful translation */
     SNTI_TRANSLATION_STATUS returnStatus = SNTI_TRANSLATION_SUCCESS;
@@ -2835,14 +2866,24 @@ SNTI_TRANSLATION_STATUS SntiTranslateWrite(
     pSrbExt->nvmeSqeUnit.CDW0.FUSE = FUSE_NORMAL_OPERATION;
     pSrbExt->nvmeSqeUnit.NSID = pLunExt->namespaceId;
 
-    /* TBD: Contiguous physical buffer of metadata (DWORD alinged) */
+    /* Metadata pointer, if any, is set once the LBA and length are known */
     pSrbExt->nvmeSqeUnit.MPTR = 0;
 
     /* PRP Entry/List */
     SntiTranslateSglToPrp(pSrbExt, pSgl);
 
-    /* Complete the non-common translation fields for the command */
+    /* Map WRPROTECT to PRINFO, WRITE 6 has no such field */
     opcode = GET_OPCODE(pSrb);
+    if (opcode != SCSIOP_WRITE6) {
+        protect = GET_U8_FROM_CDB(pSrb, WRITE_CDB_WP_OFFSET);
+        protect = (protect & WRITE_CDB_WP_MASK) >> WRITE_CDB_WP_SHIFT;
+    }
+
+    status = SntiTranslateProtection(pSrbExt, pLunExt, protect);
+    if (status != SNTI_SUCCESS)
+        return SNTI_FAILURE_CHECK_RESPONSE_DATA;
+
+    /* Complete the non-common translation fields for the command */
     switch (opcode) {
         case SCSIOP_WRITE6:
             status = SntiTranslateWrite6(pSrbExt, pLunExt);
@@ -2871,6 +2912,8 @@ SNTI_TRANSLATION_STATUS SntiTranslateWrite(
 
     if (status != SNTI_SUCCESS)
         returnStatus = SNTI_FAILURE_CHECK_RESPONSE_DATA;
+    else
+        SntiSetupMetadata(pSrbExt, pLunExt, TRUE);
 
     return returnStatus;
 } /* SntiTranslateWrite */
@@ -3145,6 +3188,7 @@ SNTI_TRANSLATION_STATUS SntiTranslateRead(
     PSTOR_SCATTER_GATHER_LIST pSgl = NULL;
     SNTI_STATUS status;
     UINT8 opcode;
+    UINT8 protect = 0;
 
     /* Default to successful translation */
     SNTI_TRANSLATION_STATUS returnStatus = SNTI_TRANSLATION_SUCCESS;
@@ -3174,14 +3218,24 @@ SNTI_TRANSLATION_STATUS SntiTranslateRead(
     pSrbExt->nvmeSqeUnit.CDW0.FUSE = FUSE_NORMAL_OPERATION;
     pSrbExt->nvmeSqeUnit.NSID = pLunExt->namespaceId;
 
-    /* TBD: Contiguous physical buffer of metadata (DWORD alinged) */
+    /* Metadata pointer, if any, is set once the LBA and length are known */
     pSrbExt->nvmeSqeUnit.MPTR = 0;
 
     /* PRP Entry/List */
     SntiTranslateSglToPrp(pSrbExt, pSgl);
 
-    /* Complete the non-common translation fields for the command */
+    /* Map RDPROTECT to PRINFO, READ 6 has no such field */
     opcode = GET_OPCODE(pSrb);
+    if (opcode != SCSIOP_READ6) {
+        protect = GET_U8_FROM_CDB(pSrb, READ_CDB_RP_OFFSET);
+        protect = (protect & READ_CDB_RP_MASK) >> READ_CDB_RP_SHIFT;
+    }
+
+    status = SntiTranslateProtection(pSrbExt, pLunExt, protect);
+    if (status != SNTI_SUCCESS)
+        return SNTI_FAILURE_CHECK_RESPONSE_DATA;
+
+    /* Complete the non-common translation fields for the command */
     switch (opcode) {
         case SCSIOP_READ6:
             status = SntiTranslateRead6(pSrbExt, pLunExt);
@@ -3210,6 +3264,8 @@ SNTI_TRANSLATION_STATUS SntiTranslateRead(
 
     if (status != SNTI_SUCCESS)
         returnStatus = SNTI_FAILURE_CHECK_RESPONSE_DATA;
+    else
+        SntiSetupMetadata(pSrbExt, pLunExt, FALSE);
 
     return returnStatus;
 } /* SntiTranslateRead */
@@ -7136,6 +7192,13 @@ SNTI_STATUS SntiValidateLbaAndLength(
     flbas = pLunExt->identifyData.FLBAS.SupportedCombination;
     lbaLengthPower = pLunExt->identifyData.LBAFx[flbas].LBADS;
     lbaSize = 1 << lbaLengthPower;
+
+    /* Without PRACT, metadata at the end of each LBA comes with the data */
+    if ((pLunExt->identifyData.FLBAS.SupportsMetadataAtEndOfLBA) &&
+        ((pSrbExt->nvmeSqeUnit.CDW12 &
+          (NVME_PRINFO_PRACT << NVME_READ_PRINFO_BIT_OFFSET)) == 0))
+        lbaSize += pLunExt->identifyData.LBAFx[flbas].MS;
+
     if ((length * lbaSize) > GET_DATA_LENGTH(pSrb)) {
         SntiSetScsiSenseData(pSrb,
                              SCSISTAT_CHECK_CONDITION,
@@ -7155,6 +7218,475 @@ SNTI_STATUS SntiValidateLbaAndLength(
     return status;
 } /* SntiValidateLbaAndLength */
 
+/******************************************************************************
+ * SntiIsFormatSupported
+ *
+ * @brief Tells whether the driver can place the metadata of the namespace's
+ *        current format. Namespaces without metadata are fine, so are those
+ *        with nothing but 8 bytes of PI, which PRACT inserts and strips.
+ *        Other metadata at the end of each LBA would land in the host's data.
+ *        Other separate metadata has nowhere to come from on a write that
+ *        wouldn't overwrite what's stored, so those namespaces stay hidden.
+ *
+ * @param pLunExt - Pointer to LUN extension
+ *
+ * @return BOOLEAN
+ *     TRUE if reads and writes can be translated for the namespace
+ ******************************************************************************/
+BOOLEAN SntiIsFormatSupported(
+    PNVME_LUN_EXTENSION pLunExt
+)
+{
+    UINT8 flbas = pLunExt->identifyData.FLBAS.SupportedCombination;
+    UINT16 metadataSize = pLunExt->identifyData.LBAFx[flbas].MS;
+
+    if (metadataSize == 0)
+        return TRUE;
+
+    return ((pLunExt->identifyData.DPS.ProtectionEnabled != 0) &&
+            (metadataSize == PI_TUPLE_SIZE));
+} /* SntiIsFormatSupported */
+
+/******************************************************************************
+ * SntiTranslateProtection
+ *
+ * @brief Maps the RDPROTECT/WRPROTECT field of a SCSI READ/WRITE to PRINFO in
+ *        Command DWORD 12, per the NVMe Translation spec:
+ *
+ *        - 000b: PRACT, check guard, application and reference tags
+ *        - 001b, 101b: check all three, the PI comes from/goes to the host
+ *        - 010b: check application and reference tags
+ *        - 011b: check nothing
+ *        - 100b: check the guard only
+ *
+ *        Type 3 never checks the reference tag, nor does Type 2, whose
+ *        expected initial reference tag only a 32-byte CDB carries. Type 2
+ *        refuses anything but 000b from the 10, 12 and 16-byte CDBs as SBC
+ *        has it. Anything but 000b needs the PI interleaved with the data,
+ *        so it's refused for namespaces without PI or keeping it in a
+ *        separate buffer. Reads and writes to a namespace whose metadata the
+ *        driver can't place are refused too.
+ *
+ * @param pSrbExt - Pointer to SRB extension
+ * @param pLunExt - Pointer to LUN extension
+ * @param protect - RDPROTECT/WRPROTECT, 0 for READ 6/WRITE 6
+ *
+ * @return SNTI_STATUS
+ *     Indicates internal translation status
+ ******************************************************************************/
+SNTI_STATUS SntiTranslateProtection(
+    PNVME_SRB_EXTENSION pSrbExt,
+    PNVME_LUN_EXTENSION pLunExt,
+    UINT8 protect
+)
+{
+#if (NTDDI_VERSION > NTDDI_WIN7)
+    PSTORAGE_REQUEST_BLOCK pSrb = pSrbExt->pSrb;
+#else
+    PSCSI_REQUEST_BLOCK pSrb = pSrbExt->pSrb;
+#endif
+    UINT8 dps = pLunExt->identifyData.DPS.ProtectionEnabled;
+    UINT32 prinfo = 0;
+    BOOLEAN valid = TRUE;
+
+    if (SntiIsFormatSupported(pLunExt) == FALSE) {
+        SntiSetScsiSenseData(pSrb,
+                             SCSISTAT_CHECK_CONDITION,
+                             SCSI_SENSE_ILLEGAL_REQUEST,
+                             SCSI_ADSENSE_INVALID_LUN,
+                             SCSI_ADSENSE_NO_SENSE);
+
+        pSrb->SrbStatus |= SRB_STATUS_INVALID_REQUEST;
+        SET_DATA_LENGTH(pSrb, 0);
+        return SNTI_INVALID_PARAMETER;
+    }
+
+    if (dps == 0) {
+        valid = (protect == WRITE_PROTECTION_CODE_0);
+    } else {
+        /* RDPROTECT and WRPROTECT share their codes */
+        switch (protect) {
+            case WRITE_PROTECTION_CODE_0:
+                prinfo = NVME_PRINFO_PRACT | NVME_PRINFO_PRCHK_ALL;
+            break;
+            case WRITE_PROTECTION_CODE_1:
+            case WRITE_PROTECTION_CODE_5:
+                prinfo = NVME_PRINFO_PRCHK_ALL;
+            break;
+            case WRITE_PROTECTION_CODE_2:
+                prinfo = NVME_PRINFO_PRCHK_APP | NVME_PRINFO_PRCHK_REF;
+            break;
+            case WRITE_PROTECTION_CODE_3:
+                prinfo = 0;
+            break;
+            case WRITE_PROTECTION_CODE_4:
+                prinfo = NVME_PRINFO_PRCHK_GUARD;
+            break;
+            default:
+                valid = FALSE;
+            break;
+        }; /* end switch */
+
+        if ((dps == NVME_PI_TYPE_2) && (protect != WRITE_PROTECTION_CODE_0))
+            valid = FALSE;
+
+        if ((dps == NVME_PI_TYPE_2) || (dps == NVME_PI_TYPE_3))
+            prinfo &= ~NVME_PRINFO_PRCHK_REF;
+
+        if (((prinfo & NVME_PRINFO_PRACT) == 0) &&
+            (pLunExt->identifyData.FLBAS.SupportsMetadataAtEndOfLBA == 0))
+            valid = FALSE;
+    }
+
+    if (valid == FALSE) {
+        SntiSetScsiSenseData(pSrb,
+                             SCSISTAT_CHECK_CONDITION,
+                             SCSI_SENSE_ILLEGAL_REQUEST,
+                             SCSI_ADSENSE_INVALID_CDB,
+                             SCSI_ADSENSE_NO_SENSE);
+
+        pSrb->SrbStatus |= SRB_STATUS_INVALID_REQUEST;
+        SET_DATA_LENGTH(pSrb, 0);
+        return SNTI_INVALID_PARAMETER;
+    }
+
+    /* Command DWORD 12 - PRINFO */
+    pSrbExt->nvmeSqeUnit.CDW12 |= prinfo << NVME_READ_PRINFO_BIT_OFFSET;
+
+    return SNTI_SUCCESS;
+} /* SntiTranslateProtection */
+
+/******************************************************************************
+ * SntiSetupMetadata
+ *
+ * @brief Completes a translated READ/WRITE for the namespace's metadata: the
+ *        initial reference tag for PI Type 1, and when PRACT would handle 8
+ *        bytes of PI kept in a separate buffer and PiHostCheck is set, the
+ *        driver's own PI instead. SntiIsFormatSupported leaves no other
+ *        separate metadata to transfer.
+ *
+ * @param pSrbExt - Pointer to SRB extension
+ * @param pLunExt - Pointer to LUN extension
+ * @param isWrite - TRUE for a WRITE
+ *
+ * @return VOID
+ ******************************************************************************/
+VOID SntiSetupMetadata(
+    PNVME_SRB_EXTENSION pSrbExt,
+    PNVME_LUN_EXTENSION pLunExt,
+    BOOLEAN isWrite
+)
+{
+    PNVME_DEVICE_EXTENSION pDevExt = pSrbExt->pNvmeDevExt;
+    UINT8 flbas = pLunExt->identifyData.FLBAS.SupportedCombination;
+    UINT16 metadataSize = pLunExt->identifyData.LBAFx[flbas].MS;
+    UINT8 dps = pLunExt->identifyData.DPS.ProtectionEnabled;
+    BOOLEAN pract;
+
+    if (metadataSize == 0)
+        return;
+
+    /* Command DWORD 14 - Initial Logical Block Reference Tag */
+    if (dps == NVME_PI_TYPE_1)
+        pSrbExt->nvmeSqeUnit.CDW14 = pSrbExt->nvmeSqeUnit.CDW10;
+
+    if (pLunExt->identifyData.FLBAS.SupportsMetadataAtEndOfLBA)
+        return;
+
+    pract = (pSrbExt->nvmeSqeUnit.CDW12 &
+             (NVME_PRINFO_PRACT << NVME_READ_PRINFO_BIT_OFFSET)) != 0;
+
+    /* PRACT leaves no metadata to transfer when it's all PI */
+    if ((dps != 0) && (metadataSize == PI_TUPLE_SIZE) && pract &&
+        (pDevExt->InitInfo.PiHostCheck != 0) && (pDevExt->ntldrDump == FALSE))
+        SntiSetupHostPi(pSrbExt, pLunExt, isWrite);
+} /* SntiSetupMetadata */
+
+/******************************************************************************
+ * SntiSetupHostPi
+ *
+ * @brief Has a READ/WRITE of a namespace keeping 8 bytes of PI in a separate
+ *        buffer carry the driver's PI instead of relying on PRACT. The PI goes
+ *        in a window at the end of the SRB extension that doesn't cross a
+ *        page, generated from the host's buffer here for a WRITE and checked
+ *        against it on completion for a READ. Commands whose PI doesn't fit
+ *        the window, or whose buffer can't be mapped, keep PRACT.
+ *
+ * @param pSrbExt - Pointer to SRB extension
+ * @param pLunExt - Pointer to LUN extension
+ * @param isWrite - TRUE for a WRITE
+ *
+ * @return VOID
+ ******************************************************************************/
+VOID SntiSetupHostPi(
+    PNVME_SRB_EXTENSION pSrbExt,
+    PNVME_LUN_EXTENSION pLunExt,
+    BOOLEAN isWrite
+)
+{
+    PNVME_DEVICE_EXTENSION pDevExt = pSrbExt->pNvmeDevExt;
+#if (NTDDI_VERSION > NTDDI_WIN7)
+    PSTORAGE_REQUEST_BLOCK pSrb = pSrbExt->pSrb;
+#else
+    PSCSI_REQUEST_BLOCK pSrb = pSrbExt->pSrb;
+#endif
+    UINT8 flbas = pLunExt->identifyData.FLBAS.SupportedCombination;
+    UINT32 length = (pSrbExt->nvmeSqeUnit.CDW12 & NVME_NLB_MASK) + 1;
+    STOR_PHYSICAL_ADDRESS physAddr;
+    ULONG paLength;
+    PUCHAR pPi = NULL;
+    PUCHAR pPage = NULL;
+    PVOID pData = NULL;
+
+    if ((length * PI_TUPLE_SIZE) > PI_HOST_MAX)
+        return;
+
+    if ((StorPortGetSystemAddress(pDevExt, pSrb, &pData) !=
+         STOR_STATUS_SUCCESS) || (pData == NULL))
+        return;
+
+    /* PI_HOST_EXT_SIZE leaves room to skip to the next page if needed */
+    pPi = (PUCHAR)pSrbExt + sizeof(NVME_SRB_EXTENSION);
+    pPage = PAGE_ALIGN_BUF_PTR(pPi);
+    if ((pPage != pPi) && ((pPi + PI_HOST_MAX) > pPage))
+        pPi = pPage;
+
+    physAddr = StorPortGetPhysicalAddress(pDevExt, NULL, pPi, &paLength);
+    if (physAddr.QuadPart == 0)
+        return;
+
+    pSrbExt->pPiBuffer = pPi;
+    pSrbExt->PiBlockSize = 1 << pLunExt->identifyData.LBAFx[flbas].LBADS;
+    pSrbExt->PiType = pLunExt->identifyData.DPS.ProtectionEnabled;
+
+    if (isWrite)
+        SntiHostPi(pSrbExt, (PUCHAR)pData, TRUE);
+    else
+        pSrbExt->pNvmeCompletionRoutine = SntiPiReadCompletion;
+
+    /* The controller checks the driver's PI rather than inserting its own */
+    pSrbExt->nvmeSqeUnit.CDW12 &=
+        ~(NVME_PRINFO_PRACT << NVME_READ_PRINFO_BIT_OFFSET);
+    pSrbExt->nvmeSqeUnit.MPTR = physAddr.QuadPart;
+} /* SntiSetupHostPi */
+
+/******************************************************************************
+ * SntiHostPi
+ *
+ * @brief Generates the PI of each block of a command into its PI window, or
+ *        verifies the PI read into it against the data. The guard is the T10
+ *        DIF CRC of the block, the application tag is 0 and the reference
+ *        tag counts up from the initial one in CDW14, the low 32 bits of the
+ *        starting LBA for Type 1 and 0 otherwise, and is only checked for
+ *        Type 1. Blocks whose tags are the escape values aren't checked, as
+ *        the controller wouldn't either. Blocks, bytes, time spent and mismatches are added
+ *        to the adapter's counters.
+ *
+ * @param pSrbExt - Pointer to SRB extension
+ * @param pData - System address of the host's buffer
+ * @param generate - TRUE to generate the PI, FALSE to verify it
+ *
+ * @return UINT8
+ *     0, or the END_TO_END_* media error of the first mismatch
+ ******************************************************************************/
+UINT8 SntiHostPi(
+    PNVME_SRB_EXTENSION pSrbExt,
+    PUCHAR pData,
+    BOOLEAN generate
+)
+{
+    PNVME_DEVICE_EXTENSION pDevExt = pSrbExt->pNvmeDevExt;
+    UINT32 length = (pSrbExt->nvmeSqeUnit.CDW12 & NVME_NLB_MASK) + 1;
+    UINT32 refTag = pSrbExt->nvmeSqeUnit.CDW14;
+    ULONG blockSize = pSrbExt->PiBlockSize;
+    ULONGLONG startUs = NVMeGetTimeStampUs(pDevExt);
+    PUCHAR pTuple = NULL;
+    UINT32 block;
+    UINT32 tupleRef;
+    UINT16 tupleApp;
+    UINT16 guard;
+    UINT8 error = 0;
+
+    for (block = 0; (block < length) && (error == 0); block++) {
+        pTuple = pSrbExt->pPiBuffer + (block * PI_TUPLE_SIZE);
+
+        if (generate) {
+            guard = SntiCrc16(pData + (block * blockSize), blockSize);
+            pTuple[BYTE_0] = (UCHAR)(guard >> BYTE_SHIFT_1);
+            pTuple[BYTE_1] = (UCHAR)guard;
+            pTuple[BYTE_2] = 0;
+            pTuple[BYTE_3] = 0;
+            pTuple[BYTE_4] = (UCHAR)((refTag + block) >> BYTE_SHIFT_3);
+            pTuple[BYTE_5] = (UCHAR)((refTag + block) >> BYTE_SHIFT_2);
+            pTuple[BYTE_6] = (UCHAR)((refTag + block) >> BYTE_SHIFT_1);
+            pTuple[BYTE_7] = (UCHAR)(refTag + block);
+            continue;
+        }
+
+        tupleApp = (UINT16)((pTuple[BYTE_2] << BYTE_SHIFT_1) | pTuple[BYTE_3]);
+        tupleRef = ((UINT32)pTuple[BYTE_4] << BYTE_SHIFT_3) |
+                   ((UINT32)pTuple[BYTE_5] << BYTE_SHIFT_2) |
+                   ((UINT32)pTuple[BYTE_6] << BYTE_SHIFT_1) |
+                   (UINT32)pTuple[BYTE_7];
+
+        if ((tupleApp == PI_APP_TAG_ESCAPE) &&
+            ((pSrbExt->PiType != NVME_PI_TYPE_3) ||
+             (tupleRef == PI_REF_TAG_ESCAPE)))
+            continue;
+
+        guard = SntiCrc16(pData + (block * blockSize), blockSize);
+        if (guard != (UINT16)((pTuple[BYTE_0] << BYTE_SHIFT_1) | pTuple[BYTE_1]))
+            error = END_TO_END_GUARD_CHECK_ERROR;
+        else if ((pSrbExt->PiType == NVME_PI_TYPE_1) &&
+                 (tupleRef != refTag + block))
+            error = END_TO_END_REFERENCE_TAG_CHECK_ERROR;
+    }
+
+    InterlockedExchangeAdd64(&pDevExt->PiHostBlocks, block);
+    InterlockedExchangeAdd64(&pDevExt->PiHostBytes,
+                             (LONG64)block * blockSize);
+    InterlockedExchangeAdd64(&pDevExt->PiHostTimeUs,
+                             NVMeGetTimeStampUs(pDevExt) - startUs);
+    if (error != 0)
+        InterlockedIncrement64(&pDevExt->PiHostErrors);
+
+    return error;
+} /* SntiHostPi */
+
+/******************************************************************************
+ * SntiPiReadCompletion
+ *
+ * @brief Completion routine of a READ carrying the driver's PI. The NVMe
+ *        status is mapped as usual, a good read then has its PI verified
+ *        against the data and a mismatch turns it into the matching logical
+ *        block check failure.
+ *
+ * @param param1 - Pointer to device extension
+ * @param param2 - Pointer to SRB extension
+ *
+ * @return BOOLEAN
+ *     TRUE - the request can be completed
+ *     FALSE - the status couldn't be mapped
+ ******************************************************************************/
+BOOLEAN SntiPiReadCompletion(
+    PVOID param1,
+    PVOID param2
+)
+{
+    PNVME_DEVICE_EXTENSION pDevExt = (PNVME_DEVICE_EXTENSION)param1;
+    PNVME_SRB_EXTENSION pSrbExt = (PNVME_SRB_EXTENSION)param2;
+#if (NTDDI_VERSION > NTDDI_WIN7)
+    PSTORAGE_REQUEST_BLOCK pSrb = pSrbExt->pSrb;
+#else
+    PSCSI_REQUEST_BLOCK pSrb = pSrbExt->pSrb;
+#endif
+    PVOID pData = NULL;
+    BOOLEAN returnValue;
+    UINT8 error;
+
+    if (pSrb == NULL)
+        return TRUE;
+
+    returnValue = SntiMapCompletionStatus(pSrbExt);
+
+    if ((returnValue == TRUE) &&
+        (pSrbExt->pCplEntry->DW3.SF.SCT == GENERIC_COMMAND_STATUS) &&
+        (pSrbExt->pCplEntry->DW3.SF.SC == SUCCESSFUL_COMPLETION) &&
+        (StorPortGetSystemAddress(pDevExt, pSrb, &pData) ==
+         STOR_STATUS_SUCCESS) && (pData != NULL)) {
+        error = SntiHostPi(pSrbExt, (PUCHAR)pData, FALSE);
+        if (error != 0) {
+            /* Start over from the good status just mapped */
+            pSrb->SrbStatus = SRB_STATUS_PENDING;
+            SntiMapMediaErrors(pSrb, error);
+        }
+    }
+
+    return returnValue;
+} /* SntiPiReadCompletion */
+
+/******************************************************************************
+ * SntiCrc16Init
+ *
+ * @brief Builds the slicing-by-8 tables of the T10 DIF CRC (polynomial
+ *        0x8BB7, no reflection, 0 seed). Table k holds the CRC of each byte
+ *        followed by k zero bytes, so 8 bytes fold in with 8 lookups. The
+ *        tables don't depend on the adapter, building them again while
+ *        another adapter uses them only rewrites the same values.
+ *
+ * @param VOID
+ *
+ * @return VOID
+ ******************************************************************************/
+VOID SntiCrc16Init(
+    VOID
+)
+{
+    ULONG value;
+    ULONG bit;
+    ULONG table;
+    UINT16 crc;
+
+    for (value = 0; value < CRC16_TABLE_ENTRIES; value++) {
+        crc = (UINT16)(value << BYTE_SHIFT_1);
+        for (bit = 0; bit < 8; bit++) {
+            if (crc & 0x8000)
+                crc = (UINT16)((crc << 1) ^ T10_DIF_CRC_POLY);
+            else
+                crc = (UINT16)(crc << 1);
+        }
+        crc16Table[0][value] = crc;
+    }
+
+    for (table = 1; table < CRC16_TABLES; table++) {
+        for (value = 0; value < CRC16_TABLE_ENTRIES; value++) {
+            crc = crc16Table[table - 1][value];
+            crc16Table[table][value] = (UINT16)(crc << BYTE_SHIFT_1) ^
+                crc16Table[0][crc >> BYTE_SHIFT_1];
+        }
+    }
+} /* SntiCrc16Init */
+
+/******************************************************************************
+ * SntiCrc16
+ *
+ * @brief Returns the T10 DIF CRC of a buffer, 8 bytes a step with the
+ *        slicing-by-8 tables and the tail a byte at a time.
+ *
+ * @param pData - Data to run the CRC over
+ * @param length - Its length in bytes
+ *
+ * @return UINT16
+ *     The guard tag
+ ******************************************************************************/
+UINT16 SntiCrc16(
+    PUCHAR pData,
+    ULONG length
+)
+{
+    UINT16 crc = 0;
+
+    while (length >= CRC16_TABLES) {
+        crc = crc16Table[7][pData[BYTE_0] ^ (crc >> BYTE_SHIFT_1)] ^
+              crc16Table[6][pData[BYTE_1] ^ (crc & 0xFF)] ^
+              crc16Table[5][pData[BYTE_2]] ^
+              crc16Table[4][pData[BYTE_3]] ^
+              crc16Table[3][pData[BYTE_4]] ^
+              crc16Table[2][pData[BYTE_5]] ^
+              crc16Table[1][pData[BYTE_6]] ^
+              crc16Table[0][pData[BYTE_7]];
+        pData += CRC16_TABLES;
+        length -= CRC16_TABLES;
+    }
+
+    while (length-- > 0) {
+        crc = (UINT16)(crc << BYTE_SHIFT_1) ^
+            crc16Table[0][((crc >> BYTE_SHIFT_1) ^ *pData++) & 0xFF];
+    }
+
+    return crc;
+} /* SntiCrc16 */
+
 /******************************************************************************
  * SntiSetScsiSenseData
  *
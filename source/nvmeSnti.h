@@ -1043,6 +1043,48 @@ SNTI_STATUS SntiValidateLbaAndLength(
     UINT32 length
 );
 
+SNTI_STATUS SntiTranslateProtection(
+    PNVME_SRB_EXTENSION pSrbExt,
+    PNVME_LUN_EXTENSION pLunExt,
+    UINT8 protect
+);
+
+VOID SntiSetupMetadata(
+    PNVME_SRB_EXTENSION pSrbExt,
+    PNVME_LUN_EXTENSION pLunExt,
+    BOOLEAN isWrite
+);
+
+VOID SntiSetupHostPi(
+    PNVME_SRB_EXTENSION pSrbExt,
+    PNVME_LUN_EXTENSION pLunExt,
+    BOOLEAN isWrite
+);
+
+UINT8 SntiHostPi(
+    PNVME_SRB_EXTENSION pSrbExt,
+    PUCHAR pData,
+    BOOLEAN generate
+);
+
+BOOLEAN SntiIsFormatSupported(
+    PNVME_LUN_EXTENSION pLunExt
+);
+
+VOID SntiCrc16Init(
+    VOID
+);
+
+UINT16 SntiCrc16(
+    PUCHAR pData,
+    ULONG length
+);
+
+BOOLEAN SntiPiReadCompletion(
+    PVOID param1,
+    PVOID param2
+);
+
 BOOLEAN SntiSetScsiSenseData(
 #if (NTDDI_VERSION > NTDDI_WIN7)
     PSTORAGE_REQUEST_BLOCK pSrb,
@@ -266,6 +266,31 @@
 #define PROTECTION_INFO                      0x00000000
 #define NVME_WRITE_PRINFO_BIT_OFFSET                 26
 #define NVME_READ_PRINFO_BIT_OFFSET                  26
+#define NVME_PRINFO_MASK                            0xF
+#define NVME_PRINFO_PRACT                           0x8
+#define NVME_PRINFO_PRCHK_GUARD                     0x4
+#define NVME_PRINFO_PRCHK_APP                       0x2
+#define NVME_PRINFO_PRCHK_REF                       0x1
+#define NVME_PRINFO_PRCHK_ALL                       0x7
+#define NVME_NLB_MASK                            0xFFFF
+#define NVME_PI_TYPE_1                                1
+#define NVME_PI_TYPE_2                                2
+#define NVME_PI_TYPE_3                                3
+#define PI_TUPLE_SIZE                                 8
+#define PI_APP_TAG_ESCAPE                        0xFFFF
+#define PI_REF_TAG_ESCAPE                    0xFFFFFFFF
+#define T10_DIF_CRC_POLY                         0x8BB7
+#define CRC16_TABLES                                  8
+#define CRC16_TABLE_ENTRIES                         256
+#define INQ_STD_PROTECT_OFFSET                        5
+#define INQ_STD_PROTECT_MASK                        0x1
+#define SPT_TYPE_1                                  0x0
+#define SPT_TYPE_1_2                                0x1
+#define SPT_TYPE_2                                  0x2
+#define SPT_TYPE_1_3                                0x3
+#define SPT_TYPE_3                                  0x4
+#define SPT_TYPE_2_3                                0x5
+#define SPT_TYPE_1_2_3                              0x7
 #define INQ_STANDARD_INQUIRY_PAGE                  0x00
 #define INQ_SUPPORTED_VPD_PAGES_PAGE               0x00
 #define INQ_UNIT_SERIAL_NUMBER_PAGE                0x80
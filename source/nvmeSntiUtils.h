@@ -59,6 +59,8 @@
 #define GET_TARGET_ID(pSrb)         (SrbGetTargetId((PVOID)pSrb))
 #define GET_LUN_ID(pSrb)            (SrbGetLun((PVOID)pSrb))
 #define GET_CDB_LENGTH(pSrb)        (SrbGetCdbLength((PVOID)pSrb))
+#define GET_SRB_FLAGS(pSrb)         (SrbGetSrbFlags((PVOID)pSrb))
+#define GET_QUEUE_ACTION(pSrb)      (SrbGetRequestAttribute((PVOID)pSrb))
 
 /* Extract fields from CDBs at offsets */
 #define GET_U8_FROM_CDB(pSrb, index)   (((PCDB)SrbGetCdb((PVOID)pSrb))->AsByte[index])
@@ -84,6 +86,8 @@
 #define GET_TARGET_ID(pSrb)          (pSrb)->TargetId
 #define GET_LUN_ID(pSrb)             (pSrb)->Lun
 #define GET_CDB_LENGTH(pSrb)         (pSrb)->CdbLength
+#define GET_SRB_FLAGS(pSrb)          (pSrb)->SrbFlags
+#define GET_QUEUE_ACTION(pSrb)       (pSrb)->QueueAction
 
 /* Extract fields from CDBs at offsets */
 #define GET_U8_FROM_CDB(pSrb, index)   ((pSrb)->Cdb[index] << 0)
@@ -53,8 +53,11 @@
 /*******************************************************************************
  * NVMeCallArbiter
  *
- * @brief Calls the init state machine arbiter either via timer callback or
- *        directly depending on crashdump or not
+ * @brief Schedules the next pass of the init state machine. The only state
+ *        that has nothing to wait on but the controller itself is RDY, so
+ *        that one is paced by the timer. Every other transition is driven by
+ *        a command completion (or a synchronous handler) and is dispatched
+ *        right away via the state DPC instead of waiting for a timer tick.
  *
  * @param pAE - Pointer to adapter device extension.
  *
@@ -64,19 +67,123 @@ VOID NVMeCallArbiter(
     PNVME_DEVICE_EXTENSION pAE
 )
 {
-	if ((pAE->ntldrDump == FALSE) && (pAE->polledResetInProg != TRUE)) {
+    if (pAE->ntldrDump == TRUE) {
+        /*
+         * NoOp in dump mode because NVMeRunningStartAttempt() steps through
+         * the initialization state machine in a while loop.
+         */
+        return;
+    }
+
+    if (pAE->polledResetInProg == TRUE) {
+        /* The polled loop in NVMeRunningStartAttempt() picks this up */
+        pAE->DriverState.DispatchPending = TRUE;
+    } else if (pAE->DriverState.NextDriverState == NVMeWaitOnRDY) {
         StorPortNotification(RequestTimerCall,
                              pAE,
                              NVMeRunning,
                              pAE->DriverState.CheckbackInterval);
     } else {
-		/*
-		 * NoOp in dump mode because NVMeRunningStartAttempt() steps through
-		 * the initialization state machine in a while loop.
-		 */
+        /*
+         * If the DPC is already queued it hasn't run yet, so it will pick up
+         * whatever NextDriverState is by the time it does.
+         */
+        StorPortIssueDpc(pAE, &pAE->StateDpc, NULL, NULL);
     }
 } /* NVMeCallArbiter */
 
+/*******************************************************************************
+ * NVMeRunningDpcRoutine
+ *
+ * @brief DPC routine that runs the next init state as soon as the previous
+ *        one has been completed.
+ *
+ * @param pDpc - Pointer to DPC
+ * @param pHwDeviceExtension - Pointer to device extension
+ * @param pSystemArgument1 - Unused
+ * @param pSystemArgument2 - Unused
+ *
+ * @return VOID
+ ******************************************************************************/
+VOID NVMeRunningDpcRoutine(
+    IN PSTOR_DPC  pDpc,
+    IN PVOID  pHwDeviceExtension,
+    IN PVOID  pSystemArgument1,
+    IN PVOID  pSystemArgument2
+)
+{
+    PNVME_DEVICE_EXTENSION pAE = (PNVME_DEVICE_EXTENSION)pHwDeviceExtension;
+    STOR_LOCK_HANDLE startLockhandle = { 0 };
+
+    UNREFERENCED_PARAMETER(pDpc);
+    UNREFERENCED_PARAMETER(pSystemArgument1);
+    UNREFERENCED_PARAMETER(pSystemArgument2);
+
+    /* Same serialization the timer callback used to give us */
+    StorPortAcquireSpinLock(pAE, StartIoLock, NULL, &startLockhandle);
+    NVMeRunning(pAE);
+    StorPortReleaseSpinLock(pAE, &startLockhandle);
+} /* NVMeRunningDpcRoutine */
+
+#if (NTDDI_VERSION > NTDDI_WIN7)
+/*******************************************************************************
+ * NVMeRunningWatchdog
+ *
+ * @brief Timer callback armed once RDY is seen. It never advances the state
+ *        machine itself, it only fails it when no state has been dispatched
+ *        for longer than the controller timeout (CAP.TO). It has a timer of
+ *        its own, on Win7 the single HwTimer belongs to RDY polling and
+ *        IsDeviceRemoved so there is no watchdog there.
+ *
+ * @param pAE - Pointer to adapter device extension.
+ * @param Context - Not used
+ *
+ * @return VOID
+ ******************************************************************************/
+VOID NVMeRunningWatchdog(
+    PNVME_DEVICE_EXTENSION pAE,
+    PVOID Context
+)
+{
+    PSTART_STATE pDS = &pAE->DriverState;
+
+    UNREFERENCED_PARAMETER(Context);
+
+    if ((pAE->ShutdownInProgress == TRUE) ||
+        (pAE->WatchdogTimerhandle == NULL))
+        return;
+
+    if ((pDS->NextDriverState == NVMeStartComplete) ||
+        (pDS->NextDriverState == NVMeStateFailed) ||
+        (pAE->polledResetInProg == TRUE)) {
+        return;
+    }
+
+    if (pDS->StateDispatchCount != pDS->WatchdogDispatchCount) {
+        pDS->WatchdogDispatchCount = pDS->StateDispatchCount;
+        pDS->WatchdogStallCount = 0;
+    } else {
+        pDS->WatchdogStallCount += STATE_WATCHDOG_us;
+        if (pDS->WatchdogStallCount > pAE->uSecCrtlTimeout) {
+            StorPortDebugPrint(ERROR,
+                "NVMeRunningWatchdog: <Error> Stuck in state 0x%x\n",
+                pDS->NextDriverState);
+            NVMeDriverFatalError(pAE,
+                                (1 << START_STATE_TIMEOUT_FAILURE));
+            NVMeCallArbiter(pAE);
+            return;
+        }
+    }
+
+    StorPortRequestTimer(pAE,
+                         pAE->WatchdogTimerhandle,
+                         NVMeRunningWatchdog,
+                         NULL,
+                         STATE_WATCHDOG_us,
+                         0);
+} /* NVMeRunningWatchdog */
+#endif
+
 /*******************************************************************************
  * NVMeCrashDelay
  *
@@ -149,17 +256,28 @@ BOOLEAN NVMeRunningStartAttempt(
     pAE->DriverState.DriverErrorStatus = 0;
     pAE->DriverState.NextDriverState = NVMeWaitOnRDY;
     pAE->DriverState.StateChkCount = 0;
-    pAE->DriverState.IdentifyNamespaceFetched = 0;
-    pAE->DriverState.CurrentNsid = 0;
     pAE->DriverState.InterruptCoalescingSet = FALSE;
+    pAE->DriverState.ApstSet = FALSE;
+    pAE->DriverState.HmbSet = FALSE;
+    pAE->DriverState.DbbufSet = FALSE;
+    pAE->DriverState.ArbitrationSet = FALSE;
     pAE->DriverState.ConfigLbaRangeNeeded = FALSE;
-    pAE->DriverState.TtlLbaRangeExamined = 0;
     pAE->DriverState.NumAERsIssued = 0;
     pAE->DriverState.TimeoutCounter = 0;
     pAE->DriverState.resetDriven = resetDriven;
     pAE->DriverState.pResetSrb = pResetSrb;
-    pAE->DriverState.VisibleNamespacesExamined = 0;
-    pAE->DriverState.NumKnownNamespaces = 0;
+    pAE->DriverState.FastResumeIssued = 0;
+    pAE->DriverState.BurstSlotsBusy = 0;
+    pAE->DriverState.ReIdentifyPending = FALSE;
+    pAE->DriverState.StateDispatchCount = 0;
+    pAE->DriverState.WatchdogDispatchCount = 0;
+    pAE->DriverState.WatchdogStallCount = 0;
+    pAE->DriverState.DispatchPending = FALSE;
+    pAE->DriverState.StartLatencyUs = 0;
+    pAE->DriverState.StartTimeUs = 0;
+    if (pAE->ntldrDump == FALSE) {
+        pAE->DriverState.StartTimeUs = NVMeGetTimeStampUs(pAE);
+    }
 #if DBG
     pAE->LearningComplete = FALSE;
 #endif
@@ -172,10 +290,21 @@ BOOLEAN NVMeRunningStartAttempt(
     pAE->QueueInfo.NumCplIoQAllocFromAdapter = 0;
     pAE->QueueInfo.NumIoQMapped = 1;  /* mapping starts at 1, since 0 is admin queue */
 
-    /* Zero out the LUN extensions and reset the counter as well */
-    memset((PVOID)pAE->pLunExtensionTable[0],
-           0,
-           sizeof(NVME_LUN_EXTENSION) * MAX_NAMESPACES);
+    /*
+     * A fast resume keeps what Identify found before the power down, the
+     * namespaces are not re-identified until the next full init.
+     */
+    if (pAE->DriverState.FastResume == FALSE) {
+        pAE->DriverState.IdentifyNamespaceFetched = 0;
+        pAE->DriverState.CurrentNsid = 0;
+        pAE->DriverState.TtlLbaRangeExamined = 0;
+        pAE->DriverState.VisibleNamespacesExamined = 0;
+        pAE->DriverState.NumKnownNamespaces = 0;
+        pAE->DriverState.ListNsStart = 0;
+
+        /* Zero out the LUN extensions and reset the counter as well */
+        NVMeResetLunTable(pAE);
+    }
 
     /*
      * Now, starts state machine by calling NVMeRunning
@@ -197,17 +326,37 @@ BOOLEAN NVMeRunningStartAttempt(
 
 			while ((pAE->DriverState.NextDriverState != NVMeStartComplete) &&
 				(pAE->DriverState.NextDriverState != NVMeStateFailed)){
+				ULONG pollInterval = STATE_POLL_us;
+
+				/*
+				 * Only run the next state once the previous one asked for it,
+				 * otherwise we'd reissue a command that just hasn't completed
+				 * yet.
+				 */
+				if ((pAE->DriverState.DispatchPending == TRUE) &&
+					(pAE->DriverState.NextDriverState != NVMeWaitOnRDY)) {
+					pAE->DriverState.DispatchPending = FALSE;
+					NVMeRunning(pAE);
+					continue;
+				}
+
+				/* RDY has nothing to complete, it's re-checked at timer pace */
+				if (pAE->DriverState.NextDriverState == NVMeWaitOnRDY)
+					pollInterval = pAE->DriverState.CheckbackInterval;
 
-				/* increment 5000us (timer callback val */
-				pAE->DriverState.TimeoutCounter += pAE->DriverState.CheckbackInterval;
+				pAE->DriverState.TimeoutCounter += pollInterval;
 				if (pAE->DriverState.TimeoutCounter > passiveTimeout) {
 					NVMeDriverFatalError(pAE,
 						(1 << START_STATE_TIMEOUT_FAILURE));
 					break;
 				}
 
-				NVMeRunning(pAE);
-				NVMeStallExecution(pAE, STORPORT_TIMER_CB_us);
+				NVMeStallExecution(pAE, pollInterval);
+
+				if (pAE->DriverState.DispatchPending == TRUE) {
+					pAE->DriverState.DispatchPending = FALSE;
+					NVMeRunning(pAE);
+				}
 				IoCompletionRoutine(NULL, pAE, (PVOID)0, 0);
 			}
 
@@ -277,6 +426,8 @@ VOID NVMeRunning(
      * in the completion routines and executed via DPC (except crasdump)
      * calling back into this arbiter
      */
+    pAE->DriverState.StateDispatchCount++;
+
     switch (pAE->DriverState.NextDriverState) {
         case NVMeStateFailed:
             NVMeFreeBuffers(pAE);
@@ -319,6 +470,20 @@ VOID NVMeRunning(
 		break;
         case NVMeStartComplete:
             pAE->RecoveryAttemptPossible = TRUE;
+
+            /* A queue recreation from NVME_TUNABLES is done with it too */
+            pAE->DriverState.FastResume = FALSE;
+
+            if ((pAE->ntldrDump == FALSE) &&
+                (pAE->DriverState.StartTimeUs != 0)) {
+                pAE->DriverState.StartLatencyUs = (ULONG)
+                    (NVMeGetTimeStampUs(pAE) - pAE->DriverState.StartTimeUs);
+                pAE->DriverState.StartTimeUs = 0;
+                StorPortDebugPrint(INFO,
+                    "NVMeRunning: reset to ready in %d us, %d state dispatches\n",
+                    pAE->DriverState.StartLatencyUs,
+                    pAE->DriverState.StateDispatchCount);
+            }
 			newVersion = StorPortReadRegisterUlong(pAE, (PULONG)(&pAE->pCtrlRegister->VS));
 
 			if (pAE->ntldrDump == FALSE  && newVersion != INVALID_DEVICE_REGISTER_VALUE && pAE->DeviceRemovedDuringIO != TRUE) {
@@ -393,8 +558,33 @@ VOID NVMeRunningWaitOnRDY(
 
         if (CSTS.RDY == 1) {
             StorPortDebugPrint(INFO,"NVMeRunningWaitOnRDY: RDY has been set\n");
-            pAE->DriverState.NextDriverState = NVMeWaitOnIdentifyCtrl;
+            if (pAE->DriverState.FastResume == TRUE) {
+                /* Identify data is still valid, go replay the features */
+                pAE->DriverState.NextDriverState = NVMeWaitOnSetFeatures;
+            } else {
+                pAE->DriverState.NextDriverState = NVMeWaitOnIdentifyCtrl;
+            }
             pAE->DriverState.StateChkCount = 0;
+
+            /*
+             * From here on every state is completion driven, the watchdog is
+             * only used to catch a controller that stops responding.
+             */
+#if (NTDDI_VERSION > NTDDI_WIN7)
+            if ((pAE->ntldrDump == FALSE) &&
+                (pAE->polledResetInProg == FALSE) &&
+                (pAE->WatchdogTimerhandle != NULL)) {
+                pAE->DriverState.WatchdogDispatchCount =
+                    pAE->DriverState.StateDispatchCount;
+                pAE->DriverState.WatchdogStallCount = 0;
+                StorPortRequestTimer(pAE,
+                                     pAE->WatchdogTimerhandle,
+                                     NVMeRunningWatchdog,
+                                     NULL,
+                                     STATE_WATCHDOG_us,
+                                     0);
+            }
+#endif
         } else {
             if (pAE->DriverState.StateChkCount == 0) {
                 StorPortDebugPrint(INFO,"NVMeRunningWaitOnRDY: Waiting...\n");
@@ -436,7 +626,7 @@ VOID NVMeRunningWaitOnIdentifyCtrl(
  * NVMeRunningWaitOnListAttachedNs
  *
  * @brief NVMeRunningWaitOnListAttachedNs is called to issue Identify command to
- *        list all the attached namespaces.
+ *        list all the attached namespaces, one page of up to 1024 at a time.
  *
  * @param pAE - Pointer to adapter device extension.
  *
@@ -446,7 +636,9 @@ VOID NVMeRunningWaitOnListAttachedNs(
     PNVME_DEVICE_EXTENSION pAE
 )
 {
-    if (NVMeGetIdentifyStructures(pAE, 0, LIST_ATTACHED_NAMESPACES) == FALSE) {
+    if (NVMeGetIdentifyStructures(pAE,
+                                  pAE->DriverState.ListNsStart,
+                                  LIST_ATTACHED_NAMESPACES) == FALSE) {
         NVMeDriverFatalError(pAE,
                             (1 << START_STATE_LIST_ATTACHED_NS_FAILURE));
         NVMeCallArbiter(pAE);
@@ -467,7 +659,9 @@ VOID NVMeRunningWaitOnListExistingNs(
     PNVME_DEVICE_EXTENSION pAE
 )
 {
-    if (NVMeGetIdentifyStructures(pAE, 0, LIST_EXISTING_NAMESPACES) == FALSE) {
+    if (NVMeGetIdentifyStructures(pAE,
+                                  pAE->DriverState.ListNsStart,
+                                  LIST_EXISTING_NAMESPACES) == FALSE) {
         NVMeDriverFatalError(pAE,
                             (1 << START_STATE_LIST_EXISTING_NS_FAILURE));
         NVMeCallArbiter(pAE);
@@ -610,8 +804,16 @@ VOID NVMeRunningWaitOnSetupQueues(
  *        commands:
  *
  *        1. Set Features command (Interrupt Coalescing, Feature ID#8)
- *        2. Set Features command (Number of Queues, Feature ID#7)
- *        3. For each existing Namespace, Get Features (LBA Range Type) first.
+ *        2. Set Features command (Autonomous Power State Transition, Feature
+ *           ID#0Ch) when the controller supports it
+ *        3. Set Features command (Host Memory Buffer, Feature ID#0Dh) when
+ *           the controller asks for one
+ *        4. Doorbell Buffer Config command when the controller supports it,
+ *           ahead of IO queue creation
+ *        5. Set Features command (Arbitration, Feature ID#1) when Weighted
+ *           Round Robin is in use
+ *        6. Set Features command (Number of Queues, Feature ID#7)
+ *        7. For each existing Namespace, Get Features (LBA Range Type) first.
  *           When its Type is 00b and NLB matches the size of the Namespace,
  *           isssue Set Features (LBA Range Type) to configure:
  *             a. its Type as Filesystem,
@@ -640,6 +842,34 @@ VOID NVMeRunningWaitOnSetFeatures(
             NVMeCallArbiter(pAE);
             return;
         }
+    } else if (pAE->DriverState.ApstSet == FALSE) {
+        if (NVMeSetApst(pAE) == FALSE) {
+            NVMeDriverFatalError(pAE,
+                                (1 << START_STATE_SET_FEATURE_FAILURE));
+            NVMeCallArbiter(pAE);
+            return;
+        }
+    } else if (pAE->DriverState.HmbSet == FALSE) {
+        if (NVMeSetHostMemBuffer(pAE) == FALSE) {
+            NVMeDriverFatalError(pAE,
+                                (1 << START_STATE_SET_FEATURE_FAILURE));
+            NVMeCallArbiter(pAE);
+            return;
+        }
+    } else if (pAE->DriverState.DbbufSet == FALSE) {
+        if (NVMeSetDoorbellBuffer(pAE) == FALSE) {
+            NVMeDriverFatalError(pAE,
+                                (1 << START_STATE_SET_FEATURE_FAILURE));
+            NVMeCallArbiter(pAE);
+            return;
+        }
+    } else if (pAE->DriverState.ArbitrationSet == FALSE) {
+        if (NVMeSetArbitration(pAE) == FALSE) {
+            NVMeDriverFatalError(pAE,
+                                (1 << START_STATE_SET_FEATURE_FAILURE));
+            NVMeCallArbiter(pAE);
+            return;
+        }
     } else if (pQI->NumSubIoQAllocFromAdapter == 0) {
         if (NVMeAllocQueueFromAdapter(pAE) == FALSE) {
             NVMeDriverFatalError(pAE,
@@ -674,11 +904,23 @@ VOID NVMeRunningWaitOnIoCQ(
 {
     PQUEUE_INFO pQI = &pAE->QueueInfo;
 
+    if (pAE->DriverState.FastResume == TRUE) {
+        if (NVMeRunningCreateQueueBurst(pAE,
+                                        pQI->NumCplIoQCreated,
+                                        pQI->NumCplIoQAllocated,
+                                        TRUE) == FALSE) {
+            NVMeDriverFatalError(pAE,
+                                (1 << START_STATE_CPLQ_CREATE_FAILURE));
+            NVMeCallArbiter(pAE);
+        }
+        return;
+    }
+
     /*
      * Issue Create IO Completion Queue commands when first called
      * If failed, fail the state machine
      */
-    if (NVMeCreateCplQueue(pAE, (USHORT)pQI->NumCplIoQCreated + 1 ) == FALSE) {
+    if (NVMeCreateCplQueue(pAE, (USHORT)pQI->NumCplIoQCreated + 1, NULL) == FALSE) {
         NVMeDriverFatalError(pAE,
                             (1 << START_STATE_CPLQ_CREATE_FAILURE));
         NVMeCallArbiter(pAE);
@@ -701,17 +943,103 @@ VOID NVMeRunningWaitOnIoSQ(
 {
     PQUEUE_INFO pQI = &pAE->QueueInfo;
 
+    if (pAE->DriverState.FastResume == TRUE) {
+        if (NVMeRunningCreateQueueBurst(pAE,
+                                        pQI->NumSubIoQCreated,
+                                        pQI->NumSubIoQAllocated,
+                                        FALSE) == FALSE) {
+            NVMeDriverFatalError(pAE,
+                                (1 << START_STATE_SUBQ_CREATE_FAILURE));
+            NVMeCallArbiter(pAE);
+        }
+        return;
+    }
+
     /*
      * Issue Create IO Submission Queue commands when first called
      * If failed, fail the state machine
      */
-    if (NVMeCreateSubQueue(pAE, (USHORT)pQI->NumSubIoQCreated + 1) == FALSE) {
+    if (NVMeCreateSubQueue(pAE, (USHORT)pQI->NumSubIoQCreated + 1, NULL) == FALSE) {
         NVMeDriverFatalError(pAE,
                             (1 << START_STATE_SUBQ_CREATE_FAILURE));
         NVMeCallArbiter(pAE);
     }
 } /* NVMeRunningWaitOnIoSQ */
 
+/*******************************************************************************
+ * NVMeRunningCreateQueueBurst
+ *
+ * @brief On a fast resume the queues being recreated are the ones that were
+ *        running before the power down and nothing else is using the admin
+ *        queue, so the creates are posted back to back instead of one per
+ *        state dispatch. Up to half the admin queue, at most
+ *        CREATE_QUEUE_BURST, is kept in flight, each create with an SRB
+ *        extension of its own, and a create that's already been posted is
+ *        not posted again when a completion re-runs the state. Without the
+ *        burst's extensions the creates go one at a time.
+ *
+ * @param pAE - Pointer to adapter device extension.
+ * @param NumCreated - Number of queues of this type created so far
+ * @param NumAllocated - Number of queues of this type to create
+ * @param CplQueue - TRUE for completion queues, FALSE for submission queues
+ *
+ * @return BOOLEAN
+ *     TRUE - All creates in the window were posted
+ *     FALSE - A create could not be posted
+ ******************************************************************************/
+BOOLEAN NVMeRunningCreateQueueBurst(
+    PNVME_DEVICE_EXTENSION pAE,
+    ULONG NumCreated,
+    ULONG NumAllocated,
+    BOOLEAN CplQueue
+)
+{
+    PSUB_QUEUE_INFO pAdminSQI = pAE->QueueInfo.pSubQueueInfo;
+    PSTART_STATE pDS = &pAE->DriverState;
+    PNVME_SRB_EXTENSION pSrbExt = NULL;
+    ULONG Window = 1;
+    ULONG LastQueue;
+    ULONG QueueID;
+    ULONG Slot = 0;
+    BOOLEAN Status;
+
+    if (pDS->pBurstSrbExt != NULL)
+        Window = min(max(pAdminSQI->SubQEntries / 2, 1), CREATE_QUEUE_BURST);
+
+    LastQueue = min(NumAllocated, NumCreated + Window);
+
+    for (QueueID = max(pDS->FastResumeIssued, NumCreated) + 1;
+         QueueID <= LastQueue;
+         QueueID++) {
+        if (pDS->pBurstSrbExt != NULL) {
+            /* Completions may come out of order, take any free extension */
+            for (Slot = 0; Slot < Window; Slot++)
+                if ((pDS->BurstSlotsBusy & (1 << Slot)) == 0)
+                    break;
+            if (Slot == Window)
+                break;
+
+            pSrbExt = (PNVME_SRB_EXTENSION)pDS->pBurstSrbExt + Slot;
+            pDS->BurstSlotsBusy |= (1 << Slot);
+        }
+
+        if (CplQueue == TRUE)
+            Status = NVMeCreateCplQueue(pAE, (USHORT)QueueID, pSrbExt);
+        else
+            Status = NVMeCreateSubQueue(pAE, (USHORT)QueueID, pSrbExt);
+
+        if (Status == FALSE) {
+            if (pSrbExt != NULL)
+                pDS->BurstSlotsBusy &= ~(1 << Slot);
+            return (FALSE);
+        }
+
+        pDS->FastResumeIssued = QueueID;
+    }
+
+    return (TRUE);
+} /* NVMeRunningCreateQueueBurst */
+
 /*******************************************************************************
  * NVMeDriverFatalError
  *
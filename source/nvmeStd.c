@@ -57,58 +57,172 @@ PVOID TraceContext;
 #endif
 
 #ifdef HISTORY
-void TracePathSubmit(HISTORY_TAG tag, ULONG queueId, ULONG NSID,
-	NVMe_COMMAND_DWORD_0 CDW0, ULONGLONG parm1, ULONGLONG parm2, ULONGLONG parm3)
+/*******************************************************************************
+ * NVMeHistoryInit
+ *
+ * @brief NVMeHistoryInit gets called once at passive init to allocate one
+ *        command history ring per core. HistoryDepth is rounded down to a
+ *        power of 2 so the write index wraps with a mask. Nothing is traced
+ *        in dump mode or when HistoryDepth is 0.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ *
+ * @return BOOLEAN
+ *     TRUE - If the rings are allocated or the history is off
+ *     FALSE - If anything goes wrong
+ ******************************************************************************/
+BOOLEAN NVMeHistoryInit(
+	PNVME_DEVICE_EXTENSION pAE
+)
 {
+	ULONG Depth = pAE->InitInfo.HistoryDepth;
+	ULONG Ring;
+
+	if ((pAE->ntldrDump == TRUE) || (Depth == 0))
+		return (TRUE);
 
-	SubmitHistory[SubmitIndex].tag = tag;
-	SubmitHistory[SubmitIndex].queueId = queueId;
-	SubmitHistory[SubmitIndex].NSID = NSID;
-	SubmitHistory[SubmitIndex].CDW0 = CDW0;
-	SubmitHistory[SubmitIndex].parm1 = parm1;
-	SubmitHistory[SubmitIndex].parm2 = parm2;
-	SubmitHistory[SubmitIndex].parm3 = parm3;
+	/* Round down to a power of 2 */
+	while ((Depth & (Depth - 1)) != 0)
+		Depth &= (Depth - 1);
+
+	pAE->NumHistoryRings = pAE->ResMapTbl.NumActiveCores;
+	pAE->pHistoryRings = (PHISTORY_RING)NVMeAllocatePool(pAE,
+		sizeof(HISTORY_RING) * pAE->NumHistoryRings);
+	pAE->pHistoryRecords = (PNVME_HISTORY_RECORD)NVMeAllocatePool(pAE,
+		sizeof(NVME_HISTORY_RECORD) * Depth * pAE->NumHistoryRings);
+	if ((pAE->pHistoryRings == NULL) || (pAE->pHistoryRecords == NULL)) {
+		if (pAE->pHistoryRings != NULL)
+			StorPortFreePool((PVOID)pAE, pAE->pHistoryRings);
+		if (pAE->pHistoryRecords != NULL)
+			StorPortFreePool((PVOID)pAE, pAE->pHistoryRecords);
+		pAE->pHistoryRings = NULL;
+		pAE->pHistoryRecords = NULL;
+		pAE->NumHistoryRings = 0;
+		return (FALSE);
+	}
 
-	if ((++SubmitIndex) >= HISTORY_DEPTH)
-		SubmitIndex = 0;
+	for (Ring = 0; Ring < pAE->NumHistoryRings; Ring++)
+		pAE->pHistoryRings[Ring].pRecords =
+			pAE->pHistoryRecords + (Ring * Depth);
 
-	SubmitHistory[SubmitIndex].tag = HISTORY_MARKER;
-}
+	pAE->HistoryDepth = Depth;
+
+	return (TRUE);
+} /* NVMeHistoryInit */
 
-void TracePathComplete(HISTORY_TAG tag, ULONG queueId, ULONG CID,
-	ULONG SQHD, NVMe_COMPLETION_QUEUE_ENTRY_DWORD_3 DW3, ULONGLONG parm2, ULONGLONG parm3)
+/*******************************************************************************
+ * TraceGetRecord
+ *
+ * @brief TraceGetRecord claims the next record in the history ring of the
+ *        current core and stamps it. Rings are indexed by the system wide
+ *        processor index so cores of different groups don't share one.
+ *        Only this core writes to the ring, the interlocked increment is
+ *        there for an interrupt that lands in the middle of a DPC writing to
+ *        the same ring and stays on this core's cache line. With the history
+ *        off this is all the hot path pays for.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ * @param tag - Record tag
+ * @param queueId - Queue the record is about
+ *
+ * @return PNVME_HISTORY_RECORD
+ *     The record to fill in, NULL when the history is off
+ ******************************************************************************/
+static PNVME_HISTORY_RECORD TraceGetRecord(
+	PNVME_DEVICE_EXTENSION pAE,
+	HISTORY_TAG tag,
+	ULONG queueId
+)
 {
+	PHISTORY_RING pRing = NULL;
+	PNVME_HISTORY_RECORD pRecord = NULL;
+	ULONG Slot;
 
-	CompleteHistory[CompleteIndex].tag = tag;
-	CompleteHistory[CompleteIndex].queueId = queueId;
-	CompleteHistory[CompleteIndex].CID = CID;
-	CompleteHistory[CompleteIndex].SQHD = SQHD;
-	CompleteHistory[CompleteIndex].DW3 = DW3;
-	CompleteHistory[CompleteIndex].parm2 = parm2;
-	CompleteHistory[CompleteIndex].parm3 = parm3;
+	if (pAE->pHistoryRings == NULL)
+		return (NULL);
 
-	if ((++CompleteIndex) >= HISTORY_DEPTH)
-		CompleteIndex = 0;
+	pRing = &pAE->pHistoryRings[KeGetCurrentProcessorNumberEx(NULL) %
+		pAE->NumHistoryRings];
+	Slot = (ULONG)(InterlockedIncrement(&pRing->Next) - 1);
+	pRecord = &pRing->pRecords[Slot & (pAE->HistoryDepth - 1)];
+
+	pRecord->TimeStampUs = NVMeGetTimeStampUs(pAE);
+	pRecord->Tag = (UCHAR)tag;
+	pRecord->QueueId = (USHORT)queueId;
+
+	return (pRecord);
+} /* TraceGetRecord */
+
+VOID TracePathSubmit(
+	PNVME_DEVICE_EXTENSION pAE,
+	HISTORY_TAG tag,
+	ULONG queueId,
+	ULONG NSID,
+	NVMe_COMMAND_DWORD_0 CDW0,
+	ULONG parm1,
+	ULONGLONG parm2,
+	ULONGLONG parm3
+)
+{
+	PNVME_HISTORY_RECORD pRecord = TraceGetRecord(pAE, tag, queueId);
+
+	if (pRecord == NULL)
+		return;
 
-	CompleteHistory[CompleteIndex].tag = HISTORY_MARKER;
+	pRecord->Opcode = (UCHAR)CDW0.OPC;
+	pRecord->CID = (USHORT)CDW0.CID;
+	pRecord->Parm0 = NSID;
+	pRecord->Parm1 = parm1;
+	pRecord->Parm2 = parm2;
+	pRecord->Parm3 = parm3;
 }
 
-void TraceEvent(HISTORY_TAG tag, ULONG queueId, ULONG CID,
-	ULONG parm0, ULONGLONG parm1, ULONGLONG parm2, ULONGLONG parm3)
+VOID TracePathComplete(
+	PNVME_DEVICE_EXTENSION pAE,
+	HISTORY_TAG tag,
+	ULONG queueId,
+	ULONG CID,
+	ULONG SQHD,
+	NVMe_COMPLETION_QUEUE_ENTRY_DWORD_3 DW3,
+	ULONGLONG parm2,
+	ULONGLONG parm3
+)
 {
+	PNVME_HISTORY_RECORD pRecord = TraceGetRecord(pAE, tag, queueId);
+
+	if (pRecord == NULL)
+		return;
 
-	EventHistory[EventIndex].tag = tag;
-	EventHistory[EventIndex].queueId = queueId;
-	EventHistory[EventIndex].CID = CID;
-	EventHistory[EventIndex].parm0 = parm0;
-	EventHistory[EventIndex].parm1 = parm1;
-	EventHistory[EventIndex].parm2 = parm2;
-	EventHistory[EventIndex].parm3 = parm3;
+	pRecord->Opcode = 0;
+	pRecord->CID = (USHORT)CID;
+	pRecord->Parm0 = SQHD;
+	pRecord->Parm1 = *(PULONG)&DW3;
+	pRecord->Parm2 = parm2;
+	pRecord->Parm3 = parm3;
+}
+
+VOID TraceEvent(
+	PNVME_DEVICE_EXTENSION pAE,
+	HISTORY_TAG tag,
+	ULONG queueId,
+	ULONG CID,
+	ULONG parm0,
+	ULONG parm1,
+	ULONGLONG parm2,
+	ULONGLONG parm3
+)
+{
+	PNVME_HISTORY_RECORD pRecord = TraceGetRecord(pAE, tag, queueId);
 
-	if ((++EventIndex) >= HISTORY_DEPTH)
-		EventIndex = 0;
+	if (pRecord == NULL)
+		return;
 
-	EventHistory[EventIndex].tag = HISTORY_MARKER;
+	pRecord->Opcode = 0;
+	pRecord->CID = (USHORT)CID;
+	pRecord->Parm0 = parm0;
+	pRecord->Parm1 = parm1;
+	pRecord->Parm2 = parm2;
+	pRecord->Parm3 = parm3;
 }
 
 #endif
@@ -333,6 +447,9 @@ NVMeFindAdapter(
 	 */
 	pAE->InitInfo.Namespaces = DFT_NAMESPACES;
 
+	/* As many namespaces tracked as can be LUNs by default */
+	pAE->InitInfo.NamespaceTable = DFT_NAMESPACE_TABLE;
+
 	/* Max transfer size is 128KB by default */
 	pAE->InitInfo.MaxTxSize = DFT_TX_SIZE;
 	pAE->PRPListSize = ((pAE->InitInfo.MaxTxSize / PAGE_SIZE) * sizeof(UINT64));
@@ -347,6 +464,43 @@ NVMeFindAdapter(
 	pAE->InitInfo.IntCoalescingTime = DFT_INT_COALESCING_TIME;
 	pAE->InitInfo.IntCoalescingEntry = DFT_INT_COALESCING_ENTRY;
 
+	/* APST may add up to 100 millisecond of exit latency by default. */
+	pAE->InitInfo.ApstMaxLatency = DFT_APST_MAX_LATENCY;
+
+	/* Up to 128MB of Host Memory Buffer by default. */
+	pAE->InitInfo.HmbMaxSize = DFT_HMB_MAX_SIZE;
+
+	/* IO submission queues in the Controller Memory Buffer when there is one. */
+	pAE->InitInfo.CmbSubQueues = DFT_CMB_SUB_QUEUES;
+
+	/* Weighted Round Robin arbitration when the controller has it. */
+	pAE->InitInfo.WrrArbitration = DFT_WRR_ARBITRATION;
+
+	/* No per namespace IOPS or bandwidth limits unless configured. */
+	pAE->InitInfo.QosIopsLimit = DFT_QOS_IOPS_LIMIT;
+	pAE->InitInfo.QosBandwidthLimit = DFT_QOS_BANDWIDTH_LIMIT;
+
+	/* Completions per queue before a DPC makes room for others. */
+	pAE->InitInfo.CplBudget = DFT_CPL_BUDGET;
+
+	/* Head doorbell once per queue sweep unless configured. */
+	pAE->InitInfo.CplDoorbellBatch = DFT_CPL_DOORBELL_BATCH;
+
+	/* Command history records per core when built with HISTORY. */
+	pAE->InitInfo.HistoryDepth = DFT_HISTORY_DEPTH;
+
+	/* Every command traced once the IO path WPP flags are enabled. */
+	pAE->InitInfo.TraceSampleRate = DFT_TRACE_SAMPLE_RATE;
+
+	/* Slow commands are those past their queue's p99.9 unless configured. */
+	pAE->InitInfo.SlowCmdThresholdUs = DFT_SLOW_CMD_THRESHOLD;
+
+	/* SRB trace recorder off unless configured. */
+	pAE->InitInfo.SrbTraceEntries = DFT_SRB_TRACE_ENTRIES;
+
+	/* Separately kept PI is left to PRACT unless configured. */
+	pAE->InitInfo.PiHostCheck = DFT_PI_HOST_CHECK;
+
 	/* Information for accessing pciCfg space */
 	pAE->SystemIoBusNumber = pPCI->SystemIoBusNumber;
 	pAE->SlotNumber = pPCI->SlotNumber;
@@ -366,6 +520,33 @@ NVMeFindAdapter(
 			pAE->InitInfo.IoQEntries = CAP.MQES + 1;
 		}
 
+		/* Map the Controller Memory Buffer if IO queues are to use it */
+		if (pAE->InitInfo.CmbSubQueues != 0)
+			NVMeMapCmb(pAE, pPCI);
+
+		/* Priority class SQs need Weighted Round Robin with Urgent */
+		if ((pAE->InitInfo.WrrArbitration != 0) &&
+			((CAP.AMS & NVME_CAP_AMS_WRR_URGENT) != 0))
+			pAE->WrrEnabled = TRUE;
+
+		/*
+		 * The class SQs all post to their base SQ's CQ, which is sized to
+		 * hold all of them and is limited by CAP as well.
+		 */
+		if ((pAE->WrrEnabled == TRUE) &&
+			((pAE->InitInfo.IoQEntries * NVME_SQ_CLASSES) >
+			 (ULONG)(CAP.MQES + 1))) {
+			if ((ULONG)(CAP.MQES + 1) <
+				(NVME_SQ_CLASSES * MIN_IO_QUEUE_ENTRIES)) {
+				pAE->WrrEnabled = FALSE;
+			} else {
+				pAE->InitInfo.IoQEntries =
+					(CAP.MQES + 1) / NVME_SQ_CLASSES;
+				StorPortDebugPrint(INFO, "IO Q size limited by WRR to 0x%x\n",
+					pAE->InitInfo.IoQEntries);
+			}
+		}
+
 		/* updte in case someone used the registry to change MaxTxSie */
 		pAE->PRPListSize = ((pAE->InitInfo.MaxTxSize / PAGE_SIZE) * sizeof(UINT64));
 
@@ -416,6 +597,38 @@ NVMeFindAdapter(
 			StorPortDebugPrint(ERROR, "---NVMeFindAdapter: <Error> Intialization of timer failed---\n");
 			pAE->Timerhandle = NULL;
 		}
+
+		/* Releases IO deferred by namespace QoS */
+		storStatus = StorPortInitializeTimer(pAE, &pAE->QosTimerhandle);
+
+		if (storStatus != STOR_STATUS_SUCCESS) {
+			StorPortDebugPrint(ERROR, "---NVMeFindAdapter: <Error> Intialization of QoS timer failed---\n");
+			pAE->QosTimerhandle = NULL;
+		}
+
+		/* Waits for IO to drain before NVME_TUNABLES recreates the queues */
+		storStatus = StorPortInitializeTimer(pAE, &pAE->RetuneTimerhandle);
+
+		if (storStatus != STOR_STATUS_SUCCESS) {
+			StorPortDebugPrint(ERROR, "---NVMeFindAdapter: <Error> Intialization of retune timer failed---\n");
+			pAE->RetuneTimerhandle = NULL;
+		}
+
+		/* Waits for a namespace's IO to drain before it's formatted */
+		storStatus = StorPortInitializeTimer(pAE, &pAE->FormatTimerhandle);
+
+		if (storStatus != STOR_STATUS_SUCCESS) {
+			StorPortDebugPrint(ERROR, "---NVMeFindAdapter: <Error> Intialization of format timer failed---\n");
+			pAE->FormatTimerhandle = NULL;
+		}
+
+		/* Watches the init state machine once it's completion driven */
+		storStatus = StorPortInitializeTimer(pAE, &pAE->WatchdogTimerhandle);
+
+		if (storStatus != STOR_STATUS_SUCCESS) {
+			StorPortDebugPrint(ERROR, "---NVMeFindAdapter: <Error> Intialization of watchdog timer failed---\n");
+			pAE->WatchdogTimerhandle = NULL;
+		}
 #endif
 	}
 
@@ -439,8 +652,10 @@ NVMeFindAdapter(
 	/* Set driver to run in full duplex mode */
 	pPCI->SynchronizationModel = StorSynchronizeFullDuplex;
 
-	/* Specify the size of SrbExtension */
+	/* Specify the size of SrbExtension, with the PI window if it's used */
 	pPCI->SrbExtensionSize = sizeof(NVME_SRB_EXTENSION);
+	if (pAE->InitInfo.PiHostCheck != 0)
+		pPCI->SrbExtensionSize += PI_HOST_EXT_SIZE;
 
 	/* For 64-bit systems, controller supports 64-bit addressing, */
 	if (pPCI->Dma64BitAddresses == SCSI_DMA64_SYSTEM_SUPPORTED)
@@ -476,6 +691,107 @@ NVMeFindAdapter(
 	return(SP_RETURN_FOUND);
 } /* NVMeFindAdapter */
 
+/*******************************************************************************
+ * NVMeMapCmb
+ *
+ * @brief NVMeMapCmb gets called from NVMeFindAdapter to locate the Controller
+ *        Memory Buffer from CMBLOC/CMBSZ and map it when the controller allows
+ *        submission queues in it. The BAR named by CMBLOC.BIR is looked up in
+ *        PCI config space and matched against the granted access ranges, BAR0
+ *        is already mapped for the registers. Nothing is mapped otherwise and
+ *        all queues stay in host memory.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ * @param pPCI - Pointer to PORT_CONFIGURATION_INFORMATION structure.
+ *
+ * @return VOID
+ ******************************************************************************/
+VOID NVMeMapCmb(
+	PNVME_DEVICE_EXTENSION pAE,
+	PPORT_CONFIGURATION_INFORMATION pPCI
+)
+{
+	PCMB_INFO pCmb = &pAE->CmbInfo;
+	NVMe_CONTROLLER_MEMORY_BUFFER_LOCATION CMBLOC;
+	NVMe_CONTROLLER_MEMORY_BUFFER_SIZE CMBSZ;
+	PCI_COMMON_HEADER PciHeader;
+	PACCESS_RANGE pRange = NULL;
+	PUCHAR pBarBase = NULL;
+	ULONG64 BarStart;
+	ULONG64 Offset;
+	ULONG64 Size;
+	ULONG Bar;
+	ULONG Range;
+
+	CMBSZ.AsUlong = StorPortReadRegisterUlong(pAE,
+		(PULONG)(&pAE->pCtrlRegister->CMBSZ));
+	CMBLOC.AsUlong = StorPortReadRegisterUlong(pAE,
+		(PULONG)(&pAE->pCtrlRegister->CMBLOC));
+
+	/* Only submission queues are placed in the CMB */
+	if ((CMBSZ.SZ == 0) || (CMBSZ.SQS == 0) ||
+		(CMBLOC.BIR >= PCI_TYPE0_ADDRESSES))
+		return;
+
+	Offset = (ULONG64)CMBLOC.OFST * CMB_UNIT_SIZE(CMBSZ.SZU);
+	Size = (ULONG64)CMBSZ.SZ * CMB_UNIT_SIZE(CMBSZ.SZU);
+
+	if (StorPortGetBusData((PVOID)pAE,
+		PCIConfiguration,
+		pPCI->SystemIoBusNumber,
+		pPCI->SlotNumber,
+		&PciHeader,
+		sizeof(PCI_COMMON_HEADER)) < sizeof(PCI_COMMON_HEADER))
+		return;
+
+	/* Bus address of the BAR, 64 bit BARs take the next one as high part */
+	Bar = PciHeader.u.type0.BaseAddresses[CMBLOC.BIR];
+	BarStart = Bar & ~((ULONG64)0xF);
+	if (((Bar & PCI_ADDRESS_MEMORY_TYPE_MASK) == PCI_TYPE_64BIT) &&
+		((CMBLOC.BIR + 1) < PCI_TYPE0_ADDRESSES))
+		BarStart |= (ULONG64)PciHeader.u.type0.BaseAddresses[CMBLOC.BIR + 1] << 32;
+
+	for (Range = 0; Range < pPCI->NumberOfAccessRanges; Range++) {
+		if (((*(pPCI->AccessRanges))[Range].RangeInMemory == TRUE) &&
+			((ULONG64)(*(pPCI->AccessRanges))[Range].RangeStart.QuadPart == BarStart)) {
+			pRange = &(*(pPCI->AccessRanges))[Range];
+			break;
+		}
+	}
+
+	if ((pRange == NULL) || (Offset >= pRange->RangeLength))
+		return;
+
+	/* Don't trust CMBSZ beyond what the BAR decodes */
+	Size = min(Size, pRange->RangeLength - Offset);
+	Size &= ~((ULONG64)PAGE_SIZE - 1);
+	if (Size == 0)
+		return;
+
+	if (Range == NVME_CTL_BAR) {
+		pBarBase = (PUCHAR)pAE->pCtrlRegister;
+	} else {
+		pBarBase = (PUCHAR)StorPortGetDeviceBase(pAE,
+			pPCI->AdapterInterfaceType,
+			pPCI->SystemIoBusNumber,
+			pRange->RangeStart,
+			pRange->RangeLength,
+			FALSE);
+		if (pBarBase == NULL)
+			return;
+	}
+
+	pCmb->pCmbStart = pBarBase + Offset;
+	pCmb->CmbStart.QuadPart = BarStart + Offset;
+	pCmb->Size = Size;
+	pCmb->Used = 0;
+	pCmb->SubQSupported = TRUE;
+
+	StorPortDebugPrint(INFO,
+		"NVMeMapCmb: %d KB in BAR%d at offset 0x%x, VirtualAddr=0x%p\n",
+		(ULONG)(Size / 1024), CMBLOC.BIR, (ULONG)Offset, pCmb->pCmbStart);
+} /* NVMeMapCmb */
+
 /*******************************************************************************
  * NVMePassiveInitialize
  *
@@ -504,7 +820,6 @@ BOOLEAN NVMePassiveInitialize(
 	ULONG Status = STOR_STATUS_SUCCESS;
 	PQUEUE_INFO pQI = &pAE->QueueInfo;
 	PRES_MAPPING_TBL pRMT = &pAE->ResMapTbl;
-	ULONG Lun;
 	ULONG i;
 	ULONG passiveTimeout;
 	ULONG newVersion = 0;
@@ -516,11 +831,13 @@ BOOLEAN NVMePassiveInitialize(
 	/*
 	 * Based on the number of active cores in the system, allocate sub/cpl queue
 	 * info structure array first. The total number of structures should be the
-	 * number of active cores plus one (Admin queue).
+	 * number of active cores, times the priority classes with WRR, plus one
+	 * (Admin queue).
 	 */
 	pQI->pSubQueueInfo =
 		(PSUB_QUEUE_INFO)NVMeAllocatePool(pAE, sizeof(SUB_QUEUE_INFO) *
-		(pRMT->NumActiveCores + 1));
+		(NVME_MAX_SUB_IO_QUEUES(pAE) + 1));
+	pQI->NumSubQClasses = 1;
 
 	if (pQI->pSubQueueInfo == NULL) {
 		/* Free the allocated SUB_QUEUE_INFO structure memory */
@@ -571,20 +888,41 @@ BOOLEAN NVMePassiveInitialize(
 		return (FALSE);
 	}
 
-	/* Allocate memory for LUN extensions */
-	pAE->LunExtSize = MAX_NAMESPACES * sizeof(NVME_LUN_EXTENSION);
-	pAE->pLunExtensionTable[0] =
-		(PNVME_LUN_EXTENSION)NVMeAllocateMem(pAE, pAE->LunExtSize, 0);
+	/* Without these a fast resume creates its queues one at a time */
+	pAE->DriverState.pBurstSrbExt = NVMeAllocatePool(pAE,
+		sizeof(NVME_SRB_EXTENSION) * CREATE_QUEUE_BURST);
 
-	if (pAE->pLunExtensionTable[0] == NULL) {
+	/* Allocate memory for LUN extensions and the NSID hash */
+	if (NVMeAllocLunTable(pAE, pAE->InitInfo.NamespaceTable) == FALSE) {
 		/* Free the allocated buffers before returning */
 		NVMeFreeBuffers(pAE);
 		return (FALSE);
 	}
 
-	/* Populate each LUN extension table with a valid address */
-	for (Lun = 1; Lun < MAX_NAMESPACES; Lun++)
-		pAE->pLunExtensionTable[Lun] = pAE->pLunExtensionTable[0] + Lun;
+	/*
+	 * Namespace QoS, the latency histograms, slow command log and SRB trace
+	 * are optional, the driver carries on without the ones it can't have.
+	 * The slow command log needs the histograms.
+	 */
+	if (NVMeQosInit(pAE) == FALSE)
+		StorPortDebugPrint(ERROR,
+			"NVMePassiveInitialize: <Error> no memory, namespace QoS is off\n");
+
+	if (NVMeLatencyInit(pAE) == FALSE)
+		StorPortDebugPrint(ERROR,
+			"NVMePassiveInitialize: <Error> no memory, latency histograms are off\n");
+
+	if (NVMeSlowCmdInit(pAE) == FALSE)
+		StorPortDebugPrint(ERROR,
+			"NVMePassiveInitialize: <Error> no memory, slow command log is off\n");
+
+	if (NVMeSrbTraceInit(pAE) == FALSE)
+		StorPortDebugPrint(ERROR,
+			"NVMePassiveInitialize: <Error> no memory, SRB trace is off\n");
+
+	/* The host PI check needs its CRC tables */
+	if (pAE->InitInfo.PiHostCheck != 0)
+		SntiCrc16Init();
 
 	/*
 	 * Allocate buffer for data transfer in Start State Machine before State
@@ -598,17 +936,16 @@ BOOLEAN NVMePassiveInitialize(
 	}
 
 #ifdef HISTORY
-	SubmitIndex = 0;
-	CompleteIndex = 0;
-	EventIndex = 0;
-	memset(&SubmitHistory, 0, sizeof(HISTORY_SUBMIT) * HISTORY_DEPTH);
-	memset(&CompleteHistory, 0, sizeof(HISTORY_COMPLETE) * HISTORY_DEPTH);
-	memset(&EventHistory, 0, sizeof(HISTORY_EVENT) * HISTORY_DEPTH);
+	/* The command history is optional too */
+	if (NVMeHistoryInit(pAE) == FALSE)
+		StorPortDebugPrint(ERROR,
+			"NVMePassiveInitialize: <Error> no memory, command history is off\n");
 #endif
 
 	/* Initialize a DPC for command completions that need to free memory */
 	StorPortInitializeDpc(pAE, &pAE->SntiDpc, SntiDpcRoutine);
 	StorPortInitializeDpc(pAE, &pAE->RecoveryDpc, RecoveryDpcRoutine);
+	StorPortInitializeDpc(pAE, &pAE->StateDpc, NVMeRunningDpcRoutine);
 
 	/* Initialize DPC objects for IO completions */
 	for (i = 0; i < pAE->NumDpc; i++) {
@@ -651,8 +988,11 @@ BOOLEAN NVMePassiveInitialize(
 		(pAE->DriverState.NextDriverState != NVMeStateFailed)) {
 
 		newVersion = StorPortReadRegisterUlong(pAE, (PULONG)(&pAE->pCtrlRegister->VS));
-		/* increment 5000us (timer callback val */
-		pAE->DriverState.TimeoutCounter += pAE->DriverState.CheckbackInterval;
+		/*
+		 * The state machine advances on its own as commands complete, poll
+		 * at a finer grain than the RDY timer so we don't add a tick at the end
+		 */
+		pAE->DriverState.TimeoutCounter += STATE_POLL_us;
 		if ((pAE->DriverState.TimeoutCounter > passiveTimeout) || (pAE->originalVersion.value != newVersion)) {
 
 #if (NTDDI_VERSION > NTDDI_WIN7)
@@ -668,7 +1008,7 @@ BOOLEAN NVMePassiveInitialize(
                           controller initialization\n");
 			break;
 		}
-		NVMeStallExecution(pAE, STORPORT_TIMER_CB_us);
+		NVMeStallExecution(pAE, STATE_POLL_us);
 	}
 
 	return (pAE->DriverState.NextDriverState == NVMeStartComplete) ? TRUE : FALSE;
@@ -705,7 +1045,6 @@ BOOLEAN NVMeInitialize(
 	ULONG Status = STOR_STATUS_SUCCESS;
 	USHORT QueueID;
 	ULONG QEntries;
-	ULONG Lun;
 	NVMe_CONTROLLER_CONFIGURATION CC = { 0 };
 	PERF_CONFIGURATION_DATA perfQueryData = { 0 };
 	PERF_CONFIGURATION_DATA perfData = { 0 };
@@ -754,7 +1093,10 @@ BOOLEAN NVMeInitialize(
 	 * it's NULL, nothing needs to be done.
 	 */
 	pAE->DriverState.pSrbExt = NULL;
-	pAE->pLunExtensionTable[0] = NULL;
+	pAE->DriverState.pBurstSrbExt = NULL;
+	pAE->pLunExtensionTable = NULL;
+	pAE->NumLunExtensions = 0;
+	pAE->pNsHashHeads = NULL;
 	pAE->QueueInfo.pSubQueueInfo = NULL;
 	pAE->QueueInfo.pCplQueueInfo = NULL;
 
@@ -837,6 +1179,7 @@ BOOLEAN NVMeInitialize(
 		pQI->pSubQueueInfo =
 			(PSUB_QUEUE_INFO)NVMeAllocatePool(pAE, sizeof(SUB_QUEUE_INFO) *
 			(pRMT->NumActiveCores + 1));
+		pQI->NumSubQClasses = 1;
 
 		if (pQI->pSubQueueInfo == NULL) {
 			NVMeFreeBuffers(pAE);
@@ -933,20 +1276,13 @@ BOOLEAN NVMeInitialize(
 			return (FALSE);
 		}
 
-		/* Allocate memory for LUN extensions */
-		pAE->LunExtSize = MAX_NAMESPACES * sizeof(NVME_LUN_EXTENSION);
-		pAE->pLunExtensionTable[0] =
-			(PNVME_LUN_EXTENSION)NVMeAllocateMem(pAE, pAE->LunExtSize, 0);
-		if (pAE->pLunExtensionTable[0] == NULL) {
+		/* Allocate memory for LUN extensions and the NSID hash */
+		if (NVMeAllocLunTable(pAE, pAE->InitInfo.NamespaceTable) == FALSE) {
 			/* Free the allocated buffers before returning */
 			NVMeFreeBuffers(pAE);
 			return (FALSE);
 		}
 
-		/* Populate each LUN extension table with valid an address */
-		for (Lun = 1; Lun < MAX_NAMESPACES; Lun++)
-			pAE->pLunExtensionTable[Lun] = pAE->pLunExtensionTable[0] + Lun;
-
 		/*
 		 * Allocate buffer for data transfer in Start State Machine before State
 		 * Machine starts
@@ -1099,6 +1435,46 @@ BOOLEAN NVMeIsReadWriteCmd(
 	return FALSE;
 } /* NVMeIsReadWriteCmd */
 
+/*******************************************************************************
+ * NVMeStopTimers
+ *
+ * @brief NVMeStopTimers gets called on shutdown and removal to cancel and
+ *        free every timer the adapter armed. Requests waiting on a timer are
+ *        completed by the timer's own stop routine. A new timer is stopped
+ *        here and nowhere else.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ *
+ * @return VOID
+ ******************************************************************************/
+VOID NVMeStopTimers(
+	PNVME_DEVICE_EXTENSION pAE
+)
+{
+#if (NTDDI_VERSION > NTDDI_WIN7)
+	if (pAE->Timerhandle != NULL) {
+		StorPortRequestTimer(pAE, pAE->Timerhandle, IsDeviceRemoved, NULL, STOP_SURPRISE_REMOVAL_TIMER, 0);
+		StorPortFreeTimer(pAE, pAE->Timerhandle);
+		pAE->Timerhandle = NULL;
+	}
+	if (pAE->QosTimerhandle != NULL) {
+		StorPortRequestTimer(pAE, pAE->QosTimerhandle, NVMeQosTimer, NULL, 0, 0);
+		StorPortFreeTimer(pAE, pAE->QosTimerhandle);
+		pAE->QosTimerhandle = NULL;
+		pAE->QosTimerArmed = FALSE;
+	}
+	NVMeRetuneStop(pAE);
+	NVMeFormatDrainStop(pAE);
+	if (pAE->WatchdogTimerhandle != NULL) {
+		StorPortRequestTimer(pAE, pAE->WatchdogTimerhandle, NVMeRunningWatchdog, NULL, 0, 0);
+		StorPortFreeTimer(pAE, pAE->WatchdogTimerhandle);
+		pAE->WatchdogTimerhandle = NULL;
+	}
+#else
+	StorPortNotification(RequestTimerCall, pAE, IsDeviceRemoved, STOP_SURPRISE_REMOVAL_TIMER);
+#endif
+} /* NVMeStopTimers */
+
 
 /*******************************************************************************
  * NVMeBuildIo
@@ -1140,6 +1516,7 @@ BOOLEAN NVMeBuildIo(
 	BOOLEAN ioctlStatus = FALSE;
 	UCHAR opCode = 0;
 	PCDB pCdb = NULL;
+	ULONGLONG stageStart = 0;
 
 #if (NTDDI_VERSION > NTDDI_WIN7)
 	if (Function == SRB_FUNCTION_STORAGE_REQUEST_BLOCK) {
@@ -1166,7 +1543,7 @@ BOOLEAN NVMeBuildIo(
 	 */
 	if ((PathId != VALID_NVME_PATH_ID) ||
 		(TargetId != VALID_NVME_TARGET_ID) ||
-		(pAdapterExtension->pLunExtensionTable[0] == NULL) ||
+		(pAdapterExtension->pLunExtensionTable == NULL) ||
 		((pAdapterExtension->RecoveryAttemptPossible != TRUE) &&
 		(pAdapterExtension->pLunExtensionTable[Lun]->slotStatus != ONLINE) &&
 			(SRB_FUNCTION_IO_CONTROL != Function))) {
@@ -1242,15 +1619,7 @@ BOOLEAN NVMeBuildIo(
 		 */
 		pAdapterExtension->ShutdownInProgress = TRUE;
 		if (pAdapterExtension->ntldrDump == FALSE) {
-#if (NTDDI_VERSION > NTDDI_WIN7)					
-			if (pAdapterExtension->Timerhandle != NULL) {
-				StorPortRequestTimer(pAdapterExtension, pAdapterExtension->Timerhandle, IsDeviceRemoved, NULL, STOP_SURPRISE_REMOVAL_TIMER, 0);
-				StorPortFreeTimer(pAdapterExtension, pAdapterExtension->Timerhandle);
-				pAdapterExtension->Timerhandle = NULL;
-			}
-#else
-			StorPortNotification(RequestTimerCall, pAdapterExtension, IsDeviceRemoved, STOP_SURPRISE_REMOVAL_TIMER);
-#endif
+			NVMeStopTimers(pAdapterExtension);
 		}
 		Srb->SrbStatus = SRB_STATUS_SUCCESS;
 		IO_StorPortNotification(RequestComplete,
@@ -1323,15 +1692,7 @@ BOOLEAN NVMeBuildIo(
 			 * allocated for it.
 			 */
 			if (pAdapterExtension->ntldrDump == FALSE) {
-#if (NTDDI_VERSION > NTDDI_WIN7)
-				if (pAdapterExtension->Timerhandle != NULL) {
-					StorPortRequestTimer(pAdapterExtension, pAdapterExtension->Timerhandle, IsDeviceRemoved, NULL, STOP_SURPRISE_REMOVAL_TIMER, 0);
-					StorPortFreeTimer(pAdapterExtension, pAdapterExtension->Timerhandle);
-					pAdapterExtension->Timerhandle = NULL;
-				}
-#else
-				StorPortNotification(RequestTimerCall, pAdapterExtension, IsDeviceRemoved, STOP_SURPRISE_REMOVAL_TIMER);
-#endif
+				NVMeStopTimers(pAdapterExtension);
 				NVMeAdapterControlPowerDown(pAdapterExtension);
 				NVMeFreeBuffers(pAdapterExtension);
 			}
@@ -1407,38 +1768,23 @@ BOOLEAN NVMeBuildIo(
 		break;
 	case SRB_FUNCTION_EXECUTE_SCSI:
 		/*
-		* Block Read/Write commands while Format NVM is in progress
-		* Case 1: All namespace are being formatted.
-		* Case 2: Only one namespace is being formatted.
+		* Block Read/Write commands while all namespaces are being
+		* formatted. When only one is, StartIo holds its IO instead, see
+		* NVMeFormatNVMHold.
 		*/
-		if (pAdapterExtension->FormatNvmInfo.State != FORMAT_NVM_NO_ACTIVITY) {
+		if ((pAdapterExtension->FormatNvmInfo.State != FORMAT_NVM_NO_ACTIVITY) &&
+			(pAdapterExtension->FormatNvmInfo.FormatAllNamespaces == TRUE)) {
 			opCode = GET_OPCODE(Srb);
-			if (pAdapterExtension->FormatNvmInfo.FormatAllNamespaces == TRUE) {
-				if (NVMeIsReadWriteCmd(Function, opCode) == TRUE) {
-					Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
-					IO_StorPortNotification(RequestComplete,
-						AdapterExtension,
-#if (NTDDI_VERSION > NTDDI_WIN7)
-						(PSTORAGE_REQUEST_BLOCK)Srb);
-#else
-						(PSCSI_REQUEST_BLOCK)Srb);
-#endif
-					return FALSE;
-				}
-			}
-			else {
-				if ((pAdapterExtension->FormatNvmInfo.TargetLun == Lun) &&
-					(NVMeIsReadWriteCmd(Function, opCode) == TRUE)) {
-					Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
-					IO_StorPortNotification(RequestComplete,
-						AdapterExtension,
+			if (NVMeIsReadWriteCmd(Function, opCode) == TRUE) {
+				Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
+				IO_StorPortNotification(RequestComplete,
+					AdapterExtension,
 #if (NTDDI_VERSION > NTDDI_WIN7)
-						(PSTORAGE_REQUEST_BLOCK)Srb);
+					(PSTORAGE_REQUEST_BLOCK)Srb);
 #else
-						(PSCSI_REQUEST_BLOCK)Srb);
+					(PSCSI_REQUEST_BLOCK)Srb);
 #endif
-					return FALSE;
-				}
+				return FALSE;
 			}
 		}
 #if DBG
@@ -1446,6 +1792,15 @@ BOOLEAN NVMeBuildIo(
 		StorPortDebugPrint(INFO, "BuildIo: SRB_FUNCTION_EXECUTE_SCSI\n");
 #endif /* DBG */
 
+		/* Record the request when the SRB trace is on */
+		if (pAdapterExtension->pSrbTrace != NULL)
+			NVMeSrbTraceRecord(pAdapterExtension,
+#if (NTDDI_VERSION > NTDDI_WIN7)
+				(PSTORAGE_REQUEST_BLOCK)Srb);
+#else
+				(PSCSI_REQUEST_BLOCK)Srb);
+#endif
+
 		/*
 		 * An SRB that makes it to this point needs to be processed and
 		 * have a valid SRB Extension... initialize its contents.
@@ -1459,12 +1814,16 @@ BOOLEAN NVMeBuildIo(
 #endif
 
 		/* Perform SCSI to NVMe translation */
+		stageStart = NVMeSrbStageStart(pAdapterExtension);
 		sntiStatus = SntiTranslateCommand(pAdapterExtension,
 #if (NTDDI_VERSION > NTDDI_WIN7) 
 			(PSTORAGE_REQUEST_BLOCK)Srb);
 #else
 			(PSCSI_REQUEST_BLOCK)Srb);
 #endif
+		NVMeSrbStageEnd(pAdapterExtension,
+			NVME_SRB_STAGE_TRANSLATE,
+			stageStart);
 
 		switch (sntiStatus) {
 		case SNTI_COMMAND_COMPLETED:
@@ -1611,6 +1970,9 @@ VOID IsDeviceRemoved(
 		StorPortResume(pAE);
 	}
 	else {
+		NVMeApstUpdateResidency(pAE,
+			START_SURPRISE_REMOVAL_TIMER / MILLI_TO_MICRO);
+
 		if (pAE->DriverState.NextDriverState == NVMeStartComplete)
 			if (pAE->Timerhandle != NULL)
 				StorPortRequestTimer(pAE, pAE->Timerhandle, IsDeviceRemoved, NULL, START_SURPRISE_REMOVAL_TIMER, 0);//every 1 seconds
@@ -1653,6 +2015,12 @@ VOID IsDeviceRemoved(
 		StorPortResume(pAE);
 	}
 	else {
+		NVMeApstUpdateResidency(pAE,
+			START_SURPRISE_REMOVAL_TIMER / MILLI_TO_MICRO);
+
+		/* No QoS timer here, release what completions didn't */
+		NVMeQosRelease(pAE);
+
 		if (pAE->DriverState.NextDriverState == NVMeStartComplete)
 			StorPortNotification(RequestTimerCall, pAE, IsDeviceRemoved, START_SURPRISE_REMOVAL_TIMER); //every 1 seconds
 	}
@@ -1722,7 +2090,7 @@ BOOLEAN NVMeProcessAbortCmd(
 	PQUEUE_INFO pQI = &pAE->QueueInfo;
 	PSUB_QUEUE_INFO pSQI = NULL;
 	PCMD_ENTRY pCmdEntry = NULL;
-	USHORT CmdID;
+	ULONG CmdID;
 	USHORT QueueID = 0;
 	PNVME_SRB_EXTENSION pSrbExtension = NULL;
 	BOOLEAN issueAbortCmdFlag = FALSE;
@@ -1743,7 +2111,7 @@ BOOLEAN NVMeProcessAbortCmd(
 		pSQI = pQI->pSubQueueInfo + QueueID;
 
 		for (CmdID = 0; CmdID < pSQI->SubQEntries; CmdID++) {
-			pCmdEntry = ((PCMD_ENTRY)pSQI->pCmdEntry) + CmdID;
+			pCmdEntry = GET_CMD_ENTRY(pSQI, CmdID);
 
 			/*
 			 * Pending bit is not set continue
@@ -1827,6 +2195,7 @@ BOOLEAN NVMeStartIo(
 	PFORMAT_NVM_INFO pFormatNvmInfo = NULL;
 	ULONG Wait = 5;
 	ULONG Version = 0;
+	ULONGLONG stageStart = 0;
 
 #if (NTDDI_VERSION > NTDDI_WIN7)
 	if (Function == SRB_FUNCTION_STORAGE_REQUEST_BLOCK)
@@ -1862,6 +2231,10 @@ BOOLEAN NVMeStartIo(
 
 	pSrbExtension = (PNVME_SRB_EXTENSION)GET_SRB_EXTENSION(Srb);
 
+	/* First request after a fast resume, refresh the Identify data */
+	if (pAdapterExtension->DriverState.ReIdentifyPending == TRUE)
+		NVMeResumeReIdentify(pAdapterExtension, FALSE);
+
 	switch (Function) {
 	case SRB_FUNCTION_ABORT_COMMAND:
 		status = NVMeProcessAbortCmd(pAdapterExtension,
@@ -1892,13 +2265,13 @@ BOOLEAN NVMeStartIo(
 		//   ASSERT(FALSE);
 #ifdef HISTORY
 		if (Function == SRB_FUNCTION_RESET_DEVICE) {
-			TraceEvent(SRB_RESET_DEVICE, 0, 0, 0, Srb->Lun, 0, 0);
+			TraceEvent(pAdapterExtension, SRB_RESET_DEVICE, 0, 0, 0, Srb->Lun, 0, 0);
 		}
 		else if (Function == SRB_FUNCTION_RESET_LOGICAL_UNIT) {
-			TraceEvent(SRB_RESET_LUN, 0, 0, 0, Srb->Lun, 0, 0);
+			TraceEvent(pAdapterExtension, SRB_RESET_LUN, 0, 0, 0, Srb->Lun, 0, 0);
 		}
 		else if (Function == SRB_FUNCTION_RESET_BUS) {
-			TraceEvent(SRB_RESET_BUS, 0, 0, 0, Srb->Lun, 0, 0);
+			TraceEvent(pAdapterExtension, SRB_RESET_BUS, 0, 0, 0, Srb->Lun, 0, 0);
 		}
 #endif
 		status = NVMeResetController(pAdapterExtension,
@@ -1939,10 +2312,23 @@ BOOLEAN NVMeStartIo(
 				Srb->SrbStatus == SRB_STATUS_SUCCESS) {
 				return TRUE;
 			}
+
+			/* Held while its namespace formats, issued once it's done */
+			if (NVMeFormatNVMHold(pAdapterExtension, pSrbExtension) == TRUE)
+				break;
+
+			/* Held back by namespace QoS, issued later on */
+			if (NVMeQosDefer(pAdapterExtension, pSrbExtension) == TRUE)
+				break;
+
+			stageStart = NVMeSrbStageStart(pAdapterExtension);
 			status = ProcessIo(pAdapterExtension,
 				pSrbExtension,
 				NVME_QUEUE_TYPE_IO,
 				FALSE);
+			NVMeSrbStageEnd(pAdapterExtension,
+				NVME_SRB_STAGE_SUBMIT,
+				stageStart);
 		}
 		break;
 	case SRB_FUNCTION_POWER:
@@ -2104,6 +2490,56 @@ void NVMeStartIoProcessIoctl(
 				 * Set Format NVM State Machine as FORMAT_NVM_CMD_ISSUED
 				 */
 				pFormatNvmInfo->State = FORMAT_NVM_CMD_ISSUED;
+
+#if (NTDDI_VERSION > NTDDI_WIN7)
+				/*
+				 * What the namespace had in flight before it was paused is
+				 * for its current format, Format NVM waits for it to finish.
+				 */
+				if ((pFormatNvmInfo->HoldIo == TRUE) &&
+					(NVMeLunQuiesced(pAdapterExtension,
+						pFormatNvmInfo->TargetLun) == FALSE)) {
+					pFormatNvmInfo->pDrainSrb = pSrb;
+					pFormatNvmInfo->DrainWaitUs = 0;
+					if ((pAdapterExtension->FormatTimerhandle == NULL) ||
+						(StorPortRequestTimer(pAdapterExtension,
+							pAdapterExtension->FormatTimerhandle,
+							NVMeFormatDrainTimer,
+							NULL,
+							FORMAT_DRAIN_INTERVAL_US,
+							0) != STOR_STATUS_SUCCESS)) {
+						pNvmePtIoctl->SrbIoCtrl.ReturnCode =
+							NVME_IOCTL_FORMAT_NVM_FAILED;
+						NVMeFormatNVMRelease(pAdapterExtension, FALSE);
+						pSrb->SrbStatus = SRB_STATUS_SUCCESS;
+						IO_StorPortNotification(RequestComplete,
+							pAdapterExtension,
+							pSrb);
+					}
+					return;
+				}
+#else
+				/*
+				 * Win7's one timer watches for surprise removal, there is
+				 * nothing to wait for the namespace's IO with. Rather than
+				 * format under it, the format fails and can be retried.
+				 */
+				if ((pFormatNvmInfo->HoldIo == TRUE) &&
+					(NVMeLunQuiesced(pAdapterExtension,
+						pFormatNvmInfo->TargetLun) == FALSE)) {
+					StorPortDebugPrint(ERROR,
+						"NVMeStartIoProcessIoctl: <Error> lunId=%d IO in flight, format failed\n",
+						pFormatNvmInfo->TargetLun);
+					pNvmePtIoctl->SrbIoCtrl.ReturnCode =
+						NVME_IOCTL_FORMAT_NVM_FAILED;
+					NVMeFormatNVMRelease(pAdapterExtension, FALSE);
+					pSrb->SrbStatus = SRB_STATUS_SUCCESS;
+					IO_StorPortNotification(RequestComplete,
+						pAdapterExtension,
+						pSrb);
+					return;
+				}
+#endif
 				break;
 			default:
 				/* fall through for PT processing */
@@ -2128,6 +2564,75 @@ void NVMeStartIoProcessIoctl(
 			IO_StorPortNotification(RequestComplete, pAdapterExtension, pSrb);
 			return;
 			break;
+		case NVME_NAMESPACE_QOS:
+			pSrb->SrbStatus = SRB_STATUS_SUCCESS;
+			/* Call NVMeIoctlNamespaceQos to set/get the namespace limits */
+			NVMeIoctlNamespaceQos(pAdapterExtension, pSrb);
+			IO_StorPortNotification(RequestComplete, pAdapterExtension, pSrb);
+			return;
+			break;
+		case NVME_PROTECTION_INFO:
+			pSrb->SrbStatus = SRB_STATUS_SUCCESS;
+			/* Call NVMeIoctlProtectionInfo to read the namespace's PI */
+			NVMeIoctlProtectionInfo(pAdapterExtension, pSrb);
+			IO_StorPortNotification(RequestComplete, pAdapterExtension, pSrb);
+			return;
+			break;
+		case NVME_LATENCY_HISTOGRAM:
+			pSrb->SrbStatus = SRB_STATUS_SUCCESS;
+			/* Call NVMeIoctlLatencyHistogram to read the histograms */
+			NVMeIoctlLatencyHistogram(pAdapterExtension, pSrb);
+			IO_StorPortNotification(RequestComplete, pAdapterExtension, pSrb);
+			return;
+			break;
+		case NVME_SRB_TRACE:
+			pSrb->SrbStatus = SRB_STATUS_SUCCESS;
+			/* Call NVMeIoctlSrbTrace to drain the SRB trace */
+			NVMeIoctlSrbTrace(pAdapterExtension, pSrb);
+			IO_StorPortNotification(RequestComplete, pAdapterExtension, pSrb);
+			return;
+			break;
+		case NVME_TUNABLES:
+			pSrb->SrbStatus = SRB_STATUS_SUCCESS;
+			/*
+			 * Call NVMeIoctlTunables to apply the new values. A coalescing
+			 * change goes on to the admin queue, queue changes are held
+			 * until IO has drained.
+			 */
+			if (NVMeIoctlTunables(pAdapterExtension, pSrb) == IOCTL_COMPLETED) {
+				IO_StorPortNotification(RequestComplete, pAdapterExtension, pSrb);
+				return;
+			}
+			if (pAdapterExtension->pRetuneSrb == pSrb)
+				return;
+			break;
+		case NVME_FW_DOWNLOAD:
+			pSrb->SrbStatus = SRB_STATUS_SUCCESS;
+			/*
+			 * Call NVMeIoctlFwDownloadImage to start the download, the
+			 * request is completed once the Firmware Commit is done.
+			 */
+			if (NVMeIoctlFwDownloadImage(pAdapterExtension, pSrb) ==
+				IOCTL_COMPLETED)
+				IO_StorPortNotification(RequestComplete, pAdapterExtension, pSrb);
+			return;
+			break;
+		case NVME_SLOW_CMD_LOG:
+			pSrb->SrbStatus = SRB_STATUS_SUCCESS;
+			/* Call NVMeIoctlSlowCmdLog to read the slow command log */
+			NVMeIoctlSlowCmdLog(pAdapterExtension, pSrb);
+			IO_StorPortNotification(RequestComplete, pAdapterExtension, pSrb);
+			return;
+			break;
+#ifdef HISTORY
+		case NVME_HISTORY_SNAPSHOT:
+			pSrb->SrbStatus = SRB_STATUS_SUCCESS;
+			/* Call NVMeIoctlHistorySnapshot to copy a history ring */
+			NVMeIoctlHistorySnapshot(pAdapterExtension, pSrb);
+			IO_StorPortNotification(RequestComplete, pAdapterExtension, pSrb);
+			return;
+			break;
+#endif
 		case NVME_RESET_DEVICE:
 			/*
 			 * Need to reset the controller per request from applications,
@@ -2423,10 +2928,19 @@ IoCompletionRoutine(
 	USHORT firstCheckQueue = 0;
 	USHORT lastCheckQueue = 0;
 	USHORT indexCheckQueue = 0;
+	USHORT sharedIoQueue = 0;
+	ULONG cplCount = 0;
+	ULONG cplSinceDoorbell = 0;
+	ULONG cplNext = 0;
+	ULONG cplHarvested = 0;
+	ULONG harvestMax = 0;
+	PNVMe_COMPLETION_QUEUE_ENTRY cplBatch[CPL_HARVEST_BATCH];
+	BOOLEAN budgetExhausted = FALSE;
 	BOOLEAN InterruptClaimed = FALSE;
 	STOR_LOCK_HANDLE DpcLockhandle = { 0 };
 	STOR_LOCK_HANDLE StartLockHandle = { 0 };
 	BOOLEAN completeStatus = FALSE;
+	ULONGLONG stageStart = 0;
 
 	if (pDpc != NULL) {
 		ASSERT(pAE->ntldrDump == FALSE);
@@ -2449,8 +2963,14 @@ IoCompletionRoutine(
 		}
 		else if (pAE->DriverState.NextDriverState == NVMeWaitOnLearnMapping) {
 
-			/* while learning we setup the CT so that this is always true */
-			firstCheckQueue = lastCheckQueue = (USHORT)MsgID + 1;
+			/*
+			 * while learning we setup the CT so that this is always true,
+			 * unless the table was derived and each vector already has its queue
+			 */
+			if (pAE->MsiMappingDerived == TRUE)
+				firstCheckQueue = lastCheckQueue = pMMT->CplQueueNum;
+			else
+				firstCheckQueue = lastCheckQueue = (USHORT)MsgID + 1;
 		}
 		/* Determine which CQ to look in based on WaitOnNamespaceReady state */
 		else if (pAE->DriverState.NextDriverState == NVMeWaitOnNamespaceReady) {
@@ -2467,16 +2987,62 @@ IoCompletionRoutine(
 		lastCheckQueue = (USHORT)pQI->NumCplIoQCreated;
 	}
 
+	/*
+	 * MSIX0 is shared by the admin queue and one IO queue. Check the admin
+	 * queue first so AER, reset and pass through completions don't wait for
+	 * a full IO queue to be drained on a busy core.
+	 */
+	if ((firstCheckQueue > 0) &&
+		(MsgID == 0)) {
+		sharedIoQueue = firstCheckQueue;
+		firstCheckQueue = lastCheckQueue = 0;
+	}
+
 	/* loop through all the queues we've decided we need to look at */
 	indexCheckQueue = firstCheckQueue;
 	do {
 		pCQI = pQI->pCplQueueInfo + indexCheckQueue;
 		pSQI = pQI->pSubQueueInfo + indexCheckQueue;
 		indexCheckQueue++;
+		cplCount = cplSinceDoorbell = 0;
+		cplNext = cplHarvested = 0;
 		/* loop through each queue itself */
 		do {
-			entryStatus = NVMeGetCplEntry(pAE, pCQI, &pCplEntry);
+			/*
+			 * Stage 1 - with the last batch done, hand its slots back if the
+			 * doorbell is due and harvest the next one. Harvested slots are
+			 * consumed, so never take more than the budget leaves room for.
+			 */
+			if (cplNext == cplHarvested) {
+				if ((pAE->InitInfo.CplDoorbellBatch != 0) &&
+					(cplSinceDoorbell >= pAE->InitInfo.CplDoorbellBatch)) {
+					NVMeRingCplDoorbell(pAE, pCQI);
+					InterruptClaimed = FALSE;
+					cplSinceDoorbell = 0;
+				}
+
+				harvestMax = CPL_HARVEST_BATCH;
+				if ((pDpc != NULL) && (pAE->InitInfo.CplBudget != 0))
+					harvestMax = min(harvestMax,
+						pAE->InitInfo.CplBudget - cplCount);
+
+				cplNext = 0;
+				cplHarvested = NVMeHarvestCplEntries(pAE,
+					pCQI,
+					cplBatch,
+					harvestMax);
+			}
+
+			/* Stage 2 - complete the harvested entries in order */
+			entryStatus = (cplNext < cplHarvested) ?
+				STOR_STATUS_SUCCESS : STOR_STATUS_UNSUCCESSFUL;
 			if (entryStatus == STOR_STATUS_SUCCESS) {
+				pCplEntry = cplBatch[cplNext++];
+
+				/* Its CMD_ENTRY should be in by now */
+				if (cplNext < cplHarvested)
+					NVMePrefetchCplContext(pAE, cplBatch[cplNext]);
+
 				/*
 				 * Mask the interrupt only when first pending completed entry
 				 * found.
@@ -2492,6 +3058,9 @@ IoCompletionRoutine(
 
 				InterruptClaimed = TRUE;
 
+				stageStart = (pCplEntry->DW2.SQID != 0) ?
+					NVMeSrbStageStart(pAE) : 0;
+
 #pragma prefast(suppress:6011,"This pointer is not NULL")
 				completeStatus = NVMeCompleteCmd(pAE,
 					pCplEntry->DW2.SQID,
@@ -2502,7 +3071,7 @@ IoCompletionRoutine(
 					return;
 				}
 #ifdef HISTORY
-				TracePathComplete(COMPPLETE_CMD, pCplEntry->DW2.SQID,
+				TracePathComplete(pAE, COMPPLETE_CMD, pCplEntry->DW2.SQID,
 					pCplEntry->DW3.CID, pCplEntry->DW2.SQHD,
 					pCplEntry->DW3,
 					(ULONGLONG)pSrbExtension->pNvmeCompletionRoutine,
@@ -2528,6 +3097,19 @@ IoCompletionRoutine(
 
 					pSrbExtension->pCplEntry = pCplEntry;
 
+					NVMeSlowCmdRecord(pAE, pSrbExtension, pCplEntry);
+
+					if (pCplEntry->DW2.SQID != 0)
+						NVMeQosCountCompletion(pAE, pCQI->CplQueueID, pSrbExtension);
+
+					if (pSrbExtension->TraceSampled == TRUE)
+						TraceIoComplete("NVMeIoComplete SQ=%u CID=0x%x SCT=%u SC=0x%x LatencyUs=%I64u",
+							pCplEntry->DW2.SQID,
+							pCplEntry->DW3.CID,
+							pCplEntry->DW3.SF.SCT,
+							pCplEntry->DW3.SF.SC,
+							pSrbExtension->LatencyUs);
+
 					/*
 					 * If we're learning and this is an IO queue then update
 					 * the PCT to note which QP to start using for this core
@@ -2560,20 +3142,36 @@ IoCompletionRoutine(
 							/* reference appropriate tables */
 							pCT = pRMT->pCoreTbl + coreNum;
 
-							/* assign new queue pair */
-							/*Only if MSIGranted is less than active core
-							the QueueNo will be remapped in sequential manner
-							Otherwise QueueNo remains same as before*/
-							if (pAE->ResMapTbl.NumMsiMsgGranted < pAE->ResMapTbl.NumActiveCores) {
-								pCT->CplQueue = pCT->SubQueue = (USHORT)pQI->NumIoQMapped;
-							}
-							pCQI = pQI->pCplQueueInfo + pCT->CplQueue;
+							/*
+							 * With a derived table this is only a check, the
+							 * vector should have landed on the core we expected
+							 * for the queue the read was sent to.
+							 */
+							if ((pAE->MsiMappingDerived == TRUE) &&
+								((pCT->MsiMsgID != (USHORT)MsgID) ||
+								 (pCT->SubQueue != pCplEntry->DW2.SQID))) {
+								pAE->MsiMappingMismatches++;
+								StorPortDebugPrint(INFO,
+									"Derived mapping mismatch: core(%d) MSI ID(%d) expected(%d)\n",
+									coreNum, MsgID, pCT->MsiMsgID);
+							}
 
-							/* update based on current completion info */
-							pCT->MsiMsgID = (USHORT)MsgID;
 							pCT->Learned = TRUE;
-							pCQI->MsiMsgID = pCT->MsiMsgID;
-							pMMT->CplQueueNum = pCT->CplQueue;
+							if (pAE->MultipleCoresToSingleQueueFlag == TRUE) {
+								/*
+								 * Cores share queues, only note where the
+								 * vector lands. NVMeBindMsiToQueues pairs
+								 * vectors and queues once all are learned.
+								 */
+								pMMT->TargetCore = coreNum;
+							} else {
+								pCQI = pQI->pCplQueueInfo + pCT->CplQueue;
+
+								/* update based on current completion info */
+								pCT->MsiMsgID = (USHORT)MsgID;
+								pCQI->MsiMsgID = pCT->MsiMsgID;
+								pMMT->CplQueueNum = pCT->CplQueue;
+							}
 
 							/* increment our learning counter */
 							pAE->LearningCores++;
@@ -2625,23 +3223,34 @@ IoCompletionRoutine(
 							pSrbExtension->pSrb);
 					}
 				} /* If there was an SRB Extension */
+
+				NVMeSrbStageEnd(pAE, NVME_SRB_STAGE_COMPLETE, stageStart);
+
+				cplSinceDoorbell++;
+
+				/*
+				 * Over budget, leave what's left to the re-queued DPC so
+				 * other DPCs on this core aren't starved by a busy queue.
+				 */
+				if ((pDpc != NULL) &&
+					(pAE->InitInfo.CplBudget != 0) &&
+					(++cplCount >= pAE->InitInfo.CplBudget)) {
+					pCQI->BudgetExhausted++;
+					budgetExhausted = TRUE;
+					break;
+				}
 			} /* If a completed command was collected */
 		} while (entryStatus == STOR_STATUS_SUCCESS);
 
 		if (InterruptClaimed == TRUE) {
 			/* Now update the Completion Head Pointer via Doorbell register */
-			StorPortWriteRegisterUlong(pAE,
-				pCQI->pCplHDBL,
-				(ULONG)pCQI->CplQHeadPtr);
+			NVMeRingCplDoorbell(pAE, pCQI);
 			InterruptClaimed = FALSE;
 		}
-		/*
-		 * If we serviced another queue on MSIX0 then we also have to check
-		 * the admin queue (admin queue shared with one other QP)
-		 */
-		if ((firstCheckQueue > 0) &&
-			(MsgID == 0)) {
-			firstCheckQueue = lastCheckQueue = indexCheckQueue = 0;
+		/* The admin queue is done, now the IO queue sharing MSIX0 */
+		if (sharedIoQueue != 0) {
+			firstCheckQueue = lastCheckQueue = indexCheckQueue = sharedIoQueue;
+			sharedIoQueue = 0;
 		}
 	} while (indexCheckQueue <= lastCheckQueue); /* end queue checking loop */
 
@@ -2650,6 +3259,19 @@ IoCompletionRoutine(
 		StorPortWriteRegisterUlong(pAE, &pAE->pCtrlRegister->INTMC, 1);
 		pAE->IntxMasked = FALSE;
 	}
+
+	/* Completions return tokens over time, issue what QoS held back */
+	if ((pDpc != NULL) && (pAE->QosDeferred != 0)) {
+		if (pAE->MultipleCoresToSingleQueueFlag) {
+			NVMeQosRelease(pAE);
+		}
+		else {
+			StorPortAcquireSpinLock(pAE, StartIoLock, NULL, &StartLockHandle);
+			NVMeQosRelease(pAE);
+			StorPortReleaseSpinLock(pAE, &StartLockHandle);
+		}
+	}
+
 	if (pDpc != NULL) {
 		if (pAE->MultipleCoresToSingleQueueFlag) {
 			StorPortReleaseSpinLock(pAE, &StartLockHandle);
@@ -2657,6 +3279,10 @@ IoCompletionRoutine(
 		else {
 			StorPortReleaseSpinLock(pAE, &DpcLockhandle);
 		}
+
+		/* Come back for the completions left over budget */
+		if (budgetExhausted == TRUE)
+			StorPortIssueDpc(pAE, pDpc, pSystemArgument1, pSystemArgument2);
 	}
 } /* IoCompletionRoutine */
 
@@ -2784,7 +3410,7 @@ VOID RecoveryDpcRoutine(
 
 	StorPortDebugPrint(INFO, "RecoveryDpcRoutine: Entry\n");
 #ifdef HISTORY
-	TraceEvent(DPC_RESET, 0, 0, 0, 0, 0, 0);
+	TraceEvent(pAE, DPC_RESET, 0, 0, 0, 0, 0, 0);
 #endif
 	/*
 	 * Get spinlocks in order, this assures we don't have submission or
@@ -3091,6 +3717,9 @@ BOOLEAN NVMeIoctlCallback(
 	case IOCTL_SCSI_MINIPORT_READ_SMART_THRESHOLDS:
 		srbDone = NVMeHandleSmartThresholds(pNVMeDevExt, pSrbExt);
 		break;
+	case NVME_TUNABLES:
+		srbDone = NVMeHandleTunables(pNVMeDevExt, pSrbExt);
+		break;
 	default:
 		ASSERT(FALSE);
 		SET_DATA_LENGTH(pSrbExt->pSrb, 0);
@@ -3386,6 +4015,169 @@ BOOLEAN NVMeHandleSmartThresholds(
 }
 
 
+/*******************************************************************************
+ * NVMeHandleTunables
+ *
+ * @brief Handles the Set Features that NVME_TUNABLES sends to change interrupt
+ *        coalescing. The new values are kept, and so replayed after a reset,
+ *        only once the controller took them.
+ *
+ * @param pNVMeDevExt - Pointer to hardware device extension.
+ * @param pSrbExtension - Pointer to SRB extension
+ *
+ * @return BOOLEAN
+ *     TRUE - If the command is completed
+ *     FALSE - If additional processing is required
+ ******************************************************************************/
+BOOLEAN NVMeHandleTunables(
+	PVOID pNVMeDevExt,
+	PNVME_SRB_EXTENSION pSrbExtension
+)
+{
+	PNVME_DEVICE_EXTENSION pDevExt = (PNVME_DEVICE_EXTENSION)pNVMeDevExt;
+	PNVME_TUNABLES_IOCTL pTunables =
+		(PNVME_TUNABLES_IOCTL)GET_DATA_BUFFER(pSrbExtension->pSrb);
+
+	if ((pSrbExtension->pCplEntry->DW3.SF.SCT == 0) &&
+		(pSrbExtension->pCplEntry->DW3.SF.SC == 0)) {
+		pDevExt->InitInfo.IntCoalescingTime = pTunables->IntCoalescingTime;
+		pDevExt->InitInfo.IntCoalescingEntry = pTunables->IntCoalescingEntry;
+		pTunables->SrbIoCtrl.ReturnCode = NVME_IOCTL_SUCCESS;
+	}
+	else {
+		pTunables->SrbIoCtrl.ReturnCode = NVME_IOCTL_INTERNAL_ERROR;
+	}
+
+	NVMeTunablesGet(pDevExt, pTunables);
+	pSrbExtension->pSrb->SrbStatus = SRB_STATUS_SUCCESS;
+
+	return TRUE;
+} /* NVMeHandleTunables */
+
+/*******************************************************************************
+ * NVMeHandleFwDownload
+ *
+ * @brief Handles the completion of one of the commands NVME_FW_DOWNLOAD sends.
+ *        A Firmware Image Download makes room for the next chunk, and once the
+ *        last one completed the Firmware Commit is sent. The request is
+ *        completed when the commit is done or, after a failure, once nothing
+ *        is left in flight.
+ *
+ * @param pNVMeDevExt - Pointer to hardware device extension.
+ * @param pSrbExtension - Pointer to SRB extension
+ *
+ * @return BOOLEAN
+ *     FALSE - The commands are internal, the request is completed here
+ ******************************************************************************/
+BOOLEAN NVMeHandleFwDownload(
+	PVOID pNVMeDevExt,
+	PNVME_SRB_EXTENSION pSrbExtension
+)
+{
+	PNVME_DEVICE_EXTENSION pDevExt = (PNVME_DEVICE_EXTENSION)pNVMeDevExt;
+	PFW_DOWNLOAD_INFO pFwDl = &pDevExt->FwDownloadInfo;
+	PNVME_FW_DOWNLOAD_IOCTL pFwIoctl = NULL;
+	PNVMe_COMMAND pCmd = &pSrbExtension->nvmeSqeUnit;
+	PADMIN_FIRMWARE_ACTIVATE_COMMAND_DW10 pCommitDW10 = NULL;
+	STOR_LOCK_HANDLE StartLockHandle = { 0 };
+	BOOLEAN LockTaken = FALSE;
+	BOOLEAN Failed;
+	ULONG CplStatus;
+	ULONG Index;
+#if (NTDDI_VERSION > NTDDI_WIN7)
+	PSTORAGE_REQUEST_BLOCK pSrb = NULL;
+#else
+	PSCSI_REQUEST_BLOCK pSrb = NULL;
+#endif
+
+	/* Admin completions run under the DPC lock, the download is kept by StartIo */
+	if (pDevExt->MultipleCoresToSingleQueueFlag == FALSE) {
+		StorPortAcquireSpinLock(pDevExt, StartIoLock, NULL, &StartLockHandle);
+		LockTaken = TRUE;
+	}
+
+	pSrb = pFwDl->pSrb;
+	if (pSrb == NULL)
+		goto done;
+
+	pFwIoctl = (PNVME_FW_DOWNLOAD_IOCTL)GET_DATA_BUFFER(pSrb);
+	CplStatus = *(PULONG)&pSrbExtension->pCplEntry->DW3;
+	Failed = ((pSrbExtension->pCplEntry->DW3.SF.SCT != 0) ||
+			  (pSrbExtension->pCplEntry->DW3.SF.SC != 0)) ? TRUE : FALSE;
+
+	Index = (ULONG)(pSrbExtension - pFwDl->pSrbExt);
+	pFwDl->FreeMask |= (1 << Index);
+	pFwDl->InFlight--;
+
+	if (pCmd->CDW0.OPC == ADMIN_FIRMWARE_ACTIVATE) {
+		pFwIoctl->CommitUs = (ULONG)(NVMeGetTimeStampUs(pDevExt) -
+			pFwDl->StartUs) - pFwIoctl->DownloadUs;
+		pFwIoctl->CplStatus = CplStatus;
+
+		/* Activation that waits for a reset still means the commit worked */
+		if ((Failed == TRUE) &&
+			((pSrbExtension->pCplEntry->DW3.SF.SCT != COMMAND_SPECIFIC_ERRORS) ||
+			 ((pSrbExtension->pCplEntry->DW3.SF.SC !=
+				FIRMWARE_APP_REQUIRES_CONVENTIONAL_RESET) &&
+			  (pSrbExtension->pCplEntry->DW3.SF.SC !=
+				FIRMWARE_ACTIVATION_REQUIRES_NVM_SUBSYSTEM_RESET) &&
+			  (pSrbExtension->pCplEntry->DW3.SF.SC !=
+				FIRMWARE_ACTIVATION_REQUIRES_RESET))))
+			pFwDl->ReturnCode = NVME_IOCTL_FW_COMMIT_FAILED;
+	}
+	else {
+		if ((Failed == TRUE) && (pFwDl->ReturnCode == NVME_IOCTL_SUCCESS)) {
+			pFwDl->ReturnCode = NVME_IOCTL_FW_DOWNLOAD_FAILED;
+			pFwIoctl->FailedOffset = pCmd->CDW11 * sizeof(ULONG);
+			pFwIoctl->CplStatus = CplStatus;
+		}
+
+		/* Keep the pipe full */
+		NVMeFwDownloadIssue(pDevExt);
+		if (pFwDl->InFlight != 0)
+			goto done;
+
+		/* All downloaded, commit it */
+		if (pFwDl->ReturnCode == NVME_IOCTL_SUCCESS) {
+			pFwIoctl->DownloadUs =
+				(ULONG)(NVMeGetTimeStampUs(pDevExt) - pFwDl->StartUs);
+
+			memset(pSrbExtension, 0, sizeof(NVME_SRB_EXTENSION));
+			pSrbExtension->pNvmeDevExt = pDevExt;
+			pSrbExtension->forAdminQueue = TRUE;
+			pSrbExtension->pNvmeCompletionRoutine =
+				(PNVME_COMPLETION_ROUTINE)NVMeHandleFwDownload;
+			pCmd->CDW0.OPC = ADMIN_FIRMWARE_ACTIVATE;
+			pCommitDW10 = (PADMIN_FIRMWARE_ACTIVATE_COMMAND_DW10)&pCmd->CDW10;
+			pCommitDW10->FS = pFwIoctl->Slot;
+			pCommitDW10->AA = pFwIoctl->CommitAction;
+
+			pFwDl->FreeMask &= ~(1 << Index);
+			pFwDl->InFlight++;
+			if (ProcessIo(pDevExt, pSrbExtension, NVME_QUEUE_TYPE_ADMIN,
+						  FALSE) == TRUE)
+				goto done;
+
+			pFwDl->FreeMask |= (1 << Index);
+			pFwDl->InFlight--;
+			pFwDl->ReturnCode = NVME_IOCTL_FW_COMMIT_FAILED;
+		}
+	}
+
+	if (pFwDl->InFlight == 0) {
+		pFwIoctl->SrbIoCtrl.ReturnCode = pFwDl->ReturnCode;
+		pFwDl->pSrb = NULL;
+		pSrb->SrbStatus = SRB_STATUS_SUCCESS;
+		IO_StorPortNotification(RequestComplete, pDevExt, pSrb);
+	}
+
+done:
+	if (LockTaken == TRUE)
+		StorPortReleaseSpinLock(pDevExt, &StartLockHandle);
+
+	return FALSE;
+} /* NVMeHandleFwDownload */
+
 /*******************************************************************************
  * NVMeIoctlGetLogPage
  *
@@ -3572,6 +4364,247 @@ BOOLEAN NVMeIoctlFwDownload(
 	return IOCTL_PENDING;
 } /* NVMeIoctlFwDownload */
 
+/*******************************************************************************
+ * NVMeIoctlFwDownloadImage
+ *
+ * @brief NVMeIoctlFwDownloadImage handles NVME_FW_DOWNLOAD. Rather than one
+ *        Firmware Image Download per round trip, the whole image comes in one
+ *        request and is split into chunks as large as the controller's update
+ *        granularity and the maximum transfer size allow, several of which are
+ *        kept in flight. The controller takes them in any order; the Firmware
+ *        Commit goes out once they all completed.
+ *
+ * @param pDevExt - Pointer to hardware device extension.
+ * @param pSrb - Pointer to SRB
+ *
+ * @return BOOLEAN
+ *     IOCTL_COMPLETED - If the request is done
+ *     IOCTL_PENDING - If the download was started
+ ******************************************************************************/
+BOOLEAN NVMeIoctlFwDownloadImage(
+	PNVME_DEVICE_EXTENSION pDevExt,
+#if (NTDDI_VERSION > NTDDI_WIN7)
+	PSTORAGE_REQUEST_BLOCK pSrb
+#else
+	PSCSI_REQUEST_BLOCK pSrb
+#endif
+)
+{
+	PNVME_FW_DOWNLOAD_IOCTL pFwIoctl =
+		(PNVME_FW_DOWNLOAD_IOCTL)GET_DATA_BUFFER(pSrb);
+	PFW_DOWNLOAD_INFO pFwDl = &pDevExt->FwDownloadInfo;
+	ULONG HdrSize = FIELD_OFFSET(NVME_FW_DOWNLOAD_IOCTL, Image);
+	ULONG Granularity;
+	ULONG ChunkSize;
+
+	if ((GET_DATA_LENGTH(pSrb) < HdrSize) ||
+		(pFwIoctl->ImageLength > (GET_DATA_LENGTH(pSrb) - HdrSize))) {
+		pFwIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_INSUFFICIENT_IN_BUFFER;
+		return IOCTL_COMPLETED;
+	}
+
+	if (pDevExt->controllerIdentifyData.OACS.SupportsFirmwareActivateFirmwareDownload == 0) {
+		pFwIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_UNSUPPORTED_ADMIN_CMD;
+		return IOCTL_COMPLETED;
+	}
+
+	/* One download at a time, and not while the controller is restarting */
+	if ((pDevExt->ntldrDump == TRUE) ||
+		(pFwDl->pSrb != NULL) ||
+		(pDevExt->RecoveryAttemptPossible == FALSE)) {
+		pFwIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_UNSUPPORTED_OPERATION;
+		return IOCTL_COMPLETED;
+	}
+
+	if ((pFwIoctl->ImageLength == 0) ||
+		((pFwIoctl->ImageLength % sizeof(ULONG)) != 0) ||
+		(pFwIoctl->Slot > 7) ||
+		(pFwIoctl->CommitAction > 3)) {
+		pFwIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_INVALID_FW_PARAMETER;
+		return IOCTL_COMPLETED;
+	}
+
+	/*
+	 * Chunks are multiples of FWUG, or of a page when the controller doesn't
+	 * say. The transfer size limit is below MDTS, it was checked at start.
+	 */
+	if (pDevExt->controllerIdentifyData.FWUG == 0xFF)
+		Granularity = sizeof(ULONG);
+	else if (pDevExt->controllerIdentifyData.FWUG != 0)
+		Granularity = pDevExt->controllerIdentifyData.FWUG * PAGE_SIZE;
+	else
+		Granularity = PAGE_SIZE;
+
+	ChunkSize = pFwIoctl->ChunkSize;
+	if ((ChunkSize == 0) || (ChunkSize > pDevExt->InitInfo.MaxTxSize))
+		ChunkSize = pDevExt->InitInfo.MaxTxSize;
+	ChunkSize -= ChunkSize % Granularity;
+	if (ChunkSize == 0) {
+		pFwIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_INVALID_FW_PARAMETER;
+		return IOCTL_COMPLETED;
+	}
+
+	if (pFwIoctl->Depth == 0)
+		pFwIoctl->Depth = NVME_FW_DOWNLOAD_DFT_DEPTH;
+	else if (pFwIoctl->Depth > NVME_FW_DOWNLOAD_MAX_DEPTH)
+		pFwIoctl->Depth = NVME_FW_DOWNLOAD_MAX_DEPTH;
+
+	if (pFwDl->pSrbExt == NULL) {
+		pFwDl->pSrbExt = (PNVME_SRB_EXTENSION)NVMeAllocatePool(pDevExt,
+			sizeof(NVME_SRB_EXTENSION) * NVME_FW_DOWNLOAD_MAX_DEPTH);
+		if (pFwDl->pSrbExt == NULL) {
+			pFwIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_INTERNAL_ERROR;
+			return IOCTL_COMPLETED;
+		}
+	}
+
+	pFwIoctl->ChunkSize = ChunkSize;
+	pFwIoctl->Chunks = 0;
+	pFwIoctl->MaxInFlight = 0;
+	pFwIoctl->DownloadUs = 0;
+	pFwIoctl->CommitUs = 0;
+	pFwIoctl->FailedOffset = 0;
+	pFwIoctl->CplStatus = 0;
+
+	pFwDl->pSrb = pSrb;
+	pFwDl->FreeMask = (1 << NVME_FW_DOWNLOAD_MAX_DEPTH) - 1;
+	pFwDl->Depth = pFwIoctl->Depth;
+	pFwDl->ChunkSize = ChunkSize;
+	pFwDl->NextOffset = 0;
+	pFwDl->InFlight = 0;
+	pFwDl->ReturnCode = NVME_IOCTL_SUCCESS;
+	pFwDl->StartUs = NVMeGetTimeStampUs(pDevExt);
+
+	NVMeFwDownloadIssue(pDevExt);
+
+	/* Nothing went out, so no completion is coming to finish it */
+	if (pFwDl->InFlight == 0) {
+		pFwDl->pSrb = NULL;
+		pFwIoctl->SrbIoCtrl.ReturnCode = pFwDl->ReturnCode;
+		return IOCTL_COMPLETED;
+	}
+
+	return IOCTL_PENDING;
+} /* NVMeIoctlFwDownloadImage */
+
+/*******************************************************************************
+ * NVMeFwDownloadIssue
+ *
+ * @brief NVMeFwDownloadIssue sends Firmware Image Download commands for the
+ *        next chunks of the image until Depth of them are in flight. It stops
+ *        early when the admin queue is full, the completions of those already
+ *        sent call it again. Called with the StartIo lock held.
+ *
+ * @param pDevExt - Pointer to hardware device extension.
+ *
+ * @return VOID
+ ******************************************************************************/
+VOID NVMeFwDownloadIssue(
+	PNVME_DEVICE_EXTENSION pDevExt
+)
+{
+	PFW_DOWNLOAD_INFO pFwDl = &pDevExt->FwDownloadInfo;
+	PNVME_FW_DOWNLOAD_IOCTL pFwIoctl =
+		(PNVME_FW_DOWNLOAD_IOCTL)GET_DATA_BUFFER(pFwDl->pSrb);
+	PNVME_SRB_EXTENSION pSrbExt = NULL;
+	ULONG Length;
+	ULONG Index;
+
+	while ((pFwDl->InFlight < pFwDl->Depth) &&
+		   (pFwDl->NextOffset < pFwIoctl->ImageLength) &&
+		   (pFwDl->ReturnCode == NVME_IOCTL_SUCCESS)) {
+		for (Index = 0; (pFwDl->FreeMask & (1 << Index)) == 0; Index++);
+
+		Length = min(pFwDl->ChunkSize,
+					 pFwIoctl->ImageLength - pFwDl->NextOffset);
+
+		pSrbExt = pFwDl->pSrbExt + Index;
+		memset(pSrbExt, 0, sizeof(NVME_SRB_EXTENSION));
+		pSrbExt->pNvmeDevExt = pDevExt;
+		pSrbExt->forAdminQueue = TRUE;
+		pSrbExt->pNvmeCompletionRoutine =
+			(PNVME_COMPLETION_ROUTINE)NVMeHandleFwDownload;
+		pSrbExt->nvmeSqeUnit.CDW0.OPC = ADMIN_FIRMWARE_IMAGE_DOWNLOAD;
+
+		/* NUMD is zero based, the offset is in dwords too */
+		pSrbExt->nvmeSqeUnit.CDW10 = (Length / sizeof(ULONG)) - 1;
+		pSrbExt->nvmeSqeUnit.CDW11 = pFwDl->NextOffset / sizeof(ULONG);
+
+		if (NVMePreparePRPs(pDevExt,
+							pSrbExt,
+							pFwIoctl->Image + pFwDl->NextOffset,
+							Length) == FALSE) {
+			pFwDl->ReturnCode = NVME_IOCTL_PRP_TRANSLATION_ERROR;
+			break;
+		}
+
+		pFwDl->FreeMask &= ~(1 << Index);
+		pFwDl->InFlight++;
+		if (ProcessIo(pDevExt, pSrbExt, NVME_QUEUE_TYPE_ADMIN, FALSE) == FALSE) {
+			pFwDl->FreeMask |= (1 << Index);
+			pFwDl->InFlight--;
+
+			/* With nothing in flight no completion would retry it */
+			if (pFwDl->InFlight == 0)
+				pFwDl->ReturnCode = NVME_IOCTL_FW_DOWNLOAD_FAILED;
+			break;
+		}
+
+		pFwDl->NextOffset += Length;
+		pFwIoctl->Chunks++;
+		pFwIoctl->MaxInFlight = max(pFwIoctl->MaxInFlight, pFwDl->InFlight);
+	}
+} /* NVMeFwDownloadIssue */
+
+/*******************************************************************************
+ * NVMeFwDownloadFlush
+ *
+ * @brief NVMeFwDownloadFlush checks for a firmware download in progress and,
+ *        when asked to, completes its request. Its commands are internal, so
+ *        the caller completes those like any other.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ * @param completeCmd - Complete the request or just report it
+ * @param SrbStatus - The status to complete it with
+ *
+ * @return BOOLEAN
+ *     TRUE - A download was in progress
+ *     FALSE - There was none
+ ******************************************************************************/
+BOOLEAN NVMeFwDownloadFlush(
+	PNVME_DEVICE_EXTENSION pAE,
+	BOOLEAN completeCmd,
+	UCHAR SrbStatus
+)
+{
+	PFW_DOWNLOAD_INFO pFwDl = &pAE->FwDownloadInfo;
+	PNVME_FW_DOWNLOAD_IOCTL pFwIoctl = NULL;
+#if (NTDDI_VERSION > NTDDI_WIN7)
+	PSTORAGE_REQUEST_BLOCK pSrb = pFwDl->pSrb;
+#else
+	PSCSI_REQUEST_BLOCK pSrb = pFwDl->pSrb;
+#endif
+
+	if (pSrb == NULL)
+		return (FALSE);
+
+	if (completeCmd == FALSE)
+		return (TRUE);
+
+	pFwIoctl = (PNVME_FW_DOWNLOAD_IOCTL)GET_DATA_BUFFER(pSrb);
+	pFwIoctl->SrbIoCtrl.ReturnCode = (pFwIoctl->DownloadUs != 0) ?
+		NVME_IOCTL_FW_COMMIT_FAILED : NVME_IOCTL_FW_DOWNLOAD_FAILED;
+
+	pFwDl->pSrb = NULL;
+	pFwDl->InFlight = 0;
+	pFwDl->FreeMask = (1 << NVME_FW_DOWNLOAD_MAX_DEPTH) - 1;
+
+	pSrb->SrbStatus = SrbStatus;
+	IO_StorPortNotification(RequestComplete, pAE, pSrb);
+
+	return (TRUE);
+} /* NVMeFwDownloadFlush */
+
 /*******************************************************************************
  * NVMeIoctlSetGetFeatures
  *
@@ -4034,85 +5067,882 @@ VOID NVMeIoctlHotAddNamespace(
 	StorPortNotification(BusChangeDetected, pDevExt);
 } /* NVMeIoctlHotAddNamespace */
 
-
 /******************************************************************************
-* NVMeFormatNVMHotRemoveNamespace
-*
-* @brief This function calls StorPortNotification with BusChangeDetected to
-*        force a bus re-enumeration after removing a namespace which used to
-*        be seen by Windows system. After removal, a Format NVM command is
-*        applied to the removed namespace(s).
-*
-* @param pSrbExt - Pointer to Srb Extension allocated in SRB.
-*
-* @return None
-******************************************************************************/
-VOID NVMeFormatNVMHotRemoveNamespace(
-	PNVME_SRB_EXTENSION pSrbExt
-)
-{
-	PNVME_DEVICE_EXTENSION pDevExt = pSrbExt->pNvmeDevExt;
+ * NVMeIoctlNamespaceQos
+ *
+ * @brief This function sets the IOPS and bandwidth limits of a namespace when
+ *        Direction is NVME_FROM_HOST_TO_DEV and returns its current limits and
+ *        throttling counters. A limit of 0 turns that limit off.
+ *
+ * @param pDevExt - Pointer to hardware device extension.
+ * @param pSrb - This parameter specifies the SCSI I/O request.
+ *
+ * @return None
+ ******************************************************************************/
+VOID NVMeIoctlNamespaceQos(
+	PNVME_DEVICE_EXTENSION pDevExt,
 #if (NTDDI_VERSION > NTDDI_WIN7)
-	PSTORAGE_REQUEST_BLOCK pSrb = pSrbExt->pSrb;
+	PSTORAGE_REQUEST_BLOCK pSrb
 #else
-	PSCSI_REQUEST_BLOCK pSrb = pSrbExt->pSrb;
+	PSCSI_REQUEST_BLOCK pSrb
 #endif
+)
+{
+	PNVME_NAMESPACE_QOS_IOCTL pQosIoctl = NULL;
+	PQOS_INFO pQos = NULL;
+	PQOS_QUEUE_COUNT pCount = NULL;
+	ULONG Queue;
 
-	PNVME_PASS_THROUGH_IOCTL pNvmePtIoctl = NULL;
-	PNVMe_COMMAND pNvmeCmd = NULL;
-	ULONG NS = 0;
-	ULONG lunId = INVALID_LUN_EXTN;
-	PNVME_LUN_EXTENSION pLunExt = NULL;
+	pQosIoctl = (PNVME_NAMESPACE_QOS_IOCTL)GET_DATA_BUFFER(pSrb);
 
-	pNvmePtIoctl = (PNVME_PASS_THROUGH_IOCTL)GET_DATA_BUFFER(pSrb);
-	pNvmeCmd = (PNVMe_COMMAND)pNvmePtIoctl->NVMeCmd;
+	if (GET_DATA_LENGTH(pSrb) < sizeof(NVME_NAMESPACE_QOS_IOCTL)) {
+		pQosIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_INSUFFICIENT_IN_BUFFER;
+		return;
+	}
 
-	/*
-	 * If we're in the middle of formatting NVM,
-	 * simply reject current request:
-	 * SrbStatus = SRB_STATUS_INVALID_REQUEST
-	 * ReturCode = NVME_IOCTL_UNSUPPORTED_OPERATION
-	 */
-	if ((pDevExt->FormatNvmInfo.State != FORMAT_NVM_RECEIVED) &&
-		(pDevExt->FormatNvmInfo.State != FORMAT_NVM_NO_ACTIVITY)) {
-		pNvmePtIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_UNSUPPORTED_OPERATION;
-		pSrb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
+	if (pDevExt->pQosInfo == NULL) {
+		pQosIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_UNSUPPORTED_OPERATION;
 		return;
 	}
 
-	StorPortDebugPrint(INFO, "NVMeFormatNVMHotRemoveNamespace: NSID:0x%x\n",
-		pNvmeCmd->NSID);
+	if (pQosIoctl->Lun >= MAX_NAMESPACES) {
+		pQosIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_INVALID_NAMESPACE_ID;
+		return;
+	}
 
-	/* Set the namespace(s) as unavailable now */
-	if (pNvmeCmd->NSID == ALL_NAMESPACES_APPLIED) {
-		/*
-		 * Set all reported namespaces as unavailable
-		 * by setting all lun slot statuses to OFFLINE
-		 */
-		pDevExt->FormatNvmInfo.FormatAllNamespaces = TRUE;
-		for (lunId = 0; lunId < MAX_NAMESPACES; lunId++) {
-			pLunExt = pDevExt->pLunExtensionTable[lunId];
-			if (ONLINE == pLunExt->slotStatus && pLunExt->identifyData.NSZE != 0) {
-				pLunExt->slotStatus = OFFLINE;
-				pLunExt->offlineReason = FORMAT_IN_PROGRESS;
-				/* Now we are in namespace hot remove state. */
-				pDevExt->FormatNvmInfo.State = FORMAT_NVM_NS_REMOVED;
-			}
+	pQos = pDevExt->pQosInfo + pQosIoctl->Lun;
+
+	if (pQosIoctl->Direction == NVME_FROM_HOST_TO_DEV) {
+		if ((pQosIoctl->IopsLimit > MAX_QOS_IOPS_LIMIT) ||
+			(pQosIoctl->BandwidthLimit > MAX_QOS_BANDWIDTH_LIMIT)) {
+			pQosIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_UNSUPPORTED_OPERATION;
+			return;
 		}
+
+		NVMeQosSetLimits(pDevExt,
+			pQos,
+			pQosIoctl->IopsLimit,
+			pQosIoctl->BandwidthLimit);
+
+		/* Lifted or raised limits may let deferred requests go now */
+		NVMeQosRelease(pDevExt);
 	}
-	else if (TRUE == NVMeIsNamespaceVisible(pSrbExt, 0, &lunId)) {
-		/*
-		 * Mark down the target namespace to format.
-		 */
-		StorPortDebugPrint(INFO,
-			"NVMeFormatNVMHotRemoveNamespace: Target lunID=%d.\n", lunId);
-		pDevExt->FormatNvmInfo.TargetLun = lunId;
 
-		/* We just have to format one namespace; OFFLINE it if it's visible */
-		if (INVALID_LUN_EXTN != lunId) {
-			pLunExt = pDevExt->pLunExtensionTable[lunId];
+	pQosIoctl->IopsLimit = pQos->IopsLimit;
+	pQosIoctl->BandwidthLimit = pQos->BandwidthLimit;
+	pQosIoctl->DeferredRequests = pQos->NumDeferred;
+	pQosIoctl->ThrottledRequests = pQos->ThrottledRequests;
+	pQosIoctl->ThrottledTimeUs = pQos->ThrottledTimeUs;
+
+	/* Completions are counted per queue, add them up for the namespace */
+	pQosIoctl->CompletedRequests = 0;
+	pQosIoctl->CompletedBytes = 0;
+	for (Queue = 0; Queue < pDevExt->NumQosQueues; Queue++) {
+		pCount = pDevExt->pQosCompleted + (Queue * MAX_NAMESPACES) +
+			pQosIoctl->Lun;
+		pQosIoctl->CompletedRequests += pCount->Requests;
+		pQosIoctl->CompletedBytes += pCount->Bytes;
+	}
+
+	pQosIoctl->HeldRequests =
+		pDevExt->pLunExtensionTable[pQosIoctl->Lun]->NumFormatHeld;
+	pQosIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_SUCCESS;
+} /* NVMeIoctlNamespaceQos */
+
+/******************************************************************************
+ * NVMeIoctlProtectionInfo
+ *
+ * @brief This function returns how a namespace is formatted for metadata and
+ *        protection information, whether the driver can use it and checks
+ *        its PI itself, along with the adapter's host PI check counters.
+ *
+ * @param pDevExt - Pointer to hardware device extension.
+ * @param pSrb - This parameter specifies the SCSI I/O request.
+ *
+ * @return None
+ ******************************************************************************/
+VOID NVMeIoctlProtectionInfo(
+	PNVME_DEVICE_EXTENSION pDevExt,
+#if (NTDDI_VERSION > NTDDI_WIN7)
+	PSTORAGE_REQUEST_BLOCK pSrb
+#else
+	PSCSI_REQUEST_BLOCK pSrb
+#endif
+)
+{
+	PNVME_PROTECTION_INFO_IOCTL pPiIoctl = NULL;
+	PNVME_LUN_EXTENSION pLunExt = NULL;
+	UCHAR flbas;
+
+	pPiIoctl = (PNVME_PROTECTION_INFO_IOCTL)GET_DATA_BUFFER(pSrb);
+
+	if (GET_DATA_LENGTH(pSrb) < sizeof(NVME_PROTECTION_INFO_IOCTL)) {
+		pPiIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_INSUFFICIENT_IN_BUFFER;
+		return;
+	}
+
+	if ((pPiIoctl->Lun >= MAX_NAMESPACES) ||
+		(pDevExt->pLunExtensionTable == NULL)) {
+		pPiIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_INVALID_NAMESPACE_ID;
+		return;
+	}
+
+	pLunExt = pDevExt->pLunExtensionTable[pPiIoctl->Lun];
+	if (pLunExt->slotStatus != ONLINE) {
+		pPiIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_INVALID_NAMESPACE_ID;
+		return;
+	}
+
+	flbas = pLunExt->identifyData.FLBAS.SupportedCombination;
+	pPiIoctl->LbaSize = 1 << pLunExt->identifyData.LBAFx[flbas].LBADS;
+	pPiIoctl->MetadataSize = pLunExt->identifyData.LBAFx[flbas].MS;
+	pPiIoctl->PiType = pLunExt->identifyData.DPS.ProtectionEnabled;
+	pPiIoctl->ExtendedLba =
+		pLunExt->identifyData.FLBAS.SupportsMetadataAtEndOfLBA;
+	pPiIoctl->Supported = SntiIsFormatSupported(pLunExt);
+	pPiIoctl->HostCheck = (pDevExt->InitInfo.PiHostCheck != 0) &&
+		(pPiIoctl->Supported != 0) &&
+		(pPiIoctl->PiType != 0) &&
+		(pPiIoctl->MetadataSize == PI_TUPLE_SIZE) &&
+		(pPiIoctl->ExtendedLba == 0);
+
+	pPiIoctl->HostBlocks = (ULONGLONG)pDevExt->PiHostBlocks;
+	pPiIoctl->HostBytes = (ULONGLONG)pDevExt->PiHostBytes;
+	pPiIoctl->HostTimeUs = (ULONGLONG)pDevExt->PiHostTimeUs;
+	pPiIoctl->HostErrors = (ULONGLONG)pDevExt->PiHostErrors;
+	pPiIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_SUCCESS;
+} /* NVMeIoctlProtectionInfo */
+
+/******************************************************************************
+ * NVMeIoctlLatencyHistogram
+ *
+ * @brief This function returns the latency histogram of one completion queue,
+ *        or of all of them, for one opcode class and clears all histograms
+ *        afterwards if asked to.
+ *
+ * @param pDevExt - Pointer to hardware device extension.
+ * @param pSrb - This parameter specifies the SCSI I/O request.
+ *
+ * @return None
+ ******************************************************************************/
+VOID NVMeIoctlLatencyHistogram(
+	PNVME_DEVICE_EXTENSION pDevExt,
+#if (NTDDI_VERSION > NTDDI_WIN7)
+	PSTORAGE_REQUEST_BLOCK pSrb
+#else
+	PSCSI_REQUEST_BLOCK pSrb
+#endif
+)
+{
+	PNVME_LATENCY_HISTOGRAM_IOCTL pHistIoctl = NULL;
+	LATENCY_HIST_CLASS Hist;
+
+	pHistIoctl = (PNVME_LATENCY_HISTOGRAM_IOCTL)GET_DATA_BUFFER(pSrb);
+
+	if (GET_DATA_LENGTH(pSrb) < sizeof(NVME_LATENCY_HISTOGRAM_IOCTL)) {
+		pHistIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_INSUFFICIENT_IN_BUFFER;
+		return;
+	}
+
+	if (NVMeLatencyGetHistogram(pDevExt,
+		pHistIoctl->QueueId,
+		pHistIoctl->OpClass,
+		&Hist) == FALSE) {
+		pHistIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_UNSUPPORTED_OPERATION;
+		return;
+	}
+
+	pHistIoctl->Count = Hist.Count;
+	pHistIoctl->TotalUs = Hist.TotalUs;
+	pHistIoctl->MaxUs = Hist.MaxUs;
+	StorPortCopyMemory(pHistIoctl->Buckets, Hist.Buckets, sizeof(Hist.Buckets));
+
+	pHistIoctl->AdminCount = pDevExt->AdminCompletions;
+	pHistIoctl->AdminTotalUs = pDevExt->AdminLatencyTotalUs;
+	pHistIoctl->AdminMaxUs = pDevExt->AdminLatencyMaxUs;
+
+	if (pHistIoctl->Reset != 0)
+		NVMeLatencyReset(pDevExt);
+
+	pHistIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_SUCCESS;
+} /* NVMeIoctlLatencyHistogram */
+
+/******************************************************************************
+ * NVMeIoctlSlowCmdLog
+ *
+ * @brief This function copies the latest slow command log records, oldest
+ *        first, as many as the caller's buffer holds, and empties the log
+ *        afterwards if asked to. A record is only returned if its Seq is
+ *        the expected one before and after it's copied, otherwise it was
+ *        being overwritten and counts as lost.
+ *
+ * @param pDevExt - Pointer to hardware device extension.
+ * @param pSrb - This parameter specifies the SCSI I/O request.
+ *
+ * @return None
+ ******************************************************************************/
+VOID NVMeIoctlSlowCmdLog(
+	PNVME_DEVICE_EXTENSION pDevExt,
+#if (NTDDI_VERSION > NTDDI_WIN7)
+	PSTORAGE_REQUEST_BLOCK pSrb
+#else
+	PSCSI_REQUEST_BLOCK pSrb
+#endif
+)
+{
+	PNVME_SLOW_CMD_LOG_IOCTL pLogIoctl = NULL;
+	PNVME_SLOW_CMD_RECORD pRecord = NULL;
+	ULONG Written;
+	ULONG Count;
+	ULONG Fit;
+	ULONG Index;
+	ULONG Slot;
+	ULONG Copied = 0;
+	ULONG Lost = 0;
+
+	pLogIoctl = (PNVME_SLOW_CMD_LOG_IOCTL)GET_DATA_BUFFER(pSrb);
+
+	if (GET_DATA_LENGTH(pSrb) < sizeof(NVME_SLOW_CMD_LOG_IOCTL)) {
+		pLogIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_INSUFFICIENT_IN_BUFFER;
+		return;
+	}
+
+	if (pDevExt->pSlowCmdLog == NULL) {
+		pLogIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_UNSUPPORTED_OPERATION;
+		return;
+	}
+
+	Written = (ULONG)pDevExt->SlowCmdNext;
+	Fit = (GET_DATA_LENGTH(pSrb) -
+		FIELD_OFFSET(NVME_SLOW_CMD_LOG_IOCTL, Records)) /
+		sizeof(NVME_SLOW_CMD_RECORD);
+
+	Count = min(Written, SLOW_CMD_LOG_ENTRIES);
+	pLogIoctl->Truncated = (Count > Fit) ? (Count - Fit) : 0;
+	Count = min(Count, Fit);
+
+	for (Index = 0; Index < Count; Index++) {
+		Slot = Written - Count + Index;
+		pRecord = &pDevExt->pSlowCmdLog[Slot % SLOW_CMD_LOG_ENTRIES];
+
+		if (pRecord->Seq != (Slot + 1)) {
+			Lost++;
+			continue;
+		}
+		MemoryBarrier();
+		pLogIoctl->Records[Copied] = *pRecord;
+		MemoryBarrier();
+		if (pRecord->Seq != (Slot + 1)) {
+			Lost++;
+			continue;
+		}
+		Copied++;
+	}
+
+	pLogIoctl->NumEntries = SLOW_CMD_LOG_ENTRIES;
+	pLogIoctl->Written = Written;
+	pLogIoctl->NumRecords = Copied;
+	pLogIoctl->Lost = Lost;
+
+	if (pLogIoctl->Reset != 0)
+		InterlockedExchange(&pDevExt->SlowCmdNext, 0);
+
+	pLogIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_SUCCESS;
+} /* NVMeIoctlSlowCmdLog */
+
+/******************************************************************************
+ * NVMeIoctlSrbTrace
+ *
+ * @brief This function drains the SRB trace, copying the records written
+ *        since the last call in order, as many as the caller's buffer holds.
+ *        It stops at a record that's still being written, that one comes
+ *        with the next call. A record whose Seq moved on, before or during
+ *        the copy, was overwritten by a writer that lapped the reader and
+ *        is counted as lost instead.
+ *
+ * @param pDevExt - Pointer to hardware device extension.
+ * @param pSrb - This parameter specifies the SCSI I/O request.
+ *
+ * @return None
+ ******************************************************************************/
+VOID NVMeIoctlSrbTrace(
+	PNVME_DEVICE_EXTENSION pDevExt,
+#if (NTDDI_VERSION > NTDDI_WIN7)
+	PSTORAGE_REQUEST_BLOCK pSrb
+#else
+	PSCSI_REQUEST_BLOCK pSrb
+#endif
+)
+{
+	PNVME_SRB_TRACE_IOCTL pTraceIoctl = NULL;
+	PNVME_SRB_TRACE_RECORD pRecord = NULL;
+	ULONGLONG Ticks;
+	ULONGLONG Frequency = pDevExt->SrbStageFrequency;
+	ULONG Written;
+	ULONG Fit;
+	ULONG Seq;
+	ULONG Stage;
+	ULONG Count = 0;
+
+	pTraceIoctl = (PNVME_SRB_TRACE_IOCTL)GET_DATA_BUFFER(pSrb);
+
+	if (GET_DATA_LENGTH(pSrb) < sizeof(NVME_SRB_TRACE_IOCTL)) {
+		pTraceIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_INSUFFICIENT_IN_BUFFER;
+		return;
+	}
+
+	if (pDevExt->pSrbTrace == NULL) {
+		pTraceIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_UNSUPPORTED_OPERATION;
+		return;
+	}
+
+	Fit = (GET_DATA_LENGTH(pSrb) -
+		FIELD_OFFSET(NVME_SRB_TRACE_IOCTL, Records)) /
+		sizeof(NVME_SRB_TRACE_RECORD);
+
+	/* Skip what was overwritten before it could be read */
+	Written = (ULONG)pDevExt->SrbTraceNext;
+	pTraceIoctl->Lost = 0;
+	if ((Written - pDevExt->SrbTraceRead) > pDevExt->SrbTraceEntries) {
+		pTraceIoctl->Lost =
+			Written - pDevExt->SrbTraceRead - pDevExt->SrbTraceEntries;
+		pDevExt->SrbTraceRead = Written - pDevExt->SrbTraceEntries;
+	}
+
+	while ((pDevExt->SrbTraceRead != Written) && (Count < Fit)) {
+		pRecord = &pDevExt->pSrbTrace[pDevExt->SrbTraceRead &
+			(pDevExt->SrbTraceEntries - 1)];
+		Seq = pRecord->Seq;
+		if (Seq != (pDevExt->SrbTraceRead + 1)) {
+			/* Newer than expected: lapped, else still being written */
+			if ((Seq == 0) ||
+				((LONG)(Seq - (pDevExt->SrbTraceRead + 1)) < 0))
+				break;
+			pTraceIoctl->Lost++;
+			pDevExt->SrbTraceRead++;
+			continue;
+		}
+
+		MemoryBarrier();
+		pTraceIoctl->Records[Count] = *pRecord;
+		MemoryBarrier();
+
+		/* Rewritten under the copy, the copy is torn */
+		if (pRecord->Seq != Seq) {
+			pTraceIoctl->Lost++;
+			pDevExt->SrbTraceRead++;
+			continue;
+		}
+
+		Count++;
+		pDevExt->SrbTraceRead++;
+	}
+
+	/* Stage times in ns, split so the ticks don't overflow the product */
+	for (Stage = 0; Stage < NVME_SRB_STAGES; Stage++) {
+		Ticks = (ULONGLONG)pDevExt->SrbStageTicks[Stage];
+		pTraceIoctl->StageTimeNs[Stage] = (Frequency == 0) ? 0 :
+			(Ticks / Frequency) * 1000000000 +
+			((Ticks % Frequency) * 1000000000) / Frequency;
+		pTraceIoctl->StageCalls[Stage] =
+			(ULONGLONG)pDevExt->SrbStageCalls[Stage];
+	}
+
+	pTraceIoctl->Entries = pDevExt->SrbTraceEntries;
+	pTraceIoctl->NumRecords = Count;
+	pTraceIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_SUCCESS;
+} /* NVMeIoctlSrbTrace */
+
+/******************************************************************************
+ * NVMeTunablesGet
+ *
+ * @brief This function fills in the NVME_TUNABLES values as they are now.
+ *
+ * @param pDevExt - Pointer to hardware device extension.
+ * @param pTunables - The IOCTL buffer
+ *
+ * @return None
+ ******************************************************************************/
+VOID NVMeTunablesGet(
+	PNVME_DEVICE_EXTENSION pDevExt,
+	PNVME_TUNABLES_IOCTL pTunables
+)
+{
+	PINIT_INFO pInit = &pDevExt->InitInfo;
+	PQUEUE_INFO pQI = &pDevExt->QueueInfo;
+
+	pTunables->IntCoalescingTime = pInit->IntCoalescingTime;
+	pTunables->IntCoalescingEntry = pInit->IntCoalescingEntry;
+	pTunables->CplBudget = pInit->CplBudget;
+	pTunables->CplDoorbellBatch = pInit->CplDoorbellBatch;
+	pTunables->TraceSampleRate = pInit->TraceSampleRate;
+	pTunables->SlowCmdThresholdUs = pInit->SlowCmdThresholdUs;
+	pTunables->QosIopsLimit = pInit->QosIopsLimit;
+	pTunables->QosBandwidthLimit = pInit->QosBandwidthLimit;
+	pTunables->IoQEntries = (pQI->NumSubIoQAllocated != 0) ?
+		(pQI->pSubQueueInfo + 1)->SubQEntries : pInit->IoQEntries;
+	pTunables->IoQueues = (pDevExt->IoQueueLimit != 0) ?
+		pDevExt->IoQueueLimit : pQI->NumCplIoQAllocated;
+	pTunables->MaxIoQEntries = pQI->NumIoQEntriesAllocated;
+	pTunables->MaxIoQueues = pQI->NumCplIoQAllocated;
+} /* NVMeTunablesGet */
+
+/******************************************************************************
+ * NVMeIoctlTunables
+ *
+ * @brief This function changes the driver parameters flagged in the request
+ *        without a reload. Most are only read on the IO path and take effect
+ *        right away. Interrupt coalescing needs a Set Features, queue depth
+ *        and count changes need the queues idle: new IO is held off and
+ *        NVMeRetuneTimer waits for the IO in flight to complete before the
+ *        queues are recreated.
+ *
+ * @param pDevExt - Pointer to hardware device extension.
+ * @param pSrb - This parameter specifies the SCSI I/O request.
+ *
+ * @return BOOLEAN
+ *     IOCTL_COMPLETED - If the request is done
+ *     IOCTL_PENDING - If it's on the admin queue or waiting for IO to drain
+ ******************************************************************************/
+BOOLEAN NVMeIoctlTunables(
+	PNVME_DEVICE_EXTENSION pDevExt,
+#if (NTDDI_VERSION > NTDDI_WIN7)
+	PSTORAGE_REQUEST_BLOCK pSrb
+#else
+	PSCSI_REQUEST_BLOCK pSrb
+#endif
+)
+{
+	PNVME_TUNABLES_IOCTL pTunables = NULL;
+	PNVME_SRB_EXTENSION pSrbExt = NULL;
+	PINIT_INFO pInit = &pDevExt->InitInfo;
+	PQUEUE_INFO pQI = &pDevExt->QueueInfo;
+	PQOS_INFO pQos = NULL;
+	PADMIN_SET_FEATURES_COMMAND_DW10 pSetFeaturesCDW10 = NULL;
+	PADMIN_SET_FEATURES_COMMAND_INTERRUPT_COALESCING_DW11
+		pSetFeaturesCDW11 = NULL;
+	ULONG Set;
+	ULONG Lun;
+
+	pTunables = (PNVME_TUNABLES_IOCTL)GET_DATA_BUFFER(pSrb);
+	pSrbExt = (PNVME_SRB_EXTENSION)GET_SRB_EXTENSION(pSrb);
+
+	if (GET_DATA_LENGTH(pSrb) < sizeof(NVME_TUNABLES_IOCTL)) {
+		pTunables->SrbIoCtrl.ReturnCode = NVME_IOCTL_INSUFFICIENT_IN_BUFFER;
+		return IOCTL_COMPLETED;
+	}
+
+	Set = pTunables->Set;
+	pTunables->QuiesceUs = 0;
+
+	/* Check everything before changing anything */
+	if (((Set & NVME_TUNE_INT_COALESCING) &&
+		 ((RANGE_CHK(pTunables->IntCoalescingTime,
+			MIN_INT_COALESCING_TIME, MAX_INT_COALESCING_TIME) == FALSE) ||
+		  (RANGE_CHK(pTunables->IntCoalescingEntry,
+			MIN_INT_COALESCING_ENTRY, MAX_INT_COALESCING_ENTRY) == FALSE))) ||
+		((Set & NVME_TUNE_CPL_BUDGET) &&
+		 (RANGE_CHK(pTunables->CplBudget,
+			MIN_CPL_BUDGET, MAX_CPL_BUDGET) == FALSE)) ||
+		((Set & NVME_TUNE_CPL_DOORBELL) &&
+		 (RANGE_CHK(pTunables->CplDoorbellBatch,
+			MIN_CPL_DOORBELL_BATCH, MAX_CPL_DOORBELL_BATCH) == FALSE)) ||
+		((Set & NVME_TUNE_TRACE_SAMPLE) &&
+		 (RANGE_CHK(pTunables->TraceSampleRate,
+			MIN_TRACE_SAMPLE_RATE, MAX_TRACE_SAMPLE_RATE) == FALSE)) ||
+		((Set & NVME_TUNE_SLOW_CMD) &&
+		 (RANGE_CHK(pTunables->SlowCmdThresholdUs,
+			MIN_SLOW_CMD_THRESHOLD, MAX_SLOW_CMD_THRESHOLD) == FALSE)) ||
+		((Set & NVME_TUNE_QOS) &&
+		 ((RANGE_CHK(pTunables->QosIopsLimit,
+			MIN_QOS_IOPS_LIMIT, MAX_QOS_IOPS_LIMIT) == FALSE) ||
+		  (RANGE_CHK(pTunables->QosBandwidthLimit,
+			MIN_QOS_BANDWIDTH_LIMIT, MAX_QOS_BANDWIDTH_LIMIT) == FALSE))) ||
+		((Set & NVME_TUNE_IO_QUEUE_ENTRIES) &&
+		 (RANGE_CHK(pTunables->IoQEntries,
+			MIN_IO_QUEUE_ENTRIES, pQI->NumIoQEntriesAllocated) == FALSE)) ||
+		((Set & NVME_TUNE_IO_QUEUES) &&
+		 (pTunables->IoQueues > pQI->NumCplIoQAllocated))) {
+		NVMeTunablesGet(pDevExt, pTunables);
+		pTunables->SrbIoCtrl.ReturnCode = NVME_IOCTL_INVALID_TUNABLE;
+		return IOCTL_COMPLETED;
+	}
+
+	/*
+	 * The queues are recreated the way a resume does it, which needs the
+	 * start to have completed, and the timer to wait for the IO to drain.
+	 */
+	if (Set & NVME_TUNE_RECREATE) {
+#if (NTDDI_VERSION > NTDDI_WIN7)
+		if ((pDevExt->RetuneTimerhandle == NULL) ||
+			(pDevExt->pRetuneSrb != NULL) ||
+			(pDevExt->RecoveryAttemptPossible == FALSE) ||
+			(NVMeFastResumePossible(pDevExt) == FALSE)) {
+#endif
+			NVMeTunablesGet(pDevExt, pTunables);
+			pTunables->SrbIoCtrl.ReturnCode = NVME_IOCTL_UNSUPPORTED_OPERATION;
+			return IOCTL_COMPLETED;
+#if (NTDDI_VERSION > NTDDI_WIN7)
+		}
+#endif
+	}
+
+	/* These are read as the IO goes, the next one sees the new value */
+	if (Set & NVME_TUNE_CPL_BUDGET)
+		pInit->CplBudget = pTunables->CplBudget;
+
+	if (Set & NVME_TUNE_CPL_DOORBELL)
+		pInit->CplDoorbellBatch = pTunables->CplDoorbellBatch;
+
+	if (Set & NVME_TUNE_TRACE_SAMPLE)
+		pInit->TraceSampleRate = pTunables->TraceSampleRate;
+
+	if (Set & NVME_TUNE_SLOW_CMD)
+		pInit->SlowCmdThresholdUs = pTunables->SlowCmdThresholdUs;
+
+	/*
+	 * Namespaces still on the old defaults move to the new ones, those
+	 * given their own limits with NVME_NAMESPACE_QOS keep them.
+	 */
+	if ((Set & NVME_TUNE_QOS) && (pDevExt->pQosInfo != NULL)) {
+		for (Lun = 0; Lun < MAX_NAMESPACES; Lun++) {
+			pQos = pDevExt->pQosInfo + Lun;
+			if ((pQos->IopsLimit == pInit->QosIopsLimit) &&
+				(pQos->BandwidthLimit == pInit->QosBandwidthLimit))
+				NVMeQosSetLimits(pDevExt,
+					pQos,
+					pTunables->QosIopsLimit,
+					pTunables->QosBandwidthLimit);
+		}
+	}
+
+	if (Set & NVME_TUNE_QOS) {
+		pInit->QosIopsLimit = pTunables->QosIopsLimit;
+		pInit->QosBandwidthLimit = pTunables->QosBandwidthLimit;
+	}
+
+#if (NTDDI_VERSION > NTDDI_WIN7)
+	if (Set & NVME_TUNE_RECREATE) {
+		/*
+		 * Hold off new IO and let the timer finish the job once the IO in
+		 * flight completed. Coalescing is replayed by the restart.
+		 */
+		pDevExt->pRetuneSrb = pSrb;
+		pDevExt->RetuneWaitUs = 0;
+		StorPortPause(pDevExt, STOR_ALL_REQUESTS);
+
+		if (StorPortRequestTimer(pDevExt,
+								 pDevExt->RetuneTimerhandle,
+								 NVMeRetuneTimer,
+								 NULL,
+								 RETUNE_TIMER_INTERVAL_US,
+								 0) != STOR_STATUS_SUCCESS) {
+			pDevExt->pRetuneSrb = NULL;
+			StorPortResume(pDevExt);
+			NVMeTunablesGet(pDevExt, pTunables);
+			pTunables->SrbIoCtrl.ReturnCode = NVME_IOCTL_INTERNAL_ERROR;
+			return IOCTL_COMPLETED;
+		}
+
+		return IOCTL_PENDING;
+	}
+#endif
+
+	if (Set & NVME_TUNE_INT_COALESCING) {
+		/* NVMeHandleTunables keeps the values once the controller took them */
+		memset(&pSrbExt->nvmeSqeUnit, 0, sizeof(NVMe_COMMAND));
+		pSrbExt->nvmeSqeUnit.CDW0.OPC = ADMIN_SET_FEATURES;
+		pSetFeaturesCDW10 = (PADMIN_SET_FEATURES_COMMAND_DW10)
+			&pSrbExt->nvmeSqeUnit.CDW10;
+		pSetFeaturesCDW11 = (PADMIN_SET_FEATURES_COMMAND_INTERRUPT_COALESCING_DW11)
+			&pSrbExt->nvmeSqeUnit.CDW11;
+		pSetFeaturesCDW10->FID = INTERRUPT_COALESCING;
+		pSetFeaturesCDW11->TIME = (UCHAR)pTunables->IntCoalescingTime;
+		pSetFeaturesCDW11->THR = (UCHAR)pTunables->IntCoalescingEntry;
+
+		pSrbExt->forAdminQueue = TRUE;
+		pSrbExt->pNvmeCompletionRoutine =
+			(PNVME_COMPLETION_ROUTINE)NVMeIoctlCallback;
+
+		return IOCTL_PENDING;
+	}
+
+	NVMeTunablesGet(pDevExt, pTunables);
+	pTunables->SrbIoCtrl.ReturnCode = NVME_IOCTL_SUCCESS;
+
+	return IOCTL_COMPLETED;
+} /* NVMeIoctlTunables */
+
+#if (NTDDI_VERSION > NTDDI_WIN7)
+/******************************************************************************
+ * NVMeRetuneTimer
+ *
+ * @brief NVMeRetuneTimer checks on the IO NVME_TUNABLES is waiting for to
+ *        drain, re-arming itself until it has or RETUNE_QUIESCE_TIMEOUT_US
+ *        passed. With nothing in flight the new queue depth and count are put
+ *        in place and the recovery DPC recreates the queues, keeping what
+ *        Identify found, then completes the request and resumes IO. Storport
+ *        calls it with the StartIo lock held, so the DPC can't start before
+ *        this is done.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ * @param Context - Not used
+ *
+ * @return VOID
+ ******************************************************************************/
+VOID NVMeRetuneTimer(
+	PNVME_DEVICE_EXTENSION pAE,
+	PVOID Context
+)
+{
+	PSTORAGE_REQUEST_BLOCK pSrb = pAE->pRetuneSrb;
+	PNVME_TUNABLES_IOCTL pTunables = NULL;
+	PQUEUE_INFO pQI = &pAE->QueueInfo;
+	USHORT QueueID;
+
+	UNREFERENCED_PARAMETER(Context);
+
+	if (pSrb == NULL)
+		return;
+
+	pTunables = (PNVME_TUNABLES_IOCTL)GET_DATA_BUFFER(pSrb);
+
+	/* A reset or removal got there first, leave the queues to it */
+	if ((pAE->ShutdownInProgress == TRUE) ||
+		(pAE->DeviceRemovedDuringIO == TRUE) ||
+		(pAE->RecoveryAttemptPossible == FALSE)) {
+		pAE->pRetuneSrb = NULL;
+		if (pAE->RecoveryAttemptPossible == TRUE)
+			StorPortResume(pAE);
+		NVMeTunablesGet(pAE, pTunables);
+		pTunables->SrbIoCtrl.ReturnCode = NVME_IOCTL_INTERNAL_ERROR;
+		pSrb->SrbStatus = SRB_STATUS_SUCCESS;
+		IO_StorPortNotification(RequestComplete, pAE, pSrb);
+		return;
+	}
+
+	if (NVMeIoQuiesced(pAE) == FALSE) {
+		pAE->RetuneWaitUs += RETUNE_TIMER_INTERVAL_US;
+		if ((pAE->RetuneWaitUs < RETUNE_QUIESCE_TIMEOUT_US) &&
+			(StorPortRequestTimer(pAE,
+								  pAE->RetuneTimerhandle,
+								  NVMeRetuneTimer,
+								  NULL,
+								  RETUNE_TIMER_INTERVAL_US,
+								  0) == STOR_STATUS_SUCCESS))
+			return;
+
+		pAE->pRetuneSrb = NULL;
+		StorPortResume(pAE);
+		NVMeTunablesGet(pAE, pTunables);
+		pTunables->QuiesceUs = pAE->RetuneWaitUs;
+		pTunables->SrbIoCtrl.ReturnCode = NVME_IOCTL_QUIESCE_TIMEOUT;
+		pSrb->SrbStatus = SRB_STATUS_SUCCESS;
+		IO_StorPortNotification(RequestComplete, pAE, pSrb);
+		return;
+	}
+
+	pAE->pRetuneSrb = NULL;
+	pAE->DriverState.FastResume = TRUE;
+	if (StorPortIssueDpc(pAE, &pAE->RecoveryDpc, pSrb, NULL) == FALSE) {
+		pAE->DriverState.FastResume = FALSE;
+		StorPortResume(pAE);
+		NVMeTunablesGet(pAE, pTunables);
+		pTunables->SrbIoCtrl.ReturnCode = NVME_IOCTL_INTERNAL_ERROR;
+		pSrb->SrbStatus = SRB_STATUS_SUCCESS;
+		IO_StorPortNotification(RequestComplete, pAE, pSrb);
+		return;
+	}
+	pAE->RecoveryAttemptPossible = FALSE;
+
+	/* Nothing in flight, put the new shape in place for the restart */
+	if (pTunables->Set & NVME_TUNE_IO_QUEUE_ENTRIES) {
+		pAE->InitInfo.IoQEntries = pTunables->IoQEntries;
+		for (QueueID = 1; QueueID <= pQI->NumSubIoQAllocated; QueueID++)
+			(pQI->pSubQueueInfo + QueueID)->SubQEntries = pTunables->IoQEntries;
+	}
+
+	if (pTunables->Set & NVME_TUNE_IO_QUEUES) {
+		pAE->IoQueueLimit =
+			(pTunables->IoQueues < pQI->NumCplIoQAllocated) ?
+			pTunables->IoQueues : 0;
+	}
+
+	if (pTunables->Set & NVME_TUNE_INT_COALESCING) {
+		pAE->InitInfo.IntCoalescingTime = pTunables->IntCoalescingTime;
+		pAE->InitInfo.IntCoalescingEntry = pTunables->IntCoalescingEntry;
+	}
+
+	NVMeTunablesGet(pAE, pTunables);
+	pTunables->QuiesceUs = pAE->RetuneWaitUs;
+	pTunables->SrbIoCtrl.ReturnCode = NVME_IOCTL_SUCCESS;
+} /* NVMeRetuneTimer */
+
+/******************************************************************************
+ * NVMeRetuneStop
+ *
+ * @brief NVMeRetuneStop gets called on shutdown and removal to cancel and free
+ *        the NVME_TUNABLES timer. A request still waiting on it for IO to
+ *        drain is failed and the IO it held off resumed.
+ *
+ * @param pAE - Pointer to hardware device extension.
+ *
+ * @return VOID
+ ******************************************************************************/
+VOID NVMeRetuneStop(
+	PNVME_DEVICE_EXTENSION pAE
+)
+{
+	PSTORAGE_REQUEST_BLOCK pSrb = pAE->pRetuneSrb;
+	PNVME_TUNABLES_IOCTL pTunables = NULL;
+
+	if (pAE->RetuneTimerhandle == NULL)
+		return;
+
+	StorPortRequestTimer(pAE, pAE->RetuneTimerhandle, NVMeRetuneTimer, NULL, 0, 0);
+	StorPortFreeTimer(pAE, pAE->RetuneTimerhandle);
+	pAE->RetuneTimerhandle = NULL;
+
+	if (pSrb != NULL) {
+		pAE->pRetuneSrb = NULL;
+		StorPortResume(pAE);
+		pTunables = (PNVME_TUNABLES_IOCTL)GET_DATA_BUFFER(pSrb);
+		NVMeTunablesGet(pAE, pTunables);
+		pTunables->QuiesceUs = pAE->RetuneWaitUs;
+		pTunables->SrbIoCtrl.ReturnCode = NVME_IOCTL_INTERNAL_ERROR;
+		pSrb->SrbStatus = SRB_STATUS_SUCCESS;
+		IO_StorPortNotification(RequestComplete, pAE, pSrb);
+	}
+} /* NVMeRetuneStop */
+#endif
+
+#ifdef HISTORY
+/******************************************************************************
+ * NVMeIoctlHistorySnapshot
+ *
+ * @brief This function copies the latest records of one core's command
+ *        history ring, oldest first, as many as the caller's buffer holds.
+ *        The ring keeps being written while it's copied.
+ *
+ * @param pDevExt - Pointer to hardware device extension.
+ * @param pSrb - This parameter specifies the SCSI I/O request.
+ *
+ * @return None
+ ******************************************************************************/
+VOID NVMeIoctlHistorySnapshot(
+	PNVME_DEVICE_EXTENSION pDevExt,
+#if (NTDDI_VERSION > NTDDI_WIN7)
+	PSTORAGE_REQUEST_BLOCK pSrb
+#else
+	PSCSI_REQUEST_BLOCK pSrb
+#endif
+)
+{
+	PNVME_HISTORY_SNAPSHOT_IOCTL pSnapIoctl = NULL;
+	PHISTORY_RING pRing = NULL;
+	ULONG Written;
+	ULONG Count;
+	ULONG Fit;
+	ULONG Index;
+
+	pSnapIoctl = (PNVME_HISTORY_SNAPSHOT_IOCTL)GET_DATA_BUFFER(pSrb);
+
+	if (GET_DATA_LENGTH(pSrb) < sizeof(NVME_HISTORY_SNAPSHOT_IOCTL)) {
+		pSnapIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_INSUFFICIENT_IN_BUFFER;
+		return;
+	}
+
+	pSnapIoctl->NumRings = pDevExt->NumHistoryRings;
+	pSnapIoctl->Depth = pDevExt->HistoryDepth;
+	pSnapIoctl->Written = 0;
+	pSnapIoctl->NumRecords = 0;
+
+	if ((pDevExt->pHistoryRings == NULL) ||
+		(pSnapIoctl->Ring >= pDevExt->NumHistoryRings)) {
+		pSnapIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_UNSUPPORTED_OPERATION;
+		return;
+	}
+
+	pRing = &pDevExt->pHistoryRings[pSnapIoctl->Ring];
+	Written = (ULONG)pRing->Next;
+	Fit = (GET_DATA_LENGTH(pSrb) -
+		FIELD_OFFSET(NVME_HISTORY_SNAPSHOT_IOCTL, Records)) /
+		sizeof(NVME_HISTORY_RECORD);
+
+	Count = min(Written, pDevExt->HistoryDepth);
+	Count = min(Count, Fit);
+
+	for (Index = 0; Index < Count; Index++)
+		pSnapIoctl->Records[Index] =
+			pRing->pRecords[(Written - Count + Index) &
+				(pDevExt->HistoryDepth - 1)];
+
+	pSnapIoctl->Written = Written;
+	pSnapIoctl->NumRecords = Count;
+	pSnapIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_SUCCESS;
+} /* NVMeIoctlHistorySnapshot */
+#endif
+
+
+/******************************************************************************
+* NVMeFormatNVMHotRemoveNamespace
+*
+* @brief This function calls StorPortNotification with BusChangeDetected to
+*        force a bus re-enumeration after removing a namespace which used to
+*        be seen by Windows system. After removal, a Format NVM command is
+*        applied to the removed namespace(s). A single visible namespace isn't
+*        removed, only its IO is held, see NVMeFormatNVMHold.
+*
+* @param pSrbExt - Pointer to Srb Extension allocated in SRB.
+*
+* @return None
+******************************************************************************/
+VOID NVMeFormatNVMHotRemoveNamespace(
+	PNVME_SRB_EXTENSION pSrbExt
+)
+{
+	PNVME_DEVICE_EXTENSION pDevExt = pSrbExt->pNvmeDevExt;
+#if (NTDDI_VERSION > NTDDI_WIN7)
+	PSTORAGE_REQUEST_BLOCK pSrb = pSrbExt->pSrb;
+#else
+	PSCSI_REQUEST_BLOCK pSrb = pSrbExt->pSrb;
+#endif
+
+	PNVME_PASS_THROUGH_IOCTL pNvmePtIoctl = NULL;
+	PNVMe_COMMAND pNvmeCmd = NULL;
+	ULONG NS = 0;
+	ULONG lunId = INVALID_LUN_EXTN;
+	PNVME_LUN_EXTENSION pLunExt = NULL;
+
+	pNvmePtIoctl = (PNVME_PASS_THROUGH_IOCTL)GET_DATA_BUFFER(pSrb);
+	pNvmeCmd = (PNVMe_COMMAND)pNvmePtIoctl->NVMeCmd;
+
+	/*
+	 * If we're in the middle of formatting NVM,
+	 * simply reject current request:
+	 * SrbStatus = SRB_STATUS_INVALID_REQUEST
+	 * ReturCode = NVME_IOCTL_UNSUPPORTED_OPERATION
+	 */
+	if ((pDevExt->FormatNvmInfo.State != FORMAT_NVM_RECEIVED) &&
+		(pDevExt->FormatNvmInfo.State != FORMAT_NVM_NO_ACTIVITY)) {
+		pNvmePtIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_UNSUPPORTED_OPERATION;
+		pSrb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
+		return;
+	}
+
+	StorPortDebugPrint(INFO, "NVMeFormatNVMHotRemoveNamespace: NSID:0x%x\n",
+		pNvmeCmd->NSID);
+
+	/* Set the namespace(s) as unavailable now */
+	if (pNvmeCmd->NSID == ALL_NAMESPACES_APPLIED) {
+		/*
+		 * Set all reported namespaces as unavailable
+		 * by setting all lun slot statuses to OFFLINE
+		 */
+		pDevExt->FormatNvmInfo.FormatAllNamespaces = TRUE;
+		for (lunId = 0; lunId < MAX_NAMESPACES; lunId++) {
+			pLunExt = pDevExt->pLunExtensionTable[lunId];
 			if (ONLINE == pLunExt->slotStatus && pLunExt->identifyData.NSZE != 0) {
-				pDevExt->FormatNvmInfo.TargetLun = lunId;
 				pLunExt->slotStatus = OFFLINE;
 				pLunExt->offlineReason = FORMAT_IN_PROGRESS;
 				/* Now we are in namespace hot remove state. */
@@ -4120,6 +5950,45 @@ VOID NVMeFormatNVMHotRemoveNamespace(
 			}
 		}
 	}
+	else if (TRUE == NVMeIsNamespaceVisible(pSrbExt, 0, &lunId)) {
+		/*
+		 * Mark down the target namespace to format.
+		 */
+		StorPortDebugPrint(INFO,
+			"NVMeFormatNVMHotRemoveNamespace: Target lunID=%d.\n", lunId);
+		pDevExt->FormatNvmInfo.TargetLun = lunId;
+
+		/*
+		 * We just have to format one namespace. It stays ONLINE, Storport
+		 * holds its new requests and we hold the ones already sent to us,
+		 * all other namespaces carry on as before.
+		 */
+		if (INVALID_LUN_EXTN != lunId) {
+			pLunExt = pDevExt->pLunExtensionTable[lunId];
+			if (ONLINE == pLunExt->slotStatus && pLunExt->identifyData.NSZE != 0) {
+				UCHAR flbas = pLunExt->identifyData.FLBAS.SupportedCombination;
+
+				pDevExt->FormatNvmInfo.TargetLun = lunId;
+				pDevExt->FormatNvmInfo.HoldIo = TRUE;
+				pDevExt->FormatNvmInfo.Lbaf =
+					pLunExt->identifyData.LBAFx[flbas];
+				pDevExt->FormatNvmInfo.Flbas =
+					*(PUCHAR)&pLunExt->identifyData.FLBAS;
+				pDevExt->FormatNvmInfo.Dps =
+					*(PUCHAR)&pLunExt->identifyData.DPS;
+				InitializeListHead(&pLunExt->FormatHoldList);
+				pLunExt->NumFormatHeld = 0;
+				pLunExt->nsReady = FALSE;
+
+				StorPortPauseDevice(pDevExt,
+					VALID_NVME_PATH_ID,
+					VALID_NVME_TARGET_ID,
+					(UCHAR)lunId,
+					pNvmePtIoctl->SrbIoCtrl.Timeout);
+				return;
+			}
+		}
+	}
 
 	StorPortDebugPrint(INFO, "NVMeFormatNVMHotRemoveNamespace: Hold off IOs.\n");
 	/*
@@ -4230,6 +6099,312 @@ VOID NVMeFormatNVMHotAddNamespace(
 	StorPortNotification(BusChangeDetected, pDevExt);
 } /* NVMeFormatNVMHotAddNamespace */
 
+/******************************************************************************
+* NVMeFormatNVMHold
+*
+* @brief This function gets called from StartIo, with the StartIo lock held,
+*        for every host IO. While a single namespace formats, the requests
+*        for it that Storport sent before pausing the LUN are put on its hold
+*        list rather than failed. NVMeFormatNVMRelease issues them later.
+*
+* @param pDevExt - Pointer to hardware device extension.
+* @param pSrbExt - Pointer to Srb Extension of the request.
+*
+* @return TRUE - The request was held, the caller must not issue it
+*         FALSE - The request can be issued now
+******************************************************************************/
+BOOLEAN NVMeFormatNVMHold(
+	PNVME_DEVICE_EXTENSION pDevExt,
+	PNVME_SRB_EXTENSION pSrbExt
+)
+{
+	PNVME_LUN_EXTENSION pLunExt = NULL;
+
+	if ((pDevExt->FormatNvmInfo.HoldIo == FALSE) || (pSrbExt->pSrb == NULL))
+		return FALSE;
+
+	if (GET_LUN_ID(pSrbExt->pSrb) != pDevExt->FormatNvmInfo.TargetLun)
+		return FALSE;
+
+	/* QoS hasn't seen the request yet, its list entry is free to use */
+	pLunExt = pDevExt->pLunExtensionTable[pDevExt->FormatNvmInfo.TargetLun];
+	InsertTailList(&pLunExt->FormatHoldList, &pSrbExt->QosListEntry);
+	pLunExt->NumFormatHeld++;
+
+	return TRUE;
+} /* NVMeFormatNVMHold */
+
+/******************************************************************************
+* NVMeFormatNVMRelease
+*
+* @brief This function gets called once a single namespace format is over and
+*        the namespace had been identified again, or the format failed. The
+*        held requests are issued in the order they came in and Storport is
+*        let go of the LUN. Requests that were built for an LBA format, be it
+*        the data or metadata size, or protection the namespace no longer has
+*        are failed instead, with those QoS deferred for it, and the
+*        controller and namespaces are identified again before Windows is told
+*        to look at them.
+*
+* @param pDevExt - Pointer to hardware device extension.
+* @param AcquireLock - Whether the StartIo lock needs to be taken, FALSE when
+*                      called from StartIo or a timer
+*
+* @return None
+******************************************************************************/
+VOID NVMeFormatNVMRelease(
+	PNVME_DEVICE_EXTENSION pDevExt,
+	BOOLEAN AcquireLock
+)
+{
+	PFORMAT_NVM_INFO pFormatNvmInfo = &pDevExt->FormatNvmInfo;
+	PNVME_LUN_EXTENSION pLunExt = NULL;
+	PNVME_SRB_EXTENSION pSrbExt = NULL;
+	PADMIN_IDENTIFY_FORMAT_DATA pLbaf = NULL;
+	STOR_LOCK_HANDLE StartLockHandle = { 0 };
+	ULONG lunId = pFormatNvmInfo->TargetLun;
+	BOOLEAN sameFormat;
+	UCHAR flbas;
+
+	pLunExt = pDevExt->pLunExtensionTable[lunId];
+	flbas = pLunExt->identifyData.FLBAS.SupportedCombination;
+	pLbaf = &pLunExt->identifyData.LBAFx[flbas];
+	sameFormat = ((pLbaf->LBADS == pFormatNvmInfo->Lbaf.LBADS) &&
+		(pLbaf->MS == pFormatNvmInfo->Lbaf.MS) &&
+		(*(PUCHAR)&pLunExt->identifyData.FLBAS == pFormatNvmInfo->Flbas) &&
+		(*(PUCHAR)&pLunExt->identifyData.DPS == pFormatNvmInfo->Dps)) ?
+		TRUE : FALSE;
+
+	StorPortDebugPrint(INFO,
+		"NVMeFormatNVMRelease: lunId=%d held=%d sameFormat=%d\n",
+		lunId, pLunExt->NumFormatHeld, sameFormat);
+
+	/* The held requests are StartIo's */
+	if ((AcquireLock == TRUE) && !pDevExt->MultipleCoresToSingleQueueFlag)
+		StorPortAcquireSpinLock(pDevExt, StartIoLock, NULL, &StartLockHandle);
+
+	while (IsListEmpty(&pLunExt->FormatHoldList) == FALSE) {
+		pSrbExt = CONTAINING_RECORD(RemoveHeadList(&pLunExt->FormatHoldList),
+			NVME_SRB_EXTENSION,
+			QosListEntry);
+		pLunExt->NumFormatHeld--;
+
+		if (sameFormat == FALSE) {
+			pSrbExt->pSrb->SrbStatus = SRB_STATUS_ERROR;
+			IO_StorPortNotification(RequestComplete, pDevExt, pSrbExt->pSrb);
+		}
+		else if (NVMeQosDefer(pDevExt, pSrbExt) == FALSE) {
+			ProcessIo(pDevExt, pSrbExt, NVME_QUEUE_TYPE_IO, FALSE);
+		}
+	}
+
+	if (sameFormat == FALSE) {
+		NVMeQosFlushLun(pDevExt, lunId, SRB_STATUS_ERROR);
+
+		/* The next StartIo refreshes Identify and tells Windows */
+		pDevExt->DriverState.ReIdentifyLun = REIDENTIFY_CONTROLLER;
+		pDevExt->DriverState.ReIdentifyChanged = TRUE;
+		pDevExt->DriverState.ReIdentifyPending = TRUE;
+	}
+
+	pLunExt->nsReady = TRUE;
+
+	/*
+	 * Reset FORMAT_NVM_INFO structure to zero
+	 * since the request is completed
+	 */
+	memset((PVOID)pFormatNvmInfo, 0, sizeof(FORMAT_NVM_INFO));
+
+	/* With the hold gone QoS may let the namespace's deferred IO go */
+	NVMeQosRelease(pDevExt);
+	NVMeQosArmTimer(pDevExt);
+
+	if ((AcquireLock == TRUE) && !pDevExt->MultipleCoresToSingleQueueFlag)
+		StorPortReleaseSpinLock(pDevExt, &StartLockHandle);
+
+	StorPortResumeDevice(pDevExt,
+		VALID_NVME_PATH_ID,
+		VALID_NVME_TARGET_ID,
+		(UCHAR)lunId);
+} /* NVMeFormatNVMRelease */
+
+/******************************************************************************
+* NVMeFormatNVMFlush
+*
+* @brief This function gets called from NVMeDetectPendingCmds. IO held for a
+*        namespace format was never issued but is still owed a completion,
+*        the Format NVM request itself is completed by the caller unless it's
+*        still waiting for the namespace's IO to drain.
+*
+* @param pAE - Pointer to hardware device extension.
+* @param completeCmd - determines if held requests should be completed
+* @param SrbStatus - Srb Status value for the completing SRBs
+*
+* @return TRUE - Requests were held
+*         FALSE - None were
+******************************************************************************/
+BOOLEAN NVMeFormatNVMFlush(
+	PNVME_DEVICE_EXTENSION pAE,
+	BOOLEAN completeCmd,
+	UCHAR SrbStatus
+)
+{
+	PNVME_LUN_EXTENSION pLunExt = NULL;
+	PNVME_SRB_EXTENSION pSrbExt = NULL;
+#if (NTDDI_VERSION > NTDDI_WIN7)
+	PSTORAGE_REQUEST_BLOCK pDrainSrb = pAE->FormatNvmInfo.pDrainSrb;
+	PNVME_PASS_THROUGH_IOCTL pNvmePtIoctl = NULL;
+#endif
+	ULONG lunId = pAE->FormatNvmInfo.TargetLun;
+	BOOLEAN retValue;
+
+	if (pAE->FormatNvmInfo.HoldIo == FALSE)
+		return FALSE;
+
+	pLunExt = pAE->pLunExtensionTable[lunId];
+	retValue = (pLunExt->NumFormatHeld != 0) ? TRUE : FALSE;
+#if (NTDDI_VERSION > NTDDI_WIN7)
+	if (pDrainSrb != NULL)
+		retValue = TRUE;
+#endif
+
+	if (completeCmd == FALSE)
+		return retValue;
+
+#if (NTDDI_VERSION > NTDDI_WIN7)
+	/* Format NVM never went out, nobody else completes it */
+	if (pDrainSrb != NULL) {
+		if (pAE->FormatTimerhandle != NULL)
+			StorPortRequestTimer(pAE, pAE->FormatTimerhandle,
+				NVMeFormatDrainTimer, NULL, 0, 0);
+		pAE->FormatNvmInfo.pDrainSrb = NULL;
+		pNvmePtIoctl = (PNVME_PASS_THROUGH_IOCTL)GET_DATA_BUFFER(pDrainSrb);
+		pNvmePtIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_FORMAT_NVM_FAILED;
+		pDrainSrb->SrbStatus = SrbStatus;
+		IO_StorPortNotification(RequestComplete, pAE, pDrainSrb);
+	}
+#endif
+
+	while (IsListEmpty(&pLunExt->FormatHoldList) == FALSE) {
+		pSrbExt = CONTAINING_RECORD(RemoveHeadList(&pLunExt->FormatHoldList),
+			NVME_SRB_EXTENSION,
+			QosListEntry);
+		pLunExt->NumFormatHeld--;
+
+		pSrbExt->pSrb->SrbStatus = SrbStatus;
+		IO_StorPortNotification(RequestComplete, pAE, pSrbExt->pSrb);
+	}
+
+	/* The format won't call back, the namespace is identified again on init */
+	pLunExt->nsReady = TRUE;
+	memset((PVOID)(&pAE->FormatNvmInfo), 0, sizeof(FORMAT_NVM_INFO));
+
+	StorPortResumeDevice(pAE,
+		VALID_NVME_PATH_ID,
+		VALID_NVME_TARGET_ID,
+		(UCHAR)lunId);
+
+	return retValue;
+} /* NVMeFormatNVMFlush */
+
+#if (NTDDI_VERSION > NTDDI_WIN7)
+/******************************************************************************
+* NVMeFormatDrainTimer
+*
+* @brief NVMeFormatDrainTimer checks on the IO a single namespace format is
+*        waiting for, re-arming itself until the namespace has none in flight
+*        or FORMAT_DRAIN_TIMEOUT_US passed. Format NVM is issued then, or
+*        failed and the held IO let go. Storport calls it with the StartIo
+*        lock held.
+*
+* @param pAE - Pointer to hardware device extension.
+* @param Context - Not used
+*
+* @return VOID
+******************************************************************************/
+VOID NVMeFormatDrainTimer(
+	PNVME_DEVICE_EXTENSION pAE,
+	PVOID Context
+)
+{
+	PFORMAT_NVM_INFO pFormatNvmInfo = &pAE->FormatNvmInfo;
+	PSTORAGE_REQUEST_BLOCK pSrb = pFormatNvmInfo->pDrainSrb;
+	PNVME_PASS_THROUGH_IOCTL pNvmePtIoctl = NULL;
+
+	UNREFERENCED_PARAMETER(Context);
+
+	if (pSrb == NULL)
+		return;
+
+	if ((pAE->ShutdownInProgress == FALSE) &&
+		(pAE->DeviceRemovedDuringIO == FALSE)) {
+		if (NVMeLunQuiesced(pAE, pFormatNvmInfo->TargetLun) == TRUE) {
+			pFormatNvmInfo->pDrainSrb = NULL;
+			ProcessIo(pAE,
+				(PNVME_SRB_EXTENSION)GET_SRB_EXTENSION(pSrb),
+				NVME_QUEUE_TYPE_ADMIN,
+				FALSE);
+			return;
+		}
+
+		pFormatNvmInfo->DrainWaitUs += FORMAT_DRAIN_INTERVAL_US;
+		if ((pFormatNvmInfo->DrainWaitUs < FORMAT_DRAIN_TIMEOUT_US) &&
+			(StorPortRequestTimer(pAE,
+								  pAE->FormatTimerhandle,
+								  NVMeFormatDrainTimer,
+								  NULL,
+								  FORMAT_DRAIN_INTERVAL_US,
+								  0) == STOR_STATUS_SUCCESS))
+			return;
+	}
+
+	StorPortDebugPrint(ERROR,
+		"NVMeFormatDrainTimer: <Error> lunId=%d IO didn't drain in %d us\n",
+		pFormatNvmInfo->TargetLun, pFormatNvmInfo->DrainWaitUs);
+
+	pNvmePtIoctl = (PNVME_PASS_THROUGH_IOCTL)GET_DATA_BUFFER(pSrb);
+	pNvmePtIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_FORMAT_NVM_FAILED;
+	NVMeFormatNVMRelease(pAE, FALSE);
+	pSrb->SrbStatus = SRB_STATUS_SUCCESS;
+	IO_StorPortNotification(RequestComplete, pAE, pSrb);
+} /* NVMeFormatDrainTimer */
+
+/******************************************************************************
+* NVMeFormatDrainStop
+*
+* @brief NVMeFormatDrainStop gets called on shutdown and removal to cancel and
+*        free the format drain timer. A Format NVM still waiting on it is
+*        failed and the IO held for its namespace let go.
+*
+* @param pAE - Pointer to hardware device extension.
+*
+* @return VOID
+******************************************************************************/
+VOID NVMeFormatDrainStop(
+	PNVME_DEVICE_EXTENSION pAE
+)
+{
+	PSTORAGE_REQUEST_BLOCK pSrb = pAE->FormatNvmInfo.pDrainSrb;
+	PNVME_PASS_THROUGH_IOCTL pNvmePtIoctl = NULL;
+
+	if (pAE->FormatTimerhandle == NULL)
+		return;
+
+	StorPortRequestTimer(pAE, pAE->FormatTimerhandle, NVMeFormatDrainTimer, NULL, 0, 0);
+	StorPortFreeTimer(pAE, pAE->FormatTimerhandle);
+	pAE->FormatTimerhandle = NULL;
+
+	if (pSrb != NULL) {
+		pAE->FormatNvmInfo.pDrainSrb = NULL;
+		pNvmePtIoctl = (PNVME_PASS_THROUGH_IOCTL)GET_DATA_BUFFER(pSrb);
+		pNvmePtIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_FORMAT_NVM_FAILED;
+		NVMeFormatNVMRelease(pAE, TRUE);
+		pSrb->SrbStatus = SRB_STATUS_SUCCESS;
+		IO_StorPortNotification(RequestComplete, pAE, pSrb);
+	}
+} /* NVMeFormatDrainStop */
+#endif
+
 /******************************************************************************
  * NVMeIoctlNamespaceAttachment
  *
@@ -4554,11 +6729,14 @@ BOOLEAN NVMeCompletionNsAttachment(
 		else if (pSrbExt->nvmeSqeUnit.CDW0.OPC == ADMIN_IDENTIFY) {
 			//Attach (part 2): Received identify data, now complete attachment
 			pLunExt->nsStatus = ATTACHED;
-			pLunExt->slotStatus = ONLINE;
 			pLunExt->ReadOnly = FALSE;
 
-			pDevExt->visibleLuns++;
-			StorPortNotification(BusChangeDetected, pDevExt);
+			//Past the LUN range the namespace is attached but not exposed
+			if (lunId < MAX_NAMESPACES) {
+				pLunExt->slotStatus = ONLINE;
+				pDevExt->visibleLuns++;
+				StorPortNotification(BusChangeDetected, pDevExt);
+			}
 			pNvmePtIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_SUCCESS;
 		}
 	}
@@ -4647,7 +6825,7 @@ BOOLEAN NVMeCompletionNsMgmt(
 				}
 				pDevExt->DriverState.NumKnownNamespaces++;
 				pLunExt = pDevExt->pLunExtensionTable[lunId];
-				pLunExt->namespaceId = currentNSID;
+				NVMeSetNamespaceId(pDevExt, lunId, currentNSID);
 				pLunExt->nsStatus = INACTIVE;
 				pLunExt->slotStatus = FREE;
 				pLunExt->offlineReason = NOT_OFFLINE;
@@ -4668,6 +6846,7 @@ BOOLEAN NVMeCompletionNsMgmt(
 				pLunExt = pDevExt->pLunExtensionTable[lunId];
 				if (FREE != pLunExt->slotStatus)
 					pDevExt->visibleLuns--;
+				NVMeSetNamespaceId(pDevExt, lunId, 0);
 				memset(pLunExt, 0, sizeof(NVME_LUN_EXTENSION));
 				pDevExt->DriverState.NumKnownNamespaces--;
 				pNvmePtIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_SUCCESS;
@@ -4804,6 +6983,10 @@ BOOLEAN FormatNVMFailure(
 		/* Need to add back namespace(s) first */
 		NVMeFormatNVMHotAddNamespace(pSrbExt);
 	}
+	else if (pFormatNvmInfo->HoldIo == TRUE) {
+		/* Let the held IO go, or fail it if the block size changed */
+		NVMeFormatNVMRelease(pDevExt, TRUE);
+	}
 	/*
 	 * Reset FORMAT_NVM_INFO structure to zero
 	 * since the request is completed
@@ -4879,6 +7062,24 @@ BOOLEAN NVMeIoctlFormatNVMCallback(
 			 */
 			return FormatNVMFailure(pDevExt, pSrbExt);
 		}
+		else if (pFormatNvmInfo->HoldIo == TRUE) {
+			/*
+			 * Formatting one namespace leaves the controller data alone,
+			 * only re-fetch the namespace's own structure. Its IO goes once
+			 * that's in.
+			 */
+			memset(&pSrbExt->nvmeSqeUnit, 0, sizeof(NVMe_COMMAND));
+			pFormatNvmInfo->NextNs = NS;
+			if (FormatNVMGetIdentify(pSrbExt, NS) == FALSE) {
+				return FormatNVMFailure(pDevExt, pSrbExt);
+			}
+
+			pFormatNvmInfo->State = FORMAT_NVM_IDEN_NAMESPACE_FETCHED;
+			StorPortDebugPrint(INFO,
+				"NVMeIoctlFormatNVMCallback: Fetching NS(ID=%d) data.\n", NS);
+
+			return FALSE;
+		}
 		else {
 			/* Re-use the SrbExt to fetch Identify Controller structure */
 			memset(&pSrbExt->nvmeSqeUnit, 0, sizeof(NVMe_COMMAND));
@@ -5033,6 +7234,9 @@ BOOLEAN NVMeIoctlFormatNVMCallback(
 		if (TRUE == pFormatNvmInfo->AddNamespaceNeeded) {
 			NVMeFormatNVMHotAddNamespace(pSrbExt);
 		}
+		else if (TRUE == pFormatNvmInfo->HoldIo) {
+			NVMeFormatNVMRelease(pDevExt, TRUE);
+		}
 		pSrb->SrbStatus = SRB_STATUS_SUCCESS;
 		pNvmePtIoctl->SrbIoCtrl.ReturnCode = NVME_IOCTL_SUCCESS;
 
@@ -5133,9 +7337,7 @@ BOOLEAN NVMeIsNamespaceVisible(
 	PNVME_PASS_THROUGH_IOCTL pNvmePtIoctl = NULL;
 	PNVMe_COMMAND pNvmeCmd = NULL;
 	ULONG NSID = 0;
-	PNVME_LUN_EXTENSION pLunExt = NULL;
 	BOOLEAN bNamespaceIsVisible = FALSE;
-	ULONG lunId = 0;
 	ULONG lunIdToBeReturned = INVALID_LUN_EXTN;
 
 	pSrb = pSrbExt->pSrb;
@@ -5153,21 +7355,17 @@ BOOLEAN NVMeIsNamespaceVisible(
 	else
 		NSID = pNvmeCmd->NSID;
 
-	for (lunId = 0; lunId < MAX_NAMESPACES; lunId++) {
-		pLunExt = pDevExt->pLunExtensionTable[lunId];
-		if (NSID == pLunExt->namespaceId) {
-			/*
-			 * We found the lun extension of the visible namespace
-			 * corresponding to NSID; return the lun id. We don't care
-			 * if the lun status is online or offline; all we care about
-			 * is the fact this namespace has an associated lun extension
-			 * and is therefore, exposed.
-			*/
-			bNamespaceIsVisible = TRUE;
-			lunIdToBeReturned = lunId;
-			break;
-		}
-	} // for (lunId)
+	lunIdToBeReturned = NVMeLookupNamespace(pDevExt, NSID);
+	if (INVALID_LUN_EXTN != lunIdToBeReturned) {
+		/*
+		 * We found the lun extension of the visible namespace
+		 * corresponding to NSID; return the lun id. We don't care
+		 * if the lun status is online or offline; all we care about
+		 * is the fact this namespace has an associated lun extension
+		 * and is therefore, exposed.
+		*/
+		bNamespaceIsVisible = TRUE;
+	}
 
 	if (NULL != pLunId) {
 		*pLunId = lunIdToBeReturned;
@@ -5193,20 +7391,17 @@ NS_STATUS NVMeGetNamespaceStatusAndSlot(
 	PULONG pLunId
 )
 {
-	int i = 0;
-	for (i = 0; i < MAX_NAMESPACES; i++) {
-		if (pDevExt->pLunExtensionTable[i]->namespaceId == targetNSID) {
-			if (NULL != pLunId) {
-				*pLunId = (ULONG)i;
-			}
-			return pDevExt->pLunExtensionTable[i]->nsStatus;
-		}
-	}
+	ULONG lunId = NVMeLookupNamespace(pDevExt, targetNSID);
 
 	if (NULL != pLunId) {
-		*pLunId = (ULONG)INVALID_LUN_EXTN;
+		*pLunId = lunId;
+	}
+
+	if (INVALID_LUN_EXTN == lunId) {
+		return INVALID;
 	}
-	return INVALID;
+
+	return pDevExt->pLunExtensionTable[lunId]->nsStatus;
 } /* NVMeGetNamespaceStatus */
 
 /******************************************************************************
@@ -5224,8 +7419,13 @@ ULONG NVMeGetFreeLunSlot(
 	PNVME_DEVICE_EXTENSION pDevExt
 )
 {
-	int i;
-	for (i = 0; i < MAX_NAMESPACES; i++) {
+	ULONG i;
+
+	/*
+	 * Lowest slot first, so a namespace created while there is room can
+	 * become a LUN once it's attached.
+	 */
+	for (i = 0; i < pDevExt->NumLunExtensions; i++) {
 		if ((0 == pDevExt->pLunExtensionTable[i]->namespaceId) &&
 			(FREE == pDevExt->pLunExtensionTable[i]->slotStatus) &&
 			(INVALID == pDevExt->pLunExtensionTable[i]->nsStatus)) {
@@ -5236,6 +7436,84 @@ ULONG NVMeGetFreeLunSlot(
 	return INVALID_LUN_EXTN;
 } /* NVMeGetFreeLunSlot */
 
+/******************************************************************************
+ * NVMeLookupNamespace
+ *
+ * @brief This function finds the LUN extension tracking a given NSID through
+ *        the NSID hash, without walking the LUN extension table.
+ *
+ * @param pDevExt - Pointer to device extension
+ * @param NSID - ID of namespace in question, 0 is never tracked.
+ *
+ * @return ULONG - LUN Id of the namespace, INVALID_LUN_EXTN if it's unknown.
+ ******************************************************************************/
+ULONG NVMeLookupNamespace(
+	PNVME_DEVICE_EXTENSION pDevExt,
+	ULONG NSID
+)
+{
+	ULONG lunId;
+
+	if ((0 == NSID) || (NULL == pDevExt->pNsHashHeads))
+		return INVALID_LUN_EXTN;
+
+	lunId = pDevExt->pNsHashHeads[NS_HASH(pDevExt, NSID)];
+	while (INVALID_LUN_EXTN != lunId) {
+		if (pDevExt->pLunExtensionTable[lunId]->namespaceId == NSID)
+			return lunId;
+		lunId = pDevExt->pLunExtensionTable[lunId]->NsHashNext;
+	}
+
+	return INVALID_LUN_EXTN;
+} /* NVMeLookupNamespace */
+
+/******************************************************************************
+ * NVMeSetNamespaceId
+ *
+ * @brief This function changes the NSID a LUN extension tracks, moving it
+ *        between hash chains. Every namespaceId change goes through here so
+ *        NVMeLookupNamespace stays in step with the table.
+ *
+ * @param pDevExt - Pointer to device extension
+ * @param lunId - LUN Id of the extension
+ * @param NSID - New namespace ID, 0 to stop tracking one.
+ *
+ * @return VOID
+ ******************************************************************************/
+VOID NVMeSetNamespaceId(
+	PNVME_DEVICE_EXTENSION pDevExt,
+	ULONG lunId,
+	ULONG NSID
+)
+{
+	PNVME_LUN_EXTENSION pLunExt = pDevExt->pLunExtensionTable[lunId];
+	PULONG pLink = NULL;
+
+	if (pLunExt->namespaceId == NSID)
+		return;
+
+	/* Unlink the extension from the chain of the NSID it had */
+	if (0 != pLunExt->namespaceId) {
+		pLink = &pDevExt->pNsHashHeads[NS_HASH(pDevExt, pLunExt->namespaceId)];
+		while (INVALID_LUN_EXTN != *pLink) {
+			if (*pLink == lunId) {
+				*pLink = pLunExt->NsHashNext;
+				break;
+			}
+			pLink = &pDevExt->pLunExtensionTable[*pLink]->NsHashNext;
+		}
+	}
+
+	pLunExt->namespaceId = NSID;
+	pLunExt->NsHashNext = INVALID_LUN_EXTN;
+
+	if (0 != NSID) {
+		pLink = &pDevExt->pNsHashHeads[NS_HASH(pDevExt, NSID)];
+		pLunExt->NsHashNext = *pLink;
+		*pLink = lunId;
+	}
+} /* NVMeSetNamespaceId */
+
 /*******************************************************************************
  * NVMeIoctlTxDataToHost
  *
@@ -97,9 +97,14 @@ HW_PASSIVE_INITIALIZE_ROUTINE NVMePassiveInitialize;
 #define DUMP_POLL_CALLS             3
 #define STORPORT_TIMER_CB_us        5000 /* .005 seconds */
 #define MAX_STATE_STALL_us          STORPORT_TIMER_CB_us
+#define STATE_POLL_us               1000 /* .001 seconds, init poll loops */
+#define STATE_WATCHDOG_us           100000 /* .1 seconds */
 #define MILLI_TO_MICRO              1000
 #define MICRO_TO_NANO               1000
 #define MSI_ADDR_RH_DM_MASK         0xC
+#define MSI_ADDR_REMAPPABLE_MASK    0x10
+#define MSI_ADDR_MAX_DESTINATION    0xFF
+#define CORE_APIC_ID_UNKNOWN        0xFFFFFFFF
 #define MICRO_TO_SEC                1000
 
 /* Default, minimum, maximum values of Registry keys */
@@ -108,6 +113,22 @@ HW_PASSIVE_INITIALIZE_ROUTINE NVMePassiveInitialize;
 #define MAX_NAMESPACES              128
 #define MAX_TTL_NAMESPACES          MAX_NAMESPACES // to account for some hidden NS
 
+/*
+ * Namespaces tracked, attached or not. Only the first MAX_NAMESPACES slots
+ * can be LUNs, the rest let Namespace Management see the whole subsystem.
+ */
+#define DFT_NAMESPACE_TABLE         MAX_NAMESPACES
+#define MIN_NAMESPACE_TABLE         MAX_NAMESPACES
+#define MAX_NAMESPACE_TABLE         4096
+
+/* LUN extensions are allocated contiguously this many at a time */
+#define LUN_EXT_CHUNK               MAX_NAMESPACES
+
+/* NSID to LUN extension hash, Fibonacci hashing into a power of 2 table */
+#define NS_HASH_MULTIPLIER          0x9E3779B1
+#define NS_HASH(pAE, NSID) \
+    ((ULONG)(((ULONG)(NSID) * NS_HASH_MULTIPLIER) >> (pAE)->NsHashShift))
+
 #ifdef DUMB_DRIVER
 #define MIN_TX_SIZE                 DUMB_DRIVER_SZ
 #define DFT_TX_SIZE                 MIN_TX_SIZE
@@ -135,10 +156,26 @@ HW_PASSIVE_INITIALIZE_ROUTINE NVMePassiveInitialize;
 #else
 #define DFT_IO_QUEUE_ENTRIES        1024
 #define MIN_IO_QUEUE_ENTRIES        2
-#define MAX_IO_QUEUE_ENTRIES        4096
+/* Largest the spec allows, further limited to CAP.MQES + 1 */
+#define MAX_IO_QUEUE_ENTRIES        65536
 #endif
 
-#define DUMP_BUFFER_SIZE            ((5*64*1024) + (sizeof(NVME_LUN_EXTENSION)*MAX_NAMESPACES))
+/*
+ * PRP lists are allocated in physically contiguous chunks; when a queue's
+ * whole pool can't be had in one piece, the chunk size is halved down to this
+ */
+#define PRP_LIST_MIN_CHUNK_PAGES    16
+
+/*
+ * Queue creates a fast resume keeps in flight at once, each with its own SRB
+ * extension so its completion and timing land on the command it belongs to
+ */
+#define CREATE_QUEUE_BURST          16
+
+#define DUMP_BUFFER_SIZE            ((5*64*1024) + \
+                                     ((sizeof(NVME_LUN_EXTENSION) + \
+                                       sizeof(PNVME_LUN_EXTENSION) + \
+                                       sizeof(ULONG)) * DFT_NAMESPACE_TABLE))
 
 #define DFT_INT_COALESCING_TIME     80
 #define MIN_INT_COALESCING_TIME     0
@@ -148,6 +185,162 @@ HW_PASSIVE_INITIALIZE_ROUTINE NVMePassiveInitialize;
 #define MIN_INT_COALESCING_ENTRY    0
 #define MAX_INT_COALESCING_ENTRY    255
 
+/*
+ * Largest exit latency, in us, APST may put in front of an I/O. 0 turns APST
+ * off. A state is entered after APST_IDLE_TIME_FACTOR times its entry plus
+ * exit latency of idle so the time spent switching stays a small fraction.
+ */
+#define DFT_APST_MAX_LATENCY        100000
+#define MIN_APST_MAX_LATENCY        0
+#define MAX_APST_MAX_LATENCY        10000000
+#define APST_IDLE_TIME_FACTOR       50
+#define APST_MAX_ITPT_MS            ((1 << 24) - 1)
+#define MAX_POWER_STATES            32
+
+/*
+ * Host Memory Buffer limit in MB, 0 turns HMB off. The buffer is built from
+ * contiguous chunks starting at HMB_MAX_CHUNK_SIZE, halved on allocation
+ * failure down to HMB_MIN_CHUNK_SIZE. The descriptor list is one page.
+ */
+#define DFT_HMB_MAX_SIZE            128
+#define MIN_HMB_MAX_SIZE            0
+#define MAX_HMB_MAX_SIZE            4096
+#define HMB_MAX_CHUNK_SIZE          (2 * 1024 * 1024)
+#define HMB_MIN_CHUNK_SIZE          (PAGE_SIZE * 2)
+#define HMB_MAX_DESCRIPTORS         (PAGE_SIZE / sizeof(ADMIN_SET_FEATURES_HMB_DESCRIPTOR))
+#define HMB_UNIT_SIZE               (4 * 1024)
+/* Wait for the HMB disable on power down, a controller reset covers a miss */
+#define HMB_DISABLE_TIMEOUT_us      100000 /* .1 seconds */
+
+/* IO submission queues go to the Controller Memory Buffer when set */
+#define DFT_CMB_SUB_QUEUES          1
+#define MIN_CMB_SUB_QUEUES          0
+#define MAX_CMB_SUB_QUEUES          1
+#define CMB_UNIT_SIZE(szu)          ((ULONG64)(4 * 1024) << (4 * (szu)))
+
+/*
+ * Weighted Round Robin with Urgent arbitration, used when CAP.AMS has it and
+ * the WrrArbitration registry value isn't 0. Every queue pair then gets one
+ * SQ per priority class on the same CQ. The medium class is the per-core SQ
+ * used under round robin, the other classes are numbered after it, i.e. SQ
+ * (Class * NumCplIoQAllocated + CQ). Weights are commands per round.
+ */
+#define NVME_SQ_CLASS_MEDIUM        0
+#define NVME_SQ_CLASS_HIGH          1
+#define NVME_SQ_CLASS_LOW           2
+#define NVME_SQ_CLASS_URGENT        3
+#define NVME_SQ_CLASSES             4
+#define DFT_WRR_ARBITRATION         1
+#define MIN_WRR_ARBITRATION         0
+#define MAX_WRR_ARBITRATION         1
+#define WRR_HIGH_WEIGHT             16
+#define WRR_MEDIUM_WEIGHT           8
+#define WRR_LOW_WEIGHT              2
+#define WRR_ARBITRATION_BURST       3   /* 2^3 commands per SQ */
+#define NVME_MAX_SUB_IO_QUEUES(pAE) ((pAE)->ResMapTbl.NumActiveCores * \
+                                     (((pAE)->WrrEnabled == TRUE) ? NVME_SQ_CLASSES : 1))
+
+/*
+ * Per namespace QoS defaults, IOPS and KB/s with 0 meaning unlimited. Tokens
+ * are kept in millionths so the microseconds elapsed times the per second
+ * rate is the refill, and a bucket holds QOS_BURST_US worth of them.
+ */
+#define DFT_QOS_IOPS_LIMIT          0
+#define MIN_QOS_IOPS_LIMIT          0
+#define MAX_QOS_IOPS_LIMIT          10000000
+#define DFT_QOS_BANDWIDTH_LIMIT     0
+#define MIN_QOS_BANDWIDTH_LIMIT     0
+#define MAX_QOS_BANDWIDTH_LIMIT     (64 * 1024 * 1024)
+#define QOS_TOKEN_SCALE             1000000
+#define QOS_BURST_US                100000
+#define QOS_TIMER_INTERVAL_US       1000
+
+/*
+ * Completions a DPC handles per queue before it updates the head doorbell and
+ * re-queues itself so other DPCs on the core get their turn, 0 for no limit.
+ */
+#define DFT_CPL_BUDGET              256
+#define MIN_CPL_BUDGET              0
+#define MAX_CPL_BUDGET              65536
+
+/*
+ * The completion loop harvests up to CPL_HARVEST_BATCH new entries at a time
+ * and prefetches what they resolve to before completing them. The head
+ * doorbell is rung at the end of a queue sweep, or after every
+ * CplDoorbellBatch completions once a batch is done when that isn't 0.
+ */
+#define CPL_HARVEST_BATCH           16
+#define DFT_CPL_DOORBELL_BATCH      0
+#define MIN_CPL_DOORBELL_BATCH      0
+#define MAX_CPL_DOORBELL_BATCH      4096
+
+/*
+ * With HISTORY, defined in every build, commands are traced to one ring of
+ * HistoryDepth records per core, each written only by its own core so there's
+ * no shared index to fight over. The depth is rounded down to a power of 2.
+ * It's 0 unless set in the registry, which leaves the history off.
+ */
+#define DFT_HISTORY_DEPTH           0
+#define MIN_HISTORY_DEPTH           0
+#define MAX_HISTORY_DEPTH           65536
+
+/*
+ * 1 in TraceSampleRate commands gets the IoSubmit/IoComplete WPP tracepoints
+ * when those flags are enabled, counted per submission queue.
+ */
+#define DFT_TRACE_SAMPLE_RATE       1
+#define MIN_TRACE_SAMPLE_RATE       1
+#define MAX_TRACE_SAMPLE_RATE       65536
+
+/*
+ * Commands slower than SlowCmdThresholdUs (0 for no fixed threshold) or the
+ * p99.9 of their queue and opcode class go to a log of SLOW_CMD_LOG_ENTRIES
+ * records. The p99.9 is refreshed every SLOW_CMD_P999_INTERVAL completions.
+ */
+#define SLOW_CMD_LOG_ENTRIES        256
+#define SLOW_CMD_P999_INTERVAL      1024
+#define DFT_SLOW_CMD_THRESHOLD      0
+#define MIN_SLOW_CMD_THRESHOLD      0
+#define MAX_SLOW_CMD_THRESHOLD      60000000
+
+/*
+ * SCSI requests entering BuildIo are recorded to a trace of SrbTraceEntries
+ * records, rounded down to a power of 2, for NVME_SRB_TRACE to drain. 0, the
+ * default, leaves the recorder off.
+ */
+#define DFT_SRB_TRACE_ENTRIES       0
+#define MIN_SRB_TRACE_ENTRIES       0
+#define MAX_SRB_TRACE_ENTRIES       (1024 * 1024)
+
+/*
+ * With PiHostCheck set, the driver generates and verifies the 8 bytes of
+ * protection information of namespaces keeping it in a separate buffer
+ * instead of leaving that to PRACT, so the guard covers the host's own
+ * buffer. The PI goes in a PI_HOST_MAX window that doesn't cross a page at
+ * the end of the SRB extension. Larger commands fall back to PRACT.
+ */
+#define DFT_PI_HOST_CHECK           0
+#define MIN_PI_HOST_CHECK           0
+#define MAX_PI_HOST_CHECK           1
+#define PI_HOST_MAX                 2048
+#define PI_HOST_EXT_SIZE            (2 * PI_HOST_MAX)
+
+/*
+ * NVME_TUNABLES queue changes hold off new IO and check every
+ * RETUNE_TIMER_INTERVAL_US for the IO in flight to drain, giving up after
+ * RETUNE_QUIESCE_TIMEOUT_US.
+ */
+#define RETUNE_TIMER_INTERVAL_US    1000
+#define RETUNE_QUIESCE_TIMEOUT_US   (10 * 1000 * 1000)
+
+/*
+ * Formatting a single namespace waits, checking every FORMAT_DRAIN_INTERVAL_US,
+ * for the commands it had in flight to complete before Format NVM is sent. The
+ * format fails if they didn't within FORMAT_DRAIN_TIMEOUT_US.
+ */
+#define FORMAT_DRAIN_INTERVAL_US    1000
+#define FORMAT_DRAIN_TIMEOUT_US     (10 * 1000 * 1000)
+
 #define MASK_INT                    0xFFFFFFFF
 #define CLEAR_INT                   0
 #define MODE_SNS_MAX_BUF_SIZE       256
@@ -202,74 +395,13 @@ HW_PASSIVE_INITIALIZE_ROUTINE NVMePassiveInitialize;
 #endif
 
 #ifdef HISTORY
-#define HISTORY_DEPTH (100)
-
-typedef enum _HISTORY_TAG
-{
-    NO_ENTRY = 0, // always first in the enum
-    GETCMD_RETURN_BUSY,
-    PRE_ISSUE,
-    ISSUE_RETURN_BUSY,
-    ISSUE,
-    COMPPLETE_CMD,
-    SRB_RESET_LUN,
-    SRB_RESET_BUS,
-    SRB_RESET_DEVICE,
-    DPC_RESET,
-    DETECTED_PENDING_CMD,
-    COMPLETE_CMD_RESET,
-    HISTORY_MARKER = 255 // always last in the enum
-} HISTORY_TAG;
-
-typedef struct _HISTORY_SUBMIT
+/* One command history ring per core, see DFT_HISTORY_DEPTH */
+typedef struct _HISTORY_RING
 {
-    HISTORY_TAG tag;
-    ULONG queueId;
-    ULONG NSID;
-    NVMe_COMMAND_DWORD_0 CDW0;
-    ULONGLONG parm1;
-    ULONGLONG parm2;
-    ULONGLONG parm3;
-} HISTORY_SUBMIT;
-HISTORY_SUBMIT SubmitHistory[HISTORY_DEPTH];
-
-typedef struct _HISTORY_COMPLETE
-{
-    HISTORY_TAG tag;
-    ULONG queueId;
-    ULONG CID;
-    ULONG SQHD;
-    NVMe_COMPLETION_QUEUE_ENTRY_DWORD_3 DW3;
-    ULONGLONG parm2;
-    ULONGLONG parm3;
-} HISTORY_COMPLETE;
-HISTORY_COMPLETE CompleteHistory[HISTORY_DEPTH];
-
-typedef struct _HISTORY_EVENT
-{
-    HISTORY_TAG tag;
-    ULONG queueId;
-    ULONG CID;
-    ULONG parm0;
-    ULONGLONG parm1;
-    ULONGLONG parm2;
-    ULONGLONG parm3;
-} HISTORY_EVENT;
-HISTORY_EVENT EventHistory[HISTORY_DEPTH];
-
-ULONG SubmitIndex;
-ULONG CompleteIndex;
-ULONG EventIndex;
-
-void TracePathSubmit(HISTORY_TAG tag, ULONG queueId, ULONG NSID,
-        NVMe_COMMAND_DWORD_0 CDW0, ULONGLONG parm1, ULONGLONG parm2, ULONGLONG parm3);
-
-void TracePathComplete(HISTORY_TAG tag, ULONG queueId, ULONG CID,
-        ULONG SQHD, NVMe_COMPLETION_QUEUE_ENTRY_DWORD_3 DW3, ULONGLONG parm2, ULONGLONG parm3);
-
-void TraceEvent(HISTORY_TAG tag, ULONG queueId, ULONG CID,
-        ULONG parm0, ULONGLONG parm1, ULONGLONG parm2, ULONGLONG parm3);
-
+    /* Records ever written, the next one goes to Next & (Depth - 1) */
+    volatile LONG               Next;
+    PNVME_HISTORY_RECORD        pRecords;
+} DECLSPEC_CACHEALIGN HISTORY_RING, *PHISTORY_RING;
 #endif
 
 
@@ -293,7 +425,9 @@ enum
 enum
 {
     NVME_CTL_BAR = 0,
-    NVME_ACCESS_RANGES
+
+    /* The Controller Memory Buffer may sit in any of the other BARs */
+    NVME_ACCESS_RANGES = PCI_TYPE0_ADDRESSES
 };
 
 /* Enabled Interrupt Type */
@@ -312,7 +446,7 @@ typedef enum _NVME_QUEUE_TYPE
     NVME_QUEUE_TYPE_IO = 1
 } NVME_QUEUE_TYPE;
 
-#define NO_SQ_HEAD_CHANGE (-1)
+#define NO_SQ_HEAD_CHANGE (-1L)
 
 /* Used when decoding the LBA Range tpye after get features on LBA type */
 typedef enum _NS_VISBILITY
@@ -393,6 +527,9 @@ enum
 
 #define ALL_NAMESPACES_APPLIED 0xFFFFFFFF
 #define INVALID_LUN_EXTN 0xFFFFFFFF
+#define REIDENTIFY_CONTROLLER 0xFFFFFFFF
+/* Seconds a namespace stays paused while its Identify data is refreshed */
+#define REIDENTIFY_PAUSE_TIMEOUT 5
 
 /* Format NVM State Machine states */
 enum
@@ -430,8 +567,56 @@ typedef struct _FORMAT_NVM_INFO
      * is required to add back the formatted namespace(s)
      */
     BOOLEAN             AddNamespaceNeeded;
+
+    /*
+     * A single visible namespace stays online while it formats, only its
+     * own IO is held on its LUN extension until it's identified again.
+     */
+    BOOLEAN             HoldIo;
+
+    /*
+     * LBA format, FLBAS and DPS of the namespace before the format, held IO
+     * was built for them
+     */
+    ADMIN_IDENTIFY_FORMAT_DATA Lbaf;
+    UCHAR               Flbas;
+    UCHAR               Dps;
+
+    /* Format NVM waiting for the namespace's IO in flight, how long so far */
+#if (NTDDI_VERSION > NTDDI_WIN7)
+    PSTORAGE_REQUEST_BLOCK pDrainSrb;
+#endif
+    ULONG               DrainWaitUs;
 } FORMAT_NVM_INFO, *PFORMAT_NVM_INFO;
 
+/*******************************************************************************
+ * NVME_FW_DOWNLOAD specific structure.
+ ******************************************************************************/
+typedef struct _FW_DOWNLOAD_INFO
+{
+    /* The request being worked on, NULL when there's none */
+#if (NTDDI_VERSION > NTDDI_WIN7)
+    PSTORAGE_REQUEST_BLOCK      pSrb;
+#else
+    PSCSI_REQUEST_BLOCK         pSrb;
+#endif
+
+    /* One SRB extension per command in flight, FreeMask has the idle ones */
+    struct _nvme_srb_extension  *pSrbExt;
+    ULONG                       FreeMask;
+
+    ULONG                       Depth;
+    ULONG                       ChunkSize;
+
+    /* Next byte to send and Firmware Image Download commands in flight */
+    ULONG                       NextOffset;
+    ULONG                       InFlight;
+
+    /* Stays NVME_IOCTL_SUCCESS until a command fails */
+    ULONG                       ReturnCode;
+    ULONGLONG                   StartUs;
+} FW_DOWNLOAD_INFO, *PFW_DOWNLOAD_INFO;
+
 #define LBA_TYPE_FILESYSTEM 1
 
 /*******************************************************************************
@@ -457,6 +642,13 @@ typedef struct _START_STATE
     /* Dedicated SRB extension for command issues */
     PVOID pSrbExt;
 
+    /*
+     * CREATE_QUEUE_BURST SRB extensions for the creates of a fast resume
+     * burst, a bit set in BurstSlotsBusy for each one in flight
+     */
+    PVOID pBurstSrbExt;
+    ULONG BurstSlotsBusy;
+
     /* Used for data transfer during start state */
     PVOID pDataBuffer;
 
@@ -489,6 +681,18 @@ typedef struct _START_STATE
     /* Indicates the Interrupt Coalescing configured when TRUE */
     BOOLEAN InterruptCoalescingSet;
 
+    /* Indicates APST was programmed, or skipped, when TRUE */
+    BOOLEAN ApstSet;
+
+    /* Indicates the Host Memory Buffer was enabled, or skipped, when TRUE */
+    BOOLEAN HmbSet;
+
+    /* Indicates shadow doorbells were configured, or skipped, when TRUE */
+    BOOLEAN DbbufSet;
+
+    /* Indicates the WRR weights were set, or skipped, when TRUE */
+    BOOLEAN ArbitrationSet;
+
     /*
      * Indicates Set Featurs commands is required to configure the current
      * Namespace when it's LBA Range Type is 00b and NLB matches the size of
@@ -517,6 +721,50 @@ typedef struct _START_STATE
 
     /* Number of namespaces known to driver */
     ULONG NumKnownNamespaces;
+
+    /* Last NSID of the previous Identify list page, 0 for the first page */
+    ULONG ListNsStart;
+
+    /*
+     * Completion driven dispatch bookkeeping. StateDispatchCount is bumped
+     * every time a state handler runs; the watchdog compares it against the
+     * value it saw last time to decide if the machine is making progress.
+     */
+    ULONG StateDispatchCount;
+    ULONG WatchdogDispatchCount;
+    ULONG WatchdogStallCount;
+
+    /* Set by NVMeCallArbiter when the polled reset loop owns dispatching */
+    BOOLEAN DispatchPending;
+
+    /*
+     * NVMeGetTimeStampUs of the state machine's (re)start and how long it
+     * took, in us
+     */
+    ULONGLONG StartTimeUs;
+    ULONG StartLatencyUs;
+
+    /*
+     * Set on resume when the queue memory and resource mapping survived the
+     * power cycle. Identify and learning are skipped, only the Set Features
+     * and queue creations the controller lost are replayed. FastResumeIssued
+     * is the highest queue ID whose create has been posted in the burst.
+     */
+    BOOLEAN FastResume;
+    ULONG FastResumeIssued;
+
+    /* Time from resume request to I/O ready for the last resume, in us */
+    ULONG ResumeLatencyUs;
+
+    /*
+     * A fast resume kept the Identify data from before the power cycle. The
+     * first request after it starts re-fetching it, the controller first
+     * (ReIdentifyLun REIDENTIFY_CONTROLLER) and then each online namespace,
+     * using the state machine's SRB extension and buffer.
+     */
+    BOOLEAN ReIdentifyPending;
+    BOOLEAN ReIdentifyChanged;
+    ULONG ReIdentifyLun;
 } START_STATE, *PSTART_STATE;
 
 /*******************************************************************************
@@ -527,6 +775,9 @@ typedef struct _INIT_INFO
     /* Supported number of namespaces */
     ULONG Namespaces;
 
+    /* Namespaces tracked, attached or not, at least MAX_NAMESPACES */
+    ULONG NamespaceTable;
+
     /* Max transfer size via one cmd entry, 128 KB by default */
     ULONG MaxTxSize;
 
@@ -542,8 +793,184 @@ typedef struct _INIT_INFO
     /* Aggregation entries per interrupt vector */
     ULONG IntCoalescingEntry;
 
+    /* Max APST exit latency in us, 0 means APST disabled */
+    ULONG ApstMaxLatency;
+
+    /* Max Host Memory Buffer size in MB, 0 means HMB disabled */
+    ULONG HmbMaxSize;
+
+    /* Place IO submission queues in the Controller Memory Buffer if 1 */
+    ULONG CmbSubQueues;
+
+    /* Use Weighted Round Robin arbitration when supported if 1 */
+    ULONG WrrArbitration;
+
+    /* Default per namespace limits, IOPS and KB/s, 0 is unlimited */
+    ULONG QosIopsLimit;
+    ULONG QosBandwidthLimit;
+
+    /* Completions per queue per DPC run, 0 is unlimited */
+    ULONG CplBudget;
+
+    /* Completions between head doorbell writes, 0 is once per sweep */
+    ULONG CplDoorbellBatch;
+
+    /* Command history records per core, 0 turns the history off */
+    ULONG HistoryDepth;
+
+    /* Trace 1 in this many commands on the IO path */
+    ULONG TraceSampleRate;
+
+    /* Log commands slower than this in us besides p99.9, 0 for p99.9 only */
+    ULONG SlowCmdThresholdUs;
+
+    /* SRB trace records, 0 turns the recorder off */
+    ULONG SrbTraceEntries;
+
+    /* Driver generates and checks separately kept PI itself if 1 */
+    ULONG PiHostCheck;
+
 } INIT_INFO, *PINIT_INFO;
 
+/*******************************************************************************
+ * Autonomous Power State Transition data structure.
+ ******************************************************************************/
+typedef struct _APST_INFO
+{
+    /* TRUE once the controller accepted a table with APSTE set */
+    BOOLEAN Enabled;
+
+    /* Where APST takes each power state and after how much idle, 0 = never */
+    UCHAR TargetState[MAX_POWER_STATES];
+    ULONG IdleTimeMs[MAX_POWER_STATES];
+
+    /*
+     * The controller doesn't report where it is, so residency is estimated
+     * by playing idle time from the surprise removal timer through the
+     * table. Any request in a tick puts the controller back in state 0.
+     */
+    ULONG64 ResidencyMs[MAX_POWER_STATES];
+    ULONG64 Wakeups;
+    UCHAR CurrentState;
+    ULONG StateIdleMs;
+    LONG64 LastRequests;
+} APST_INFO, *PAPST_INFO;
+
+/*******************************************************************************
+ * Host Memory Buffer data structure.
+ ******************************************************************************/
+typedef struct _HMB_INFO
+{
+    /* Descriptor list handed to the controller and the chunks it describes */
+    PADMIN_SET_FEATURES_HMB_DESCRIPTOR pDescList;
+    PVOID *ppChunk;
+    ULONG NumChunks;
+
+    /* Bytes allocated across all chunks */
+    ULONG64 TotalSize;
+
+    /* TRUE while the controller has the buffer enabled */
+    BOOLEAN Enabled;
+
+    /* The controller has used this buffer, so MR may be set on re-enable */
+    BOOLEAN Returnable;
+
+    /* Set while a polled disable is waiting for its completion */
+    BOOLEAN DisablePending;
+} HMB_INFO, *PHMB_INFO;
+
+/*******************************************************************************
+ * Shadow Doorbell data structure, see Doorbell Buffer Config command.
+ ******************************************************************************/
+typedef struct _DBBUF_INFO
+{
+    /*
+     * One page each, laid out like the doorbell registers with the same
+     * stride. The host writes new tail/head values to the shadow page and
+     * the controller writes the EventIdx page telling when it wants an MMIO.
+     */
+    PULONG pShadowDbl;
+    PULONG pEventIdx;
+
+    /* TRUE while the controller has accepted the buffers */
+    BOOLEAN Enabled;
+} DBBUF_INFO, *PDBBUF_INFO;
+
+/*******************************************************************************
+ * Controller Memory Buffer data structure.
+ ******************************************************************************/
+typedef struct _CMB_INFO
+{
+    /* Mapped CMB and its bus address, both page aligned */
+    PUCHAR pCmbStart;
+    STOR_PHYSICAL_ADDRESS CmbStart;
+
+    /* Usable bytes and bytes handed out to queues so far */
+    ULONG64 Size;
+    ULONG64 Used;
+
+    /* CMBSZ.SQS, submission queues may live in the CMB */
+    BOOLEAN SubQSupported;
+} CMB_INFO, *PCMB_INFO;
+
+/*******************************************************************************
+ * Per namespace QoS data structure, kept apart from the LUN extensions so the
+ * limits and any deferred requests survive a re-enumeration.
+ ******************************************************************************/
+typedef struct _QOS_INFO
+{
+    /* Limits in IOPS and KB/s, 0 means unlimited */
+    ULONG IopsLimit;
+    ULONG BandwidthLimit;
+
+    /* Tokens left, in QOS_TOKEN_SCALE units; bytes may go below 0 */
+    LONGLONG IoTokens;
+    LONGLONG ByteTokens;
+    ULONGLONG LastRefillUs;
+
+    /* Reads and writes waiting for tokens, oldest first */
+    LIST_ENTRY DeferredList;
+    ULONG NumDeferred;
+
+    /* Requests that had to wait and the total time they waited */
+    ULONG64 ThrottledRequests;
+    ULONG64 ThrottledTimeUs;
+} QOS_INFO, *PQOS_INFO;
+
+/*******************************************************************************
+ * Reads and writes one completion queue completed for one namespace. Only
+ * that queue's completion path updates them, NVME_NAMESPACE_QOS sums them up.
+ ******************************************************************************/
+typedef struct _QOS_QUEUE_COUNT
+{
+    ULONG64 Requests;
+    ULONG64 Bytes;
+} QOS_QUEUE_COUNT, *PQOS_QUEUE_COUNT;
+
+/*******************************************************************************
+ * Latency histogram of one opcode class, see NVME_LAT_BUCKETS.
+ ******************************************************************************/
+typedef struct _LATENCY_HIST_CLASS
+{
+    ULONG64 Count;
+    ULONG64 TotalUs;
+    ULONG64 MaxUs;
+    ULONG64 Buckets[NVME_LAT_BUCKETS];
+
+    /* Top of the bucket holding the p99.9, 0 until it's first worked out */
+    ULONG64 P999Us;
+} LATENCY_HIST_CLASS, *PLATENCY_HIST_CLASS;
+
+/*******************************************************************************
+ * Latency histograms of one completion queue. They're only updated from that
+ * queue's completion path, which runs on one core at a time, so no atomics or
+ * extra locks are needed.
+ ******************************************************************************/
+typedef struct _LATENCY_HIST
+{
+    LATENCY_HIST_CLASS Class[NVME_LAT_CLASSES];
+} LATENCY_HIST, *PLATENCY_HIST;
+
 /*******************************************************************************
  * Command Entry/Information data structure.
  ******************************************************************************/
@@ -589,8 +1016,39 @@ typedef struct _CMD_ENTRY
      * successfully acquired
      */
     CMD_INFO CmdInfo;
+
+    /* Time stamp in us when issued, 0 if not timed */
+    ULONGLONG SubmitTimeUs;
 } CMD_ENTRY, *PCMD_ENTRY;
 
+/*
+ * Command entries are host-only bookkeeping kept in non-paged pool. The table
+ * is cache line aligned and entries are laid out one cache line (or a whole
+ * number of them) apart, so entries acquired and completed on different cores
+ * never share a line. Always index the table with GET_CMD_ENTRY.
+ */
+#define CMD_ENTRY_ALIGN          64
+#define CMD_ENTRY_STRIDE                                               \
+    ((sizeof(CMD_ENTRY) + CMD_ENTRY_ALIGN - 1) & ~(CMD_ENTRY_ALIGN - 1))
+#define GET_CMD_ENTRY(pSQI, CmdID)                                     \
+    ((PCMD_ENTRY)((PUCHAR)(pSQI)->pCmdEntry + ((CmdID) * CMD_ENTRY_STRIDE)))
+
+/*******************************************************************************
+ * One physically contiguous piece of a submission queue's PRP list pool
+ ******************************************************************************/
+typedef struct _PRP_LIST_CHUNK
+{
+    /* Buffer as returned by NVMeAllocateMem and its byte size */
+    PVOID pAlloc;
+    ULONG AllocSize;
+
+    /* First system page aligned PRP list page in the buffer */
+    PVOID pStart;
+
+    /* Number of pages of PRP lists in this chunk */
+    ULONG NumPages;
+} PRP_LIST_CHUNK, *PPRP_LIST_CHUNK;
+
 /*******************************************************************************
  * Submission Queue Information data structure.
  ******************************************************************************/
@@ -604,11 +1062,13 @@ typedef struct _SUB_QUEUE_INFO
     /* Byte size of the allocated buffer for queue entries */
     ULONG QueueAllocSize;
 
-    /* Starting virtual addr of the allocated buffer for PRP Lists */
-    PVOID pPRPListAlloc;
+    /* Submission queue carved out of the CMB, NULL when in host memory */
+    PVOID pCmbSubQ;
+    STOR_PHYSICAL_ADDRESS CmbSubQStart;
 
-    /* Byte size of the allocated buffer for PRP Lists */
-    ULONG PRPListAllocSize;
+    /* Table of PRP List chunks (pool) and number of chunks in use */
+    PPRP_LIST_CHUNK pPRPListChunk;
+    ULONG NumPRPListChunks;
 
     /* Submission Queue */
 
@@ -616,20 +1076,30 @@ typedef struct _SUB_QUEUE_INFO
     USHORT SubQueueID;
 
     /* Reported number of queue entries when creating the queue */
-    USHORT SubQEntries;
+    ULONG SubQEntries;
+
+    /*
+     * Entries of the CQ carved out of this queue's memory block, 0 for
+     * priority class SQs which don't have one.
+     */
+    ULONG CplQEntries;
 
     /* Current number of free entries in the submission queue */
-    USHORT FreeSubQEntries;
+    ULONG FreeSubQEntries;
 
     /* Current tail pointer to submission queue */
-    USHORT SubQTailPtr;
+    ULONG SubQTailPtr;
 
     /* Current head pointer to submission queue fetched from cpl queue entry */
-    USHORT SubQHeadPtr;
+    ULONG SubQHeadPtr;
 
     /* Associated doorbell register to ring for submissions */
     PULONG pSubTDBL;
 
+    /* Shadow doorbell and EventIdx entries, NULL when not in use */
+    volatile ULONG *pSubTShadow;
+    volatile ULONG *pSubTEventIdx;
+
     /* The associated completion queue ID */
     USHORT CplQueueID;
 
@@ -645,19 +1115,21 @@ typedef struct _SUB_QUEUE_INFO
     /* Indicates the submission is shared among active cores in the system */
     BOOLEAN Shared;
 
+    /* NVME_SQ_CLASS_xxx this SQ serves, and where its memory was allocated */
+    UCHAR PriorityClass;
+    USHORT NumaNode;
+
     /* Command Entries */
 
-    /* Starting virtual addr of all command entries */
+    /*
+     * Non-paged pool buffer holding the command entries and the first, cache
+     * line aligned, command entry in it
+     */
+    PVOID pCmdEntryAlloc;
     PVOID pCmdEntry;
 
     /* PRP Lists */
 
-    /* Starting virtual addr of PRP Lists (system memory page aligned) */
-    PVOID pPRPListStart;
-
-    /* Starting physical address of PRP Lists */
-    STOR_PHYSICAL_ADDRESS PRPListStart;
-
     /* Number of PRP lists one system page can accommodate */
     ULONG NumPRPListOnePage;
 
@@ -666,6 +1138,12 @@ typedef struct _SUB_QUEUE_INFO
     /* Current accumulated, issued requests */
     LONG64 Requests;
 
+    /* MMIO writes to the tail doorbell, fewer than Requests with shadows */
+    ULONG64 DoorbellWrites;
+
+    /* Commands since the last one sampled for the IO path tracepoints */
+    ULONG TraceSampleCount;
+
 #ifdef DUMB_DRIVER
     PVOID pDblBuffAlloc;
     ULONG dblBuffSz;
@@ -688,7 +1166,7 @@ typedef struct _CPL_QUEUE_INFO
     USHORT CplQueueID;
 
     /* Reported number of queue entries when creating the queue */
-    USHORT CplQEntries;
+    ULONG CplQEntries;
 
     /* Used to decide if newly completed entry, either 0 or 1 */
     USHORT CurPhaseTag:1;
@@ -697,7 +1175,7 @@ typedef struct _CPL_QUEUE_INFO
     USHORT Reserved:15;
 
     /* Current head pointer to completion queue entries */
-    USHORT CplQHeadPtr;
+    ULONG CplQHeadPtr;
 
     /* Starting virtual addr of completion Queue (system memory page aligned) */
     PVOID pCplQStart;
@@ -705,6 +1183,10 @@ typedef struct _CPL_QUEUE_INFO
     /* Associated doorbell register to ring for completions */
     PULONG pCplHDBL;
 
+    /* Shadow doorbell and EventIdx entries, NULL when not in use */
+    volatile ULONG *pCplHShadow;
+    volatile ULONG *pCplHEventIdx;
+
     /* Starting physical address of completion queue */
     STOR_PHYSICAL_ADDRESS CplQStart;
 
@@ -718,6 +1200,12 @@ typedef struct _CPL_QUEUE_INFO
 
     /* Current accumulated, completed requests */
     ULONG64 Completions;
+
+    /* MMIO writes to the head doorbell */
+    ULONG64 DoorbellWrites;
+
+    /* DPC runs that hit the completion budget and re-queued the DPC */
+    ULONG64 BudgetExhausted;
 } CPL_QUEUE_INFO, *PCPL_QUEUE_INFO;
 
 /*******************************************************************************
@@ -755,14 +1243,22 @@ typedef struct _QUEUE_INFO
     ULONG NumSubIoQAllocated; /* Number of IO submission queues allocated */
     ULONG NumCplIoQAllocated; /* Number of IO completion queues allocated */
 
+    /*
+     * Submission queues granted by the controller before trimming to cores
+     * and vectors, and the SQs allocated per CQ, NVME_SQ_CLASSES with WRR
+     * and 1 otherwise.
+     */
+    ULONG NumSubIoQGranted;
+    ULONG NumSubQClasses;
+
     /*
      * They start with the number of entries fetched from Registry.
      * When failing in the middle of allocating buffers,
      * they store the reduced number of queue entries and are used in
-     * later allocations.
+     * later allocations. Each queue keeps its own size in SubQEntries.
      */
-    USHORT NumIoQEntriesAllocated; /* Number of IO queue entries allocated */
-    USHORT NumAdQEntriesAllocated; /* Number of Admin queue entries allocated */
+    ULONG NumIoQEntriesAllocated; /* Number of IO queue entries allocated */
+    ULONG NumAdQEntriesAllocated; /* Number of Admin queue entries allocated */
 
     /*
      * Number of queues created via Create IO Submission/Completion Queue
@@ -816,6 +1312,13 @@ typedef struct _NUMA_NODE_TBL
     /* Its associated group number */
     GROUP_AFFINITY GroupAffinity;
 
+    /*
+     * When cores outnumber IO queues, the contiguous range of queues handed
+     * to this node's cores (see NVMePlanSharedQueues)
+     */
+    ULONG FirstQueue;
+    ULONG NumQueues;
+
 } NUMA_NODE_TBL, *PNUMA_NODE_TBL;
 
 /*******************************************************************************
@@ -836,6 +1339,17 @@ typedef struct _CORE_TBL
     USHORT SubQueue;
     USHORT CplQueue;
     ULONG  Learned;
+
+    /* APIC ID read on the core itself, CORE_APIC_ID_UNKNOWN if it couldn't */
+    ULONG  ApicId;
+
+    /*
+     * Queue this core folds onto under IoQueueLimit, valid while CplQueue and
+     * the limit are still the FoldFrom and FoldLimit it was picked for.
+     */
+    USHORT FoldQueue;
+    USHORT FoldFrom;
+    ULONG  FoldLimit;
 } CORE_TBL, *PCORE_TBL;
 
 /*******************************************************************************
@@ -863,6 +1377,9 @@ typedef struct _MSI_MESSAGE_TBL
 
     /* Indicates if this MSI vector has been mapped already */
     ULONG Learned;
+
+    /* System-wise core the message is delivered to, if known */
+    ULONG TargetCore;
 } MSI_MESSAGE_TBL, *PMSI_MESSAGE_TBL;
 
 /*******************************************************************************
@@ -928,6 +1445,14 @@ typedef struct _nvme_lun_extension
     BOOLEAN                      IsNamespaceReadOnly;
     LUN_SLOT_STATUS              slotStatus;
     LUN_OFFLINE_REASON           offlineReason;
+    UCHAR                        PriorityClass;
+
+    /* Next LUN Id in this NSID's hash chain, INVALID_LUN_EXTN ends it */
+    ULONG                        NsHashNext;
+
+    /* IO that came in while the namespace formats, see NVMeFormatNVMHold */
+    LIST_ENTRY                   FormatHoldList;
+    ULONG                        NumFormatHeld;
 } NVME_LUN_EXTENSION, *PNVME_LUN_EXTENSION;
 
 /* Submission Queue Entry Unit - 64 Bytes */
@@ -993,16 +1518,32 @@ typedef struct _nvme_device_extension
     /* Bus, Device, Function */
     ULONG                       SlotNumber;
 
-    /* Tables */
-    ULONG                       LunExtSize;
-
-    /* Reference by LUN Id and current number of visible NSs */
-    PNVME_LUN_EXTENSION         pLunExtensionTable[MAX_NAMESPACES];
+    /*
+     * Reference by LUN Id and current number of visible NSs. The table holds
+     * NumLunExtensions entries, allocated LUN_EXT_CHUNK at a time; the
+     * NSID hash heads hold LUN Ids, see NVMeLookupNamespace.
+     */
+    PNVME_LUN_EXTENSION         *pLunExtensionTable;
+    ULONG                       NumLunExtensions;
+    PULONG                      pNsHashHeads;
+    ULONG                       NsHashShift;
     ULONG                       visibleLuns;
 
     /* Controller Identify Data */
     ADMIN_IDENTIFY_CONTROLLER   controllerIdentifyData;
 
+    /* Autonomous power state transition table and residency */
+    APST_INFO                   ApstInfo;
+
+    /* Host Memory Buffer given to the controller */
+    HMB_INFO                    HmbInfo;
+
+    /* Shadow doorbells for emulated controllers */
+    DBBUF_INFO                  DbbufInfo;
+
+    /* Controller Memory Buffer mapping, if the controller has one */
+    CMB_INFO                    CmbInfo;
+
     /* Scsi WMI info */
     SCSI_WMILIB_CONTEXT         WmiLibContext;
     /* Wmi Custom Data */
@@ -1033,6 +1574,13 @@ typedef struct _nvme_device_extension
     STOR_DPC                    RecoveryDpc;
     BOOLEAN                     RecoveryAttemptPossible;
 
+    /* DPC used to advance the init state machine on admin completions */
+    STOR_DPC                    StateDpc;
+#if (NTDDI_VERSION > NTDDI_WIN7)
+    /* Fails the init state machine when it stops making progress */
+    PVOID                       WatchdogTimerhandle;
+#endif
+
     /* IO Completion DPC Array Info */
     PVOID                       pDpcArray;
     ULONG                       NumDpc;
@@ -1047,6 +1595,9 @@ typedef struct _nvme_device_extension
     /* Format NVM State Machine information */
     FORMAT_NVM_INFO             FormatNvmInfo;
 
+    /* Pipelined firmware download from NVME_FW_DOWNLOAD */
+    FW_DOWNLOAD_INFO            FwDownloadInfo;
+
     /* counter used to determine in learning the vector/core table */
     ULONG                       LearningCores;
 
@@ -1062,6 +1613,86 @@ typedef struct _nvme_device_extension
    /* Flag to check if StorPortInitializePerfOpts API executed succesfully.. */
    BOOLEAN                     IsMsiMappingComplete;
 
+    /*
+     * Set when the core/vector table was derived from the MSI destination
+     * fields; learning mode then only verifies it and counts mismatches.
+     */
+    BOOLEAN                     MsiMappingDerived;
+    ULONG                       MsiMappingMismatches;
+
+    /* CC.AMS programmed for Weighted Round Robin with Urgent */
+    BOOLEAN                     WrrEnabled;
+
+    /* Per namespace QoS, requests deferred on all namespaces, release timer */
+    PQOS_INFO                   pQosInfo;
+    ULONG                       QosDeferred;
+    BOOLEAN                     QosTimerArmed;
+#if (NTDDI_VERSION > NTDDI_WIN7)
+    PVOID                       QosTimerhandle;
+#endif
+
+    /* Completions per queue and namespace, MAX_NAMESPACES per queue */
+    PQOS_QUEUE_COUNT            pQosCompleted;
+    ULONG                       NumQosQueues;
+
+    /* Format NVM of a single namespace waiting for its IO to drain */
+#if (NTDDI_VERSION > NTDDI_WIN7)
+    PVOID                       FormatTimerhandle;
+#endif
+
+    /* NVME_TUNABLES waiting for IO to drain, how long it's been waiting */
+#if (NTDDI_VERSION > NTDDI_WIN7)
+    PSTORAGE_REQUEST_BLOCK      pRetuneSrb;
+    PVOID                       RetuneTimerhandle;
+#else
+    PSCSI_REQUEST_BLOCK         pRetuneSrb;
+#endif
+    ULONG                       RetuneWaitUs;
+
+    /* Cores fold onto the first IoQueueLimit IO queues, 0 for all of them */
+    ULONG                       IoQueueLimit;
+
+    /*
+     * Admin completion latency in us, kept apart from IO. AER is left out
+     * as it stays outstanding until there's an event to report.
+     */
+    ULONG64                     AdminCompletions;
+    ULONG64                     AdminLatencyTotalUs;
+    ULONG64                     AdminLatencyMaxUs;
+
+    /* Latency histograms indexed by completion queue ID */
+    PLATENCY_HIST               pLatencyHist;
+    ULONG                       NumLatencyHist;
+
+    /* Slow command log, SLOW_CMD_LOG_ENTRIES records */
+    PNVME_SLOW_CMD_RECORD       pSlowCmdLog;
+    volatile LONG               SlowCmdNext;
+
+    /* SRB trace, records written and drained so far */
+    PNVME_SRB_TRACE_RECORD      pSrbTrace;
+    ULONG                       SrbTraceEntries;
+    volatile LONG               SrbTraceNext;
+    ULONG                       SrbTraceRead;
+
+    /* Performance counter ticks and calls per NVME_SRB_STAGE_XXX */
+    ULONGLONG                   SrbStageFrequency;
+    volatile LONG64             SrbStageTicks[NVME_SRB_STAGES];
+    volatile LONG64             SrbStageCalls[NVME_SRB_STAGES];
+
+    /* Host PI check, blocks and bytes checked, time spent and mismatches */
+    volatile LONG64             PiHostBlocks;
+    volatile LONG64             PiHostBytes;
+    volatile LONG64             PiHostTimeUs;
+    volatile LONG64             PiHostErrors;
+
+#ifdef HISTORY
+    /* Command history rings, one per core, HistoryDepth records each */
+    PHISTORY_RING               pHistoryRings;
+    PNVME_HISTORY_RECORD        pHistoryRecords;
+    ULONG                       NumHistoryRings;
+    ULONG                       HistoryDepth;
+#endif
+
 #if DBG
     /* part of debug code to sanity check learning */
     BOOLEAN                     LearningComplete;
@@ -1195,6 +1826,22 @@ typedef struct _nvme_srb_extension
     PROCESSOR_NUMBER             procNum;
 #endif
 
+    /* Link and start time while deferred by namespace QoS */
+    LIST_ENTRY                   QosListEntry;
+    ULONGLONG                    QosDeferUs;
+
+    /* Sampled for the IO path tracepoints, and latency once completed */
+    BOOLEAN                      TraceSampled;
+    ULONGLONG                    LatencyUs;
+
+    /* Core the command was submitted on */
+    USHORT                       SubmitCore;
+
+    /* Host checked PI window at the end of the extension, block size, type */
+    PUCHAR                       pPiBuffer;
+    ULONG                        PiBlockSize;
+    UCHAR                        PiType;
+
 #ifdef DUMB_DRIVER
     PVOID pDblVir;     // this cmd's dbl buffer virtual address
     PVOID pSrbDataVir; // this cmd's SRB databuffer virtual address
@@ -1243,6 +1890,11 @@ BOOLEAN NVMeEnumNumaCores(
     __in PNVME_DEVICE_EXTENSION pAE
 );
 
+ULONG NVMeGetCoreApicId(
+    __in USHORT Group,
+    __in USHORT Number
+);
+
 BOOLEAN NVMeStrCompare(
     __in PCSTR pTargetString,
     __in PCSTR pArgumentString
@@ -1273,6 +1925,14 @@ VOID NVMeMsiMapCores(
     __in PNVME_DEVICE_EXTENSION pAE
 );
 
+BOOLEAN NVMeDeriveMsiMapping(
+    __in PNVME_DEVICE_EXTENSION pAE
+);
+
+VOID NVMeBindMsiToQueues(
+    __in PNVME_DEVICE_EXTENSION pAE
+);
+
 VOID NVMeCompleteResMapTbl(
     __in PNVME_DEVICE_EXTENSION pAE
 );
@@ -1284,6 +1944,11 @@ ULONG NVMeMapCore2Queue(
     __inout USHORT* pCplQueue
 );
 
+VOID NVMeFoldCoreQueue(
+    __in PNVME_DEVICE_EXTENSION pAE,
+    __in PCORE_TBL pCT
+);
+
 
 VOID
 IoCompletionRoutine(
@@ -1318,6 +1983,10 @@ BOOLEAN NVMeResetAdapter(
     __in PNVME_DEVICE_EXTENSION pAE
 );
 
+BOOLEAN NVMeQuiesceController(
+    __in PNVME_DEVICE_EXTENSION pAE
+);
+
 BOOLEAN NVMeEnableAdapter(
     __in PNVME_DEVICE_EXTENSION pAE
 );
@@ -1337,15 +2006,56 @@ BOOLEAN NVMeSetIntCoalescing(
     __in PNVME_DEVICE_EXTENSION pAE
 );
 
-BOOLEAN NVMeAllocQueueFromAdapter(
+BOOLEAN NVMeSetApst(
     __in PNVME_DEVICE_EXTENSION pAE
 );
 
-BOOLEAN NVMeAccessLbaRangeEntry(
+BOOLEAN NVMeSetHostMemBuffer(
     __in PNVME_DEVICE_EXTENSION pAE
 );
 
-BOOLEAN NVMeGetIdentifyStructures(
+BOOLEAN NVMeAllocHostMemBuffer(
+    __in PNVME_DEVICE_EXTENSION pAE
+);
+
+VOID NVMeFreeHostMemBuffer(
+    __in PNVME_DEVICE_EXTENSION pAE
+);
+
+BOOLEAN NVMeDisableHostMemBuffer(
+    __in PNVME_DEVICE_EXTENSION pAE
+);
+
+BOOLEAN NVMeHmbDisableCallback(
+    __in PVOID pAE,
+    __in PVOID pSrbExtension
+);
+
+BOOLEAN NVMeSetDoorbellBuffer(
+    __in PNVME_DEVICE_EXTENSION pAE
+);
+
+BOOLEAN NVMeSetArbitration(
+    __in PNVME_DEVICE_EXTENSION pAE
+);
+
+BOOLEAN NVMeAllocPriorityQueues(
+    __in PNVME_DEVICE_EXTENSION pAE
+);
+
+VOID NVMeFreeDoorbellBuffer(
+    __in PNVME_DEVICE_EXTENSION pAE
+);
+
+BOOLEAN NVMeAllocQueueFromAdapter(
+    __in PNVME_DEVICE_EXTENSION pAE
+);
+
+BOOLEAN NVMeAccessLbaRangeEntry(
+    __in PNVME_DEVICE_EXTENSION pAE
+);
+
+BOOLEAN NVMeGetIdentifyStructures(
     PNVME_DEVICE_EXTENSION pAE,
     ULONG NamespaceID,
     USHORT CNS
@@ -1353,12 +2063,14 @@ BOOLEAN NVMeGetIdentifyStructures(
 
 BOOLEAN NVMeCreateCplQueue(
     __in PNVME_DEVICE_EXTENSION pAE,
-    __in USHORT QueueID
+    __in USHORT QueueID,
+    __in_opt PNVME_SRB_EXTENSION pSrbExt
 );
 
 BOOLEAN NVMeCreateSubQueue(
     __in PNVME_DEVICE_EXTENSION pAE,
-    __in USHORT QueueID
+    __in USHORT QueueID,
+    __in_opt PNVME_SRB_EXTENSION pSrbExt
 );
 
 BOOLEAN NVMeDeleteCplQueues(
@@ -1377,10 +2089,29 @@ BOOLEAN NVMeAllocIoQueues(
     __in PNVME_DEVICE_EXTENSION pAE
 );
 
+VOID NVMePlanSharedQueues(
+    __in PNVME_DEVICE_EXTENSION pAE,
+    __in ULONG NumQueues
+);
+
 VOID NVMeFreeBuffers (
     PNVME_DEVICE_EXTENSION pAE
 );
 
+BOOLEAN NVMeAllocLunTable(
+    __in PNVME_DEVICE_EXTENSION pAE,
+    __in ULONG NumEntries
+);
+
+VOID NVMeResetLunTable(
+    __in PNVME_DEVICE_EXTENSION pAE
+);
+
+VOID NVMeFreeQueueMem(
+    __in PNVME_DEVICE_EXTENSION pAE,
+    __in PSUB_QUEUE_INFO pSQI
+);
+
 VOID NVMeFreeNonContiguousBuffers (
     PNVME_DEVICE_EXTENSION pAE
 );
@@ -1403,12 +2134,221 @@ ULONG NVMeIssueCmd(
     __in PVOID pTempSubEntry
 );
 
+ULONG NVMeMapSrbPriority(
+    __in PNVME_DEVICE_EXTENSION pAE,
+    __in PNVME_SRB_EXTENSION pSrbExt
+);
+
+VOID NVMeRingSubDoorbell(
+    __in PNVME_DEVICE_EXTENSION pAE,
+    __in PSUB_QUEUE_INFO pSQI
+);
+
+BOOLEAN NVMeShadowDoorbellNeedsMmio(
+    __in volatile ULONG *pShadow,
+    __in volatile ULONG *pEventIdx,
+    __in ULONG NewValue
+);
+
+VOID NVMeRingCplDoorbell(
+    __in PNVME_DEVICE_EXTENSION pAE,
+    __in PCPL_QUEUE_INFO pCQI
+);
+
+ULONGLONG NVMeGetTimeStampUs(
+    __in PNVME_DEVICE_EXTENSION pAE
+);
+
+#ifdef HISTORY
+BOOLEAN NVMeHistoryInit(
+    __in PNVME_DEVICE_EXTENSION pAE
+);
+
+VOID TracePathSubmit(
+    __in PNVME_DEVICE_EXTENSION pAE,
+    __in HISTORY_TAG tag,
+    __in ULONG queueId,
+    __in ULONG NSID,
+    __in NVMe_COMMAND_DWORD_0 CDW0,
+    __in ULONG parm1,
+    __in ULONGLONG parm2,
+    __in ULONGLONG parm3
+);
+
+VOID TracePathComplete(
+    __in PNVME_DEVICE_EXTENSION pAE,
+    __in HISTORY_TAG tag,
+    __in ULONG queueId,
+    __in ULONG CID,
+    __in ULONG SQHD,
+    __in NVMe_COMPLETION_QUEUE_ENTRY_DWORD_3 DW3,
+    __in ULONGLONG parm2,
+    __in ULONGLONG parm3
+);
+
+VOID TraceEvent(
+    __in PNVME_DEVICE_EXTENSION pAE,
+    __in HISTORY_TAG tag,
+    __in ULONG queueId,
+    __in ULONG CID,
+    __in ULONG parm0,
+    __in ULONG parm1,
+    __in ULONGLONG parm2,
+    __in ULONGLONG parm3
+);
+#endif
+
+BOOLEAN NVMeLatencyInit(
+    __in PNVME_DEVICE_EXTENSION pAE
+);
+
+VOID NVMeLatencyRecord(
+    __in PNVME_DEVICE_EXTENSION pAE,
+    __in USHORT CplQueueID,
+    __in PNVME_SRB_EXTENSION pSrbExt,
+    __in ULONGLONG LatencyUs
+);
+
+BOOLEAN NVMeLatencyGetHistogram(
+    __in PNVME_DEVICE_EXTENSION pAE,
+    __in ULONG QueueId,
+    __in ULONG OpClass,
+    __out PLATENCY_HIST_CLASS pHistOut
+);
+
+VOID NVMeLatencyReset(
+    __in PNVME_DEVICE_EXTENSION pAE
+);
+
+ULONG NVMeLatencyClass(
+    __in USHORT CplQueueID,
+    __in PNVME_SRB_EXTENSION pSrbExt
+);
+
+BOOLEAN NVMeSlowCmdInit(
+    __in PNVME_DEVICE_EXTENSION pAE
+);
+
+VOID NVMeSlowCmdRecord(
+    __in PNVME_DEVICE_EXTENSION pAE,
+    __in PNVME_SRB_EXTENSION pSrbExt,
+    __in PNVMe_COMPLETION_QUEUE_ENTRY pCplEntry
+);
+
+BOOLEAN NVMeSrbTraceInit(
+    __in PNVME_DEVICE_EXTENSION pAE
+);
+
+VOID NVMeSrbTraceRecord(
+    __in PNVME_DEVICE_EXTENSION pAE,
+#if (NTDDI_VERSION > NTDDI_WIN7)
+    __in PSTORAGE_REQUEST_BLOCK pSrb
+#else
+    __in PSCSI_REQUEST_BLOCK pSrb
+#endif
+);
+
+ULONGLONG NVMeSrbStageStart(
+    __in PNVME_DEVICE_EXTENSION pAE
+);
+
+VOID NVMeSrbStageEnd(
+    __in PNVME_DEVICE_EXTENSION pAE,
+    __in ULONG Stage,
+    __in ULONGLONG StartTicks
+);
+
+BOOLEAN NVMeQosInit(
+    __in PNVME_DEVICE_EXTENSION pAE
+);
+
+VOID NVMeQosSetLimits(
+    __in PNVME_DEVICE_EXTENSION pAE,
+    __in PQOS_INFO pQos,
+    __in ULONG IopsLimit,
+    __in ULONG BandwidthLimit
+);
+
+BOOLEAN NVMeQosAdmit(
+    __in PQOS_INFO pQos,
+    __in ULONGLONG NowUs,
+    __in ULONG Length
+);
+
+BOOLEAN NVMeQosDefer(
+    __in PNVME_DEVICE_EXTENSION pAE,
+    __in PNVME_SRB_EXTENSION pSrbExt
+);
+
+VOID NVMeQosRelease(
+    __in PNVME_DEVICE_EXTENSION pAE
+);
+
+VOID NVMeQosArmTimer(
+    __in PNVME_DEVICE_EXTENSION pAE
+);
+
+VOID NVMeQosCountCompletion(
+    __in PNVME_DEVICE_EXTENSION pAE,
+    __in USHORT CplQueueID,
+    __in PNVME_SRB_EXTENSION pSrbExt
+);
+
+VOID NVMeQosFlushLun(
+    __in PNVME_DEVICE_EXTENSION pAE,
+    __in ULONG Lun,
+    __in UCHAR SrbStatus
+);
+
+BOOLEAN NVMeQosFlush(
+    __in PNVME_DEVICE_EXTENSION pAE,
+    __in BOOLEAN completeCmd,
+    __in UCHAR SrbStatus
+);
+
+BOOLEAN NVMeFwDownloadFlush(
+    __in PNVME_DEVICE_EXTENSION pAE,
+    __in BOOLEAN completeCmd,
+    __in UCHAR SrbStatus
+);
+
+BOOLEAN NVMeFormatNVMFlush(
+    __in PNVME_DEVICE_EXTENSION pAE,
+    __in BOOLEAN completeCmd,
+    __in UCHAR SrbStatus
+);
+
+#if (NTDDI_VERSION > NTDDI_WIN7)
+    HW_TIMER_EX NVMeQosTimer;
+    HW_TIMER_EX NVMeRetuneTimer;
+
+VOID NVMeRetuneStop(
+    __in PNVME_DEVICE_EXTENSION pAE
+);
+#endif
+
+VOID NVMeStopTimers(
+    __in PNVME_DEVICE_EXTENSION pAE
+);
+
 ULONG NVMeGetCplEntry(
     __in PNVME_DEVICE_EXTENSION pAE,
     __in PCPL_QUEUE_INFO pCQI,
     __inout PVOID pCplEntry
 );
 
+ULONG NVMeHarvestCplEntries(
+    __in PNVME_DEVICE_EXTENSION pAE,
+    __in PCPL_QUEUE_INFO pCQI,
+    __out PNVMe_COMPLETION_QUEUE_ENTRY *ppCplBatch,
+    __in ULONG MaxEntries
+);
+
+VOID NVMePrefetchCplContext(
+    __in PNVME_DEVICE_EXTENSION pAE,
+    __in PNVMe_COMPLETION_QUEUE_ENTRY pCplEntry
+);
+
 BOOLEAN NVMeReadRegistry(
     PNVME_DEVICE_EXTENSION pAE,
     UCHAR* pLabel,
@@ -1457,6 +2397,17 @@ VOID NVMeRunning(
     PNVME_DEVICE_EXTENSION pAE
 );
 
+VOID NVMeRunningDpcRoutine(
+    IN PSTOR_DPC  pDpc,
+    IN PVOID  pHwDeviceExtension,
+    IN PVOID  pSystemArgument1,
+    IN PVOID  pSystemArgument2
+);
+
+#if (NTDDI_VERSION > NTDDI_WIN7)
+    HW_TIMER_EX NVMeRunningWatchdog;
+#endif
+
 VOID NVMeRunningWaitOnRDY(
     PNVME_DEVICE_EXTENSION pAE
 );
@@ -1494,6 +2445,13 @@ VOID NVMeRunningWaitOnIoSQ(
     PNVME_DEVICE_EXTENSION pAE
 );
 
+BOOLEAN NVMeRunningCreateQueueBurst(
+    PNVME_DEVICE_EXTENSION pAE,
+    ULONG NumCreated,
+    ULONG NumAllocated,
+    BOOLEAN CplQueue
+);
+
 VOID NVMeRunningWaitOnLearnMapping(
     PNVME_DEVICE_EXTENSION pAE
 );
@@ -1526,6 +2484,17 @@ ULONG NVMeFindAdapter(
     __out PUCHAR Again
 );
 
+VOID NVMeMapCmb(
+    __in PNVME_DEVICE_EXTENSION pAE,
+    __in PPORT_CONFIGURATION_INFORMATION pPCI
+);
+
+BOOLEAN NVMeAllocCmbSubQueue(
+    __in PNVME_DEVICE_EXTENSION pAE,
+    __in PSUB_QUEUE_INFO pSQI,
+    __in ULONG QEntries
+);
+
 ULONG NVMeAllocQueues(
     __in PNVME_DEVICE_EXTENSION pAE,
     __in USHORT QueueID,
@@ -1533,6 +2502,13 @@ ULONG NVMeAllocQueues(
     __in USHORT NumaNode
 );
 
+ULONG NVMeAllocPRPLists(
+    __in PNVME_DEVICE_EXTENSION pAE,
+    __in PSUB_QUEUE_INFO pSQI,
+    __in ULONG NumPages,
+    __in USHORT NumaNode
+);
+
 BOOLEAN NVMePassiveInitialize(
     PVOID Context
 );
@@ -1616,6 +2592,89 @@ VOID NVMeIoctlHotAddNamespace(
     PNVME_SRB_EXTENSION pSrbExt
 );
 
+VOID NVMeIoctlNamespaceQos(
+    PNVME_DEVICE_EXTENSION pDevExt,
+#if (NTDDI_VERSION > NTDDI_WIN7)
+    PSTORAGE_REQUEST_BLOCK pSrb
+#else
+    PSCSI_REQUEST_BLOCK pSrb
+#endif
+);
+
+VOID NVMeIoctlProtectionInfo(
+    PNVME_DEVICE_EXTENSION pDevExt,
+#if (NTDDI_VERSION > NTDDI_WIN7)
+    PSTORAGE_REQUEST_BLOCK pSrb
+#else
+    PSCSI_REQUEST_BLOCK pSrb
+#endif
+);
+
+VOID NVMeIoctlLatencyHistogram(
+    PNVME_DEVICE_EXTENSION pDevExt,
+#if (NTDDI_VERSION > NTDDI_WIN7)
+    PSTORAGE_REQUEST_BLOCK pSrb
+#else
+    PSCSI_REQUEST_BLOCK pSrb
+#endif
+);
+
+VOID NVMeIoctlSrbTrace(
+    PNVME_DEVICE_EXTENSION pDevExt,
+#if (NTDDI_VERSION > NTDDI_WIN7)
+    PSTORAGE_REQUEST_BLOCK pSrb
+#else
+    PSCSI_REQUEST_BLOCK pSrb
+#endif
+);
+
+VOID NVMeIoctlSlowCmdLog(
+    PNVME_DEVICE_EXTENSION pDevExt,
+#if (NTDDI_VERSION > NTDDI_WIN7)
+    PSTORAGE_REQUEST_BLOCK pSrb
+#else
+    PSCSI_REQUEST_BLOCK pSrb
+#endif
+);
+
+BOOLEAN NVMeIoctlTunables(
+    PNVME_DEVICE_EXTENSION pDevExt,
+#if (NTDDI_VERSION > NTDDI_WIN7)
+    PSTORAGE_REQUEST_BLOCK pSrb
+#else
+    PSCSI_REQUEST_BLOCK pSrb
+#endif
+);
+
+VOID NVMeTunablesGet(
+    PNVME_DEVICE_EXTENSION pDevExt,
+    PNVME_TUNABLES_IOCTL pTunables
+);
+
+BOOLEAN NVMeIoctlFwDownloadImage(
+    PNVME_DEVICE_EXTENSION pDevExt,
+#if (NTDDI_VERSION > NTDDI_WIN7)
+    PSTORAGE_REQUEST_BLOCK pSrb
+#else
+    PSCSI_REQUEST_BLOCK pSrb
+#endif
+);
+
+VOID NVMeFwDownloadIssue(
+    PNVME_DEVICE_EXTENSION pDevExt
+);
+
+#ifdef HISTORY
+VOID NVMeIoctlHistorySnapshot(
+    PNVME_DEVICE_EXTENSION pDevExt,
+#if (NTDDI_VERSION > NTDDI_WIN7)
+    PSTORAGE_REQUEST_BLOCK pSrb
+#else
+    PSCSI_REQUEST_BLOCK pSrb
+#endif
+);
+#endif
+
 VOID NVMeFormatNVMHotRemoveNamespace(
     PNVME_SRB_EXTENSION pSrbExt
 );
@@ -1624,6 +2683,24 @@ VOID NVMeFormatNVMHotAddNamespace(
     PNVME_SRB_EXTENSION pSrbExt
 );
 
+BOOLEAN NVMeFormatNVMHold(
+    PNVME_DEVICE_EXTENSION pDevExt,
+    PNVME_SRB_EXTENSION pSrbExt
+);
+
+VOID NVMeFormatNVMRelease(
+    PNVME_DEVICE_EXTENSION pDevExt,
+    BOOLEAN AcquireLock
+);
+
+#if (NTDDI_VERSION > NTDDI_WIN7)
+HW_TIMER_EX NVMeFormatDrainTimer;
+
+VOID NVMeFormatDrainStop(
+    PNVME_DEVICE_EXTENSION pAE
+);
+#endif
+
 BOOLEAN NVMeIoctlFormatNVMCallback(
     PVOID pNVMeDevExt,
     PVOID pSrbExtension
@@ -1707,6 +2784,16 @@ BOOLEAN NVMeHandleSmartThresholds(
     PNVME_SRB_EXTENSION pSrbExtension
 );
 
+BOOLEAN NVMeHandleTunables(
+    PVOID pNVMeDevExt,
+    PNVME_SRB_EXTENSION pSrbExtension
+);
+
+BOOLEAN NVMeHandleFwDownload(
+    PVOID pNVMeDevExt,
+    PNVME_SRB_EXTENSION pSrbExtension
+);
+
 BOOLEAN NVMeCompletionNsAttachment(
     PVOID pNVMeDevExt,
     PNVME_SRB_EXTENSION pSrbExt
@@ -1742,6 +2829,17 @@ ULONG NVMeGetFreeLunSlot(
     __in PNVME_DEVICE_EXTENSION pDevExt
 );
 
+ULONG NVMeLookupNamespace(
+    __in PNVME_DEVICE_EXTENSION pDevExt,
+    __in ULONG NSID
+);
+
+VOID NVMeSetNamespaceId(
+    __in PNVME_DEVICE_EXTENSION pDevExt,
+    __in ULONG lunId,
+    __in ULONG NSID
+);
+
 VOID NVMeLogError(
     __in PNVME_DEVICE_EXTENSION pAE,
     __in ULONG ErrorNum
@@ -55,12 +55,14 @@
 SCSIWMIGUIDREGINFO WmiGuidList[] =                    // GUIDs supported.                       
 {
     {&NVMe_QueryDevInfo_GUID, 1, 0},
-    {&NVMe_Method_GUID, 1, 0}
+    {&NVMe_Method_GUID, 1, 0},
+    {&NVMe_LatencyHistogram_GUID, 1, 0}
 };
 
 enum {
     NVMe_QueryDevInfo_Idx = 0,
-    NVMe_Method_Idx = 1
+    NVMe_Method_Idx = 1,
+    NVMe_LatencyHistogram_Idx = 2
 };
 
 #define WmiGuidCount (sizeof(WmiGuidList) / sizeof(SCSIWMIGUIDREGINFO))
@@ -247,6 +249,7 @@ _Out_writes_bytes_(BufferAvail) PUCHAR pBuffer
     break;
 
     case NVMe_Method_Idx:
+    case NVMe_LatencyHistogram_Idx:
         //
         // Even though this class only has methods, we need to
         // respond to any queries for it since WMI expects that
@@ -339,7 +342,8 @@ _Inout_updates_bytes_to_(InBufferSize, OutBufferSize) PUCHAR pBuffer
             pGetNsInfoIn = (PGetNameSpaceInfo_IN)pBuffer;
             lunId = pGetNsInfoIn->lunId;
 
-            if (lunId >= pDevExtension->controllerIdentifyData.NN) {
+            if ((lunId >= pDevExtension->controllerIdentifyData.NN) ||
+                (lunId >= pDevExtension->NumLunExtensions)) {
                 status = SRB_STATUS_INVALID_REQUEST;
                 break;
             }
@@ -358,6 +362,192 @@ _Inout_updates_bytes_to_(InBufferSize, OutBufferSize) PUCHAR pBuffer
         }
             break;
 
+        case GetPowerStateInfo: {
+            PGetPowerStateInfo_IN  pGetPsInfoIn;
+            PGetPowerStateInfo_OUT pGetPsInfoOut;
+            PADMIN_IDENTIFY_POWER_STATE_DESCRIPTOR pPSD;
+            PAPST_INFO pApst = &pDevExtension->ApstInfo;
+            UINT32 powerState = 0;
+
+            if (InBufferSize < GetPowerStateInfo_IN_SIZE) {
+                status = SRB_STATUS_INVALID_REQUEST;
+                break;
+            }
+
+            pGetPsInfoIn = (PGetPowerStateInfo_IN)pBuffer;
+            powerState = pGetPsInfoIn->powerState;
+
+            /* NPSS is 0's based */
+            if (powerState > pDevExtension->controllerIdentifyData.NPSS ||
+                powerState >= MAX_POWER_STATES) {
+                status = SRB_STATUS_INVALID_REQUEST;
+                break;
+            }
+
+            sizeNeeded = GetPowerStateInfo_OUT_SIZE;
+
+            if (OutBufferSize < sizeNeeded) {
+                status = SRB_STATUS_DATA_OVERRUN;
+                break;
+            }
+            pGetPsInfoOut = (PGetPowerStateInfo_OUT)pBuffer;
+            pPSD = &pDevExtension->controllerIdentifyData.PSDx[powerState];
+
+            pGetPsInfoOut->apstEnabled = pApst->Enabled;
+            pGetPsInfoOut->entryLatencyUs = pPSD->ENLAT;
+            pGetPsInfoOut->exitLatencyUs = pPSD->EXLAT;
+            pGetPsInfoOut->idleTransitionState = pApst->TargetState[powerState];
+            pGetPsInfoOut->idleTimeMs = pApst->IdleTimeMs[powerState];
+            pGetPsInfoOut->residencyMs = pApst->ResidencyMs[powerState];
+            pGetPsInfoOut->wakeups = pApst->Wakeups;
+            status = SRB_STATUS_SUCCESS;
+        }
+            break;
+
+        case GetHostMemBufferInfo: {
+            PGetHostMemBufferInfo_OUT pGetHmbInfoOut;
+            PHMB_INFO pHmb = &pDevExtension->HmbInfo;
+
+            sizeNeeded = GetHostMemBufferInfo_OUT_SIZE;
+
+            if (OutBufferSize < sizeNeeded) {
+                status = SRB_STATUS_DATA_OVERRUN;
+                break;
+            }
+            pGetHmbInfoOut = (PGetHostMemBufferInfo_OUT)pBuffer;
+
+            pGetHmbInfoOut->enabled = pHmb->Enabled;
+            pGetHmbInfoOut->allocatedSize = pHmb->TotalSize;
+            pGetHmbInfoOut->preferredSize = (UINT64)
+                pDevExtension->controllerIdentifyData.HMPRE * HMB_UNIT_SIZE;
+            pGetHmbInfoOut->minimumSize = (UINT64)
+                pDevExtension->controllerIdentifyData.HMMIN * HMB_UNIT_SIZE;
+            pGetHmbInfoOut->descriptorCount = pHmb->NumChunks;
+            status = SRB_STATUS_SUCCESS;
+        }
+            break;
+
+        case SetNameSpacePriority: {
+            PSetNameSpacePriority_IN pSetNsPrioIn;
+            UINT32 lunId = 0;
+
+            if (InBufferSize < SetNameSpacePriority_IN_SIZE) {
+                status = SRB_STATUS_INVALID_REQUEST;
+                break;
+            }
+
+            pSetNsPrioIn = (PSetNameSpacePriority_IN)pBuffer;
+            lunId = pSetNsPrioIn->lunId;
+
+            /* Classes follow NVME_SQ_CLASS_XXX, they only matter with WRR */
+            if ((lunId >= pDevExtension->controllerIdentifyData.NN) ||
+                (lunId >= MAX_NAMESPACES) ||
+                (lunId >= pDevExtension->NumLunExtensions) ||
+                (pSetNsPrioIn->priorityClass >= NVME_SQ_CLASSES)) {
+                status = SRB_STATUS_INVALID_REQUEST;
+                break;
+            }
+
+            pDevExtension->pLunExtensionTable[lunId]->PriorityClass =
+                (UCHAR)pSetNsPrioIn->priorityClass;
+            status = SRB_STATUS_SUCCESS;
+        }
+            break;
+
+        case GetCplQueueStats: {
+            PGetCplQueueStats_IN  pGetCqStatsIn;
+            PGetCplQueueStats_OUT pGetCqStatsOut;
+            PCPL_QUEUE_INFO pCQI = NULL;
+            UINT32 queueId = 0;
+
+            if (InBufferSize < GetCplQueueStats_IN_SIZE) {
+                status = SRB_STATUS_INVALID_REQUEST;
+                break;
+            }
+
+            pGetCqStatsIn = (PGetCplQueueStats_IN)pBuffer;
+            queueId = pGetCqStatsIn->queueId;
+
+            /* Queue 0 is the admin queue */
+            if ((pDevExtension->QueueInfo.pCplQueueInfo == NULL) ||
+                (queueId > pDevExtension->QueueInfo.NumCplIoQCreated)) {
+                status = SRB_STATUS_INVALID_REQUEST;
+                break;
+            }
+
+            sizeNeeded = GetCplQueueStats_OUT_SIZE;
+
+            if (OutBufferSize < sizeNeeded) {
+                status = SRB_STATUS_DATA_OVERRUN;
+                break;
+            }
+            pGetCqStatsOut = (PGetCplQueueStats_OUT)pBuffer;
+            pCQI = pDevExtension->QueueInfo.pCplQueueInfo + queueId;
+
+            pGetCqStatsOut->cplBudget = pDevExtension->InitInfo.CplBudget;
+            pGetCqStatsOut->completions = pCQI->Completions;
+            pGetCqStatsOut->doorbellWrites = pCQI->DoorbellWrites;
+            pGetCqStatsOut->budgetExhausted = pCQI->BudgetExhausted;
+            status = SRB_STATUS_SUCCESS;
+        }
+            break;
+
+        default:
+            status = SRB_STATUS_INVALID_REQUEST;
+            break;
+        }
+    }
+        break;
+
+    case NVMe_LatencyHistogram_Idx:
+    {
+        switch (MethodId) {
+        case GetLatencyHistogram: {
+            PGetLatencyHistogram_IN  pGetHistIn;
+            PGetLatencyHistogram_OUT pGetHistOut;
+            LATENCY_HIST_CLASS Hist;
+
+            if (InBufferSize < GetLatencyHistogram_IN_SIZE) {
+                status = SRB_STATUS_INVALID_REQUEST;
+                break;
+            }
+
+            pGetHistIn = (PGetLatencyHistogram_IN)pBuffer;
+
+            if (NVMeLatencyGetHistogram(pDevExtension,
+                                        pGetHistIn->queueId,
+                                        pGetHistIn->opClass,
+                                        &Hist) == FALSE) {
+                status = SRB_STATUS_INVALID_REQUEST;
+                break;
+            }
+
+            sizeNeeded = GetLatencyHistogram_OUT_SIZE;
+
+            if (OutBufferSize < sizeNeeded) {
+                status = SRB_STATUS_DATA_OVERRUN;
+                break;
+            }
+            pGetHistOut = (PGetLatencyHistogram_OUT)pBuffer;
+
+            pGetHistOut->count = Hist.Count;
+            pGetHistOut->totalUs = Hist.TotalUs;
+            pGetHistOut->maxUs = Hist.MaxUs;
+            StorPortCopyMemory(pGetHistOut->buckets,
+                               Hist.Buckets,
+                               sizeof(Hist.Buckets));
+            status = SRB_STATUS_SUCCESS;
+        }
+            break;
+
+        case ResetLatencyHistograms:
+            if (pDevExtension->pLatencyHist != NULL)
+                memset(pDevExtension->pLatencyHist,
+                       0,
+                       sizeof(LATENCY_HIST) * pDevExtension->NumLatencyHist);
+            status = SRB_STATUS_SUCCESS;
+            break;
+
         default:
             status = SRB_STATUS_INVALID_REQUEST;
             break;
@@ -51,7 +51,9 @@
 // NVMe control GUID = {0BD0EE0C-BB49-45F4-A798-80D221BE3DE1}
 #define WPP_CONTROL_GUIDS \
     WPP_DEFINE_CONTROL_GUID(NVMe, (0F5937E9, FEAB, 40FF, BBAE, 9C2202C54B1F), \
-    WPP_DEFINE_BIT(Default) )
+    WPP_DEFINE_BIT(Default) \
+    WPP_DEFINE_BIT(IoSubmit) \
+    WPP_DEFINE_BIT(IoComplete) )
 
 // This tracing setup currently uses the following levels (defined in evntrace.h):
 //      TRACE_LEVEL_NONE        0   // Tracing is not on
@@ -61,14 +63,32 @@
 //      TRACE_LEVEL_INFORMATION 4   // Includes non-error cases(for example, Entry-Exit)
 //      TRACE_LEVEL_VERBOSE     5   // Detailed traces from intermediate steps
 //
-// Note: The tracing setup does NOT currently use any flags.  To define level-specific
-//      logging macros, we define custom WPP_LEVEL_ENABLED and WPP_LEVEL_LOGGER macros
+// Note: The level-specific logging macros below all log under the Default flag.  To
+//      define them, we define custom WPP_LEVEL_ENABLED and WPP_LEVEL_LOGGER macros
 //      below.  See the 'sources' file as well for declarations of the tracing macros.
 //      We are using custom tracing macros explicitly here, rather than the auto-generated
-//      ones via WPP_USE_TRACE_LEVELS, so that we can add component flags in the future.
+//      ones via WPP_USE_TRACE_LEVELS, so that component flags can be added.
 #define WPP_LEVEL_LOGGER(Level) (WPP_CONTROL(WPP_BIT_ ## Default).Logger),
 #define WPP_LEVEL_ENABLED(lvl) (WPP_CONTROL(WPP_BIT_ ## Default).Level >= (lvl))
 
+// The IO path tracepoints each have their own component flag, so submissions and
+// completions can be enabled separately, and log at TRACE_LEVEL_INFORMATION.  Only
+// 1 in TraceSampleRate commands (registry) is traced; the sampling decision is made
+// at submit time and carried to the completion so both ends of a command show up.
+// nvmew -traceStats turns the text tracefmt makes of a capture into per queue
+// latency statistics, so keep the message formats below as they are.
+#define WPP_FLAG_LEVEL_LOGGER(flag, lvl) (WPP_CONTROL(WPP_BIT_ ## flag).Logger),
+#define WPP_FLAG_LEVEL_ENABLED(flag, lvl) \
+    ((WPP_CONTROL(WPP_BIT_ ## flag).Flags[WPP_FLAG_NO(WPP_BIT_ ## flag)] & \
+      WPP_MASK(WPP_BIT_ ## flag)) && \
+     (WPP_CONTROL(WPP_BIT_ ## flag).Level >= (lvl)))
+#define NVME_TRACE_ENABLED(flag) WPP_FLAG_LEVEL_ENABLED(flag, TRACE_LEVEL_INFORMATION)
+
+// begin_wpp config
+// FUNC TraceIoSubmit{FLAG=IoSubmit, LEVEL=TRACE_LEVEL_INFORMATION}(MSG, ...);
+// FUNC TraceIoComplete{FLAG=IoComplete, LEVEL=TRACE_LEVEL_INFORMATION}(MSG, ...);
+// end_wpp
+
 /*
 #ifndef DBG
 // For FRE / Retail builds, override StorPortDebugPrint to log ETW messages for